@@ -0,0 +1,378 @@
+/* affinity.c: CPU and NUMA Placement of Workers */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Globals */
+
+static int Nodes[AFFINITY_CPUS_MAX];    /* NUMA node of each listed CPU (-1 = unknown) */
+static int Home  = 0;                   /* Slot of this process's event loop */
+
+/**
+ * Parse a CPU list.
+ *
+ * @param   spec        Comma-separated CPUs and ranges, e.g. "0-3,8,10-11",
+ *                      or "all" for every CPU the process may run on.
+ * @return  true if the list was understood.
+ *
+ * Workers are placed on the CPUs in the order listed.
+ **/
+bool affinity_configure(const char *spec) {
+    if (streq(spec, "all")) {
+        Affinity.count = -1;            /* Filled in by affinity_start */
+        return true;
+    }
+
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    Affinity.count = 0;
+    for (char *item = strtok_r(copy, ",", &saveptr); item && ok; item = strtok_r(NULL, ",", &saveptr)) {
+        char *end = NULL;
+        long first = strtol(item, &end, 10);
+        long last  = first;
+        if (end != item && *end == '-') {
+            char *start = end + 1;
+            last = strtol(start, &end, 10);
+            ok = end != start;
+        }
+        if (!ok || end == item || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            fprintf(stderr, "Invalid CPU list %s\n", spec);
+            ok = false;
+            break;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (Affinity.count == AFFINITY_CPUS_MAX) {
+                fprintf(stderr, "Too many CPUs (at most %d)\n", AFFINITY_CPUS_MAX);
+                ok = false;
+                break;
+            }
+            for (int i = 0; i < Affinity.count && ok; i++) {
+                if (Affinity.cpus[i] == cpu) {
+                    fprintf(stderr, "CPU %ld listed twice\n", cpu);
+                    ok = false;
+                }
+            }
+            if (!ok) {
+                break;
+            }
+            Affinity.cpus[Affinity.count++] = cpu;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+/**
+ * Return the NUMA node of a CPU, or -1 if it cannot be determined.
+ **/
+static int affinity_node(int cpu) {
+    char path[64];
+    struct dirent *entry;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * Check the CPU list against the CPUs the process may use and look up their
+ * nodes (before any worker starts).
+ *
+ * @return  0 on success, -1 if a listed CPU is unavailable.
+ *
+ * --numa without a list places workers on every available CPU, node by node.
+ **/
+int affinity_start(void) {
+    cpu_set_t allowed;
+
+    if (Affinity.count == 0 && !Affinity.numa) {
+        return 0;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        log("Unable to get CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+
+    if (Affinity.count <= 0) {
+        /* Every available CPU; with --numa, grouped by node */
+        int count = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < AFFINITY_CPUS_MAX; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                Affinity.cpus[count++] = cpu;
+            }
+        }
+        Affinity.count = count;
+        if (Affinity.numa) {
+            for (int i = 1; i < count; i++) {
+                int cpu = Affinity.cpus[i], node = affinity_node(cpu), j = i;
+                for (; j > 0 && affinity_node(Affinity.cpus[j - 1]) > node; j--) {
+                    Affinity.cpus[j] = Affinity.cpus[j - 1];
+                }
+                Affinity.cpus[j] = cpu;
+            }
+        }
+    }
+
+    for (int i = 0; i < Affinity.count; i++) {
+        if (!CPU_ISSET(Affinity.cpus[i], &allowed)) {
+            fprintf(stderr, "CPU %d is not available\n", Affinity.cpus[i]);
+            return -1;
+        }
+        Nodes[i] = affinity_node(Affinity.cpus[i]);
+    }
+    return 0;
+}
+
+/**
+ * Pin the calling thread to the CPU of a worker slot and, with --numa,
+ * prefer memory from that CPU's node for everything it allocates from now
+ * on (buffers, caches and stacks of threads it starts).
+ *
+ * @param   slot        Worker slot (wraps around the CPU list).
+ **/
+void affinity_pin(int slot) {
+    if (Affinity.count <= 0) {
+        return;
+    }
+    slot %= Affinity.count;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(Affinity.cpus[slot], &set);
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (status != 0) {
+        log("Unable to pin worker to CPU %d: %s", Affinity.cpus[slot], strerror(status));
+        return;
+    }
+
+    if (Affinity.numa && Nodes[slot] >= 0) {
+        unsigned long mask = 1ul << (Nodes[slot] % (8 * sizeof(mask)));
+        if (Nodes[slot] >= (int)(8 * sizeof(mask)) ||
+            syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask)) < 0) {
+            log("Unable to prefer memory from node %d: %s", Nodes[slot], strerror(errno));
+        }
+    }
+    debug("Worker slot %d on CPU %d (node %d)", slot, Affinity.cpus[slot], Nodes[slot]);
+}
+
+/**
+ * Pin a scheduler worker thread, spreading the threads of an event loop over
+ * the listed CPUs starting with the loop's own.
+ *
+ * @param   index       Index of the thread in its pool.
+ **/
+void affinity_pin_thread(int index) {
+    affinity_pin(Home + index);
+}
+
+/**
+ * Find the worker slot for the CPU that has been handling a connection's
+ * packets.
+ *
+ * @param   fd          Accepted client socket.
+ * @return  Slot whose CPU matches SO_INCOMING_CPU, or -1.
+ **/
+int affinity_slot(int fd) {
+    int cpu;
+    socklen_t length = sizeof(cpu);
+
+    if (Affinity.count <= 0 || getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) < 0) {
+        return -1;
+    }
+    for (int slot = 0; slot < Affinity.count; slot++) {
+        if (Affinity.cpus[slot] == cpu) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Steer each connection of a SO_REUSEPORT group to the listener of the worker
+ * on the CPU that received it.
+ *
+ * @param   fd          Any listener of the group.
+ * @return  0 on success, -1 if the filter could not be attached.
+ *
+ * The classic BPF program maps the receiving CPU to its slot (listeners
+ * join the group in slot order); CPUs that are not listed are spread by
+ * CPU number.
+ **/
+static int affinity_steer(int fd) {
+    struct sock_filter code[2 * AFFINITY_CPUS_MAX + 3];
+    int n = 0;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int slot = 0; slot < Affinity.count; slot++) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, Affinity.cpus[slot], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, slot);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, Affinity.count);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = { .len = n, .filter = code };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+}
+
+/**
+ * Fork the event-loop worker of a slot.
+ *
+ * @param   slot        Worker slot.
+ * @param   fds         Listeners of every slot.
+ * @param   nfds        Listeners per slot.
+ * @param   action      SIGCHLD disposition the worker's server expects.
+ * @return  Process id of the worker in the supervisor, 0 in the worker, or
+ *          -1 on error.
+ **/
+static pid_t affinity_fork(int slot, int fds[][SOCKET_LISTENERS_MAX], size_t nfds, const struct sigaction *action) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    sigaction(SIGCHLD, action, NULL);
+
+    /* Keep only this worker's listeners; the supervisor holds all of them */
+    for (int i = 0; i < Affinity.count; i++) {
+        for (size_t f = 0; f < nfds; f++) {
+            if (i != slot) {
+                close(fds[i][f]);
+            }
+        }
+    }
+    memcpy(ListenFds, fds[slot], nfds * sizeof(int));
+    ListenCount = nfds;
+
+    Home = slot;
+    affinity_pin(slot);
+    log("Event loop %d on CPU %d", slot, Affinity.cpus[slot]);
+    return 0;
+}
+
+/**
+ * Start one event-loop worker per listed CPU and respawn any that dies.
+ *
+ * @return  Slot of the calling worker, or -1 on error.  Each worker is
+ *          pinned to its CPU and left with only its own listeners in
+ *          ListenFds.  The calling process stays behind as the supervisor
+ *          and does not return.
+ *
+ * Every worker gets a SO_REUSEPORT listener per address family, created
+ * here in slot order; connections are steered to the worker on the CPU that
+ * received them (by a reuseport filter, or SO_INCOMING_CPU on kernels that
+ * honour it).  The filter picks a listener by its index in the group, so
+ * the supervisor keeps every listener open: when a worker dies its socket
+ * stays in the group and in place, holding connections in its backlog
+ * until the worker forked again for the same slot accepts them.  Workers
+ * exit with the supervisor.
+ **/
+int affinity_spawn(void) {
+    int fds[AFFINITY_CPUS_MAX][SOCKET_LISTENERS_MAX];
+    pid_t pids[AFFINITY_CPUS_MAX];
+    time_t started[AFFINITY_CPUS_MAX];
+    size_t nfds = ListenCount;
+
+    memcpy(fds[0], ListenFds, nfds * sizeof(int));
+    for (int i = 1; i < Affinity.count; i++) {
+        ListenCount = 0;
+        if (socket_listen(Port) < 0 || ListenCount != nfds) {
+            log("Unable to open listeners for CPU %d", Affinity.cpus[i]);
+            return -1;
+        }
+        memcpy(fds[i], ListenFds, nfds * sizeof(int));
+    }
+
+    for (size_t f = 0; f < nfds; f++) {
+        for (int i = 0; i < Affinity.count; i++) {
+            int cpu = Affinity.cpus[i];
+            if (setsockopt(fds[i][f], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+                log("Unable to set SO_INCOMING_CPU: %s", strerror(errno));
+            }
+        }
+        if (Affinity.count > 1 && affinity_steer(fds[0][f]) < 0) {
+            log("Unable to attach reuseport filter: %s", strerror(errno));
+        }
+    }
+
+    /* The supervisor reaps workers itself; they get the server's handler back */
+    struct sigaction action, reap = { .sa_handler = SIG_DFL };
+    sigemptyset(&reap.sa_mask);
+    sigaction(SIGCHLD, &reap, &action);
+
+    for (int i = 0; i < Affinity.count; i++) {
+        if ((pids[i] = affinity_fork(i, fds, nfds, &action)) < 0) {
+            log("Unable to fork worker: %s", strerror(errno));
+            return -1;
+        }
+        if (pids[i] == 0) {
+            return i;
+        }
+        started[i] = time(NULL);
+    }
+
+    while (true) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to wait for workers: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < Affinity.count; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            log("Event loop %d (process %d) %s %d: respawning", i, pid,
+                WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+            if (time(NULL) - started[i] < 1) {
+                sleep(1);               /* Do not spin on a worker that dies at once */
+            }
+            while ((pids[i] = affinity_fork(i, fds, nfds, &action)) < 0) {
+                log("Unable to fork worker: %s", strerror(errno));
+                sleep(1);
+            }
+            if (pids[i] == 0) {
+                return i;
+            }
+            started[i] = time(NULL);
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
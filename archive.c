@@ -0,0 +1,166 @@
+/* archive.c: Memory-mapped Pack Archive */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Globals */
+
+static const char       *Map     = NULL;    /* Whole archive, shared by every worker */
+static size_t            MapSize = 0;
+static int               MapFd   = -1;      /* Kept open for sendfile */
+static const PackHeader *Archive = NULL;
+static const uint32_t   *Table   = NULL;
+static const PackEntry  *Entries = NULL;
+
+/**
+ * Check that [offset, offset + length) lies inside the archive.
+ **/
+static bool pack_contains(uint64_t offset, uint64_t length) {
+    return offset <= MapSize && length <= MapSize - offset;
+}
+
+/**
+ * Check that a NUL-terminated string starts inside the archive and ends there.
+ **/
+static bool pack_string(uint64_t offset) {
+    return offset < MapSize && memchr(Map + offset, '\0', MapSize - offset) != NULL;
+}
+
+static bool pack_body_valid(const PackBody *b) {
+    return pack_contains(b->headers, b->headers_length) &&
+           pack_contains(b->body, b->body_length) &&
+           pack_string(b->etag);
+}
+
+/**
+ * Map a pack archive built by the pack tool.
+ *
+ * @param   path        Path to the archive.
+ * @return  0 on success, -1 on error (errno is EINVAL for a malformed archive).
+ *
+ * Startup is one mmap: requests are answered with slices of the mapping, so
+ * forked workers share its pages and nothing is opened or stat'ed per request.
+ * Every offset is checked once here so lookups need not check them again.
+ **/
+int pack_open(const char *path) {
+    struct stat st;
+
+    if ((MapFd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(MapFd, &st) < 0) {
+        return -1;
+    }
+    MapSize = st.st_size;
+    if (MapSize < sizeof(PackHeader)) {
+        log("Pack %s is truncated", path);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, MapSize, PROT_READ, MAP_SHARED, MapFd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    Map     = map;
+    Archive = map;
+
+    if (memcmp(Archive->magic, PACK_MAGIC, sizeof(Archive->magic)) != 0 || Archive->size != MapSize) {
+        log("Pack %s is not a pack archive (or was built on another architecture)", path);
+        errno = EINVAL;
+        return -1;
+    }
+    if (Archive->slots <= Archive->count || (Archive->slots & (Archive->slots - 1)) ||
+        Archive->table % sizeof(uint32_t) || Archive->entries % sizeof(uint64_t) ||
+        !pack_contains(Archive->table, (uint64_t)Archive->slots * sizeof(uint32_t)) ||
+        !pack_contains(Archive->entries, (uint64_t)Archive->count * sizeof(PackEntry))) {
+        log("Pack %s has a corrupt index", path);
+        errno = EINVAL;
+        return -1;
+    }
+    Table   = (const uint32_t *)(Map + Archive->table);
+    Entries = (const PackEntry *)(Map + Archive->entries);
+
+    for (uint32_t i = 0; i < Archive->slots; i++) {
+        if (Table[i] > Archive->count) {
+            log("Pack %s has a corrupt index", path);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < Archive->count; i++) {
+        const PackEntry *e = &Entries[i];
+        if (!pack_string(e->key) || !pack_body_valid(&e->identity) ||
+            (e->gzip.body_length && !pack_body_valid(&e->gzip))) {
+            log("Pack %s has a corrupt entry", path);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    madvise(map, MapSize, MADV_WILLNEED);
+    log("Mapped pack %s (%u resources, %zu bytes)", path, Archive->count, MapSize);
+    return 0;
+}
+
+const char * pack_data(uint64_t offset) {
+    return Map + offset;
+}
+
+/**
+ * Look up a request URI in the pack archive.
+ *
+ * @param   uri         Request URI (without query).
+ * @return  Entry for the URI, or NULL (errno is EINVAL for an undecodable URI).
+ *
+ * Keys are decoded paths below the root without trailing slashes, so only
+ * resources that were packed can match: there is nothing to traverse.
+ **/
+const PackEntry * pack_lookup(const char *uri) {
+    char key[PATH_MAX];
+
+    if (!Archive) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (!decode_request_path(uri, key, sizeof(key))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t length = strlen(key);
+    while (length > 1 && key[length - 1] == '/') {
+        key[--length] = '\0';
+    }
+
+    uint64_t hash = string_hash(key, length);
+    uint32_t mask = Archive->slots - 1;
+    for (uint32_t slot = hash & mask; Table[slot]; slot = (slot + 1) & mask) {
+        const PackEntry *e = &Entries[Table[slot] - 1];
+        if (e->hash == hash && streq(Map + e->key, key)) {
+            return e;
+        }
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+/**
+ * Send a packed body after the response headers.
+ *
+ * Small bodies go out with the headers in one writev straight from the
+ * mapping; larger ones are sent with sendfile at their offset in the archive.
+ **/
+ssize_t pack_send(Response *res, const PackBody *body) {
+    if (body->body_length <= RESPONSE_INLINE_MAX) {
+        return response_send(res, Map + body->body, body->body_length);
+    }
+    return response_send_file(res, MapFd, body->body, body->body_length);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
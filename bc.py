@@ -1,53 +1,285 @@
 #!/usr/bin/env python3
 
+import json
 import os
-import time
+import platform
+import shutil
+import socket
 import subprocess
+import sys
+import tempfile
+import time
+
+# Globals
+
+ROOT        = os.path.dirname(os.path.abspath(__file__))
+SPIDEY      = os.path.join(ROOT, 'spidey')
+THOR        = os.path.join(ROOT, 'thor')
+WWW         = os.path.join(ROOT, 'www')
+
+MODES       = ['single', 'forking']
+LEVELS      = [1, 4, 16]
+REQUESTS    = 400
+TIMEOUT     = 60
+THRESHOLD   = 0.20
+LARGE       = False
+KEEPALIVE   = False
+OUTPUT      = os.path.join(ROOT, 'bench_output.json')
+BASELINE    = os.path.join(ROOT, 'bench_baseline.json')
+SAVE        = False
+
+# Matrix: (kind, uri, request scale)
+MATRIX = [
+    ('file',   '/html/1k.txt',       1.0),
+    ('file',   '/html/1M.txt',       0.05),
+    ('file',   '/html/index.html',   1.0),
+    ('file',   '/text/hackers.txt',  1.0),
+    ('browse', '/',                  1.0),
+    ('browse', '/text',              1.0),
+    ('cgi',    '/scripts/env.sh',    0.25),
+    ('cgi',    '/scripts/cowsay.sh', 0.25),
+]
+
+LARGE_MATRIX = [
+    ('file',   '/html/1G.txt',       0.0),
+]
+
+FIXTURES = {
+    '1k.txt': 1 << 10,
+    '1M.txt': 1 << 20,
+}
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [options]
+    -h              Display help message
+    -m MODES        Comma separated concurrency modes ({})
+    -c LEVELS       Comma separated client concurrency levels ({})
+    -n REQUESTS     Requests per run at scale 1.0 ({})
+    -t THRESHOLD    Regression threshold as a fraction ({})
+    -k              Use keep-alive connections
+    -L              Include the 1G transfer
+    -o PATH         Results file ({})
+    -b PATH         Baseline file ({})
+    -s              Save results as the new baseline
+    '''.format(os.path.basename(sys.argv[0]), ','.join(MODES), ','.join(map(str, LEVELS)),
+               REQUESTS, THRESHOLD, os.path.relpath(OUTPUT), os.path.relpath(BASELINE)))
+    sys.exit(status)
+
+def make_fixtures(workspace):
+    ''' Copy www into workspace and generate the sized text fixtures. '''
+    root = os.path.join(workspace, 'www')
+    shutil.copytree(WWW, root, symlinks=True)
+
+    line = b'Spidey benchmark fixture: 0123456789abcdefghijklmnopqrstuvwxyz\n'
+    for name, size in FIXTURES.items():
+        with open(os.path.join(root, 'html', name), 'wb') as fs:
+            data = line * (size // len(line) + 1)
+            fs.write(data[:size])
+
+    if LARGE:
+        # Sparse file: reads as zeros without consuming a gigabyte of disk
+        with open(os.path.join(root, 'html', '1G.txt'), 'wb') as fs:
+            fs.truncate(1 << 30)
+
+    return root
+
+def free_port():
+    ''' Ask the kernel for an unused loopback port. '''
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def wait_for_port(port, deadline=5.0):
+    end = time.time() + deadline
+    while time.time() < end:
+        try:
+            with socket.create_connection(('127.0.0.1', port), timeout=0.2):
+                return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+def start_spidey(mode, root, port, log):
+    command = [SPIDEY, '-r', root, '-p', str(port), '-c', mode]
+    server  = subprocess.Popen(command, stdout=log, stderr=log)
+    if not wait_for_port(port):
+        server.kill()
+        server.wait()
+        sys.exit('Unable to start {}'.format(' '.join(command)))
+    # The readiness probe is itself a request; let single mode finish it
+    time.sleep(0.1)
+    return server
+
+def stop_spidey(server):
+    server.terminate()
+    try:
+        server.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+def run_thor(port, uri, concurrency, requests):
+    command = [THOR, '-j', '-c', str(concurrency), '-n', str(requests), '-t', str(TIMEOUT)]
+    if KEEPALIVE:
+        command.append('-k')
+    command.append('http://127.0.0.1:{}{}'.format(port, uri))
+
+    try:
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                timeout=TIMEOUT * 2)
+    except subprocess.TimeoutExpired:
+        return None
+    try:
+        return json.loads(result.stdout.decode())
+    except ValueError:
+        return None
+
+def benchmark(root):
+    results = []
+    print('| {:8}| {:7}| {:20}| {:>5}| {:>11}| {:>13}| {:>10}| {:>10}|'.format(
+        'mode', 'kind', 'uri', 'conc', 'req/s', 'MB/s', 'p50 (ms)', 'p99 (ms)'))
+    print('|{:-<9}|{:-<8}|{:-<21}|{:-<6}|{:-<12}|{:-<14}|{:-<11}|{:-<11}|'.format(*'-' * 8))
+
+    for mode in MODES:
+        port   = free_port()
+        log    = open(os.path.join(os.path.dirname(root), 'spidey-{}.log'.format(mode)), 'w')
+        server = start_spidey(mode, root, port, log)
+        try:
+            for kind, uri, scale in MATRIX + (LARGE_MATRIX if LARGE else []):
+                for level in LEVELS:
+                    requests = max(level, int(REQUESTS * scale))
+                    report   = run_thor(port, uri, level, requests)
+                    entry    = {
+                        'mode': mode, 'kind': kind, 'uri': uri, 'concurrency': level,
+                        'requests': requests, 'timeout': report is None,
+                    }
+                    if report is not None:
+                        entry.update({
+                            'throughput_rps': report['throughput']['requests_per_sec'],
+                            'throughput_bps': report['throughput']['bytes_per_sec'],
+                            'p50_us':         report['latency_us']['p50'],
+                            'p99_us':         report['latency_us']['p99'],
+                            'max_us':         report['latency_us']['max'],
+                            'errors':         sum(report['errors'].values()),
+                            'status':         report['status'],
+                        })
+                        print('| {:8}| {:7}| {:20}| {:5}| {:11.1f}| {:13.3f}| {:10.2f}| {:10.2f}|'.format(
+                            mode, kind, uri, level, entry['throughput_rps'],
+                            entry['throughput_bps'] / 1048576.0, entry['p50_us'] / 1000.0,
+                            entry['p99_us'] / 1000.0))
+                    else:
+                        print('| {:8}| {:7}| {:20}| {:5}| {:>11}| {:>13}| {:>10}| {:>10}|'.format(
+                            mode, kind, uri, level, 'inf', 'inf', 'inf', 'inf'))
+                    sys.stdout.flush()
+                    results.append(entry)
+        finally:
+            stop_spidey(server)
+            log.close()
+
+    return results
+
+def key(entry):
+    return '{} {} c={}'.format(entry['mode'], entry['uri'], entry['concurrency'])
+
+def statuses(entry):
+    ''' Status classes that came back at least once (e.g. 2xx,5xx). '''
+    return ','.join(sorted(k for k, v in entry.get('status', {}).items() if v)) or 'none'
+
+def compare(results, baseline):
+    ''' Flag new errors, changed statuses, throughput drops or p99 growth beyond THRESHOLD. '''
+    previous    = {key(e): e for e in baseline.get('results', [])}
+    regressions = []
+
+    for entry in results:
+        old = previous.get(key(entry))
+        if old is None or old.get('timeout'):
+            continue
+        if entry['timeout']:
+            regressions.append('{}: timed out (baseline {:.1f} req/s)'.format(key(entry), old['throughput_rps']))
+            continue
+        if entry['errors'] and not old.get('errors'):
+            regressions.append('{}: {} errors (baseline none)'.format(key(entry), entry['errors']))
+        if 'status' in old and statuses(entry) != statuses(old):
+            regressions.append('{}: status {} -> {}'.format(key(entry), statuses(old), statuses(entry)))
+        if entry['throughput_rps'] < old['throughput_rps'] * (1 - THRESHOLD):
+            regressions.append('{}: throughput {:.1f} -> {:.1f} req/s'.format(
+                key(entry), old['throughput_rps'], entry['throughput_rps']))
+        if entry['p99_us'] > old['p99_us'] * (1 + THRESHOLD):
+            regressions.append('{}: p99 {:.2f} -> {:.2f} ms'.format(
+                key(entry), old['p99_us'] / 1000.0, entry['p99_us'] / 1000.0))
+
+    return regressions
+
+# Main execution
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    while args and args[0].startswith('-') and len(args[0]) > 1:
+        arg = args.pop(0)
+        if arg == '-h':
+            usage(0)
+        elif arg == '-m' and args:
+            MODES = args.pop(0).split(',')
+        elif arg == '-c' and args:
+            LEVELS = [int(level) for level in args.pop(0).split(',')]
+        elif arg == '-n' and args:
+            REQUESTS = int(args.pop(0))
+        elif arg == '-t' and args:
+            THRESHOLD = float(args.pop(0))
+        elif arg == '-k':
+            KEEPALIVE = True
+        elif arg == '-L':
+            LARGE = True
+        elif arg == '-o' and args:
+            OUTPUT = args.pop(0)
+        elif arg == '-b' and args:
+            BASELINE = args.pop(0)
+        elif arg == '-s':
+            SAVE = True
+        else:
+            usage(1)
+
+    for binary in (SPIDEY, THOR):
+        if not os.access(binary, os.X_OK):
+            sys.exit('Missing {} (run make first)'.format(binary))
+
+    workspace = tempfile.mkdtemp(prefix='spidey-bench.')
+    try:
+        results = benchmark(make_fixtures(workspace))
+    finally:
+        shutil.rmtree(workspace, ignore_errors=True)
+
+    document = {
+        'meta': {
+            'host':      platform.node(),
+            'machine':   platform.machine(),
+            'date':      time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'requests':  REQUESTS,
+            'levels':    LEVELS,
+            'keepalive': KEEPALIVE,
+        },
+        'results': results,
+    }
+    with open(OUTPUT, 'w') as fs:
+        json.dump(document, fs, indent=2)
+    print('\nResults written to {}'.format(os.path.relpath(OUTPUT)))
+
+    if SAVE or not os.path.exists(BASELINE):
+        shutil.copyfile(OUTPUT, BASELINE)
+        print('Baseline saved to {}'.format(os.path.relpath(BASELINE)))
+        sys.exit(0)
+
+    with open(BASELINE) as fs:
+        regressions = compare(results, json.load(fs))
+
+    if regressions:
+        print('\nREGRESSIONS (threshold {:.0f}%):'.format(THRESHOLD * 100))
+        for regression in regressions:
+            print('    ' + regression)
+        sys.exit(1)
+
+    print('No regressions against {} (threshold {:.0f}%)'.format(os.path.relpath(BASELINE), THRESHOLD * 100))
 
-# Variables
-
-
-nitems = ["/html/1k.txt","/html/1M.txt","/html/1G.txt","/html/index.html", "/scripts/cowsay.sh", "/scripts/env.sh", "/text/hackers.txt", "/text/lyrics.txt" ]
-#nitems = ["/html/index.html", "/scripts/cowsay.sh", "/scripts/env.sh", "/text/hackers.txt", "/text/lyrics.txt" ]
-processes = [1,2,3,4]
-requests = [2,3]
-# Heading
-print("| {:7}| {:7}| {:21}| {:11}| {:14}|".format("process","request","uri", "latency","throughput"))
-print("|{:-<8}|{:-<8}|{:-<22}|{:-<12}|{:-<15}|".format("-","-","-", "-", "-"))
-
-# Running
-max_run_time = 60
-FAILED = False
-
-for nitem in nitems:
-	for i in processes:
-		for j in requests:
-			start = time.time()
-			end = start + max_run_time
-			interval = max_run_time / 1000.0
-
-		#Run Commanda
-			command = "./thor.py -r " + str(j) + " -p "+ str(i) +" http://student06.cse.nd.edu:9002" + nitem
-
-			p = subprocess.Popen(command, shell=True, stdout=subprocess.PIPE)
-		#Check if still waiting
-			while True:
-				result = p.poll()
-				if result is not None:
-					break
-				if time.time() >= end:
-					p.kill()
-					print("| {:21}| {:11}| {:14}|".format(nitem, "inf", "inf"))
-					FAILED = True
-					break
-				time.sleep(interval)
-		
-			if not FAILED:
-				endd = time.time()
-				size = os.path.getsize("/afs/nd.edu/user40/lyokum/gitlab_projects/systems_programming/cse-20289-sp18-project/www"+nitem)
-				stream, err  = p.communicate()#.stdout.read().split()
-				stream = stream.decode().split()
-				timme = round(endd-start,5)
-				print("| {:7}| {:7}| {:21}| {:11}| {:14}M|".format(i, j, nitem, timme, round(size/timme/1024/1024,5)))
-
-			FAILED = False
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,315 @@
+/* body.c: HTTP Request Bodies */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BODY_LINE_MAX       256         /* Longest chunk-size or trailer line */
+
+/**
+ * Skip the blanks (and the CR the header parser leaves) around header values.
+ **/
+static const char *body_skip(const char *s) {
+    while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') {
+        s++;
+    }
+    return s;
+}
+
+/**
+ * Check that a header value is a given token (ignoring case).
+ **/
+static bool body_token(const char *value, const char *token) {
+    size_t length = strlen(token);
+    value = body_skip(value);
+    return strncasecmp(value, token, length) == 0 && *body_skip(value + length) == '\0';
+}
+
+/**
+ * Work out how the body of a parsed request is delimited.
+ *
+ * @param   r           Request (after its headers are parsed).
+ * @return  0 on success, -1 if the framing is invalid or ambiguous (400).
+ *
+ * A body is announced by Content-Length or, from HTTP/1.1 clients, by
+ * Transfer-Encoding: chunked; a request with both is refused rather than
+ * guessed at.  Bytes of the body that arrived with the head are in
+ * r->buffered.
+ **/
+int request_body_parse(Request *r) {
+    const char *length   = request_header(r, "Content-Length");
+    const char *encoding = request_header(r, "Transfer-Encoding");
+
+    if (length && encoding) {
+        log("Request has both Content-Length and Transfer-Encoding");
+        return -1;
+    }
+
+    if (encoding) {
+        if (r->version < 1 || !body_token(encoding, "chunked")) {
+            log("Unsupported Transfer-Encoding: %s", encoding);
+            return -1;
+        }
+        r->chunked   = true;
+        r->body_done = false;
+        return 0;
+    }
+
+    if (length) {
+        const char *start = body_skip(length);
+        char *end = NULL;
+        errno = 0;
+        unsigned long long value = strtoull(start, &end, 10);
+        if (*start < '0' || *start > '9' || errno || *body_skip(end) != '\0' || value > INT64_MAX) {
+            log("Invalid Content-Length: %s", length);
+            return -1;
+        }
+        r->content_length = value;
+        r->body_done      = value == 0;
+    }
+    return 0;
+}
+
+/**
+ * Write body bytes that arrived with the head (or chunk framing) to a pipe
+ * or socket, waiting on it with wait (see socket_splice).  Any failure of
+ * the receiving end (closed, reset or stalled) is EPIPE.
+ **/
+static int body_write(int fd, const char *data, size_t length, PipeWait wait, void *context) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                int ready = wait ? wait(fd, context) : coroutine_poll(fd, POLLOUT, Timeouts.body > 0 ? Timeouts.body : -1);
+                if (ready == 0) {
+                    errno = EPIPE;
+                    return -1;
+                }
+                if (ready < 0 && errno != EINTR) {
+                    return -1;
+                }
+                continue;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+        data   += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Move count body bytes to a pipe (or, relaying, to a socket): first what
+ * was buffered with the head, then straight from the client socket with
+ * splice.
+ **/
+static int body_move(Request *r, int fd, size_t count, bool relay, PipeWait wait, void *context) {
+    size_t buffered = r->buffered_length - r->buffered_used;
+    if (buffered > 0) {
+        size_t n = buffered < count ? buffered : count;
+        if (body_write(fd, r->buffered + r->buffered_used, n, wait, context) < 0) {
+            return -1;
+        }
+        r->buffered_used += n;
+        count -= n;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (!relay) {
+        return socket_splice(r->fd, fd, count, wait, context) < 0 ? -1 : 0;
+    }
+
+    ssize_t moved = socket_relay(r->fd, fd, count);
+    if (moved >= 0 && (size_t)moved < count) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    return moved < 0 ? -1 : 0;
+}
+
+/**
+ * Read one CRLF-terminated framing line of a chunked body (buffered bytes
+ * first, then a byte at a time from the socket so no body data is read
+ * past it).
+ **/
+static int body_line(Request *r, char *line, size_t size) {
+    size_t length = 0;
+
+    while (true) {
+        char c;
+        if (r->buffered_used < r->buffered_length) {
+            c = r->buffered[r->buffered_used++];
+        } else {
+            ssize_t n = socket_recv(r->fd, &c, 1);
+            if (n <= 0) {
+                if (n == 0) {
+                    errno = ECONNRESET;
+                }
+                return -1;
+            }
+        }
+        if (c == '\n') {
+            break;
+        }
+        if (length + 1 >= size) {
+            errno = EINVAL;
+            return -1;
+        }
+        line[length++] = c;
+    }
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+/**
+ * Stream a request's body to fd: decoded into a pipe, or framed as it
+ * arrived (chunked bodies re-chunked) into a socket when relaying.
+ **/
+static ssize_t body_forward(Request *r, int fd, bool relay, PipeWait wait, void *context) {
+    char line[BODY_LINE_MAX];
+    size_t total = 0;
+    size_t limit = BodyMax ? BodyMax : INT64_MAX;   /* total fits the return value */
+
+    if (r->body_done) {
+        return 0;
+    }
+
+    const char *expect = request_header(r, "Expect");
+    if (expect && r->version >= 1 && body_token(expect, "100-continue") && r->buffered_used == r->buffered_length) {
+        struct iovec iov = { "HTTP/1.1 100 Continue\r\n\r\n", 25 };
+        if (socket_writev(r->fd, &iov, 1) < 0) {
+            if (errno != ETIMEDOUT) {
+                errno = ECONNRESET;     /* Not to be taken for the reader's EPIPE */
+            }
+            return -1;
+        }
+    }
+
+    if (!r->chunked) {
+        if (body_move(r, fd, r->content_length, relay, wait, context) < 0) {
+            return -1;
+        }
+        r->body_done = true;
+        return r->content_length;
+    }
+
+    while (true) {
+        char *end = NULL;
+        if (body_line(r, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        /* strtoull() alone would also take leading blanks and a sign ("-1") */
+        errno = 0;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (!isxdigit((unsigned char)line[0]) || errno || (*body_skip(end) != '\0' && *body_skip(end) != ';')) {
+            log("Invalid chunk size: %s", line);
+            errno = EINVAL;
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (size > limit - total) {
+            errno = EFBIG;
+            return -1;
+        }
+        if (relay) {
+            int n = snprintf(line, sizeof(line), "%llx\r\n", size);
+            if (body_write(fd, line, n, wait, context) < 0) {
+                return -1;
+            }
+        }
+        if (body_move(r, fd, size, relay, wait, context) < 0 || body_line(r, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        if (line[0] != '\0') {
+            errno = EINVAL;
+            return -1;
+        }
+        if (relay && body_write(fd, "\r\n", 2, wait, context) < 0) {
+            return -1;
+        }
+        total += size;
+    }
+
+    /* Trailers (ignored) end with an empty line */
+    do {
+        if (body_line(r, line, sizeof(line)) < 0) {
+            return -1;
+        }
+    } while (line[0] != '\0');
+
+    if (relay && body_write(fd, "0\r\n\r\n", 5, wait, context) < 0) {
+        return -1;
+    }
+    r->body_done = true;
+    return total;
+}
+
+/**
+ * Stream a request's body into a pipe (e.g. a CGI script's stdin).
+ *
+ * @param   r           Request whose body has not been read.
+ * @param   pipefd      Write end of a (non-blocking) pipe.
+ * @param   wait        Waits for the pipe to drain, e.g. relaying the
+ *                      reader's output meanwhile (NULL = just wait).
+ * @param   context     Passed to wait.
+ * @return  Body length, or -1 on error with errno set: EFBIG when a chunked
+ *          body grows past BodyMax (413), EINVAL for bad chunk framing
+ *          (400), EPIPE if the reader went away or stopped reading,
+ *          ETIMEDOUT or ECONNRESET if the client stalled or left.
+ *
+ * The body moves from the socket to the pipe with splice, so uploads of any
+ * size take constant memory and are never copied through user space (only
+ * chunk-size lines are read).  A client that waits for 100 Continue is sent
+ * it first.
+ **/
+ssize_t request_body_splice(Request *r, int pipefd, PipeWait wait, void *context) {
+    return body_forward(r, pipefd, false, wait, context);
+}
+
+/**
+ * Relay a request's body to another server (e.g. an upstream).
+ *
+ * @param   r           Request whose body has not been read.
+ * @param   fd          Non-blocking socket to the server.
+ * @return  As request_body_splice (EPIPE: the server closed, reset or
+ *          stalled).
+ *
+ * The server is sent the body framed as the client sent it: Content-Length
+ * bodies move socket to socket with splice, chunked bodies are re-chunked
+ * (without trailers) so only their chunk-size lines are copied.
+ **/
+ssize_t request_body_relay(Request *r, int fd) {
+    return body_forward(r, fd, true, NULL, NULL);
+}
+
+/**
+ * Consume the body of a request that has no use for it (e.g. a file GET)
+ * if it has already arrived whole, so the connection can be kept alive.
+ **/
+void request_body_skip(Request *r) {
+    if (!r->body_done && !r->chunked &&
+        r->content_length <= (int64_t)(r->buffered_length - r->buffered_used)) {
+        r->buffered_used += r->content_length;
+        r->body_done = true;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,458 @@
+/* connection.c: Client Connections and Deadlines */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CONNECTION_SHED_BATCH   64      /* Most clients turned away per accept */
+
+/* Globals */
+
+static size_t Live = 0;                 /* Open connections of this process */
+
+/**
+ * Parse a timeout profile.
+ *
+ * @param   spec        Comma-separated seconds, e.g. "header=10,body=30,write=30,idle=5".
+ * @return  true if every option was understood, false otherwise.
+ **/
+bool timeouts_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *option = strtok_r(copy, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        char *end   = NULL;
+        double seconds;
+
+        if (!value) {
+            fprintf(stderr, "Missing value for timeout %s\n", option);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+        seconds = strtod(value, &end);
+        if (end == value || *end != '\0' || seconds < 0) {
+            fprintf(stderr, "Invalid timeout %s=%s\n", option, value);
+            ok = false;
+            break;
+        }
+
+        int milliseconds = (int)(seconds * 1000);
+        if (streq(option, "header")) {
+            Timeouts.header = milliseconds;
+        } else if (streq(option, "body")) {
+            Timeouts.body = milliseconds;
+        } else if (streq(option, "write")) {
+            Timeouts.write = milliseconds;
+        } else if (streq(option, "idle")) {
+            Timeouts.idle = milliseconds;
+        } else {
+            fprintf(stderr, "Unknown timeout %s\n", option);
+            ok = false;
+            break;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+/**
+ * Wrap an accepted client socket in a connection.
+ *
+ * @param   fd          Non-blocking client socket.
+ * @param   addr        Client address.
+ * @param   addrlen     Length of client address.
+ * @return  Newly allocated connection (closes fd on failure).
+ *
+ * The header deadline starts at accept, so a client that connects and sends
+ * nothing is timed out like one that stalls halfway through its request.
+ **/
+Connection * connection_new(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    Connection *c = mem_calloc(MEM_CONNECTION, 1, sizeof(Connection));
+    if (!c) {
+        log("Couldn't allocate memory: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    c->fd      = fd;
+    c->addrlen = addrlen;
+    memcpy(&c->addr, addr, addrlen);
+    __atomic_add_fetch(&Live, 1, __ATOMIC_RELAXED);
+
+    /* Record numeric client information */
+    int status = getnameinfo(addr, addrlen, c->host, sizeof(c->host), c->port, sizeof(c->port),
+                             NI_NUMERICHOST | NI_NUMERICSERV);
+    if (status != 0) {
+        log("Failed to get client info: %s", gai_strerror(status));
+        connection_free(c);
+        return NULL;
+    }
+
+    c->deadline = Timeouts.header ? timer_now() + Timeouts.header : 0;
+    log("Accepted connection from %s:%s", c->host, c->port);
+    return c;
+}
+
+/**
+ * Accept a pending connection from a ready listener without blocking.
+ *
+ * @param   lfd         Listening socket.
+ * @return  New connection, or NULL when none is pending (or only clients
+ *          that were shed).
+ *
+ * Past the connection limit, pending clients are answered 503 straight
+ * away, a batch at a time so that connections already admitted keep being
+ * served.
+ **/
+Connection * connection_accept(int lfd) {
+    for (int shed = 0; shed < CONNECTION_SHED_BATCH; shed++) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+
+        int fd = socket_accept_ready(lfd, (struct sockaddr *)&addr, &addrlen);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log("accept failed: %s", strerror(errno));
+            }
+            return NULL;
+        }
+        if (overload_admit(SHED_CONNECTIONS, __atomic_load_n(&Live, __ATOMIC_RELAXED))) {
+            return connection_new(fd, (struct sockaddr *)&addr, addrlen);
+        }
+        overload_shed(fd, SHED_CONNECTIONS);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Return the length of the first complete request head in the buffer, or 0.
+ **/
+static size_t connection_head(Connection *c) {
+    char *end = memmem(c->buffer, c->length, "\r\n\r\n", 4);
+    if (end) {
+        return end - c->buffer + 4;
+    }
+    end = memmem(c->buffer, c->length, "\n\n", 2);
+    return end ? (size_t)(end - c->buffer + 2) : 0;
+}
+
+/**
+ * Check the complete lines of a partial request head for obvious garbage, so
+ * that a malformed request is rejected at once instead of at its deadline.
+ *
+ * @return  true if a complete line cannot start a valid request head.
+ **/
+static bool connection_malformed(Connection *c) {
+    const char *line = c->buffer;
+    const char *end  = c->buffer + c->length;
+    const char *eol;
+    bool first = true;
+
+    while ((eol = memchr(line, '\n', end - line)) != NULL) {
+        if (first) {
+            /* <METHOD> SP /<URI> */
+            const char *space = memchr(line, ' ', eol - line);
+            if (!space || space == line || space + 1 >= eol || space[1] != '/') {
+                return true;
+            }
+            first = false;
+        } else if (!memchr(line, ':', eol - line)) {
+            return true;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+/**
+ * Answer a connection that will not produce a request with an error page.
+ **/
+static void connection_reject(Connection *c, HTTPStatus status) {
+    Request *r = accept_request(c, 0);
+    if (r) {
+        handle_error(r, status);
+        free_request(r);
+    }
+}
+
+/**
+ * Finish with a served request head: drop it (and any body read from the
+ * buffer) from the buffer, keeping any pipelined bytes that follow it.  A
+ * request whose body was left unread ends the connection.
+ **/
+static void connection_complete(Connection *c, Request *r) {
+    request_body_skip(r);
+    c->keepalive = r->keepalive && r->body_done;
+    c->head += r->buffered_used;
+    free_request(r);
+
+    c->length -= c->head;
+    memmove(c->buffer, c->buffer + c->head, c->length);
+    c->requests++;
+}
+
+/**
+ * Body of a handler coroutine: serve the request left in c->request.
+ **/
+static void connection_coroutine(void *argument) {
+    connection_run(argument);
+}
+
+/**
+ * Serve one buffered request head, or hand it to the scheduler.
+ *
+ * @return  CONNECTION_WAIT if the connection may carry another request,
+ *          CONNECTION_CLOSE if not, or CONNECTION_BUSY if a worker (or a
+ *          suspended coroutine) now owns the connection (see
+ *          connection_resume).
+ *
+ * Requests are parsed and resolved here so that the scheduler can classify
+ * them; errors are cheap and are answered at once.
+ **/
+static ConnectionState connection_dispatch(Connection *c, size_t length) {
+    Request *r = accept_request(c, length);
+    if (!r) {
+        return CONNECTION_CLOSE;
+    }
+    c->head = length;
+
+    HTTPStatus status = handle_prepare(r);
+    if (http2_upgradable(r)) {
+        /* Upgrade: h2c turns the connection into HTTP/2, the request into
+         * its first stream */
+        return http2_start(c, r, status);
+    }
+    if (status != HTTP_STATUS_OK) {
+        handle_error(r, status);
+    } else if (hybrid_active() && hybrid_fork(c, r)) {
+        /* A child serves it and the rest of the connection */
+        free_request(r);
+        return CONNECTION_CLOSE;
+    } else if (scheduler_active()) {
+        Lane lane = request_lane(r);
+        if (lane == LANE_CGI && !overload_admit(SHED_CGI, scheduler_queued(lane))) {
+            /* Too many scripts waiting for a worker already */
+            free_request(r);
+            overload_shed(c->fd, SHED_CGI);
+            return CONNECTION_CLOSE;
+        }
+        c->request = r;
+        scheduler_submit(c, lane);
+        return CONNECTION_BUSY;
+    } else if (coroutine_active()) {
+        /* Most responses finish without blocking; the others suspend and
+         * the event loop takes the connection back when they are done */
+        c->request = r;
+        if (!coroutine_spawn(connection_coroutine, c)) {
+            return CONNECTION_BUSY;
+        }
+        return c->keepalive ? CONNECTION_WAIT : CONNECTION_CLOSE;
+    } else {
+        handle_resolved(r);
+    }
+
+    connection_complete(c, r);
+    return c->keepalive ? CONNECTION_WAIT : CONNECTION_CLOSE;
+}
+
+/**
+ * Serve every complete request in the buffer and decide what to wait for.
+ **/
+static ConnectionState connection_advance(Connection *c) {
+    ConnectionState state;
+    size_t length;
+
+    /* HTTP/2 with prior knowledge starts with the client connection preface,
+     * whose first line would otherwise pass for a request head */
+    if (Http2Enabled && c->requests == 0 && c->length > 0 &&
+        memcmp(c->buffer, HTTP2_PREFACE, c->length < HTTP2_PREFACE_LENGTH ? c->length : HTTP2_PREFACE_LENGTH) == 0) {
+        if (c->length >= HTTP2_PREFACE_LENGTH) {
+            return http2_start(c, NULL, HTTP_STATUS_OK);
+        }
+        return c->eof ? CONNECTION_CLOSE : CONNECTION_WAIT;
+    }
+
+    /* Serve complete requests already buffered (pipelining) */
+    while ((length = connection_head(c)) > 0) {
+        if ((state = connection_dispatch(c, length)) != CONNECTION_WAIT || c->h2) {
+            return state;
+        }
+        c->idle = false;
+        c->deadline = 0;
+    }
+
+    if (c->eof) {
+        /* Client finished sending: answer whatever it managed to send */
+        if (c->length > 0 && connection_dispatch(c, c->length) == CONNECTION_BUSY) {
+            return CONNECTION_BUSY;
+        }
+        return CONNECTION_CLOSE;
+    }
+
+    if (c->length == sizeof(c->buffer)) {
+        log("Request head from %s:%s is too large", c->host, c->port);
+        connection_reject(c, HTTP_STATUS_BAD_REQUEST);
+        return CONNECTION_CLOSE;
+    }
+
+    /* Let the parser reject (with 400) a head that can never be valid */
+    if (connection_malformed(c)) {
+        c->eof = true;
+        return connection_dispatch(c, c->length) == CONNECTION_BUSY ? CONNECTION_BUSY : CONNECTION_CLOSE;
+    }
+
+    /* Arm the deadline for what we are waiting on: the rest of a request head
+     * (measured from its first byte) or the next keep-alive request */
+    if (c->length > 0 && (c->idle || c->deadline == 0)) {
+        c->idle = false;
+        c->deadline = Timeouts.header ? timer_now() + Timeouts.header : 0;
+    } else if (c->length == 0 && c->deadline == 0 && c->requests > 0) {
+        c->idle = true;
+        c->deadline = timer_now() + Timeouts.idle;
+    }
+    return CONNECTION_WAIT;
+}
+
+/**
+ * Read what the client has sent and serve every complete request.
+ *
+ * @param   c           Client connection.
+ * @return  CONNECTION_WAIT to wait for more input (c->deadline is updated),
+ *          CONNECTION_CLOSE once the connection is finished, or
+ *          CONNECTION_BUSY while a scheduler worker serves a request.
+ *
+ * Only one read is made per call, so a keep-alive client that sends its next
+ * request as soon as the last response arrives cannot starve other
+ * connections in the event loop.
+ **/
+ConnectionState connection_process(Connection *c) {
+    if (c->h2) {
+        return http2_process(c);
+    }
+
+    ssize_t n = recv(c->fd, c->buffer + c->length, sizeof(c->buffer) - c->length, 0);
+    if (n > 0) {
+        c->length += n;
+    } else if (n == 0) {
+        c->eof = true;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return CONNECTION_CLOSE;
+    }
+    return connection_advance(c);
+}
+
+/**
+ * Serve the request handed to the scheduler (on a worker thread) or to a
+ * coroutine: c->request, or on an HTTP/2 connection the stream waiting in
+ * it.
+ **/
+void connection_run(Connection *c) {
+    if (c->h2) {
+        http2_run(c);
+        return;
+    }
+
+    Request *r = c->request;
+    c->request = NULL;
+
+    handle_resolved(r);
+    connection_complete(c, r);
+}
+
+/**
+ * Take a connection back from a worker and carry on with it.
+ *
+ * @return  As connection_process, without reading from the socket first.
+ **/
+ConnectionState connection_resume(Connection *c) {
+    if (c->h2) {
+        return http2_resume(c);
+    }
+    if (!c->keepalive) {
+        return CONNECTION_CLOSE;
+    }
+    c->idle = false;
+    c->deadline = 0;
+    return connection_advance(c);
+}
+
+/**
+ * Handle a missed deadline: a stalled request gets 408, an idle keep-alive
+ * connection is simply dropped.  The caller closes the connection.
+ **/
+void connection_expire(Connection *c) {
+    if (c->h2) {
+        http2_expire(c);
+        return;
+    }
+    if (c->idle) {
+        debug("Keep-alive connection from %s:%s idle", c->host, c->port);
+        return;
+    }
+    log("Request from %s:%s timed out", c->host, c->port);
+    connection_reject(c, HTTP_STATUS_REQUEST_TIMEOUT);
+}
+
+/**
+ * Serve a connection until it closes (for a process that owns it alone).
+ *
+ * @param   c           Client connection.
+ * @return  EXIT_SUCCESS.
+ **/
+int connection_serve(Connection *c) {
+    while (connection_process(c) == CONNECTION_WAIT) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        int timeout = -1;
+
+        if (c->deadline) {
+            uint64_t now = timer_now();
+            if (now >= c->deadline) {
+                connection_expire(c);
+                break;
+            }
+            timeout = (int)(c->deadline - now);
+        }
+
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Close the client socket and release the connection.
+ **/
+void connection_free(Connection *c) {
+    if (!c) {
+        return;
+    }
+    if (timer_pending(&c->timer)) {
+        timer_cancel(&c->timer);
+    }
+    if (c->request) {
+        free_request(c->request);
+    }
+    http2_free(c->h2);
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    __atomic_sub_fetch(&Live, 1, __ATOMIC_RELAXED);
+    mem_free(c);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
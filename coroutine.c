@@ -0,0 +1,480 @@
+/* coroutine.c: Handler Coroutines */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/* Constants */
+
+#define COROUTINE_STACK_MIN     32768   /* Smallest stack accepted (response_send_file keeps 16K on it) */
+#define COROUTINE_POOL_MAX      1024    /* Idle stacks kept for reuse */
+#define COROUTINE_EVENTS_MAX    64
+
+/**
+ * Saved registers of a suspended coroutine (or of whoever resumed it).
+ *
+ * On x86-64 only the stack pointer is kept: the callee-saved registers are
+ * pushed onto the stack being left, so a switch costs a dozen instructions
+ * and no system call (swapcontext also saves the signal mask with one).
+ */
+#if defined(__x86_64__)
+typedef void *CoroutineContext;
+
+void coroutine_switch(CoroutineContext *save, CoroutineContext *load);
+
+__asm__(
+    ".text\n"
+    ".globl coroutine_switch\n"
+    ".hidden coroutine_switch\n"
+    ".type coroutine_switch, @function\n"
+    "coroutine_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coroutine_switch, .-coroutine_switch\n"
+);
+#else
+typedef ucontext_t CoroutineContext;
+
+#define coroutine_switch(save, load)    swapcontext((save), (load))
+#endif
+
+/**
+ * A coroutine, kept at the top of its own stack mapping.
+ */
+typedef struct coroutine Coroutine;
+struct coroutine {
+    CoroutineContext context;           /**< Where the coroutine left off */
+    CoroutineContext caller;            /**< Where it returns to when it yields */
+    Coroutine  *parent;                 /**< Coroutine that resumed it (NULL = event loop) */
+    Coroutine  *next;                   /**< Next in the ready, finished or free list */
+    void      (*function)(void *);      /**< Body */
+    void       *argument;
+    char       *stack;                  /**< Start of the mapping (guard page) */
+    size_t      size;                   /**< Length of the mapping */
+    Timer       timer;                  /**< Deadline of the current wait */
+    uint32_t    revents;                /**< Readiness that ended the wait (0 = timed out) */
+    bool        waiting;                /**< Suspended in coroutine_poll or coroutine_sleep */
+    bool        finished;               /**< Body has returned */
+};
+
+/**
+ * Run queue of one event loop.
+ */
+typedef struct {
+    Coroutine  *head;
+    Coroutine  *tail;
+} CoroutineQueue;
+
+/* Globals */
+
+static __thread Coroutine      *Current = NULL;    /* Running coroutine (NULL on the event loop) */
+static __thread TimerWheel     *Wheel   = NULL;    /* Event loop's deadlines */
+static __thread int             PollFd  = -1;      /* Waits on descriptors (itself watched by the loop) */
+static __thread CoroutineQueue  Ready;             /* Woken, not yet resumed */
+static __thread CoroutineQueue  Finished;          /* Done after suspending, not yet collected */
+static __thread Coroutine      *Pool    = NULL;    /* Idle stacks */
+static __thread size_t          Pooled  = 0;
+
+/* Queues */
+
+static void coroutine_push(CoroutineQueue *q, Coroutine *co) {
+    co->next = NULL;
+    if (q->tail) {
+        q->tail->next = co;
+    } else {
+        q->head = co;
+    }
+    q->tail = co;
+}
+
+static Coroutine *coroutine_pop(CoroutineQueue *q) {
+    Coroutine *co = q->head;
+    if (co) {
+        q->head = co->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+    }
+    return co;
+}
+
+/* Stacks */
+
+/**
+ * Deadline callback: wake a waiting coroutine empty-handed.
+ **/
+static void coroutine_expire(Timer *timer) {
+    Coroutine *co = (Coroutine *)((char *)timer - offsetof(Coroutine, timer));
+    co->revents = 0;
+    co->waiting = false;
+    coroutine_push(&Ready, co);
+}
+
+/**
+ * Take a coroutine from the pool, or map a new stack for one.
+ *
+ * Each stack has a guard page below it so an overflow faults instead of
+ * overwriting a neighbour.  Pages are only backed once touched, so most of a
+ * stack costs address space rather than memory.
+ **/
+static Coroutine *coroutine_alloc(void) {
+    Coroutine *co = Pool;
+    if (co) {
+        Pool = co->next;
+        Pooled--;
+        return co;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (CoroutineStack + page - 1) / page * page + page;
+    char *stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(stack, page, PROT_NONE) < 0) {
+        munmap(stack, size);
+        return NULL;
+    }
+
+    co = (Coroutine *)(stack + size - ((sizeof(Coroutine) + 63) & ~(size_t)63));
+    memset(co, 0, sizeof(Coroutine));
+    co->stack = stack;
+    co->size  = size;
+    co->timer.callback = coroutine_expire;
+    return co;
+}
+
+static void coroutine_release(Coroutine *co) {
+    if (Pooled >= COROUTINE_POOL_MAX) {
+        munmap(co->stack, co->size);
+        return;
+    }
+    co->next = Pool;
+    Pool = co;
+    Pooled++;
+}
+
+/* Switching */
+
+/**
+ * Resume a coroutine until it yields or finishes.
+ **/
+static void coroutine_resume(Coroutine *co) {
+    co->parent = Current;
+    Current = co;
+    coroutine_switch(&co->caller, &co->context);
+    Current = co->parent;
+}
+
+/**
+ * Suspend the running coroutine and return to whoever resumed it.
+ **/
+static void coroutine_yield(void) {
+    Coroutine *co = Current;
+    coroutine_switch(&co->context, &co->caller);
+}
+
+/**
+ * First frame of every coroutine: run the body, then leave for good.
+ **/
+static void coroutine_main(void) {
+    Coroutine *co = Current;
+    co->function(co->argument);
+    co->finished = true;
+    coroutine_yield();
+}
+
+/**
+ * Point a coroutine's context at coroutine_main on a fresh stack.
+ **/
+static void coroutine_prepare(Coroutine *co) {
+    char *top = (char *)co;             /* The stack grows down from the Coroutine */
+
+#if defined(__x86_64__)
+    uintptr_t *sp = (uintptr_t *)((uintptr_t)top & ~(uintptr_t)15);
+    *--sp = 0;                          /* Return address of coroutine_main (ends backtraces) */
+    *--sp = (uintptr_t)coroutine_main;  /* Where coroutine_switch returns to */
+    for (int i = 0; i < 6; i++) {
+        *--sp = 0;                      /* rbp, rbx, r12-r15 */
+    }
+    co->context = sp;
+#else
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp   = co->stack + sysconf(_SC_PAGESIZE);
+    co->context.uc_stack.ss_size = top - (char *)co->context.uc_stack.ss_sp;
+    co->context.uc_link          = NULL;
+    makecontext(&co->context, coroutine_main, 0);
+#endif
+}
+
+/* Waiting */
+
+/**
+ * Park the running coroutine until it is woken (by readiness or a deadline).
+ **/
+static void coroutine_park(int timeout) {
+    Coroutine *co = Current;
+
+    co->waiting = true;
+    co->revents = 0;
+    if (timeout >= 0) {
+        timer_add(Wheel, &co->timer, timer_now() + timeout);
+    }
+    coroutine_yield();
+    timer_cancel(&co->timer);
+}
+
+/**
+ * Wait for a descriptor to become ready, like poll on a single fd.
+ *
+ * @param   fd          Descriptor.
+ * @param   events      POLLIN and/or POLLOUT.
+ * @param   timeout     Milliseconds to wait at most (-1 = no limit).
+ * @return  The events that are ready (poll revents), 0 on timeout, or -1 on
+ *          error with errno set.
+ *
+ * Inside a coroutine the wait is handed to the event loop and other
+ * connections carry on meanwhile; anywhere else (forking children, scheduler
+ * workers, HTTP/2 sessions) it is a plain poll.
+ **/
+int coroutine_poll(int fd, short events, int timeout) {
+    if (!Current) {
+        struct pollfd pfd = { .fd = fd, .events = events };
+        int n;
+        while ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);     /* e.g. SIGUSR1 dumps */
+        return n > 0 ? pfd.revents : n;
+    }
+
+    struct epoll_event event = {
+        .events   = ((events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLLOUT) ? EPOLLOUT : 0),
+        .data.ptr = Current,
+    };
+    if (epoll_ctl(PollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        /* Not pollable by epoll (e.g. a regular file): it never blocks */
+        return errno == EPERM ? (events & (POLLIN | POLLOUT)) : -1;
+    }
+    coroutine_park(timeout);
+    epoll_ctl(PollFd, EPOLL_CTL_DEL, fd, NULL);
+
+    uint32_t revents = Current->revents;
+    return ((revents & (EPOLLIN | EPOLLRDHUP)) ? POLLIN  : 0) |
+           ((revents & EPOLLOUT)               ? POLLOUT : 0) |
+           ((revents & EPOLLERR)               ? POLLERR : 0) |
+           ((revents & EPOLLHUP)               ? POLLHUP : 0);
+}
+
+/**
+ * Wait for any of several descriptors, like poll.
+ *
+ * @param   fds         Descriptors and the events wanted of each.
+ * @param   nfds        Number of descriptors.
+ * @param   timeout     Milliseconds to wait at most (-1 = no limit).
+ * @return  Number of descriptors with events (in their revents), 0 on
+ *          timeout, or -1 on error with errno set.
+ *
+ * Inside a coroutine the wait is handed to the event loop as in
+ * coroutine_poll; once woken, a poll that does not block fills in revents.
+ **/
+int coroutine_pollv(struct pollfd *fds, nfds_t nfds, int timeout) {
+    int n;
+
+    if (Current) {
+        nfds_t added = 0;
+        bool ready = false;
+        for (; added < nfds; added++) {
+            struct epoll_event event = {
+                .events   = ((fds[added].events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) | ((fds[added].events & POLLOUT) ? EPOLLOUT : 0),
+                .data.ptr = Current,
+            };
+            if (epoll_ctl(PollFd, EPOLL_CTL_ADD, fds[added].fd, &event) < 0) {
+                ready = true;           /* Never blocks (EPERM), or the poll below says why */
+                break;
+            }
+        }
+        if (!ready) {
+            coroutine_park(timeout);
+        }
+        for (nfds_t i = 0; i < added; i++) {
+            epoll_ctl(PollFd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+        }
+        if (!ready && Current->revents == 0) {
+            for (nfds_t i = 0; i < nfds; i++) {
+                fds[i].revents = 0;
+            }
+            return 0;
+        }
+        timeout = 0;
+    }
+
+    while ((n = poll(fds, nfds, timeout)) < 0 && errno == EINTR);
+    return n;
+}
+
+/**
+ * Sleep for a while without holding up the event loop (inside a coroutine).
+ **/
+void coroutine_sleep(int milliseconds) {
+    if (!Current) {
+        struct timespec ts = { .tv_sec = milliseconds / 1000, .tv_nsec = (milliseconds % 1000) * 1000000L };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        return;
+    }
+    coroutine_park(milliseconds);
+}
+
+/* Event Loop */
+
+/**
+ * Set up coroutines for the calling thread's event loop.
+ *
+ * @param   wheel       The loop's timer wheel (wait deadlines go there).
+ * @return  Descriptor the loop must watch for readability and then call
+ *          coroutine_run, or -1 if coroutines are disabled.
+ **/
+int coroutine_start(TimerWheel *wheel) {
+    if (CoroutineStack == 0) {
+        return -1;
+    }
+    if (CoroutineStack < COROUTINE_STACK_MIN) {
+        CoroutineStack = COROUTINE_STACK_MIN;
+    }
+    if ((PollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        log("Unable to create coroutine epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    Wheel = wheel;
+    debug("Handlers run in coroutines with %zu byte stacks", CoroutineStack);
+    return PollFd;
+}
+
+bool coroutine_active(void) {
+    return PollFd >= 0;
+}
+
+/**
+ * Stop using coroutines in a process forked from the event loop: the
+ * coroutines it inherited never run again, and it serves its connection by
+ * waiting in place.
+ **/
+void coroutine_stop(void) {
+    if (PollFd >= 0) {
+        close(PollFd);
+        PollFd = -1;
+    }
+    Current = NULL;                     /* Even when forked from within one */
+}
+
+/**
+ * Return whether the caller is the event loop itself rather than one of its
+ * coroutines: any wait here would hold up every connection.
+ **/
+bool coroutine_on_loop(void) {
+    return PollFd >= 0 && !Current;
+}
+
+/**
+ * Run a function as a coroutine, starting it at once.
+ *
+ * @param   function    Body.
+ * @param   argument    Passed to it.
+ * @return  true if it ran to completion without blocking, false if it is
+ *          suspended; it is then handed back by coroutine_finished once done.
+ *
+ * When no stack can be had the function simply runs on the caller's.
+ **/
+bool coroutine_spawn(void (*function)(void *), void *argument) {
+    Coroutine *co = coroutine_alloc();
+    if (!co) {
+        function(argument);
+        return true;
+    }
+
+    co->function = function;
+    co->argument = argument;
+    co->finished = false;
+    co->waiting  = false;
+    coroutine_prepare(co);
+    coroutine_resume(co);
+
+    if (co->finished) {
+        coroutine_release(co);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Resume every coroutine whose wait is over (call after epoll reports the
+ * coroutine descriptor and after advancing the timer wheel).
+ **/
+void coroutine_run(void) {
+    struct epoll_event events[COROUTINE_EVENTS_MAX];
+    Coroutine *co;
+    int n;
+
+    if (PollFd < 0) {
+        return;
+    }
+
+    do {
+        n = epoll_wait(PollFd, events, COROUTINE_EVENTS_MAX, 0);
+        for (int i = 0; i < n; i++) {
+            co = events[i].data.ptr;
+            if (co->waiting) {
+                co->waiting = false;
+                co->revents = events[i].events;
+                coroutine_push(&Ready, co);
+            }
+        }
+    } while (n == COROUTINE_EVENTS_MAX);
+
+    while ((co = coroutine_pop(&Ready)) != NULL) {
+        coroutine_resume(co);
+        if (co->finished) {
+            coroutine_push(&Finished, co);
+        }
+    }
+}
+
+/**
+ * Collect a coroutine that finished after suspending.
+ *
+ * @return  Its argument, or NULL when there are no more.
+ **/
+void *coroutine_finished(void) {
+    Coroutine *co = coroutine_pop(&Finished);
+    if (!co) {
+        return NULL;
+    }
+    void *argument = co->argument;
+    coroutine_release(co);
+    return argument;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
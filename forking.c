@@ -6,55 +6,105 @@
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Globals */
+
+static volatile sig_atomic_t Children = 0;  /* Children serving connections */
+
+/**
+ * Reap finished children and count them out.
+ **/
+static void forking_reap(int signum) {
+    int saved = errno;
+    (void)signum;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        if (Children > 0) {
+            Children--;
+        }
+    }
+    errno = saved;
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
- * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * The parent should accept a connection and then fork off and let the child
+ * handle its requests (and any keep-alive requests that follow).
+ *
+ * With a CPU list (--cpus), each child is pinned to the CPU that has been
+ * receiving its connection's packets, or to the next listed CPU in turn.
+ *
+ * Once the child limit (-o children=N) is reached, new clients are answered
+ * 503 by the parent instead of forking more.
  **/
 int forking_server(int sfd) {
     /* Accept and handle HTTP request */
     if (sfd < 0){
         return EXIT_FAILURE;
     }
+    /* Reap children as they finish */
+    struct sigaction action = { .sa_handler = forking_reap, .sa_flags = SA_RESTART | SA_NOCLDSTOP };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+    int next_slot = 0;
     while (true) {
-    	/* Accept request */
-         Request* client = NULL;
-         if ((client = accept_request(sfd)) == NULL) {
-             return EXIT_FAILURE;                       
-         }
-        //FILE* client_file = client->file;
-        /*if (!client_file) {
+    	/* Accept connection */
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = socket_accept(sfd, (struct sockaddr *)&addr, &addrlen);
+        if (fd < 0) {
+            log("accept failed: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        if (!overload_admit(SHED_CHILDREN, Children)) {
+            overload_shed(fd, SHED_CHILDREN);
+            close(fd);
             continue;
-        }*/
-	/* Ignore children */
-        signal(SIGCHLD,SIG_IGN);
-	/* Fork off child process to handle request */
+        }
+
+        Connection *client = connection_new(fd, (struct sockaddr *)&addr, addrlen);
+        if (!client) {
+            continue;
+        }
+
+        int slot = affinity_slot(fd);
+        if (slot < 0 && Affinity.count > 0) {
+            slot = next_slot++ % Affinity.count;
+        }
+
+	/* Fork off child process to serve the connection until it closes
+	 * (counting it before it can be reaped) */
+        sigset_t mask, saved;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &saved);
         pid_t pid = fork();
+        if (pid > 0) {
+            Children++;
+        }
+        sigprocmask(SIG_SETMASK, &saved, NULL);
         if (pid < 0) {
             fprintf(stderr,"Unable to fork:%s\n",strerror(errno));
-            free_request(client);
+            connection_free(client);
             return EXIT_FAILURE;
-            //fclose(client_file);
         } else if (pid==0) {
-            debug("Handling client request");
-            handle_request(client);
-            free_request(client);
-            return EXIT_SUCCESS;
-                //fclose(client_file);
-                //handle_error(client,handle_request(client));
-             /*else {
-                //handle_request(client);
-                //fclose(client_file);
-                exit(EXIT_SUCCESS);
-            }*/
+            debug("Handling client connection");
+            signal(SIGCHLD, SIG_DFL);       /* Leave CGI children to pclose */
+            if (slot >= 0) {
+                affinity_pin(slot);
+            }
+            connection_serve(client);
+            connection_free(client);
+            exit(EXIT_SUCCESS);
         } else {
-            free_request(client);
+            connection_free(client);
         }
     }
 
@@ -63,4 +113,109 @@ int forking_server(int sfd) {
     return EXIT_SUCCESS;
 }
 
+/* Hybrid Mode */
+
+static bool HybridActive = false;
+
+/**
+ * Serve cheap requests in an event loop and fork only for expensive ones.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The event loop of single_server parses every request and resolves its
+ * path. It answers errors, directory listings, small (or cached) files and
+ * proxied requests itself, with no process creation. A request for a CGI
+ * script or a large file is passed to hybrid_fork instead: a child takes
+ * over the connection, so a crashing or hanging script takes down only its
+ * own client.
+ *
+ * Children count against the child limit (-o children=N) as in forking
+ * mode. Scheduler workers and coroutines are not used, except that
+ * bandwidth limits (-q bytes=) run inline handlers as coroutines so that
+ * pacing one client does not stall the loop.
+ **/
+int hybrid_server(int sfd) {
+    if (sfd < 0) {
+        return EXIT_FAILURE;
+    }
+    if (Scheduler.workers > 0 || CoroutineStack > 0) {
+        log("Hybrid mode forks for slow requests: ignoring scheduler workers and coroutines");
+        Scheduler.workers = 0;
+        CoroutineStack    = 0;
+    }
+
+    struct sigaction action = { .sa_handler = forking_reap, .sa_flags = SA_RESTART | SA_NOCLDSTOP };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    HybridActive = true;
+    return single_server(sfd);
+}
+
+/**
+ * Return whether the event loop hands slow requests to children.
+ **/
+bool hybrid_active(void) {
+    return HybridActive;
+}
+
+/**
+ * Hand a prepared request, and the rest of its connection, to a child if
+ * serving it could block the event loop.
+ *
+ * @param   c           Connection (in the event loop).
+ * @param   r           Request (after handle_prepare).
+ * @return  true if the request was handed off (or shed with 503), in which
+ *          case the caller closes its copy of the connection; false if it
+ *          should be served inline.
+ *
+ * Only scripts and files too large to be sent without waiting on the client
+ * (LANE_STATIC) are handed off.  Proxied requests stay in the loop, whose
+ * pool of upstream connections a child would have to start afresh.  The
+ * child serves the request, then any that follow on the connection, and
+ * exits.
+ **/
+bool hybrid_fork(Connection *c, Request *r) {
+    if (r->kind != INDEX_CGI && request_lane(r) != LANE_STATIC) {
+        return false;
+    }
+
+    if (!overload_admit(SHED_CHILDREN, Children)) {
+        overload_shed(c->fd, SHED_CHILDREN);
+        return true;
+    }
+
+    sigset_t mask, saved;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &saved);
+    pid_t pid = fork();
+    if (pid > 0) {
+        Children++;
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    if (pid < 0) {
+        log("Unable to fork (serving inline): %s", strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        /* The child owns the connection alone, as in forking mode */
+        signal(SIGCHLD, SIG_DFL);       /* Leave CGI children to cgi_reap */
+        HybridActive = false;
+        single_forked(c);
+
+        c->request = r;
+        connection_run(c);
+        if (c->keepalive) {
+            connection_serve(c);
+        }
+        connection_free(c);
+        exit(EXIT_SUCCESS);
+    }
+    debug("Handed %s from %s:%s to child %d", r->uri, c->host, c->port, pid);
+    return true;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
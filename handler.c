@@ -1,22 +1,72 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define CGI_HEADERS_MAX     8192        /* Largest header block a script may write */
+#define CGI_HEADERS_COUNT   64          /* Most header lines a script may write */
+#define CGI_BLOCK_SIZE      65536       /* Largest block of output relayed at once */
+
+extern char **environ;
+
+/**
+ * Environment of one CGI script: the request's variables, then the server's
+ * own.  It is built per request rather than with setenv, which never frees
+ * the strings it replaces (REMOTE_PORT alone differs on every request) and
+ * would leave one request's headers behind for the next.
+ **/
+typedef struct {
+    char  **vars;                       /**< "NAME=value" strings (NULL-terminated) */
+    size_t  owned;                      /**< Leading strings allocated for the request */
+    size_t  count;                      /**< Strings in vars */
+    size_t  capacity;                   /**< Slots allocated in vars */
+} CgiEnvironment;
+
+/**
+ * Output of one CGI script on its way to the client: the header block is
+ * collected first and turned into the response headers, then the rest is
+ * relayed in chunks as it arrives.
+ **/
+typedef struct {
+    Request    *request;
+    Response    response;
+    int         fd;                     /**< Read end of the script's stdout */
+    char       *buffer;                 /**< CGI_BLOCK_SIZE bytes */
+    size_t      length;                 /**< Bytes of the header block collected */
+    bool        streaming;              /**< Response begun: relaying the body */
+    bool        ended;                  /**< The script closed its output */
+    bool        failed;                 /**< Output unusable, or the client is gone */
+    int         error;                  /**< errno of a failed read (0 = none) */
+} CgiOutput;
+
 /* Internal Declarations */
 HTTPStatus handle_browse_request(Request *request);
 HTTPStatus handle_file_request(Request *request);
 HTTPStatus handle_cgi_request(Request *request);
-HTTPStatus handle_error(Request *request, HTTPStatus status);
+HTTPStatus handle_not_modified(Request *request);
+bool       request_not_modified(Request *request);
+bool       request_accepts_gzip(Request *request);
+const char *request_etag(Request *request, char *buffer, size_t size);
 
 /**
  * Handle HTTP Request.
@@ -30,60 +80,178 @@ HTTPStatus handle_error(Request *request, HTTPStatus status);
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 HTTPStatus  handle_request(Request *r) {
-    HTTPStatus result;
-    struct stat st;
-
-    /* Parse request */
-    if (parse_request(r) < 0) {
-        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    HTTPStatus status = handle_prepare(r);
+    if (status != HTTP_STATUS_OK) {
+        return handle_error(r, status);
     }
+    return handle_resolved(r);
+}
 
-    /* Determine request path */
-    if(determine_request_path(r->uri) == NULL)
-    {
-        log("Couldn't determine path of uri");
+/**
+ * Parse a request and resolve the resource it names.
+ *
+ * @param   r           HTTP Request structure
+ * @return  HTTP_STATUS_OK once r->kind is known, otherwise the error status
+ *          to answer with (nothing has been sent).
+ **/
+HTTPStatus  handle_prepare(Request *r) {
+    struct stat *st = &r->st;
 
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    /* Parse request (HTTP/2 streams arrive parsed) */
+    if (!r->stream && parse_request(r) < 0) {
+        return HTTP_STATUS_BAD_REQUEST;
     }
 
+    /* Refuse a body larger than allowed before reading any of it */
+    if (BodyMax && r->content_length > (int64_t)BodyMax) {
+        return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    }
 
-    r->path = strdup(determine_request_path(r->uri));
-    debug("HTTP REQUEST PATH: %s", r->path);
+    /* Charge the request to its client (-q requests=...) */
+    if (!ratelimit_request(r)) {
+        return HTTP_STATUS_TOO_MANY_REQUESTS;
+    }
 
-    /* Dispatch to appropriate request handler type based on file type */
-    if(stat(r->path, &st) < 0)
+    /* Prefixes served by an upstream pool (-u) never touch RootPath */
+    if((r->upstream = proxy_route(r->uri)) != NULL)
     {
-        log("Stat didn't work: %s", strerror(errno));
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        r->kind = INDEX_PROXY;
+        return HTTP_STATUS_OK;
     }
 
-    // CGI or static
-    if(S_ISREG(st.st_mode))
+    /* A pack archive holds every resource (directory listings included)
+     * as a prebuilt response; with --index one hash probe finds the
+     * resource; otherwise open the request path beneath RootPath (and stat
+     * it) in one step */
+    if(PackPath)
     {
-        // CGI
-        if(st.st_mode & S_IXUSR)
+        const PackEntry *e = pack_lookup(r->uri);
+        if(e == NULL)
         {
-            result = handle_cgi_request(r);
+            log("Couldn't find uri %s in pack: %s", r->uri, strerror(errno));
+            return errno == EINVAL ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_NOT_FOUND;
+        }
+        r->kind = INDEX_FILE;
+        r->packed = (e->gzip.body_length && request_accepts_gzip(r)) ? &e->gzip : &e->identity;
+        st->st_size  = r->packed->body_length;
+        st->st_mtime = e->mtime;
+    }
+    else if((r->entry = index_lookup(r->uri)) != NULL)
+    {
+        r->kind = r->entry->kind;
+        st->st_size  = r->entry->size;
+        st->st_mtime = r->entry->mtime;
+        if(r->kind == INDEX_CGI)
+        {
+            r->path = mem_strdup(MEM_PATH, index_string(r->entry->path));
+        }
+    }
+    else
+    {
+        /* Paths already known to be missing cost no syscalls */
+        uint32_t generation = 0;
+        if(negcache_lookup(r->uri, &generation))
+        {
+            debug("Known missing uri %s", r->uri);
+            return HTTP_STATUS_NOT_FOUND;
+        }
+
+        r->pathfd = determine_request_path(r->uri, &r->path, st);
+        if(r->pathfd < 0)
+        {
+            int error = errno;
+            log("Couldn't determine path of uri %s: %s", r->uri, strerror(error));
+            if(error == ENOENT || error == ENOTDIR)
+            {
+                negcache_insert(r->uri, generation);
+            }
+            return error == EINVAL ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_NOT_FOUND;
+        }
+        debug("HTTP REQUEST PATH: %s", r->path);
+
+        if(S_ISREG(st->st_mode))
+        {
+            r->kind = (st->st_mode & S_IXUSR) ? INDEX_CGI : INDEX_FILE;
+        }
+        else if(S_ISDIR(st->st_mode))
+        {
+            r->kind = INDEX_DIR;
         }
-        // reg file
         else
         {
-            result = handle_file_request(r);
+            log("Unknown file type O_O");
+            return HTTP_STATUS_NOT_FOUND;
         }
     }
-    // dir
-    else if(S_ISDIR(st.st_mode))
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Classify a prepared request for the scheduler.
+ *
+ * @param   r           HTTP Request structure (after handle_prepare).
+ * @return  LANE_CACHED for responses served from memory (packed or indexed
+ *          resources, 304s, small files), LANE_STATIC for other files,
+ *          LANE_BROWSE for directory listings and LANE_CGI for scripts
+ *          and proxied requests.
+ **/
+Lane        request_lane(Request *r) {
+    switch(r->kind)
     {
-        result = handle_browse_request(r);
+        case INDEX_CGI:
+        case INDEX_PROXY:
+            return LANE_CGI;
+        case INDEX_DIR:
+            return LANE_BROWSE;
+        default:
+            if(r->packed || (r->entry && r->entry->data) || r->st.st_size <= SCHEDULER_SMALL_MAX)
+            {
+                return LANE_CACHED;
+            }
+            return request_not_modified(r) ? LANE_CACHED : LANE_STATIC;
     }
-    // something else
-    else
+}
+
+/**
+ * Serve a prepared request.
+ *
+ * @param   r           HTTP Request structure (after handle_prepare).
+ * @return  Status of the HTTP request.
+ **/
+HTTPStatus  handle_resolved(Request *r) {
+    HTTPStatus result;
+
+    /* Hold partial segments until the whole response is queued */
+    socket_cork(r->fd, true);
+
+    /* Dispatch to appropriate request handler type based on file type */
+    switch(r->kind)
     {
-        log("Unknown file type O_O");
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        case INDEX_CGI:
+            result = handle_cgi_request(r);
+            break;
+        case INDEX_PROXY:
+            result = handle_proxy_request(r);
+            break;
+        case INDEX_DIR:
+            result = handle_browse_request(r);
+            break;
+        default:
+            // unchanged since the client's copy
+            if(request_not_modified(r))
+            {
+                result = handle_not_modified(r);
+            }
+            else
+            {
+                result = handle_file_request(r);
+            }
+            break;
     }
 
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    socket_cork(r->fd, false);
+
+    log("HTTP REQUEST STATUS: %s (%s)", http_status_string(result), request_hostname(r));
     return result;
 }
 
@@ -95,71 +263,54 @@ HTTPStatus  handle_request(Request *r) {
  *
  * This lists the contents of a directory in HTML.
  *
- * If the path cannot be opened or scanned as a directory, then handle error
+ * If the directory cannot be scanned, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
 HTTPStatus  handle_browse_request(Request *r) {
     struct dirent **entries;
-    //DIR * dir;
+    Response res;
     int n;
 
     debug("Browsing directory");
 
-    /* Open a directory for reading or scanning */
-    /*if((dir = opendir(r->path)) == NULL)
-    {
-        log("Couldn't open directory: %s", strerror(errno));
-        return HTTP_STATUS_NOT_FOUND;
-    }*/
-
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    
-    fprintf(r->file, "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
-
-    /* For each entry in directory, emit HTML list item */
-
-    fprintf(r->file, "<html>");
-    
-    fprintf(r->file, "<ul>\n");
-
-    // loop while entry exists
-    char link [BUFSIZ];
-    char host [BUFSIZ];
-
-    if(gethostname(host, BUFSIZ) < 0)
-    {
-        log("Couldn't resolve hostname: %s\n", strerror(errno));
-        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
-    }
-
-    n = scandir(r->path, &entries, NULL, alphasort);
+    /* Scan directory */
+    n = scandirat(r->entry ? r->entry->fd : r->pathfd, ".", &entries, NULL, alphasort);
     if (n == -1) {
         log("Couldn't scan dir: %s", strerror(errno));
-        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
+    /* scandir allocates with malloc: charge its entries to browse */
+    int64_t scanned = n * sizeof(struct dirent *);
     for (int i = 0; i < n; i++) {
-        if(streq(entries[i]->d_name, ".")) continue;
-        
-        // make entry string
-        strcpy(link, r->uri);
-        if(strlen(r->uri) > 1) strcat(link, "/");
-        strcat(link, entries[i]->d_name);
+        scanned += entries[i]->d_reclen;
+    }
+    mem_charge(MEM_BROWSE, scanned);
 
-        // make link
+    /* Write HTTP Header with OK Status and text/html Content-Type */
+    response_init(&res, r, HTTP_STATUS_OK);
+    response_content_type(&res, "text/html");
 
-        log("Link: %s", link);
-        fprintf(r->file, "<li><a href=\"%s\">%s</a></li>\n", link, entries[i]->d_name);
-        free(entries[i]);
-    } 
+    /* For each entry in directory, emit HTML list item */
+    response_append(&res, "<html><ul>\n");
 
-    fprintf(r->file, "</ul>");
-    fprintf(r->file, "</html>");
+    const char *separator = strlen(r->uri) > 1 ? "/" : "";
+    for (int i = 0; i < n; i++) {
+        if(!streq(entries[i]->d_name, "."))
+        {
+            response_append(&res, "<li><a href=\"%s%s%s\">%s</a></li>\n",
+                r->uri, separator, entries[i]->d_name, entries[i]->d_name);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    mem_charge(MEM_BROWSE, -scanned);
 
-    //closedir(dir);
+    response_append(&res, "</ul></html>");
 
-    /* Flush socket, return OK */
-    fflush(r->file);
+    /* Send headers and listing together, return OK */
+    response_send(&res, NULL, 0);
+    response_free(&res);
     return HTTP_STATUS_OK;
 }
 
@@ -169,65 +320,597 @@ HTTPStatus  handle_browse_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This streams the contents of the already opened file to the socket.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * If the mimetype cannot be determined, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 HTTPStatus  handle_file_request(Request *r) {
-    FILE *fs = NULL;
-    char buffer[BUFSIZ] = {0};
     char *mimetype = NULL;
-    size_t nread = 0;
+    Response res;
 
     debug("Making some file stuff happen");
 
-    /* Open file for reading */
-    int rfd = open(r->path, O_RDONLY);
-    if (rfd < 0)
+    char etag[64];
+
+    /* Packed resources carry their headers and body in the archive */
+    if(r->packed)
     {
-        log("Error reading file: %s", strerror(errno));
-        return HTTP_STATUS_NOT_FOUND;
+        response_init(&res, r, HTTP_STATUS_OK);
+        response_header(&res, NULL, "%.*s", (int)r->packed->headers_length, pack_data(r->packed->headers));
+        pack_send(&res, r->packed);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Indexed files carry their MIME type, ETag and (for small files) their
+     * contents in memory */
+    if(r->entry)
+    {
+        const IndexEntry *e = r->entry;
+
+        response_init(&res, r, HTTP_STATUS_OK);
+        response_content_type(&res, index_string(e->mimetype));
+        response_validators(&res, index_string(e->etag), e->mtime);
+        if(e->data)
+        {
+            response_send(&res, e->data, e->size);
+        }
+        else
+        {
+            response_send_file(&res, e->fd, 0, e->size);
+        }
+        return HTTP_STATUS_OK;
     }
-    fs = fdopen(rfd, "r");
 
     /* Determine mimetype */
     mimetype = determine_mimetype(r->uri);
     if(mimetype == NULL)
     {
         log("Cannot determine mimetype");
-        goto fail;
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
     log("Mimetype: %s", mimetype);
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content-Type: %s\n", mimetype);
-    fprintf(r->file, "\r\n");
+    /* Write HTTP Headers with OK status and determined Content-Type, followed
+     * by the file contents (one writev for small files, sendfile otherwise);
+     * the file was opened and stat'ed when the path was resolved */
+    response_init(&res, r, HTTP_STATUS_OK);
+    response_content_type(&res, mimetype);
+    response_validators(&res, request_etag(r, etag, sizeof(etag)), r->st.st_mtime);
+    response_send_file(&res, r->pathfd, 0, r->st.st_size);
 
-    /* Read from file and write to socket in chunks */
-    
-    while((nread = fread(buffer, 1, 1, fs)) > 0)
-    {
-        fwrite(buffer, nread, 1, r->file);
-        fwrite(buffer, nread, 1, stderr);
+    /* Deallocate mimetype, return OK */
+    mem_free(mimetype);
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Return the entity tag of the requested file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   buffer      Buffer for a computed tag.
+ * @param   size        Size of buffer.
+ * @return  The packed or indexed tag, or one computed from the file status
+ *          into buffer.
+ **/
+const char *request_etag(Request *r, char *buffer, size_t size) {
+    if (r->packed) {
+        return pack_data(r->packed->etag);
     }
+    if (r->entry) {
+        return index_string(r->entry->etag);
+    }
+    http_etag(&r->st, buffer, size);
+    return buffer;
+}
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    fflush(r->file);
-    free(mimetype);
+/**
+ * Check whether the client accepts a gzip content coding.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether Accept-Encoding lists gzip (or *) without q=0.
+ **/
+bool request_accepts_gzip(Request *r) {
+    const char *value = request_header(r, "Accept-Encoding");
 
-    return HTTP_STATUS_OK;
+    while (value && *value) {
+        value += strspn(value, " \t\r\n,");
+        size_t length = strcspn(value, " \t\r\n,;");
+        bool match = (length == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+                     (length == 1 && *value == '*');
+        value += length;
+
+        /* Parameters: only a zero quality value refuses the coding */
+        bool refused = false;
+        while (*value && *value != ',') {
+            value += strspn(value, " \t\r\n;");
+            if (strncasecmp(value, "q=", 2) == 0) {
+                refused = strtod(value + 2, NULL) == 0.0;
+            }
+            value += strcspn(value, ";,");
+        }
+        if (match) {
+            return !refused;
+        }
+    }
+    return false;
+}
+
+/**
+ * Evaluate conditional request headers against a static file.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether the client's cached copy is still current.
+ *
+ * If-None-Match takes precedence over If-Modified-Since (RFC 7232 section 6);
+ * entity tags are compared weakly, and "*" matches any existing file.
+ **/
+bool request_not_modified(Request *r) {
+    const char *value;
 
-fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    if(rfd != -1) close(rfd);
-    if(mimetype != NULL) free(mimetype);
+    if ((value = request_header(r, "If-None-Match")) != NULL) {
+        char buffer[64];
+        const char *etag = request_etag(r, buffer, sizeof(buffer));
+        size_t etag_length = strlen(etag);
 
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        while (*value) {
+            value += strspn(value, " \t\r,");
+            size_t length = strcspn(value, " \t\r,");
+            if (length == 1 && *value == '*') {
+                return true;
+            }
+            /* Weak comparison: W/"x" matches "x" */
+            const char *tag = value;
+            size_t tag_length = length;
+            if (tag_length > 2 && strncmp(tag, "W/", 2) == 0) {
+                tag += 2;
+                tag_length -= 2;
+            }
+            if (tag_length == etag_length && strncmp(tag, etag, etag_length) == 0) {
+                return true;
+            }
+            value += length;
+        }
+        return false;
+    }
+
+    if ((value = request_header(r, "If-Modified-Since")) != NULL) {
+        struct tm tm = {0};
+        const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == NULL) {
+            return false;
+        }
+        return r->st.st_mtime <= timegm(&tm);
+    }
+
+    return false;
+}
+
+/**
+ * Handle a conditional request whose cached copy is current.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  HTTP_STATUS_NOT_MODIFIED.
+ *
+ * Sends the validators without opening the file or sending a body.
+ **/
+HTTPStatus handle_not_modified(Request *r) {
+    Response res;
+    char etag[64];
+
+    debug("Client copy is current");
+
+    response_init(&res, r, HTTP_STATUS_NOT_MODIFIED);
+    response_validators(&res, request_etag(r, etag, sizeof(etag)), r->st.st_mtime);
+    response_send(&res, NULL, 0);
+    return HTTP_STATUS_NOT_MODIFIED;
+}
+
+/**
+ * Read what a script has written so far: wait for some output (or its end),
+ * then take whatever else is already waiting, up to size bytes.
+ *
+ * @param   wait        Wait for output if there is none yet (otherwise fail
+ *                      with EAGAIN).
+ * @return  Bytes read (0 at the end of the output), or -1 on error
+ *          (ETIMEDOUT if the script wrote nothing for Timeouts.write).
+ *
+ * The pipe is non-blocking, so a handler coroutine yields while the script
+ * is quiet.
+ **/
+static ssize_t cgi_read(int fd, char *buffer, size_t size, bool wait) {
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, buffer + total, size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            if (total > 0) {
+                break;
+            }
+            if (!wait) {
+                return -1;
+            }
+            int ready = coroutine_poll(fd, POLLIN, Timeouts.write > 0 ? Timeouts.write : -1);
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (ready < 0 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0) {
+            return total ? (ssize_t)total : -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * Kill a script, along with anything it started (it leads a process group
+ * of its own).
+ **/
+static void cgi_kill(pid_t pid) {
+    kill(-pid, SIGKILL);
+}
+
+/**
+ * Reap a script.  One that closed its output may still be running: it is
+ * given Timeouts.write to exit, waiting on a pidfd (a handler coroutine
+ * yields rather than blocking the event loop in waitpid), and is then
+ * killed.
+ **/
+static void cgi_reap(pid_t pid) {
+    if (waitpid(pid, NULL, WNOHANG) != 0) {
+        return;
+    }
+#ifdef SYS_pidfd_open
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        if (coroutine_poll(pidfd, POLLIN, Timeouts.write > 0 ? Timeouts.write : -1) == 0) {
+            log("Killing cgi script %d: still running %d ms after its output", pid, Timeouts.write);
+            cgi_kill(pid);
+        }
+        close(pidfd);
+    }
+#endif
+    waitpid(pid, NULL, 0);
+}
+
+static bool cgi_env_append(CgiEnvironment *env, char *var) {
+    if (env->count + 2 > env->capacity) {
+        size_t capacity = env->capacity ? env->capacity * 2 : 64;
+        char **vars = mem_realloc(MEM_CGI, env->vars, capacity * sizeof(char *));
+        if (!vars) {
+            return false;
+        }
+        env->vars = vars;
+        env->capacity = capacity;
+    }
+    env->vars[env->count++] = var;
+    env->vars[env->count] = NULL;
+    return true;
+}
+
+static bool cgi_env_named(const char *var, const char *name, size_t length) {
+    return strncmp(var, name, length) == 0 && (var[length] == '=' || var[length] == '\0');
+}
+
+/**
+ * Set (or with a NULL value, withhold) a variable of a script's environment.
+ **/
+static void cgi_setenv(CgiEnvironment *env, const char *name, const char *value) {
+    char *var = value ? mem_asprintf(MEM_CGI, "%s=%s", name, value) : mem_strdup(MEM_CGI, name);
+    if (!var) {
+        return;
+    }
+    for (size_t i = 0; i < env->owned; i++) {
+        if (cgi_env_named(env->vars[i], name, strlen(name))) {
+            mem_free(env->vars[i]);
+            env->vars[i] = var;
+            return;
+        }
+    }
+    if (cgi_env_append(env, var)) {
+        env->owned++;
+    } else {
+        mem_free(var);
+    }
+}
+
+/**
+ * Add the server's variables that the request did not set or withhold, and
+ * drop the withheld names.
+ **/
+static char **cgi_environment(CgiEnvironment *env) {
+    for (char **e = environ; *e; e++) {
+        size_t length = strcspn(*e, "=");
+        bool set = false;
+        for (size_t i = 0; i < env->owned && !set; i++) {
+            set = cgi_env_named(env->vars[i], *e, length);
+        }
+        if (!set) {
+            cgi_env_append(env, *e);
+        }
+    }
+
+    size_t kept = 0, owned = 0;
+    for (size_t i = 0; i < env->count; i++) {
+        if (i < env->owned && !strchr(env->vars[i], '=')) {
+            mem_free(env->vars[i]);
+            continue;
+        }
+        owned += i < env->owned;
+        env->vars[kept++] = env->vars[i];
+    }
+    env->owned = owned;
+    env->count = kept;
+    if (env->vars) {
+        env->vars[kept] = NULL;
+    }
+    return env->vars ? env->vars : environ;
+}
+
+static void cgi_env_free(CgiEnvironment *env) {
+    for (size_t i = 0; i < env->owned; i++) {
+        mem_free(env->vars[i]);
+    }
+    mem_free(env->vars);
+}
+
+/**
+ * Start a CGI script with pipes for its stdin and stdout.
+ *
+ * @param   path        Script to execute.
+ * @param   envp        Its environment.
+ * @param   input       Set to the pipe feeding its stdin (write end input[1]
+ *                      is non-blocking).
+ * @param   output      Set to the pipe carrying its stdout (read end
+ *                      output[0] is non-blocking).
+ * @param   pid         Set to the script's process ID.
+ * @return  0 on success, or an errno value.
+ *
+ * The script gets the default SIGPIPE disposition back (the server ignores
+ * it) and none of the server's other descriptors, which are close-on-exec.
+ * It leads a new process group, so that cgi_kill reaches its children too.
+ **/
+static int cgi_spawn(const char *path, char **envp, int input[2], int output[2], pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    char *argv[] = { (char *)path, NULL };
+
+    if (pipe2(input, O_CLOEXEC) < 0) {
+        return errno;
+    }
+    if (pipe2(output, O_CLOEXEC) < 0) {
+        int status = errno;
+        close(input[0]);
+        close(input[1]);
+        return status;
+    }
+    fcntl(input[1], F_SETFL, O_NONBLOCK);
+    fcntl(output[0], F_SETFL, O_NONBLOCK);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    int status = posix_spawn(pid, path, &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(input[0]);
+    close(output[1]);
+    if (status != 0) {
+        close(input[1]);
+        close(output[0]);
+    }
+    return status;
+}
+
+/**
+ * Return the length of a script's header block (through the blank line that
+ * ends it), or 0 if the blank line has not arrived yet.
+ **/
+static size_t cgi_header_length(const char *buffer, size_t length) {
+    const char *end = buffer + length;
+
+    for (const char *s = memchr(buffer, '\n', length); s; s = memchr(s + 1, '\n', end - s - 1)) {
+        if (s + 1 < end && s[1] == '\n') {
+            return s - buffer + 2;
+        }
+        if (s + 2 < end && s[1] == '\r' && s[2] == '\n') {
+            return s - buffer + 3;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Begin the response from a script's header block.
+ *
+ * @param   res         Response to begin.
+ * @param   r           HTTP Request structure.
+ * @param   block       Header block.
+ * @param   length      Length of the header block.
+ * @return  false if the block is not a list of CGI (or NPH) headers.
+ *
+ * The status comes from a leading "HTTP/1.x" status line, a Status header, or
+ * (302) a Location header.  Framing headers are dropped: spidey frames the
+ * body itself.
+ **/
+static bool cgi_headers(Response *res, Request *r, const char *block, size_t length) {
+    char lines[CGI_HEADERS_MAX + 1];
+    char *names[CGI_HEADERS_COUNT];
+    char *values[CGI_HEADERS_COUNT];
+    const char *status = NULL;
+    bool location = false;
+    bool type = false;
+    size_t count = 0;
+    char *saveptr = NULL;
+
+    memcpy(lines, block, length);
+    lines[length] = '\0';
+    for (char *line = strtok_r(lines, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        size_t n = strlen(line);
+        if (n > 0 && line[n - 1] == '\r') {
+            line[--n] = '\0';
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (count == 0 && !status && strncmp(line, "HTTP/", 5) == 0) {
+            if (!(status = skip_whitespace(skip_nonwhitespace(line)))) {
+                return false;
+            }
+            continue;
+        }
+
+        char *colon = strchr(line, ':');
+        if (!colon || colon == line || count == CGI_HEADERS_COUNT) {
+            return false;
+        }
+        *colon = '\0';
+        names[count]  = line;
+        values[count] = colon + 1 + strspn(colon + 1, " \t");
+
+        if (strcasecmp(line, "Status") == 0) {
+            status = values[count];
+        } else if (strcasecmp(line, "Location") == 0) {
+            location = true;
+        } else if (strcasecmp(line, "Content-Type") == 0) {
+            type = true;
+        }
+        count++;
+    }
+
+    if (!status) {
+        status = location ? "302 Found" : "200 OK";
+    }
+    if (strspn(status, "0123456789") != 3 || (status[3] != '\0' && status[3] != ' ')) {
+        return false;
+    }
+
+    response_init_status(res, r, status);
+    for (size_t i = 0; i < count; i++) {
+        if (strcasecmp(names[i], "Status") == 0 ||
+            strcasecmp(names[i], "Connection") == 0 ||
+            strcasecmp(names[i], "Keep-Alive") == 0 ||
+            strcasecmp(names[i], "Content-Length") == 0 ||
+            strcasecmp(names[i], "Transfer-Encoding") == 0) {
+            continue;
+        }
+        if (strcasecmp(names[i], "Content-Type") == 0) {
+            response_content_type(res, values[i]);
+        } else {
+            response_header(res, names[i], "%s", values[i]);
+        }
+    }
+    if (!type && !location) {
+        response_content_type(res, DefaultMimeType);
+    }
+    return true;
+}
+
+/**
+ * Relay what a script has written: collect its header block and begin the
+ * response from it, then send the rest on as chunks (to HTTP/1.1 clients,
+ * so the connection can be kept alive; delimited by closing it otherwise).
+ *
+ * @param   out         Script output.
+ * @param   wait        Wait for output until the script closes it, rather
+ *                      than returning as soon as the pipe is empty.
+ * @return  0 on success, -1 once the output has failed (out->failed).
+ **/
+static int cgi_relay(CgiOutput *out, bool wait) {
+    Request *r = out->request;
+
+    while (!out->ended && !out->failed) {
+        size_t offset = out->streaming ? 0 : out->length;
+        ssize_t nread = cgi_read(out->fd, out->buffer + offset, CGI_BLOCK_SIZE - offset, wait);
+        if (nread < 0) {
+            if (!wait && errno == EAGAIN) {
+                break;
+            }
+            out->error  = errno;
+            out->failed = true;
+            break;
+        }
+        out->ended = nread == 0;
+
+        if (out->streaming) {
+            if (nread > 0 && response_send_chunk(&out->response, out->buffer, nread) < 0) {
+                out->failed = true;
+            }
+            continue;
+        }
+
+        /* Collect the header block, however the output is broken up */
+        out->length += nread;
+        size_t head = cgi_header_length(out->buffer, out->length);
+        if (head == 0 && !out->ended && out->length < CGI_HEADERS_MAX) {
+            continue;
+        }
+        if (head == 0 && out->ended) {
+            head = out->length;         /* Output ended with the headers */
+        }
+        if (head == 0 || head > CGI_HEADERS_MAX || !cgi_headers(&out->response, r, out->buffer, head)) {
+            out->failed = true;
+            break;
+        }
+
+        socket_cork(r->fd, false);
+        response_stream(&out->response);
+        out->streaming = true;
+        if (response_send_chunk(&out->response, out->buffer + head, out->length - head) < 0) {
+            out->failed = true;
+        }
+    }
+    return out->failed ? -1 : 0;
+}
+
+/**
+ * Wait for a script to take more of the request body, relaying its output
+ * meanwhile: a script that writes as it reads (e.g. cat) stops reading once
+ * its stdout pipe is full, so waiting on stdin alone would never end.
+ **/
+static int cgi_wait(int pipefd, void *context) {
+    CgiOutput *out = context;
+
+    while (true) {
+        struct pollfd fds[2] = {
+            { .fd = pipefd,  .events = POLLOUT },
+            { .fd = out->fd, .events = POLLIN },
+        };
+        int ready = coroutine_pollv(fds, out->ended ? 1 : 2, Timeouts.body > 0 ? Timeouts.body : -1);
+        if (ready <= 0) {
+            return ready;
+        }
+        if (fds[0].revents) {
+            return fds[0].revents;
+        }
+        if (cgi_relay(out, false) < 0) {
+            errno = EPIPE;              /* Feed the script no more */
+            return -1;
+        }
+    }
 }
 
 /**
@@ -236,44 +919,72 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This spawns the specified executable with pipes for its stdin and stdout,
+ * streams the request body (if any) into its stdin, turns the headers it
+ * writes into the response headers, and streams the rest of its output to
+ * the socket as it arrives (while the body is still going in, too).
  *
- * If the path cannot be popened, then handle error with
+ * If the script cannot be spawned, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 HTTPStatus handle_cgi_request(Request *r) {
-    FILE *pfs = NULL;
-    char buffer[BUFSIZ] = {0};
+    int input[2], output[2];
+    pid_t pid;
+    CgiEnvironment env = { NULL, 0, 0, 0 };
 
     debug("Making some CGI happen");
-
     /* Export CGI environment variables from request structure:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
     // DOCUMENT_ROOT
-    setenv("DOCUMENT_ROOT", RootPath, 1);
+    cgi_setenv(&env, "DOCUMENT_ROOT", RootPath);
 
     // QUERY_STRING
-    if(r->query) setenv("QUERY_STRING", r->query, 1);
-    else        setenv("QUERY_STRING", "", 1);
+    if(r->query) cgi_setenv(&env, "QUERY_STRING", r->query);
+    else        cgi_setenv(&env, "QUERY_STRING", "");
 
     // REMOTE_ADDR
-    setenv("REMOTE_ADDR", r->host, 1);
+    cgi_setenv(&env, "REMOTE_ADDR", r->host);
+
+    // REMOTE_HOST (numeric until the resolver has cached a name)
+    cgi_setenv(&env, "REMOTE_HOST", request_hostname(r));
 
     // REMOTE_PORT
-    setenv("REMOTE_PORT", r->port, 1);
+    cgi_setenv(&env, "REMOTE_PORT", r->port);
 
     // REQUEST_METHOD
-    setenv("REQUEST_METHOD", r->method, 1);
+    cgi_setenv(&env, "REQUEST_METHOD", r->method);
+
+    // CONTENT_LENGTH (unknown in advance for a chunked body) and CONTENT_TYPE
+    char content_length[32];
+    if(!r->chunked && r->content_length >= 0)
+    {
+        snprintf(content_length, sizeof(content_length), "%lld", (long long)r->content_length);
+        cgi_setenv(&env, "CONTENT_LENGTH", content_length);
+    }
+    else
+    {
+        cgi_setenv(&env, "CONTENT_LENGTH", NULL);
+    }
+    const char *content_type = request_header(r, "Content-Type");
+    if(content_type)
+    {
+        char *type = mem_strndup(MEM_CGI, content_type, strcspn(content_type, "\r\n"));
+        cgi_setenv(&env, "CONTENT_TYPE", type);
+        mem_free(type);
+    }
+    else
+    {
+        cgi_setenv(&env, "CONTENT_TYPE", NULL);
+    }
 
     // REQUEST_URI
-    setenv("REQUEST_URI", r->uri, 1);
+    cgi_setenv(&env, "REQUEST_URI", r->uri);
 
     // SCRIPT_FILENAME
-    setenv("SCRIPT_FILENAME", r->path, 1);
+    cgi_setenv(&env, "SCRIPT_FILENAME", r->path);
 
     // SERVER_PORT
-    setenv("SERVER_PORT", Port, 1);
+    cgi_setenv(&env, "SERVER_PORT", Port);
 
     /* Export CGI environment variables from request headers */
     Header * curr = r->headers;
@@ -282,49 +993,117 @@ HTTPStatus handle_cgi_request(Request *r) {
     while(curr != NULL)
     {
         debug("Exporting %s", curr->name);
-        if(streq(curr->name, "Host"))
+        if(strcasecmp(curr->name, "Host") == 0)
         {
-            setenv("HTTP_HOST", curr->value, 1);
+            cgi_setenv(&env, "HTTP_HOST", curr->value);
         }
-        else if(streq(curr->name, "Accept"))
+        else if(strcasecmp(curr->name, "Accept") == 0)
         {
-            setenv("HTTP_ACCEPT", curr->value, 1);
+            cgi_setenv(&env, "HTTP_ACCEPT", curr->value);
         }
-        else if(streq(curr->name, "Accept-Language"))
+        else if(strcasecmp(curr->name, "Accept-Language") == 0)
         {
-            setenv("HTTP_ACCEPT_LANGUAGE", curr->value, 1);
+            cgi_setenv(&env, "HTTP_ACCEPT_LANGUAGE", curr->value);
         }
-        else if(streq(curr->name, "Accept-Encoding"))
+        else if(strcasecmp(curr->name, "Accept-Encoding") == 0)
         {
-            setenv("HTTP_ACCEPT_ENCODING", curr->value, 1);
+            cgi_setenv(&env, "HTTP_ACCEPT_ENCODING", curr->value);
         }
-        else if(streq(curr->name, "Connection"))
+        else if(strcasecmp(curr->name, "Connection") == 0)
         {
-            setenv("HTTP_CONNECTION", curr->value, 1);
+            cgi_setenv(&env, "HTTP_CONNECTION", curr->value);
         }
-        else if(streq(curr->name, "User-Agent"))
+        else if(strcasecmp(curr->name, "User-Agent") == 0)
         {
-            setenv("HTTP_USER_AGENT", curr->value, 1);
+            cgi_setenv(&env, "HTTP_USER_AGENT", curr->value);
         }
         curr = curr->next;
     }
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
+    /* Spawn CGI Script with pipes for its stdin and stdout */
+    int status = cgi_spawn(r->path, cgi_environment(&env), input, output, &pid);
+    cgi_env_free(&env);
+
+    if(status != 0)
+    {
+        log("Couldn't spawn cgi script: %s", strerror(status));
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
 
-    if(pfs < 0)
+    CgiOutput out = { .request = r, .fd = output[0], .buffer = mem_malloc(MEM_CGI, CGI_BLOCK_SIZE) };
+    if(out.buffer == NULL)
     {
-        log("Couldn't open cgi script: %s\n", strerror(errno));
-        return HTTP_STATUS_NOT_FOUND;
+        log("Couldn't allocate output buffer for %s", r->path);
+        r->keepalive = false;
+        cgi_kill(pid);
+        close(input[1]);
+        close(output[0]);
+        cgi_reap(pid);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Feed it the request body (the script sees EOF once it is all in),
+     * relaying whatever it writes meanwhile */
+    ssize_t body = request_body_splice(r, input[1], cgi_wait, &out);
+    int error = errno;
+    close(input[1]);
+    if(body < 0 && error != EPIPE)
+    {
+        /* The body did not arrive whole: the script cannot be trusted with
+         * it and the connection cannot carry another request */
+        log("Couldn't read request body for %s: %s", r->path, strerror(error));
+        r->keepalive = false;
+        cgi_kill(pid);
+        mem_free(out.buffer);
+        close(output[0]);
+        cgi_reap(pid);
+        if(out.streaming)
+        {
+            return HTTP_STATUS_OK;              /* Answered already (truncated) */
+        }
+        if(error == ECONNRESET)
+        {
+            return HTTP_STATUS_BAD_REQUEST;     /* Client is gone */
+        }
+        return handle_error(r, error == EFBIG  ? HTTP_STATUS_PAYLOAD_TOO_LARGE :
+                               error == EINVAL ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_REQUEST_TIMEOUT);
     }
 
-    /* Copy data from popen to socket */
-    while(fgets(buffer, BUFSIZ, pfs))
+    /* Relay the rest of the output as it arrives, in blocks as large as the
+     * script's writes allow */
+    cgi_relay(&out, true);
+    if(!out.streaming)
+    {
+        if(out.error)
+        {
+            log("No headers from cgi script %s: %s", r->path, strerror(out.error));
+            cgi_kill(pid);
+        }
+        else
+        {
+            log("Malformed output from cgi script %s", r->path);
+        }
+        mem_free(out.buffer);
+        close(output[0]);
+        cgi_reap(pid);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if(out.failed)
     {
-        fputs(buffer, r->file);
+        /* A truncated body must not look complete; a script that went
+         * quiet (or lost its client) is not waited for */
+        r->keepalive = false;
+        cgi_kill(pid);
+    }
+    else
+    {
+        response_end(&out.response);
     }
 
-    /* Close popen, flush socket, return OK */
+    /* Reap the script, return OK */
+    mem_free(out.buffer);
+    close(output[0]);
+    cgi_reap(pid);
     return HTTP_STATUS_OK;
 }
 
@@ -335,28 +1114,39 @@ HTTPStatus handle_cgi_request(Request *r) {
  * @return  Status of the HTTP error request.
  *
  * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * notify the user of the error (404s over HTTP/1.x are sent pre-serialized by
+ * negcache_send).
  **/
 HTTPStatus  handle_error(Request *r, HTTPStatus status) {
+    Response res;
+
     debug("Handling error");
 
+    /* 404s (e.g. from scanners) are answered with a prebuilt response */
+    if (status == HTTP_STATUS_NOT_FOUND && !r->stream) {
+        negcache_send(r);
+        return status;
+    }
+
     const char *status_string = http_status_string(status);
     log("ERROR STATUS STRING: %s", status_string);
 
     /* Write HTTP Header */
-
-    fprintf(r->file, "HTTP/1.0 %s\n", status_string);
-    fprintf(r->file, "Content-Type: text/html\n");
+    response_init(&res, r, status);
+    response_content_type(&res, "text/html");
+    if (status == HTTP_STATUS_TOO_MANY_REQUESTS) {
+        response_header(&res, "Retry-After", "%d", ratelimit_retry());
+    }
 
     /* Write HTML Description of Error*/
-    fprintf(r->file, "\r\n");
-    fprintf(r->file, "<html>\n");
-    fprintf(r->file, "<h1>%s</h1>\n", status_string);
-    fprintf(r->file, "<h2>Stuff's all borked. I blame nargles.</h2>\n");
-    fprintf(r->file, "</html>\n");
+    response_append(&res, "<html>\n");
+    response_append(&res, "<h1>%s</h1>\n", status_string);
+    response_append(&res, "<h2>Stuff's all borked. I blame nargles.</h2>\n");
+    response_append(&res, "</html>\n");
 
     /* Return specified status */
-    fflush(r->file);
+    response_send(&res, NULL, 0);
+    response_free(&res);
     return status;
 }
 
@@ -0,0 +1,663 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Constants */
+
+#define HPACK_ENTRY_OVERHEAD    32      /* Added to every entry's size (RFC 7541 section 4.1) */
+#define HPACK_STATIC_COUNT      61
+#define HPACK_EOS               256     /* End-of-string symbol */
+
+static const struct {
+    const char *name;
+    const char *value;
+} StaticTable[HPACK_STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* Huffman code of each symbol (RFC 7541 Appendix B): code, length in bits */
+static const struct {
+    uint32_t code;
+    uint8_t  bits;
+} HuffmanCodes[HPACK_EOS + 1] = {
+    { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+    { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+    { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+    { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+    { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+    { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+    { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+    { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+    { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+    { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+    { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+    { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+    { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+    { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+    { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+    { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+    { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+    { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+    { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+    { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+    { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+    { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+    { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+    { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+    { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+    { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+    { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+    { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+    { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+    { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+    { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+    { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+    { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+    { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+    { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+    { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+    { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+    { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+    { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+    { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+    { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+    { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+    { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+    { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+    { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+    { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+    { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+    { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+    { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+    { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+    { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+    { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+    { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+    { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+    { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+    { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+    { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+    { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+    { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+    { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+    { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+    { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+    { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+    { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+struct hpack_field {
+    char   *name;                       /**< Field name (NUL-terminated) */
+    char   *value;                      /**< Field value (NUL-terminated) */
+    size_t  name_length;                /**< Length of name */
+    size_t  value_length;               /**< Length of value */
+};
+
+/* Globals */
+
+static int16_t        HuffmanTree[HPACK_EOS][2];  /* Child node, or -(symbol + 1) for a leaf */
+static pthread_once_t HuffmanOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Build the Huffman decoding tree from the code table.
+ **/
+static void hpack_huffman_build(void) {
+    int nodes = 1;
+
+    for (int symbol = 0; symbol <= HPACK_EOS; symbol++) {
+        uint32_t code = HuffmanCodes[symbol].code;
+        int node = 0;
+        for (int bit = HuffmanCodes[symbol].bits - 1; bit > 0; bit--) {
+            int branch = (code >> bit) & 1;
+            if (!HuffmanTree[node][branch]) {
+                HuffmanTree[node][branch] = nodes++;
+            }
+            node = HuffmanTree[node][branch];
+        }
+        HuffmanTree[node][code & 1] = -(symbol + 1);
+    }
+}
+
+/* Dynamic Table */
+
+static size_t hpack_field_size(size_t name_length, size_t value_length) {
+    return name_length + value_length + HPACK_ENTRY_OVERHEAD;
+}
+
+/**
+ * Return the dynamic table entry at position i (0 is the newest).
+ **/
+static HpackField *hpack_entry(HpackTable *t, size_t i) {
+    return &t->fields[(t->first + i) & (t->capacity - 1)];
+}
+
+/**
+ * Drop the oldest entries until the table fits in size bytes.
+ **/
+static void hpack_evict(HpackTable *t, size_t size) {
+    while (t->count > 0 && t->size > size) {
+        HpackField *f = hpack_entry(t, t->count - 1);
+        t->size -= hpack_field_size(f->name_length, f->value_length);
+        mem_free(f->name);
+        mem_free(f->value);
+        t->count--;
+    }
+}
+
+/**
+ * Add an entry to the dynamic table, taking ownership of name and value.
+ *
+ * An entry larger than the whole table empties it and is not added.
+ **/
+static void hpack_insert(HpackTable *t, char *name, size_t name_length, char *value, size_t value_length) {
+    size_t size = hpack_field_size(name_length, value_length);
+
+    if (size > t->max) {
+        hpack_evict(t, 0);
+        mem_free(name);
+        mem_free(value);
+        return;
+    }
+    hpack_evict(t, t->max - size);
+
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 16;
+        HpackField *fields = mem_malloc(MEM_HTTP2, capacity * sizeof(HpackField));
+        if (!fields) {
+            log("Unable to grow header table: %s", strerror(errno));
+            mem_free(name);
+            mem_free(value);
+            return;
+        }
+        for (size_t i = 0; i < t->count; i++) {
+            fields[i] = *hpack_entry(t, i);
+        }
+        mem_free(t->fields);
+        t->fields   = fields;
+        t->capacity = capacity;
+        t->first    = 0;
+    }
+
+    t->first = (t->first - 1) & (t->capacity - 1);
+    t->count++;
+    t->size += size;
+    *hpack_entry(t, 0) = (HpackField){ name, value, name_length, value_length };
+}
+
+/**
+ * Initialize a dynamic table.
+ *
+ * @param   t           Table.
+ * @param   limit       Largest size the peer allows (SETTINGS_HEADER_TABLE_SIZE).
+ **/
+void hpack_init(HpackTable *t, size_t limit) {
+    memset(t, 0, sizeof(*t));
+    t->max = t->limit = limit;
+}
+
+/**
+ * Apply a new SETTINGS_HEADER_TABLE_SIZE from the peer to an encoder table.
+ *
+ * The encoder never uses more than HPACK_TABLE_SIZE; a change is announced
+ * at the start of the next header block.
+ **/
+void hpack_limit(HpackTable *t, size_t limit) {
+    size_t max = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+
+    t->limit = limit;
+    if (max != t->max) {
+        t->max = max;
+        t->resized = true;
+        hpack_evict(t, max);
+    }
+}
+
+void hpack_free(HpackTable *t) {
+    hpack_evict(t, 0);
+    mem_free(t->fields);
+    t->fields = NULL;
+    t->capacity = 0;
+}
+
+/**
+ * Look up a field by HPACK index (static entries first, then dynamic).
+ **/
+static bool hpack_lookup(HpackTable *t, size_t index, const char **name, const char **value) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        *name  = StaticTable[index - 1].name;
+        *value = StaticTable[index - 1].value;
+        return true;
+    }
+    if (index - HPACK_STATIC_COUNT > t->count) {
+        return false;
+    }
+    HpackField *f = hpack_entry(t, index - HPACK_STATIC_COUNT - 1);
+    *name  = f->name;
+    *value = f->value;
+    return true;
+}
+
+/* Decoding */
+
+/**
+ * Decode an integer with an N-bit prefix (RFC 7541 section 5.1).
+ **/
+static bool hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    size_t max = (1u << prefix) - 1;
+
+    *value = *(*p)++ & max;
+    if (*value < max) {
+        return true;
+    }
+    for (int shift = 0; *p < end && shift < 28; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decode a Huffman-coded string into buffer (which holds at least 8/5 of
+ * length bytes, the most the shortest codes can expand to).
+ *
+ * @return  Decoded length, or -1 if the coding is invalid.
+ **/
+static ssize_t hpack_huffman_decode(const uint8_t *data, size_t length, char *buffer) {
+    size_t n = 0;
+    int node = 0;
+    int depth = 0;
+    bool ones = true;
+
+    pthread_once(&HuffmanOnce, hpack_huffman_build);
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int branch = (data[i] >> bit) & 1;
+            int next = HuffmanTree[node][branch];
+            if (next < 0) {
+                if (-next - 1 == HPACK_EOS) {
+                    return -1;
+                }
+                buffer[n++] = -next - 1;
+                node  = 0;
+                depth = 0;
+                ones  = true;
+            } else {
+                node  = next;
+                depth++;
+                ones &= branch;
+            }
+        }
+    }
+
+    /* Padding is a prefix of EOS (all ones) shorter than a byte */
+    return (depth < 8 && ones) ? (ssize_t)n : -1;
+}
+
+/**
+ * Decode a string literal (RFC 7541 section 5.2).
+ *
+ * @return  Allocated NUL-terminated string, or NULL if it is invalid.
+ **/
+static char *hpack_string(const uint8_t **p, const uint8_t *end, size_t *length) {
+    if (*p >= end) {
+        return NULL;
+    }
+
+    bool huffman = **p & 0x80;
+    size_t size;
+    if (!hpack_integer(p, end, 7, &size) || size > (size_t)(end - *p)) {
+        return NULL;
+    }
+
+    char *s = mem_malloc(MEM_HEADERS, huffman ? size * 8 / 5 + 1 : size + 1);
+    if (!s) {
+        return NULL;
+    }
+    if (huffman) {
+        ssize_t n = hpack_huffman_decode(*p, size, s);
+        if (n < 0) {
+            mem_free(s);
+            return NULL;
+        }
+        *length = n;
+    } else {
+        memcpy(s, *p, size);
+        *length = size;
+    }
+    s[*length] = '\0';
+    *p += size;
+    return s;
+}
+
+/**
+ * Decode a header block.
+ *
+ * @param   t           Decoder's dynamic table.
+ * @param   block       Header block (all fragments joined).
+ * @param   length      Length of block.
+ * @param   headers     Decoded fields in order, as Header entries
+ *                      (pseudo-header fields included).
+ * @return  0 on success, -1 on a compression error (the table is then out
+ *          of step with the peer's and the connection must end).
+ **/
+int hpack_decode(HpackTable *t, const uint8_t *block, size_t length, Header **headers) {
+    const uint8_t *p   = block;
+    const uint8_t *end = block + length;
+    Header **tail = headers;
+
+    *headers = NULL;
+    while (p < end) {
+        uint8_t byte = *p;
+        size_t index;
+        char *name  = NULL;
+        char *value = NULL;
+        size_t name_length, value_length;
+        const char *known_name, *known_value;
+
+        if (byte & 0x80) {
+            /* Indexed field */
+            if (!hpack_integer(&p, end, 7, &index) || !hpack_lookup(t, index, &known_name, &known_value)) {
+                goto fail;
+            }
+            name  = mem_strdup(MEM_HEADERS, known_name);
+            value = mem_strdup(MEM_HEADERS, known_value);
+        } else if ((byte & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (!hpack_integer(&p, end, 5, &index) || index > t->limit) {
+                goto fail;
+            }
+            t->max = index;
+            hpack_evict(t, index);
+            continue;
+        } else {
+            /* Literal field: with incremental indexing (01), without (0000)
+             * or never indexed (0001) */
+            bool indexed = (byte & 0xc0) == 0x40;
+            if (!hpack_integer(&p, end, indexed ? 6 : 4, &index)) {
+                goto fail;
+            }
+            if (index) {
+                if (!hpack_lookup(t, index, &known_name, &known_value) || !(name = mem_strdup(MEM_HEADERS, known_name))) {
+                    goto fail;
+                }
+                name_length = strlen(known_name);
+            } else if (!(name = hpack_string(&p, end, &name_length))) {
+                goto fail;
+            }
+            if (!(value = hpack_string(&p, end, &value_length))) {
+                mem_free(name);
+                goto fail;
+            }
+            if (indexed) {
+                char *name_copy  = mem_strdup(MEM_HTTP2, name);
+                char *value_copy = mem_strdup(MEM_HTTP2, value);
+                if (!name_copy || !value_copy) {
+                    mem_free(name_copy);
+                    mem_free(value_copy);
+                    mem_free(name);
+                    mem_free(value);
+                    goto fail;
+                }
+                hpack_insert(t, name_copy, name_length, value_copy, value_length);
+            }
+        }
+
+        Header *header = mem_calloc(MEM_HEADERS, 1, sizeof(Header));
+        if (!header || !name || !value) {
+            mem_free(header);
+            mem_free(name);
+            mem_free(value);
+            goto fail;
+        }
+        header->name  = name;
+        header->value = value;
+        *tail = header;
+        tail  = &header->next;
+    }
+    return 0;
+
+fail:
+    free_headers(*headers);
+    *headers = NULL;
+    return -1;
+}
+
+/* Encoding */
+
+/**
+ * Encode an integer with an N-bit prefix after the given flag bits.
+ *
+ * @return  Bytes written, or 0 if out has no room.
+ **/
+static size_t hpack_put_integer(uint8_t *out, size_t size, uint8_t flags, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    size_t n = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[n++] = flags | value;
+        return n;
+    }
+    out[n++] = flags | max;
+    value -= max;
+    while (n < size) {
+        if (value < 0x80) {
+            out[n++] = value;
+            return n;
+        }
+        out[n++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    return 0;
+}
+
+/**
+ * Encode a string literal, Huffman-coded when that is shorter.
+ *
+ * @return  Bytes written, or 0 if out has no room.
+ **/
+static size_t hpack_put_string(uint8_t *out, size_t size, const char *s, size_t length) {
+    size_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits += HuffmanCodes[(uint8_t)s[i]].bits;
+    }
+    size_t coded = (bits + 7) / 8;
+    bool huffman = coded < length;
+
+    size_t n = hpack_put_integer(out, size, huffman ? 0x80 : 0x00, 7, huffman ? coded : length);
+    if (n == 0 || size - n < (huffman ? coded : length)) {
+        return 0;
+    }
+    if (!huffman) {
+        memcpy(out + n, s, length);
+        return n + length;
+    }
+
+    uint64_t accumulator = 0;
+    int pending = 0;
+    for (size_t i = 0; i < length; i++) {
+        accumulator = (accumulator << HuffmanCodes[(uint8_t)s[i]].bits) | HuffmanCodes[(uint8_t)s[i]].code;
+        pending += HuffmanCodes[(uint8_t)s[i]].bits;
+        while (pending >= 8) {
+            pending -= 8;
+            out[n++] = accumulator >> pending;
+        }
+    }
+    if (pending > 0) {
+        out[n++] = (accumulator << (8 - pending)) | (0xff >> pending);
+    }
+    return n;
+}
+
+/**
+ * Find the best index for a field: one that matches name and value, or
+ * failing that one that matches the name.
+ **/
+static void hpack_find(HpackTable *t, const char *name, size_t name_length, const char *value,
+                       size_t value_length, size_t *full, size_t *named) {
+    *full = *named = 0;
+
+    for (size_t i = 0; i < HPACK_STATIC_COUNT; i++) {
+        if (strlen(StaticTable[i].name) == name_length && memcmp(StaticTable[i].name, name, name_length) == 0) {
+            if (!*named) {
+                *named = i + 1;
+            }
+            if (strlen(StaticTable[i].value) == value_length &&
+                memcmp(StaticTable[i].value, value, value_length) == 0) {
+                *full = i + 1;
+                return;
+            }
+        }
+    }
+    for (size_t i = 0; i < t->count; i++) {
+        HpackField *f = hpack_entry(t, i);
+        if (f->name_length == name_length && memcmp(f->name, name, name_length) == 0) {
+            if (!*named) {
+                *named = HPACK_STATIC_COUNT + i + 1;
+            }
+            if (f->value_length == value_length && memcmp(f->value, value, value_length) == 0) {
+                *full = HPACK_STATIC_COUNT + i + 1;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Encode one header field.
+ *
+ * @param   t           Encoder's dynamic table.
+ * @param   out         Output buffer.
+ * @param   size        Room in out.
+ * @param   name        Field name (lower case).
+ * @param   name_length Length of name.
+ * @param   value       Field value.
+ * @param   value_length Length of value.
+ * @param   index       Whether to add the field to the dynamic table (for
+ *                      values that recur across responses).
+ * @return  Bytes written, or -1 if out has no room (the table may then
+ *          have changed, so the block must not be abandoned).
+ **/
+ssize_t hpack_encode(HpackTable *t, uint8_t *out, size_t size, const char *name, size_t name_length,
+                     const char *value, size_t value_length, bool index) {
+    size_t n = 0, m;
+    size_t full, named;
+
+    if (t->resized) {
+        if ((n = hpack_put_integer(out, size, 0x20, 5, t->max)) == 0) {
+            return -1;
+        }
+        t->resized = false;
+    }
+
+    hpack_find(t, name, name_length, value, value_length, &full, &named);
+    if (full) {
+        m = hpack_put_integer(out + n, size - n, 0x80, 7, full);
+        return m ? (ssize_t)(n + m) : -1;
+    }
+
+    if ((m = hpack_put_integer(out + n, size - n, index ? 0x40 : 0x00, index ? 6 : 4, named)) == 0) {
+        return -1;
+    }
+    n += m;
+    if (!named) {
+        if ((m = hpack_put_string(out + n, size - n, name, name_length)) == 0) {
+            return -1;
+        }
+        n += m;
+    }
+    if ((m = hpack_put_string(out + n, size - n, value, value_length)) == 0) {
+        return -1;
+    }
+    n += m;
+
+    if (index) {
+        char *name_copy  = mem_strndup(MEM_HTTP2, name, name_length);
+        char *value_copy = mem_strndup(MEM_HTTP2, value, value_length);
+        if (name_copy && value_copy) {
+            hpack_insert(t, name_copy, name_length, value_copy, value_length);
+        } else {
+            /* The field was sent as indexed: keep the table in step */
+            log("Unable to index header field: %s", strerror(errno));
+            mem_free(name_copy);
+            mem_free(value_copy);
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1318 @@
+/* http2.c: Cleartext HTTP/2 (h2c) Connections */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define HTTP2_FRAME_HEADER      9       /* Length (24), type, flags, stream (31) */
+#define HTTP2_WINDOW_DEFAULT    65535   /* Initial flow-control window */
+#define HTTP2_WINDOW_LIMIT      0x7fffffff
+#define HTTP2_INPUT_MAX         (2 * (HTTP2_FRAME_HEADER + HTTP2_FRAME_MAX))
+
+typedef enum {
+    HTTP2_DATA,
+    HTTP2_HEADERS,
+    HTTP2_PRIORITY,
+    HTTP2_RST_STREAM,
+    HTTP2_SETTINGS,
+    HTTP2_PUSH_PROMISE,
+    HTTP2_PING,
+    HTTP2_GOAWAY,
+    HTTP2_WINDOW_UPDATE,
+    HTTP2_CONTINUATION,
+} Http2FrameType;
+
+#define HTTP2_FLAG_END_STREAM   0x01
+#define HTTP2_FLAG_ACK          0x01
+#define HTTP2_FLAG_END_HEADERS  0x04
+#define HTTP2_FLAG_PADDED       0x08
+#define HTTP2_FLAG_PRIORITY     0x20
+
+typedef enum {
+    HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    HTTP2_SETTINGS_ENABLE_PUSH,
+    HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    HTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+    HTTP2_SETTINGS_MAX_FRAME_SIZE,
+    HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE,
+} Http2Setting;
+
+typedef enum {
+    HTTP2_NO_ERROR,
+    HTTP2_PROTOCOL_ERROR,
+    HTTP2_INTERNAL_ERROR,
+    HTTP2_FLOW_CONTROL_ERROR,
+    HTTP2_SETTINGS_TIMEOUT,
+    HTTP2_STREAM_CLOSED,
+    HTTP2_FRAME_SIZE_ERROR,
+    HTTP2_REFUSED_STREAM,
+    HTTP2_CANCEL,
+    HTTP2_COMPRESSION_ERROR,
+    HTTP2_CONNECT_ERROR,
+    HTTP2_ENHANCE_YOUR_CALM,
+} Http2Error;
+
+struct http2_stream {
+    uint32_t      id;                   /**< Stream identifier (odd: client-initiated) */
+    int64_t       window;               /**< Send window */
+    Header       *headers;              /**< Decoded request header fields */
+    bool          ended;                /**< Client has sent END_STREAM */
+    bool          closed;               /**< We have sent END_STREAM */
+    bool          reset;                /**< Stream was reset: send nothing more */
+    bool          head;                 /**< HEAD request: the response has no body */
+    Http2Session *session;              /**< Connection the stream belongs to */
+    Http2Stream  *next;                 /**< Next open stream (oldest first) */
+};
+
+struct http2_session {
+    Connection   *connection;           /**< Client connection */
+    uint8_t       input[HTTP2_INPUT_MAX]; /**< Frames received so far */
+    size_t        length;               /**< Bytes in input */
+    bool          preface;              /**< Client connection preface still expected */
+    bool          settings;             /**< Client's first SETTINGS has arrived */
+    bool          goaway;               /**< Client is going away: open no more streams */
+    bool          failed;               /**< Connection is finished (GOAWAY sent or I/O error) */
+
+    HpackTable    decoder;              /**< Client's header compression state */
+    HpackTable    encoder;              /**< Our header compression state */
+
+    int64_t       window;               /**< Connection send window */
+    uint32_t      initial_window;       /**< Client's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t      frame_max;            /**< Client's SETTINGS_MAX_FRAME_SIZE */
+
+    uint32_t      last_stream;          /**< Highest stream the client has opened */
+    Http2Stream  *streams;              /**< Open streams, oldest first */
+    size_t        open;                 /**< Number of open streams */
+    Http2Stream  *active;               /**< Stream being served */
+
+    uint32_t      continuation;         /**< Stream whose header block is incomplete (0 = none) */
+    uint8_t       block_flags;          /**< Flags of the HEADERS frame that began it */
+    uint8_t      *block;                /**< Header block fragments so far */
+    size_t        block_length;         /**< Bytes in block */
+};
+
+/* Internal Declarations */
+static void http2_frames(Http2Session *s);
+
+/* Frame Output */
+
+static void http2_put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t http2_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void http2_frame_header(uint8_t *header, size_t length, uint8_t type, uint8_t flags, uint32_t id) {
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    http2_put32(header + 5, id & HTTP2_WINDOW_LIMIT);
+}
+
+/**
+ * Send one frame.
+ *
+ * @return  Number of bytes written, or -1 on error (the session has failed).
+ **/
+static ssize_t http2_send_frame(Http2Session *s, uint8_t type, uint8_t flags, uint32_t id,
+                                const void *payload, size_t length) {
+    uint8_t header[HTTP2_FRAME_HEADER];
+    struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void *)payload, length },
+    };
+
+    if (s->failed) {
+        return -1;
+    }
+    http2_frame_header(header, length, type, flags, id);
+
+    ssize_t written = socket_writev(s->connection->fd, iov, length ? 2 : 1);
+    if (written < 0) {
+        log("Unable to send HTTP/2 frame: %s", strerror(errno));
+        s->failed = true;
+    }
+    return written;
+}
+
+/**
+ * End the connection with GOAWAY (a connection error unless error is
+ * HTTP2_NO_ERROR); streams already being served are not completed.
+ **/
+static void http2_goaway(Http2Session *s, Http2Error error) {
+    uint8_t payload[8];
+
+    if (error != HTTP2_NO_ERROR) {
+        log("HTTP/2 connection error %d from %s:%s", error, s->connection->host, s->connection->port);
+    }
+    http2_put32(payload, s->last_stream);
+    http2_put32(payload + 4, error);
+    http2_send_frame(s, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload));
+    s->failed = true;
+}
+
+static void http2_reset(Http2Session *s, uint32_t id, Http2Error error) {
+    uint8_t payload[4];
+    http2_put32(payload, error);
+    http2_send_frame(s, HTTP2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void http2_window_update(Http2Session *s, uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    http2_put32(payload, increment);
+    http2_send_frame(s, HTTP2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Announce our settings (the server connection preface).
+ **/
+static void http2_send_settings(Http2Session *s) {
+    uint8_t payload[12];
+
+    payload[0] = 0;
+    payload[1] = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    http2_put32(payload + 2, HTTP2_STREAMS_MAX);
+    payload[6] = 0;
+    payload[7] = HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    http2_put32(payload + 8, HTTP2_HEADERS_MAX);
+    http2_send_frame(s, HTTP2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/* Streams */
+
+static Http2Stream *http2_find(Http2Session *s, uint32_t id) {
+    Http2Stream *st = s->streams;
+    while (st && st->id != id) {
+        st = st->next;
+    }
+    return st;
+}
+
+/**
+ * Open a stream, taking ownership of its decoded header fields.
+ **/
+static Http2Stream *http2_open(Http2Session *s, uint32_t id, Header *headers, bool ended) {
+    Http2Stream *st = mem_calloc(MEM_HTTP2, 1, sizeof(Http2Stream));
+    if (!st) {
+        log("Couldn't allocate memory: %s", strerror(errno));
+        free_headers(headers);
+        return NULL;
+    }
+    st->id      = id;
+    st->window  = s->initial_window;
+    st->headers = headers;
+    st->ended   = ended;
+    st->session = s;
+
+    Http2Stream **tail = &s->streams;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = st;
+    s->open++;
+    return st;
+}
+
+static void http2_remove(Http2Session *s, Http2Stream *st) {
+    Http2Stream **link = &s->streams;
+    while (*link && *link != st) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = st->next;
+        s->open--;
+    }
+    free_headers(st->headers);
+    mem_free(st);
+}
+
+/**
+ * Reset a stream (a stream error): one being served stops sending, any other
+ * is forgotten.
+ **/
+static void http2_cancel(Http2Session *s, Http2Stream *st, Http2Error error) {
+    http2_reset(s, st->id, error);
+    if (st == s->active) {
+        st->reset = true;
+    } else {
+        http2_remove(s, st);
+    }
+}
+
+/* Frame Input */
+
+/**
+ * Apply a SETTINGS payload from the client.
+ *
+ * @return  HTTP2_NO_ERROR, or the connection error it causes.
+ **/
+static Http2Error http2_settings(Http2Session *s, const uint8_t *p, size_t length) {
+    for (; length >= 6; p += 6, length -= 6) {
+        uint16_t id = p[0] << 8 | p[1];
+        uint32_t value = http2_get32(p + 2);
+
+        switch (id) {
+            case HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_limit(&s->encoder, value);
+                break;
+            case HTTP2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return HTTP2_PROTOCOL_ERROR;
+                }
+                break;
+            case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > HTTP2_WINDOW_LIMIT) {
+                    return HTTP2_FLOW_CONTROL_ERROR;
+                }
+                /* The change applies to the windows of open streams too */
+                for (Http2Stream *st = s->streams; st; st = st->next) {
+                    st->window += (int64_t)value - s->initial_window;
+                }
+                s->initial_window = value;
+                break;
+            case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < HTTP2_FRAME_MAX || value > 0xffffff) {
+                    return HTTP2_PROTOCOL_ERROR;
+                }
+                s->frame_max = value;
+                break;
+            default:
+                break;
+        }
+    }
+    return length ? HTTP2_FRAME_SIZE_ERROR : HTTP2_NO_ERROR;
+}
+
+/**
+ * Strip the padding (and priority fields) from a DATA or HEADERS payload.
+ *
+ * @return  false if the padding is longer than the frame.
+ **/
+static bool http2_unpad(uint8_t flags, const uint8_t **p, size_t *length) {
+    if (flags & HTTP2_FLAG_PADDED) {
+        if (*length < 1 || (*p)[0] > *length - 1) {
+            return false;
+        }
+        *length -= 1 + (*p)[0];
+        (*p)++;
+    }
+    return true;
+}
+
+/**
+ * Handle a complete header block: open a stream, or end one (trailers).
+ **/
+static void http2_receive_block(Http2Session *s, uint32_t id, uint8_t flags, const uint8_t *block, size_t length) {
+    bool opening = id > s->last_stream;
+    Header *headers;
+
+    /* Decode even blocks we refuse: the table must stay in step */
+    if (hpack_decode(&s->decoder, block, length, &headers) < 0) {
+        http2_goaway(s, HTTP2_COMPRESSION_ERROR);
+        return;
+    }
+
+    if (!opening) {
+        Http2Stream *st = http2_find(s, id);
+        free_headers(headers);
+        if (!st) {
+            http2_goaway(s, HTTP2_STREAM_CLOSED);
+        } else if (st->ended || !(flags & HTTP2_FLAG_END_STREAM)) {
+            http2_cancel(s, st, HTTP2_PROTOCOL_ERROR);
+        } else {
+            st->ended = true;           /* Trailers are ignored */
+        }
+        return;
+    }
+
+    s->last_stream = id;
+    if (s->open >= HTTP2_STREAMS_MAX || s->goaway) {
+        free_headers(headers);
+        http2_reset(s, id, HTTP2_REFUSED_STREAM);
+        return;
+    }
+    if (!http2_open(s, id, headers, flags & HTTP2_FLAG_END_STREAM)) {
+        http2_reset(s, id, HTTP2_INTERNAL_ERROR);
+    }
+}
+
+/**
+ * Collect a header block fragment that will be continued.
+ **/
+static bool http2_append_block(Http2Session *s, const uint8_t *p, size_t length) {
+    if (s->block_length + length > HTTP2_HEADERS_MAX) {
+        log("Request header block from %s:%s is too large", s->connection->host, s->connection->port);
+        http2_goaway(s, HTTP2_ENHANCE_YOUR_CALM);
+        return false;
+    }
+
+    uint8_t *block = mem_realloc(MEM_HTTP2, s->block, s->block_length + length);
+    if (!block && s->block_length + length) {
+        log("Couldn't allocate memory: %s", strerror(errno));
+        http2_goaway(s, HTTP2_INTERNAL_ERROR);
+        return false;
+    }
+    s->block = block;
+    memcpy(s->block + s->block_length, p, length);
+    s->block_length += length;
+    return true;
+}
+
+static void http2_receive_headers(Http2Session *s, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (id == 0 || !(id & 1) || !http2_unpad(flags, &p, &length)) {
+        http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & HTTP2_FLAG_PRIORITY) {
+        if (length < 5) {
+            http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+            return;
+        }
+        p += 5;
+        length -= 5;
+    }
+
+    if (flags & HTTP2_FLAG_END_HEADERS) {
+        http2_receive_block(s, id, flags, p, length);
+        return;
+    }
+    s->block_length = 0;
+    s->block_flags  = flags;
+    if (http2_append_block(s, p, length)) {
+        s->continuation = id;
+    }
+}
+
+static void http2_receive_continuation(Http2Session *s, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    if (!http2_append_block(s, p, length)) {
+        return;
+    }
+    if (flags & HTTP2_FLAG_END_HEADERS) {
+        s->continuation = 0;
+        http2_receive_block(s, id, s->block_flags, s->block, s->block_length);
+    }
+}
+
+/**
+ * Handle request body data.  Bodies are not passed on (as with HTTP/1.x),
+ * but the client is credited for them so it is never blocked.
+ **/
+static void http2_receive_data(Http2Session *s, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    size_t frame = length;
+
+    if (id == 0 || !http2_unpad(flags, &p, &length)) {
+        http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    if (frame > 0) {
+        http2_window_update(s, 0, frame);
+    }
+
+    Http2Stream *st = http2_find(s, id);
+    if (!st) {
+        if (id > s->last_stream) {
+            http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+        } else {
+            http2_reset(s, id, HTTP2_STREAM_CLOSED);
+        }
+        return;
+    }
+    if (st->ended) {
+        http2_cancel(s, st, HTTP2_STREAM_CLOSED);
+        return;
+    }
+    if (flags & HTTP2_FLAG_END_STREAM) {
+        st->ended = true;
+    } else if (frame > 0) {
+        http2_window_update(s, id, frame);
+    }
+}
+
+static void http2_receive_window_update(Http2Session *s, uint32_t id, const uint8_t *p, size_t length) {
+    if (length != 4) {
+        http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = http2_get32(p) & HTTP2_WINDOW_LIMIT;
+
+    if (id == 0) {
+        if (increment == 0 || s->window + increment > HTTP2_WINDOW_LIMIT) {
+            http2_goaway(s, increment ? HTTP2_FLOW_CONTROL_ERROR : HTTP2_PROTOCOL_ERROR);
+            return;
+        }
+        s->window += increment;
+        return;
+    }
+
+    Http2Stream *st = http2_find(s, id);
+    if (!st) {
+        return;                         /* Closed streams may still be credited */
+    }
+    if (increment == 0 || st->window + increment > HTTP2_WINDOW_LIMIT) {
+        http2_cancel(s, st, increment ? HTTP2_FLOW_CONTROL_ERROR : HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    st->window += increment;
+}
+
+/**
+ * Handle one frame.
+ **/
+static void http2_receive(Http2Session *s, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t length) {
+    /* A header block's CONTINUATION frames must follow it directly, and the
+     * client's connection preface ends with its SETTINGS */
+    if ((s->continuation != 0) != (type == HTTP2_CONTINUATION) ||
+        (s->continuation && id != s->continuation) ||
+        (!s->settings && type != HTTP2_SETTINGS)) {
+        http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+        case HTTP2_DATA:
+            http2_receive_data(s, flags, id, p, length);
+            break;
+        case HTTP2_HEADERS:
+            http2_receive_headers(s, flags, id, p, length);
+            break;
+        case HTTP2_CONTINUATION:
+            http2_receive_continuation(s, flags, id, p, length);
+            break;
+        case HTTP2_PRIORITY:
+            /* Streams are served in the order they were opened */
+            if (id == 0) {
+                http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+            }
+            break;
+        case HTTP2_RST_STREAM: {
+            Http2Stream *st;
+            if (id == 0 || length != 4) {
+                http2_goaway(s, id ? HTTP2_FRAME_SIZE_ERROR : HTTP2_PROTOCOL_ERROR);
+            } else if ((st = http2_find(s, id)) != NULL) {
+                if (st == s->active) {
+                    st->reset = true;
+                } else {
+                    http2_remove(s, st);
+                }
+            } else if (id > s->last_stream) {
+                http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+            }
+            break;
+        }
+        case HTTP2_SETTINGS: {
+            Http2Error error;
+            if (id != 0) {
+                http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+            } else if (flags & HTTP2_FLAG_ACK) {
+                if (length != 0) {
+                    http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+                }
+            } else if ((error = http2_settings(s, p, length)) != HTTP2_NO_ERROR) {
+                http2_goaway(s, error);
+            } else {
+                s->settings = true;
+                http2_send_frame(s, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+            }
+            break;
+        }
+        case HTTP2_PUSH_PROMISE:
+            http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+            break;
+        case HTTP2_PING:
+            if (id != 0 || length != 8) {
+                http2_goaway(s, id ? HTTP2_PROTOCOL_ERROR : HTTP2_FRAME_SIZE_ERROR);
+            } else if (!(flags & HTTP2_FLAG_ACK)) {
+                http2_send_frame(s, HTTP2_PING, HTTP2_FLAG_ACK, 0, p, length);
+            }
+            break;
+        case HTTP2_GOAWAY:
+            s->goaway = true;
+            break;
+        case HTTP2_WINDOW_UPDATE:
+            http2_receive_window_update(s, id, p, length);
+            break;
+        default:
+            break;                      /* Unknown frame types are ignored */
+    }
+}
+
+/**
+ * Handle every complete frame in the input buffer.
+ *
+ * Frames only change session state here; requests are served by http2_serve,
+ * so this may also run while a response waits for flow-control credit.
+ **/
+static void http2_frames(Http2Session *s) {
+    size_t offset = 0;
+
+    if (s->preface) {
+        size_t n = s->length < HTTP2_PREFACE_LENGTH ? s->length : HTTP2_PREFACE_LENGTH;
+        if (memcmp(s->input, HTTP2_PREFACE, n) != 0) {
+            log("Bad HTTP/2 connection preface from %s:%s", s->connection->host, s->connection->port);
+            http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+            return;
+        }
+        if (n < HTTP2_PREFACE_LENGTH) {
+            return;
+        }
+        s->preface = false;
+        offset = HTTP2_PREFACE_LENGTH;
+    }
+
+    while (!s->failed && s->length - offset >= HTTP2_FRAME_HEADER) {
+        const uint8_t *header = s->input + offset;
+        size_t length = header[0] << 16 | header[1] << 8 | header[2];
+
+        if (length > HTTP2_FRAME_MAX) {
+            http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (s->length - offset < HTTP2_FRAME_HEADER + length) {
+            break;
+        }
+        http2_receive(s, header[3], header[4], http2_get32(header + 5) & HTTP2_WINDOW_LIMIT,
+                      header + HTTP2_FRAME_HEADER, length);
+        offset += HTTP2_FRAME_HEADER + length;
+    }
+
+    s->length -= offset;
+    memmove(s->input, s->input + offset, s->length);
+}
+
+/**
+ * Read what the client has sent while a response is blocked on flow
+ * control, waiting at most the write deadline.
+ *
+ * @return  false if the session has failed.
+ *
+ * A handler coroutine yields to the event loop while it waits; a scheduler
+ * worker blocks only itself.
+ **/
+static bool http2_wait(Http2Session *s) {
+    Connection *c = s->connection;
+
+    /* Flush what is corked: the client credits what it has received */
+    socket_cork(c->fd, false);
+
+    int n = coroutine_poll(c->fd, POLLIN, Timeouts.write > 0 ? Timeouts.write : -1);
+    if (n == 0) {
+        log("Client stalled for %d ms", Timeouts.write);
+        s->failed = true;
+        return false;
+    }
+    if (n < 0) {
+        return errno == EINTR;
+    }
+
+    ssize_t received = recv(c->fd, s->input + s->length, sizeof(s->input) - s->length, 0);
+    if (received == 0) {
+        c->eof = true;
+        s->failed = true;
+        return false;
+    }
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
+        s->failed = true;
+        return false;
+    }
+    s->length += received;
+    http2_frames(s);
+    return !s->failed;
+}
+
+/**
+ * Wait until a stream may send DATA.
+ *
+ * @return  Most bytes (up to want) the next DATA frame may carry, or -1 if
+ *          the stream was reset or the session failed.
+ **/
+static ssize_t http2_window(Http2Session *s, Http2Stream *st, size_t want) {
+    while (!s->failed && !st->reset && (s->window <= 0 || st->window <= 0)) {
+        if (!http2_wait(s)) {
+            break;
+        }
+    }
+    if (s->failed || st->reset) {
+        return -1;
+    }
+
+    int64_t n = want < s->frame_max ? (int64_t)want : s->frame_max;
+    if (n > s->window) {
+        n = s->window;
+    }
+    if (n > st->window) {
+        n = st->window;
+    }
+    return n;
+}
+
+/* Response Output */
+
+/**
+ * Check whether a response header must not be forwarded: HTTP/2 has no
+ * connection-specific headers, and frames its bodies itself.
+ **/
+static bool http2_hop_by_hop(const char *name) {
+    return streq(name, "connection") || streq(name, "keep-alive") || streq(name, "proxy-connection") ||
+           streq(name, "transfer-encoding") || streq(name, "upgrade");
+}
+
+/**
+ * Check whether a response header value is worth adding to the dynamic
+ * table (one likely to recur in later responses).
+ **/
+static bool http2_indexable(const char *name) {
+    return !streq(name, "content-length") && !streq(name, "etag") && !streq(name, "last-modified") &&
+           !streq(name, "location") && !streq(name, "set-cookie");
+}
+
+/**
+ * Send a response header block on a request's stream.
+ *
+ * @param   r           HTTP/2 request.
+ * @param   headers     Status line and header lines as built by the
+ *                      Response functions.
+ * @param   length      Length of headers.
+ * @param   end         Whether the response has no body.
+ * @return  length, or -1 on error.
+ *
+ * The status line becomes :status, names are lowered and connection-specific
+ * headers are dropped before the fields are HPACK-encoded.
+ **/
+ssize_t http2_send_headers(Request *r, const char *headers, size_t length, bool end) {
+    Http2Stream *st = r->stream;
+    Http2Session *s = st->session;
+    uint8_t block[2 * RESPONSE_HEADERS_MAX];
+    size_t n = 0;
+    bool status = true;
+
+    if (s->failed || st->reset) {
+        return -1;
+    }
+
+    for (const char *line = headers, *stop = headers + length, *next; line < stop; line = next) {
+        const char *eol = memchr(line, '\n', stop - line);
+        size_t line_length = (eol ? eol : stop) - line;
+        ssize_t m;
+
+        next = eol ? eol + 1 : stop;
+        if (line_length && line[line_length - 1] == '\r') {
+            line_length--;
+        }
+        if (line_length == 0) {
+            continue;
+        }
+
+        if (status) {
+            /* HTTP/1.x NNN Reason */
+            const char *code = memchr(line, ' ', line_length);
+            if (!code || line + line_length - code < 4) {
+                log("Malformed response status line");
+                http2_goaway(s, HTTP2_INTERNAL_ERROR);
+                return -1;
+            }
+            m = hpack_encode(&s->encoder, block + n, sizeof(block) - n, ":status", 7, code + 1, 3, false);
+            status = false;
+        } else {
+            const char *colon = memchr(line, ':', line_length);
+            char name[64];
+            size_t name_length = colon ? (size_t)(colon - line) : 0;
+
+            if (name_length == 0 || name_length >= sizeof(name)) {
+                continue;
+            }
+            for (size_t i = 0; i < name_length; i++) {
+                name[i] = tolower((unsigned char)line[i]);
+            }
+            name[name_length] = '\0';
+            if (http2_hop_by_hop(name)) {
+                continue;
+            }
+
+            const char *value = colon + 1;
+            while (value < line + line_length && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            m = hpack_encode(&s->encoder, block + n, sizeof(block) - n, name, name_length,
+                             value, line + line_length - value, http2_indexable(name));
+        }
+
+        if (m < 0) {
+            /* The encoder may already have indexed fields the client will
+             * never see: the connection cannot continue */
+            log("Response headers do not fit in a HEADERS frame");
+            http2_goaway(s, HTTP2_INTERNAL_ERROR);
+            return -1;
+        }
+        n += m;
+    }
+
+    end = end || st->head;
+    if (http2_send_frame(s, HTTP2_HEADERS, HTTP2_FLAG_END_HEADERS | (end ? HTTP2_FLAG_END_STREAM : 0),
+                         st->id, block, n) < 0) {
+        return -1;
+    }
+    st->closed = end;
+    return length;
+}
+
+/**
+ * Send (part of) a response body on a request's stream as DATA frames,
+ * waiting for flow-control credit as needed.
+ *
+ * @param   r           HTTP/2 request.
+ * @param   data        Body bytes.
+ * @param   length      Number of bytes.
+ * @param   end         Whether this is the end of the body.
+ * @return  length, or -1 on error.
+ **/
+ssize_t http2_send_data(Request *r, const void *data, size_t length, bool end) {
+    Http2Stream *st = r->stream;
+    Http2Session *s = st->session;
+    const char *p = data;
+    size_t left = length;
+
+    if (s->failed || st->reset) {
+        return -1;
+    }
+    if (st->closed) {
+        return length;                  /* HEAD: the headers ended the stream */
+    }
+
+    while (left > 0) {
+        ssize_t n = http2_window(s, st, left);
+        if (n < 0) {
+            return -1;
+        }
+        bool last = end && (size_t)n == left;
+        if (http2_send_frame(s, HTTP2_DATA, last ? HTTP2_FLAG_END_STREAM : 0, st->id, p, n) < 0) {
+            return -1;
+        }
+        s->window  -= n;
+        st->window -= n;
+        st->closed  = last;
+        p    += n;
+        left -= n;
+    }
+
+    if (end && !st->closed) {
+        if (http2_send_frame(s, HTTP2_DATA, HTTP2_FLAG_END_STREAM, st->id, NULL, 0) < 0) {
+            return -1;
+        }
+        st->closed = true;
+    }
+    return length;
+}
+
+/**
+ * Send a file as the whole response body on a request's stream: each DATA
+ * frame header goes out with MSG_MORE and its payload with sendfile (paced
+ * frame by frame to the client's bandwidth limit).
+ *
+ * @return  size, or -1 on error.
+ **/
+ssize_t http2_send_file(Request *r, int fd, off_t offset, size_t size) {
+    Http2Stream *st = r->stream;
+    Http2Session *s = st->session;
+    size_t left = size;
+
+    if (s->failed || st->reset) {
+        return -1;
+    }
+    if (st->closed) {
+        return size;
+    }
+    if (size == 0) {
+        return http2_send_data(r, NULL, 0, true);
+    }
+
+    while (left > 0) {
+        ssize_t n = http2_window(s, st, left);
+        if (n < 0) {
+            return -1;
+        }
+
+        ratelimit_pace(r, n);
+        uint8_t header[HTTP2_FRAME_HEADER];
+        http2_frame_header(header, n, HTTP2_DATA, (size_t)n == left ? HTTP2_FLAG_END_STREAM : 0, st->id);
+        if (socket_send_more(s->connection->fd, header, sizeof(header)) < 0 ||
+            socket_sendfile(s->connection->fd, fd, &offset, n) != n) {
+            /* A short frame cannot be completed: the connection is lost */
+            log("Unable to send file on HTTP/2 stream: %s", strerror(errno));
+            s->failed = true;
+            return -1;
+        }
+        s->window  -= n;
+        st->window -= n;
+        left -= n;
+    }
+    st->closed = true;
+    return size;
+}
+
+/* Requests */
+
+/**
+ * Turn a stream's header fields into a request: pseudo-header fields give
+ * the method and URI (and :authority the Host header), the rest become the
+ * request headers.
+ *
+ * @return  0 on success, -1 if the fields do not form a valid request.
+ **/
+static int http2_request(Request *r, Http2Stream *st) {
+    Header **tail = &r->headers;
+    Header *header = st->headers;
+    int status = 0;
+
+    st->headers = NULL;
+    while (header) {
+        Header *next = header->next;
+        header->next = NULL;
+
+        if (strpbrk(header->value, "\r\n") || (header->name[0] != ':' && !header_token(header->name))) {
+            status = -1;
+        }
+
+        if (header->name[0] == ':') {
+            char **field = NULL;
+            if (streq(header->name, ":method")) {
+                field = &r->method;
+            } else if (streq(header->name, ":path")) {
+                field = &r->uri;
+            } else if (streq(header->name, ":authority")) {
+                char *host = mem_strdup(MEM_HEADERS, "Host");
+                if (host) {
+                    mem_free(header->name);
+                    header->name = host;
+                    *tail = header;
+                    tail  = &header->next;
+                    header = next;
+                    continue;
+                }
+            } else if (!streq(header->name, ":scheme")) {
+                status = -1;
+            }
+            if (field && !*field) {
+                *field = header->value;
+                header->value = NULL;
+            }
+            free_headers(header);
+        } else {
+            *tail = header;
+            tail  = &header->next;
+        }
+        header = next;
+    }
+
+    if (!r->method || !r->uri || r->uri[0] != '/') {
+        return -1;
+    }
+
+    char *query = strchr(r->uri, '?');
+    if (query) {
+        *query++ = '\0';
+        if (!(r->query = mem_strdup(MEM_REQUEST, query))) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Build a request from a stream whose request is complete and prepare it.
+ *
+ * @param   s           HTTP/2 session.
+ * @param   st          Stream whose request is complete.
+ * @param   status      Set to the result of handle_prepare.
+ * @return  Request, or NULL if the stream was reset (and removed) instead.
+ **/
+static Request *http2_prepare(Http2Session *s, Http2Stream *st, HTTPStatus *status) {
+    Request *r = accept_request(s->connection, 0);
+    if (!r) {
+        http2_reset(s, st->id, HTTP2_INTERNAL_ERROR);
+        http2_remove(s, st);
+        return NULL;
+    }
+    r->stream  = st;
+    r->version = 1;
+    if (http2_request(r, st) < 0) {
+        log("Malformed request on HTTP/2 stream %u", st->id);
+        http2_reset(s, st->id, HTTP2_PROTOCOL_ERROR);
+        http2_remove(s, st);
+        free_request(r);
+        return NULL;
+    }
+    log("HTTP/2 stream %u: %s %s", st->id, r->method, r->uri);
+    *status = handle_prepare(r);
+    return r;
+}
+
+/**
+ * Serve one prepared stream through the usual request handlers, then forget
+ * the stream.
+ *
+ * @param   s           HTTP/2 session.
+ * @param   st          Stream whose request is complete.
+ * @param   r           Request (prepared).
+ * @param   status      Result of handle_prepare for r.
+ **/
+static void http2_serve_stream(Http2Session *s, Http2Stream *st, Request *r, HTTPStatus status) {
+    r->stream    = st;
+    r->keepalive = true;
+    st->head     = streq(r->method, "HEAD");
+
+    s->active = st;
+    if (status != HTTP_STATUS_OK) {
+        handle_error(r, status);
+    } else {
+        handle_resolved(r);
+    }
+    s->active = NULL;
+
+    /* A response that did not finish must not look complete */
+    if (!st->closed && !st->reset && !s->failed) {
+        http2_reset(s, st->id, HTTP2_INTERNAL_ERROR);
+    }
+    free_request(r);
+    http2_remove(s, st);
+    s->connection->requests++;
+}
+
+/**
+ * Serve the stream handed to a scheduler worker or a coroutine (its request
+ * is in c->request, the stream is s->active).
+ **/
+void http2_run(Connection *c) {
+    Http2Session *s = c->h2;
+    Request *r = c->request;
+
+    c->request = NULL;
+    http2_serve_stream(s, s->active, r, HTTP_STATUS_OK);
+}
+
+/**
+ * Body of a handler coroutine serving a stream.
+ **/
+static void http2_coroutine(void *argument) {
+    http2_run(argument);
+}
+
+/**
+ * Serve a prepared stream, or hand it (and with it the connection) to a
+ * scheduler worker or a coroutine, as connection_dispatch does for HTTP/1.x
+ * requests.
+ *
+ * @return  CONNECTION_BUSY if a worker or a suspended coroutine now owns the
+ *          connection (see http2_resume), CONNECTION_WAIT otherwise.
+ *
+ * Errors are answered at once.  A handler that waits for flow-control
+ * credit reads the client's frames itself (http2_wait), so it owns the
+ * whole session until it is done; streams are still served one at a time.
+ **/
+static ConnectionState http2_dispatch(Http2Session *s, Http2Stream *st, Request *r, HTTPStatus status) {
+    Connection *c = s->connection;
+
+    if (status == HTTP_STATUS_OK && scheduler_active()) {
+        Lane lane = request_lane(r);
+        if (lane == LANE_CGI && !overload_admit(SHED_CGI, scheduler_queued(lane))) {
+            /* Too many scripts waiting for a worker already */
+            http2_serve_stream(s, st, r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+            return CONNECTION_WAIT;
+        }
+        r->stream  = st;
+        s->active  = st;
+        c->request = r;
+        scheduler_submit(c, lane);
+        return CONNECTION_BUSY;
+    }
+    if (status == HTTP_STATUS_OK && coroutine_active()) {
+        r->stream  = st;
+        s->active  = st;
+        c->request = r;
+        return coroutine_spawn(http2_coroutine, c) ? CONNECTION_WAIT : CONNECTION_BUSY;
+    }
+
+    http2_serve_stream(s, st, r, status);
+    return CONNECTION_WAIT;
+}
+
+/**
+ * Serve every stream whose request is complete, oldest first.
+ *
+ * @return  CONNECTION_BUSY if one was handed to a worker or coroutine,
+ *          CONNECTION_WAIT otherwise.
+ *
+ * Responses go out one at a time: a stream's response is not interleaved
+ * with another's, but streams opened meanwhile are queued rather than
+ * refused.
+ **/
+static ConnectionState http2_serve(Http2Session *s) {
+    while (!s->failed) {
+        Http2Stream *st = s->streams;
+        while (st && !st->ended) {
+            st = st->next;
+        }
+        if (!st) {
+            break;
+        }
+
+        HTTPStatus status = HTTP_STATUS_OK;
+        Request *r = http2_prepare(s, st, &status);
+        if (r && http2_dispatch(s, st, r, status) == CONNECTION_BUSY) {
+            return CONNECTION_BUSY;
+        }
+    }
+    return CONNECTION_WAIT;
+}
+
+/**
+ * Handle buffered frames, serve complete requests and decide what to wait for.
+ **/
+static ConnectionState http2_advance(Http2Session *s) {
+    Connection *c = s->connection;
+
+    http2_frames(s);
+    if (http2_serve(s) == CONNECTION_BUSY) {
+        return CONNECTION_BUSY;
+    }
+
+    if (s->failed || c->eof || (s->goaway && !s->streams)) {
+        return CONNECTION_CLOSE;
+    }
+
+    /* A partial frame or request is held to the header deadline; an idle
+     * connection to the keep-alive one */
+    if (s->length > 0 || s->preface || s->continuation || s->streams) {
+        if (c->idle || c->deadline == 0) {
+            c->idle = false;
+            c->deadline = Timeouts.header ? timer_now() + Timeouts.header : 0;
+        }
+    } else {
+        int idle = Timeouts.idle > 0 ? Timeouts.idle : Timeouts.header;
+        c->idle = true;
+        c->deadline = idle ? timer_now() + idle : 0;
+    }
+    return CONNECTION_WAIT;
+}
+
+/* Connections */
+
+/**
+ * Check a token list header (e.g. Upgrade) for a token.
+ **/
+static bool http2_token(const char *value, const char *token) {
+    size_t length = strlen(token);
+
+    while (value && *value) {
+        value += strspn(value, " \t\r\n,");
+        size_t n = strcspn(value, " \t\r\n,");
+        if (n == length && strncasecmp(value, token, length) == 0) {
+            return true;
+        }
+        value += n;
+    }
+    return false;
+}
+
+/**
+ * Decode an HTTP2-Settings header value (base64url without padding).
+ *
+ * @return  Number of bytes decoded, or -1 if the value is invalid.
+ **/
+static ssize_t http2_base64url(const char *value, uint8_t *buffer, size_t size) {
+    uint32_t bits = 0;
+    int count = 0;
+    size_t n = 0;
+
+    for (; *value && !strchr(" \t\r\n=", *value); value++) {
+        int digit;
+        if (*value >= 'A' && *value <= 'Z') {
+            digit = *value - 'A';
+        } else if (*value >= 'a' && *value <= 'z') {
+            digit = *value - 'a' + 26;
+        } else if (*value >= '0' && *value <= '9') {
+            digit = *value - '0' + 52;
+        } else if (*value == '-') {
+            digit = 62;
+        } else if (*value == '_') {
+            digit = 63;
+        } else {
+            return -1;
+        }
+
+        bits = bits << 6 | digit;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            if (n == size) {
+                return -1;
+            }
+            buffer[n++] = bits >> count;
+        }
+    }
+    return n;
+}
+
+/**
+ * Check whether a parsed HTTP/1.1 request asks to switch to h2c.
+ *
+ * @param   r           HTTP Request structure (after handle_prepare).
+ * @return  Whether the request carries Upgrade: h2c with valid HTTP2-Settings
+ *          and no body.
+ **/
+bool http2_upgradable(Request *r) {
+    const char *settings = request_header(r, "HTTP2-Settings");
+    uint8_t payload[HTTP2_FRAME_MAX];
+    ssize_t n;
+
+    return Http2Enabled && r->method && r->version >= 1 && settings &&
+           http2_token(request_header(r, "Upgrade"), "h2c") &&
+           !request_header(r, "Content-Length") && !request_header(r, "Transfer-Encoding") &&
+           (n = http2_base64url(settings, payload, sizeof(payload))) >= 0 && n % 6 == 0;
+}
+
+/**
+ * Switch a connection to HTTP/2.
+ *
+ * @param   c           Client connection.
+ * @param   r           Upgrade request (prepared, its head c->head bytes at
+ *                      the start of c->buffer), or NULL when the buffer
+ *                      starts with the client connection preface.
+ * @param   status      Result of handle_prepare for r.
+ * @return  As connection_process.
+ *
+ * An upgrade is answered with 101 Switching Protocols and the request is
+ * then served as stream 1.  Everything buffered after it belongs to the
+ * HTTP/2 connection.
+ **/
+ConnectionState http2_start(Connection *c, Request *r, HTTPStatus status) {
+    size_t head = r ? c->head : 0;
+
+    Http2Session *s = mem_calloc(MEM_HTTP2, 1, sizeof(Http2Session));
+    if (!s) {
+        log("Couldn't allocate memory: %s", strerror(errno));
+        free_request(r);
+        return CONNECTION_CLOSE;
+    }
+    s->connection     = c;
+    s->preface        = true;
+    s->window         = HTTP2_WINDOW_DEFAULT;
+    s->initial_window = HTTP2_WINDOW_DEFAULT;
+    s->frame_max      = HTTP2_FRAME_MAX;
+    hpack_init(&s->decoder, HPACK_TABLE_SIZE);
+    hpack_init(&s->encoder, HPACK_TABLE_SIZE);
+    c->h2 = s;
+
+    s->length = c->length - head;
+    memcpy(s->input, c->buffer + head, s->length);
+    c->length = 0;
+
+    if (r) {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        struct iovec iov = { (void *)switching, sizeof(switching) - 1 };
+        uint8_t settings[HTTP2_FRAME_MAX];
+        ssize_t n = http2_base64url(request_header(r, "HTTP2-Settings"), settings, sizeof(settings));
+
+        if (socket_writev(c->fd, &iov, 1) < 0 || http2_settings(s, settings, n) != HTTP2_NO_ERROR) {
+            free_request(r);
+            return CONNECTION_CLOSE;
+        }
+    }
+    http2_send_settings(s);
+    log("HTTP/2 connection from %s:%s%s", c->host, c->port, r ? " (upgraded)" : "");
+
+    if (r) {
+        /* The client has finished sending stream 1: its request was the upgrade */
+        Http2Stream *st = http2_open(s, 1, NULL, true);
+        s->last_stream = 1;
+        if (!st) {
+            free_request(r);
+            return CONNECTION_CLOSE;
+        }
+        if (http2_dispatch(s, st, r, status) == CONNECTION_BUSY) {
+            return CONNECTION_BUSY;
+        }
+    }
+    return http2_advance(s);
+}
+
+/**
+ * Read what the client has sent on an HTTP/2 connection and serve every
+ * complete request.
+ *
+ * @return  CONNECTION_WAIT or CONNECTION_CLOSE, as connection_process.
+ **/
+ConnectionState http2_process(Connection *c) {
+    Http2Session *s = c->h2;
+
+    ssize_t n = recv(c->fd, s->input + s->length, sizeof(s->input) - s->length, 0);
+    if (n > 0) {
+        s->length += n;
+    } else if (n == 0) {
+        c->eof = true;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return CONNECTION_CLOSE;
+    }
+    return http2_advance(s);
+}
+
+/**
+ * Take a connection back from a worker or coroutine that served one of its
+ * streams, and carry on with the others.
+ *
+ * @return  As connection_process, without reading from the socket first.
+ **/
+ConnectionState http2_resume(Connection *c) {
+    return http2_advance(c->h2);
+}
+
+/**
+ * Handle a missed deadline: say goodbye with GOAWAY.  The caller closes the
+ * connection.
+ **/
+void http2_expire(Connection *c) {
+    if (c->idle) {
+        debug("HTTP/2 connection from %s:%s idle", c->host, c->port);
+    } else {
+        log("HTTP/2 connection from %s:%s timed out", c->host, c->port);
+    }
+    http2_goaway(c->h2, HTTP2_NO_ERROR);
+}
+
+/**
+ * Release an HTTP/2 session and its streams.
+ **/
+void http2_free(Http2Session *s) {
+    if (!s) {
+        return;
+    }
+    while (s->streams) {
+        http2_remove(s, s->streams);
+    }
+    hpack_free(&s->decoder);
+    hpack_free(&s->encoder);
+    mem_free(s->block);
+    mem_free(s);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,400 @@
+/* index.c: Startup-built Static File Index */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define INDEX_BUCKET_SIZE   4           /* Average keys per displacement bucket */
+#define INDEX_SEEDS_MAX     (1 << 20)   /* Displacements tried per bucket */
+#define INDEX_MLOCK_MAX     65536       /* Largest file locked into memory */
+#define INDEX_FD_RESERVE    1024        /* Descriptors left for connections */
+
+/* Globals */
+
+static IndexEntry  *Entries    = NULL;  /* Records, in perfect hash order */
+static size_t       EntryCount = 0;
+static uint32_t    *Seeds      = NULL;  /* Displacement per bucket */
+static size_t       BucketCount = 0;
+static char        *Pool       = NULL;  /* URIs, paths, MIME types, ETags */
+static size_t       PoolLength = 0;
+static size_t       PoolCapacity = 0;
+static size_t       FdBudget   = 0;     /* Descriptors the index may keep */
+static size_t       FdKept     = 0;
+
+/* Hashing */
+
+static size_t index_slot(uint64_t hash, uint32_t seed) {
+    uint64_t x = hash + (uint64_t)seed * 0x9E3779B97F4A7C15ull;  /* splitmix64 */
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return (x ^ (x >> 31)) % EntryCount;
+}
+
+/**
+ * Return the length of a URI as an index key: directories are indexed
+ * without their trailing slash.
+ **/
+static size_t index_key_length(const char *uri) {
+    size_t length = strlen(uri);
+    while (length > 1 && uri[length - 1] == '/') {
+        length--;
+    }
+    return length;
+}
+
+/* String Pool */
+
+static uint32_t pool_add(const char *s, size_t length) {
+    if (PoolLength + length + 1 > PoolCapacity) {
+        size_t capacity = PoolCapacity ? PoolCapacity * 2 : BUFSIZ;
+        while (PoolLength + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *pool = mem_realloc(MEM_CACHE, Pool, capacity);
+        if (!pool) {
+            fatal("Unable to grow index: %s", strerror(errno));
+        }
+        Pool = pool;
+        PoolCapacity = capacity;
+    }
+    uint32_t offset = PoolLength;
+    memcpy(Pool + PoolLength, s, length);
+    Pool[PoolLength + length] = '\0';
+    PoolLength += length + 1;
+    return offset;
+}
+
+const char * index_string(uint32_t offset) {
+    return Pool + offset;
+}
+
+/* Building */
+
+/**
+ * Record one resource found while walking the tree.
+ *
+ * @return  Position of the new record.
+ **/
+static size_t index_add(const char *uri, int fd, const struct stat *st, size_t *capacity) {
+    char path[BUFSIZ];
+    char etag[64];
+    IndexEntry *e;
+
+    if (EntryCount == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if (!(Entries = mem_realloc(MEM_CACHE, Entries, *capacity * sizeof(IndexEntry)))) {
+            fatal("Unable to grow index: %s", strerror(errno));
+        }
+    }
+    e = &Entries[EntryCount++];
+    memset(e, 0, sizeof(*e));
+
+    snprintf(path, sizeof(path), "%s%s", RootPath, uri);
+    http_etag(st, etag, sizeof(etag));
+
+    e->uri    = pool_add(uri, index_key_length(uri));
+    e->hash   = string_hash(uri, index_key_length(uri));
+    e->path   = pool_add(path, strlen(path));
+    e->etag   = pool_add(etag, strlen(etag));
+    e->fd     = fd;
+    e->size   = st->st_size;
+    e->mtime  = st->st_mtime;
+    e->kind   = S_ISDIR(st->st_mode) ? INDEX_DIR : (st->st_mode & S_IXUSR) ? INDEX_CGI : INDEX_FILE;
+
+    if (e->kind == INDEX_FILE) {
+        char *mimetype = determine_mimetype(uri);
+        e->mimetype = pool_add(mimetype, strlen(mimetype));
+        mem_free(mimetype);
+
+        /* Small files can be served straight from locked memory */
+        if (IndexMlock && st->st_size > 0 && st->st_size <= INDEX_MLOCK_MAX) {
+            void *data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+            if (data == MAP_FAILED) {
+                log("Unable to map %s: %s", path, strerror(errno));
+            } else {
+                if (mlock(data, st->st_size) < 0) {
+                    debug("Unable to lock %s: %s", path, strerror(errno));
+                }
+                e->data = data;
+                mem_charge(MEM_CACHE, st->st_size);
+            }
+        }
+    }
+    return EntryCount - 1;
+}
+
+/**
+ * Decide whether a record keeps its descriptor once its subtree is indexed:
+ * mapped files do not need one, and beyond the budget records are served by
+ * opening the path per request instead.
+ **/
+static void index_keep(size_t i) {
+    IndexEntry *e = &Entries[i];
+    if (e->fd < 0) {
+        return;
+    }
+    if (e->data || FdKept >= FdBudget) {
+        close(e->fd);
+        e->fd = -1;
+    } else {
+        FdKept++;
+    }
+}
+
+/**
+ * Walk a directory (already opened beneath RootFd) and index its contents.
+ **/
+static void index_walk(int dirfd, const char *uri, size_t *capacity) {
+    DIR *dir = fdopendir(dup(dirfd));
+    struct dirent *entry;
+
+    if (!dir) {
+        log("Unable to index %s: %s", uri, strerror(errno));
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char child[BUFSIZ];
+        struct stat st;
+        int fd;
+
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s%s%s", uri, streq(uri, "/") ? "" : "/", entry->d_name);
+
+        /* Symbolic links are left to determine_request_path */
+        fd = openat(dirfd, entry->d_name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
+        if (fd < 0) {
+            debug("Not indexing %s: %s", child, strerror(errno));
+            continue;
+        }
+        if (fstat(fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            close(fd);
+            continue;
+        }
+
+        bool cgi = S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR);
+        if (cgi) {
+            close(fd);          /* Scripts run by path */
+            fd = -1;
+        }
+        size_t i = index_add(child, fd, &st, capacity);
+        if (S_ISDIR(st.st_mode)) {
+            index_walk(fd, child, capacity);
+        }
+        index_keep(i);
+    }
+    closedir(dir);
+}
+
+static int index_compare_hash(const void *a, const void *b) {
+    uint64_t ha = *(const uint64_t *)a;
+    uint64_t hb = *(const uint64_t *)b;
+    return (ha > hb) - (ha < hb);
+}
+
+static int index_compare_size(const void *a, const void *b, void *arg) {
+    const size_t *sizes = arg;
+    size_t sa = sizes[*(const uint32_t *)a];
+    size_t sb = sizes[*(const uint32_t *)b];
+    return (sa < sb) - (sa > sb);
+}
+
+/**
+ * Place the records with a minimal perfect hash (hash and displace): keys are
+ * grouped into buckets, and each bucket, largest first, is given the first
+ * seed that sends all of its keys to free slots.
+ *
+ * @return  0 on success, -1 if no displacement could be found.
+ **/
+static int index_place(void) {
+    size_t      *sizes  = calloc(BucketCount, sizeof(size_t));
+    uint32_t    *order  = calloc(BucketCount, sizeof(uint32_t));
+    uint32_t    *keys   = calloc(EntryCount, sizeof(uint32_t));
+    size_t      *starts = calloc(BucketCount + 1, sizeof(size_t));
+    IndexEntry  *placed = calloc(EntryCount, sizeof(IndexEntry));
+    bool        *used   = calloc(EntryCount, sizeof(bool));
+    size_t      *slots  = calloc(EntryCount, sizeof(size_t));
+    int          status = -1;
+
+    if (!sizes || !order || !keys || !starts || !placed || !used || !slots) {
+        goto done;
+    }
+
+    /* Group keys by bucket (counting sort) */
+    for (size_t i = 0; i < EntryCount; i++) {
+        sizes[Entries[i].hash % BucketCount]++;
+    }
+    for (size_t b = 0; b < BucketCount; b++) {
+        starts[b + 1] = starts[b] + sizes[b];
+        order[b] = b;
+    }
+    memcpy(slots, starts, BucketCount * sizeof(size_t));
+    for (size_t i = 0; i < EntryCount; i++) {
+        keys[slots[Entries[i].hash % BucketCount]++] = i;
+    }
+    qsort_r(order, BucketCount, sizeof(uint32_t), index_compare_size, sizes);
+
+    for (size_t o = 0; o < BucketCount && sizes[order[o]] > 0; o++) {
+        uint32_t b = order[o];
+        uint32_t seed;
+
+        for (seed = 0; seed < INDEX_SEEDS_MAX; seed++) {
+            size_t k;
+            for (k = 0; k < sizes[b]; k++) {
+                size_t slot = index_slot(Entries[keys[starts[b] + k]].hash, seed);
+                bool clash = used[slot];
+                for (size_t j = 0; j < k && !clash; j++) {
+                    clash = slots[j] == slot;
+                }
+                if (clash) {
+                    break;
+                }
+                slots[k] = slot;
+            }
+            if (k == sizes[b]) {
+                break;
+            }
+        }
+        if (seed == INDEX_SEEDS_MAX) {
+            log("Unable to build perfect hash (bucket of %zu keys)", sizes[b]);
+            goto done;
+        }
+
+        Seeds[b] = seed;
+        for (size_t k = 0; k < sizes[b]; k++) {
+            used[slots[k]] = true;
+            placed[slots[k]] = Entries[keys[starts[b] + k]];
+        }
+    }
+
+    memcpy(Entries, placed, EntryCount * sizeof(IndexEntry));
+    status = 0;
+
+done:
+    free(sizes);
+    free(order);
+    free(keys);
+    free(starts);
+    free(placed);
+    free(used);
+    free(slots);
+    return status;
+}
+
+/**
+ * Walk RootPath once and build the static index.
+ *
+ * @return  0 on success, -1 on error (IndexEnabled is then cleared and
+ *          requests resolve paths as usual).
+ *
+ * Every file and directory gets a record holding its open descriptor (or its
+ * locked contents, or for CGI scripts its path), size, MIME type, ETag and
+ * kind.  Files stay open for the lifetime of the server, so the tree must not
+ * change underneath it.
+ **/
+int index_build(void) {
+    struct stat st;
+    size_t capacity = 0;
+    struct rlimit limit;
+
+    if (!IndexEnabled) {
+        return 0;
+    }
+
+    /* Indexed files hold descriptors: raise the limit, but leave room for
+     * connections */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        if (limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        FdBudget = limit.rlim_cur > 2 * INDEX_FD_RESERVE ? limit.rlim_cur - INDEX_FD_RESERVE : limit.rlim_cur / 2;
+    }
+
+    int rootfd = openat(RootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0 || fstat(rootfd, &st) < 0) {
+        log("Unable to index %s: %s", RootPath, strerror(errno));
+        goto fail;
+    }
+    index_add("/", rootfd, &st, &capacity);
+    index_walk(rootfd, "/", &capacity);
+    index_keep(0);
+
+    BucketCount = (EntryCount + INDEX_BUCKET_SIZE - 1) / INDEX_BUCKET_SIZE;
+    if (!(Seeds = mem_calloc(MEM_CACHE, BucketCount, sizeof(uint32_t)))) {
+        log("Unable to allocate index: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* Distinct hashes are required to tell keys apart */
+    uint64_t *hashes = malloc(EntryCount * sizeof(uint64_t));
+    if (!hashes) {
+        log("Unable to allocate index: %s", strerror(errno));
+        goto fail;
+    }
+    for (size_t i = 0; i < EntryCount; i++) {
+        hashes[i] = Entries[i].hash;
+    }
+    qsort(hashes, EntryCount, sizeof(uint64_t), index_compare_hash);
+    for (size_t i = 1; i < EntryCount; i++) {
+        if (hashes[i] == hashes[i - 1]) {
+            log("Index hash collision among %zu URIs", EntryCount);
+            free(hashes);
+            goto fail;
+        }
+    }
+    free(hashes);
+
+    if (index_place() < 0) {
+        goto fail;
+    }
+
+    log("Indexed %zu resources (%zu bytes of strings, %zu descriptors)", EntryCount, PoolLength, FdKept);
+    return 0;
+
+fail:
+    /* Descriptors and mappings are left to exit; only lookups are disabled */
+    IndexEnabled = false;
+    return -1;
+}
+
+/**
+ * Look up a request URI in the static index.
+ *
+ * @param   uri         Request URI (without query).
+ * @return  Record for the URI, or NULL if it is not indexed or cannot be
+ *          served from the index (no descriptor or mapping was kept).
+ **/
+const IndexEntry * index_lookup(const char *uri) {
+    if (!IndexEnabled || EntryCount == 0) {
+        return NULL;
+    }
+
+    size_t length = index_key_length(uri);
+    uint64_t hash = string_hash(uri, length);
+    const IndexEntry *e = &Entries[index_slot(hash, Seeds[hash % BucketCount])];
+
+    if (e->hash != hash || strncmp(Pool + e->uri, uri, length) != 0 || Pool[e->uri + length] != '\0') {
+        return NULL;
+    }
+    if (e->kind != INDEX_CGI && e->fd < 0 && !e->data) {
+        return NULL;
+    }
+    return e;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,371 @@
+/* memory.c: Allocation Accounting by Subsystem */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MEM_WORKERS_MAX     64          /* Threads with counters of their own */
+#define MEM_MAGIC           0x5E3A      /* Marks tracked blocks */
+
+/**
+ * Header placed before every tracked block.
+ */
+typedef struct {
+    uint64_t    size;                   /**< Requested size */
+    uint16_t    magic;                  /**< MEM_MAGIC */
+    uint8_t     tag;                    /**< MemTag */
+    uint8_t     unused;
+    uint32_t    worker;                 /**< Counters charged (freed from any thread) */
+} MemBlock;
+
+/**
+ * Counters of one tag.
+ */
+typedef struct {
+    int64_t     live;                   /**< Bytes allocated and not yet freed */
+    int64_t     peak;                   /**< Most bytes live at once */
+    uint64_t    allocs;                 /**< Allocations made */
+    uint64_t    bytes;                  /**< Bytes allocated in total */
+} MemCounter;
+
+/**
+ * Counters of one worker (event loop, scheduler worker or coroutine host).
+ */
+typedef struct {
+    pid_t       tid;                    /**< Thread that allocates through them */
+    MemCounter  tags[MEM_TAGS];
+    uint64_t    allocs[MEM_TAGS];       /**< Allocations at the previous dump */
+    uint64_t    bytes[MEM_TAGS];        /**< Bytes at the previous dump */
+    uint64_t    reported;               /**< When the previous dump ran (timer_now ms) */
+} MemWorker;
+
+/* Globals */
+
+static const char *TagNames[MEM_TAGS] = {
+    [MEM_REQUEST]    = "request",
+    [MEM_HEADERS]    = "headers",
+    [MEM_MIME]       = "mime",
+    [MEM_PATH]       = "path",
+    [MEM_BROWSE]     = "browse",
+    [MEM_CGI]        = "cgi",
+    [MEM_CACHE]      = "cache",
+    [MEM_CONNECTION] = "connection",
+    [MEM_RESPONSE]   = "response",
+    [MEM_HTTP2]      = "http2",
+    [MEM_PROXY]      = "proxy",
+};
+
+static MemWorker        Workers[MEM_WORKERS_MAX];
+static uint32_t         WorkerCount = 0;
+static uint64_t         Started     = 0;
+static __thread uint32_t Self       = UINT32_MAX;
+
+_Static_assert(sizeof(MemBlock) == MEM_HEADER, "MemBlock must fill MEM_HEADER");
+
+/* Counters */
+
+/**
+ * Return the index of the calling thread's counters, claiming them on its
+ * first allocation (threads past MEM_WORKERS_MAX share the last ones).
+ **/
+static uint32_t mem_self(void) {
+    if (Self == UINT32_MAX) {
+        uint32_t index = __atomic_fetch_add(&WorkerCount, 1, __ATOMIC_RELAXED);
+        Self = index < MEM_WORKERS_MAX ? index : MEM_WORKERS_MAX - 1;
+        Workers[Self].tid = syscall(SYS_gettid);
+    }
+    return Self;
+}
+
+/**
+ * Add bytes (negative when freed) to a worker's tag.  Blocks are freed on
+ * other threads (scheduler workers finish requests the event loop parsed), so
+ * updates are atomic; they are uncontended in the common case.
+ **/
+static void mem_add(uint32_t worker, MemTag tag, int64_t bytes) {
+    MemCounter *c = &Workers[worker].tags[tag];
+    int64_t live = __atomic_add_fetch(&c->live, bytes, __ATOMIC_RELAXED);
+
+    if (bytes > 0) {
+        __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+        if (live > __atomic_load_n(&c->peak, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&c->peak, live, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Charge memory that was not allocated here (directory scans, mappings) to
+ * the calling worker.
+ *
+ * @param   tag         Subsystem owning it.
+ * @param   bytes       Bytes gained (negative when released).
+ **/
+void mem_charge(MemTag tag, int64_t bytes) {
+    mem_add(mem_self(), tag, bytes);
+}
+
+/* Blocks */
+
+/**
+ * Fill in the header of a block the allocator returned and charge it.
+ *
+ * @param   base        Block of size + MEM_HEADER bytes (or NULL).
+ * @param   tag         Subsystem owning it.
+ * @param   size        Bytes requested.
+ * @return  Pointer handed to the caller, or NULL if base is NULL.
+ **/
+void *mem_track(void *base, MemTag tag, size_t size) {
+    if (!base) {
+        return NULL;
+    }
+
+    MemBlock *b = base;
+    b->size   = size;
+    b->magic  = MEM_MAGIC;
+    b->tag    = tag;
+    b->worker = mem_self();
+    mem_add(b->worker, tag, size);
+    return (char *)base + MEM_HEADER;
+}
+
+/**
+ * Recharge a block realloc returned.
+ *
+ * @param   base        New block (or NULL if realloc failed, leaving the old
+ *                      one charged).
+ * @param   resized     The block replaced a tracked one (whose header it
+ *                      carries).
+ * @param   tag         Subsystem owning it.
+ * @param   size        Bytes requested.
+ **/
+void *mem_moved(void *base, bool resized, MemTag tag, size_t size) {
+    if (!base) {
+        return NULL;
+    }
+    if (resized) {
+        MemBlock *b = base;
+        mem_add(b->worker, b->tag, -(int64_t)b->size);
+    }
+    return mem_track(base, tag, size);
+}
+
+/**
+ * Free a block from one of the mem_ allocators.
+ **/
+void mem_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    MemBlock *b = (MemBlock *)((char *)ptr - MEM_HEADER);
+    if (b->magic != MEM_MAGIC) {
+        /* Double free, or memory from malloc or libc freed here */
+        log("Freeing untracked block %p", ptr);
+        abort();
+    }
+    mem_add(b->worker, b->tag, -(int64_t)b->size);
+    b->magic = 0;
+    free(b);
+}
+
+/**
+ * Format a string into a tracked block.
+ *
+ * @return  String (freed with mem_free), or NULL on failure.
+ **/
+char *mem_asprintf(MemTag tag, const char *format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    if (length < 0) {
+        return NULL;
+    }
+
+    char *s = mem_malloc(tag, length + 1);
+    if (s) {
+        va_start(arguments, format);
+        vsnprintf(s, length + 1, format, arguments);
+        va_end(arguments);
+    }
+    return s;
+}
+
+/* Reports */
+
+/**
+ * A report line, formatted by hand: snprintf is not async-signal-safe.
+ */
+typedef struct {
+    char        text[256];
+    size_t      length;
+} MemLine;
+
+static void mem_put(MemLine *l, const char *s) {
+    while (*s && l->length < sizeof(l->text)) {
+        l->text[l->length++] = *s++;
+    }
+}
+
+static void mem_put_padded(MemLine *l, const char *s, size_t width) {
+    size_t start = l->length;
+    mem_put(l, s);
+    while (l->length - start < width && l->length < sizeof(l->text)) {
+        l->text[l->length++] = ' ';
+    }
+}
+
+static void mem_put_unsigned(MemLine *l, uint64_t value, size_t width) {
+    char digits[24];
+    size_t n = sizeof(digits) - 1;
+
+    digits[n] = '\0';
+    do {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (sizeof(digits) - 1 - n < width) {
+        digits[--n] = ' ';
+    }
+    mem_put(l, digits + n);
+}
+
+static void mem_put_signed(MemLine *l, int64_t value) {
+    if (value < 0) {
+        mem_put(l, "-");
+        mem_put_unsigned(l, -(uint64_t)value, 0);
+    } else {
+        mem_put_unsigned(l, value, 0);
+    }
+}
+
+/**
+ * Write one line: "[pid] MEMORY <who> <tag> live=N peak=N allocs=N rate=N/s bytes=N/s".
+ **/
+static void mem_report(pid_t pid, const char *who, int tag, const MemCounter *c, uint64_t rate, uint64_t bytes) {
+    MemLine l = { .length = 0 };
+
+    mem_put(&l, "[");
+    mem_put_unsigned(&l, pid, 5);
+    mem_put(&l, "] MEMORY ");
+    mem_put(&l, who);
+    mem_put(&l, " ");
+    mem_put_padded(&l, TagNames[tag], 10);
+    mem_put(&l, " live=");
+    mem_put_signed(&l, c->live);
+    mem_put(&l, " peak=");
+    mem_put_signed(&l, c->peak);
+    mem_put(&l, " allocs=");
+    mem_put_unsigned(&l, c->allocs, 0);
+    mem_put(&l, " rate=");
+    mem_put_unsigned(&l, rate, 0);
+    mem_put(&l, "/s bytes=");
+    mem_put_unsigned(&l, bytes, 0);
+    mem_put(&l, "/s\n");
+
+    ssize_t written = write(STDERR_FILENO, l.text, l.length);
+    (void)written;
+}
+
+/**
+ * Log every worker's counters, and the process totals, one tag per line:
+ *
+ *      [pid] MEMORY <worker>/<tid> <tag> live=N peak=N allocs=N rate=N/s bytes=N/s
+ *
+ * Rates cover the time since the previous dump (or startup).  Totals sum
+ * the workers, so their peak is an upper bound.  As this runs from the
+ * SIGUSR1 handler, lines are formatted by hand and written with write(2):
+ * no allocation and no stdio.
+ **/
+void mem_dump(void) {
+    MemCounter totals[MEM_TAGS] = {{0}};
+    uint64_t   rates[MEM_TAGS][2] = {{0}};
+    uint64_t   now = timer_now();
+    pid_t      pid = getpid();
+
+    uint32_t count = __atomic_load_n(&WorkerCount, __ATOMIC_RELAXED);
+    count = count < MEM_WORKERS_MAX ? count : MEM_WORKERS_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        MemWorker *w = &Workers[i];
+        uint64_t elapsed = now - (w->reported ? w->reported : Started);
+        elapsed = elapsed ? elapsed : 1;
+
+        MemLine who = { .length = 0 };
+        mem_put_unsigned(&who, i, 0);
+        mem_put(&who, "/");
+        mem_put_signed(&who, w->tid);
+        who.text[who.length] = '\0';
+
+        for (int t = 0; t < MEM_TAGS; t++) {
+            MemCounter c = {
+                .live   = __atomic_load_n(&w->tags[t].live,   __ATOMIC_RELAXED),
+                .peak   = __atomic_load_n(&w->tags[t].peak,   __ATOMIC_RELAXED),
+                .allocs = __atomic_load_n(&w->tags[t].allocs, __ATOMIC_RELAXED),
+                .bytes  = __atomic_load_n(&w->tags[t].bytes,  __ATOMIC_RELAXED),
+            };
+            uint64_t rate  = (c.allocs - w->allocs[t]) * 1000 / elapsed;
+            uint64_t bytes = (c.bytes  - w->bytes[t])  * 1000 / elapsed;
+            w->allocs[t] = c.allocs;
+            w->bytes[t]  = c.bytes;
+
+            totals[t].live   += c.live;
+            totals[t].peak   += c.peak;
+            totals[t].allocs += c.allocs;
+            rates[t][0]      += rate;
+            rates[t][1]      += bytes;
+            if (c.allocs == 0 && c.live == 0) {
+                continue;
+            }
+            mem_report(pid, who.text, t, &c, rate, bytes);
+        }
+        w->reported = now;
+    }
+
+    for (int t = 0; t < MEM_TAGS; t++) {
+        mem_report(pid, "total", t, &totals[t], rates[t][0], rates[t][1]);
+    }
+}
+
+static void mem_signal(int signum) {
+    int saved = errno;
+    mem_dump();
+    errno = saved;
+}
+
+/**
+ * The child of a fork keeps its parent's counters (and the memory they
+ * describe) under its own thread id.
+ **/
+static void mem_forked(void) {
+    if (Self != UINT32_MAX) {
+        Workers[Self].tid = syscall(SYS_gettid);
+    }
+}
+
+/**
+ * Start accounting: SIGUSR1 makes a process log its counters.
+ **/
+void mem_start(void) {
+    struct sigaction action = { .sa_handler = mem_signal, .sa_flags = SA_RESTART };
+
+    Started = timer_now();
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    pthread_atfork(NULL, NULL, mem_forked);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
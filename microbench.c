@@ -0,0 +1,425 @@
+/* microbench.c: Microbenchmarks for spidey's request hot path */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Functions under test that are internal to request.c */
+int parse_request_method(Request *r);
+int parse_request_headers(Request *r);
+
+/* Constants */
+
+#define CALIBRATE_NS    (10 * 1000000ull)       /* Minimum calibration batch */
+#define TARGET_NS       (200 * 1000000ull)      /* Measured time per benchmark */
+#define CORPUS_PASS     840                     /* Divisible by every corpus size (1..8) */
+
+/* Allocation Accounting */
+
+/* Interposing the allocator in the executable also catches allocations made
+ * inside libc on our behalf (strdup, fopen, fmemopen, scandir, ...). */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static uint64_t Allocations = 0;
+
+void *malloc(size_t size) {
+    Allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    Allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    Allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/* Corpus */
+
+static const char *RequestLines[] = {
+    "GET / HTTP/1.1\r\n",
+    "GET /html/index.html HTTP/1.1\r\n",
+    "GET /text/hackers.txt HTTP/1.0\r\n",
+    "GET /scripts/cowsay.sh?message=hello+world&template=vader HTTP/1.1\r\n",
+    "GET /scripts/env.sh?q=foo HTTP/1.1\r\n",
+    "HEAD /html/1k.txt HTTP/1.1\r\n",
+    "GET /static/js/app.8f3e2c1b.min.js HTTP/1.1\r\n",
+    "GET /images/avengers/spider-man/thumbnail-large.png?v=20180505 HTTP/1.1\r\n",
+};
+
+static const char *HeaderBlocks[] = {
+    /* Browser */
+    "Host: localhost:9000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://localhost:9000/html/\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n",
+    /* curl */
+    "Host: student06.cse.nd.edu:9002\r\n"
+    "User-Agent: curl/7.58.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    /* Load generator */
+    "Host: 127.0.0.1\r\n"
+    "User-Agent: thor\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    /* Conditional revisit */
+    "Host: localhost:9000\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_13_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/11.1 Safari/605.1.15\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "If-Modified-Since: Sat, 05 May 2018 17:02:11 GMT\r\n"
+    "If-None-Match: \"1f2c-3ad-5aede2a3\"\r\n"
+    "Cookie: session=8c1e5a4b0f9d4e3a; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+};
+
+static const char *MimePaths[] = {
+    "/html/index.html",
+    "/text/hackers.txt",
+    "/static/js/app.min.js",
+    "/images/thumbnail.png",
+    "/docs/report.pdf",
+    "/scripts/cowsay.sh",
+    "/archive/site.tar.gz",
+    "/README",
+};
+
+static const char *RequestUris[] = {
+    "/",
+    "/html/index.html",
+    "/text/lyrics.txt",
+    "/scripts/cowsay.sh",
+    "/a/deeply/nested/path/that/does/not/exist.html",
+    "/../../etc/passwd",
+};
+
+static char *WhitespaceInputs[] = {
+    "value",
+    "   Mozilla/5.0 (X11; Linux x86_64)",
+    " \t keep-alive",
+    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t text/html",
+};
+
+#define countof(a)  (sizeof(a) / sizeof((a)[0]))
+
+/* Streams fed to the parsers instead of sockets */
+static FILE *LineStreams[countof(RequestLines)];
+static FILE *HeaderStreams[countof(HeaderBlocks)];
+
+/* Cycle Counter */
+
+static int CycleFd = -1;
+
+static void cycles_open(void) {
+    struct perf_event_attr attr = {
+        .type           = PERF_TYPE_HARDWARE,
+        .size           = sizeof(struct perf_event_attr),
+        .config         = PERF_COUNT_HW_CPU_CYCLES,
+        .disabled       = 1,
+        .exclude_kernel = 1,
+        .exclude_hv     = 1,
+    };
+    CycleFd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (CycleFd < 0) {
+        fprintf(stderr, "perf_event_open unavailable (%s): cycles/op not reported\n", strerror(errno));
+    }
+}
+
+static void cycles_start(void) {
+    if (CycleFd >= 0) {
+        ioctl(CycleFd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(CycleFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static int64_t cycles_stop(void) {
+    uint64_t count = 0;
+    if (CycleFd < 0) {
+        return -1;
+    }
+    ioctl(CycleFd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(CycleFd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return (int64_t)count;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Benchmarks */
+
+/* Defeat dead-code elimination of pure results */
+static volatile uintptr_t Sink;
+
+static void release_request(Request *r) {
+    mem_free(r->method);
+    mem_free(r->uri);
+    mem_free(r->query);
+    for (Header *h = r->headers; h != NULL; ) {
+        Header *next = h->next;
+        mem_free(h->name);
+        mem_free(h->value);
+        mem_free(h);
+        h = next;
+    }
+    memset(r, 0, sizeof(Request));
+}
+
+static void bench_parse_request_method(uint64_t i) {
+    Request r = {0};
+    r.file = LineStreams[i % countof(LineStreams)];
+    rewind(r.file);
+    Sink += (uintptr_t)parse_request_method(&r);
+    release_request(&r);
+}
+
+static void bench_parse_request_headers(uint64_t i) {
+    Request r = {0};
+    r.file = HeaderStreams[i % countof(HeaderStreams)];
+    rewind(r.file);
+    Sink += (uintptr_t)parse_request_headers(&r);
+    release_request(&r);
+}
+
+static void bench_determine_mimetype(uint64_t i) {
+    char *mimetype = determine_mimetype(MimePaths[i % countof(MimePaths)]);
+    Sink += (uintptr_t)mimetype;
+    mem_free(mimetype);
+}
+
+static void bench_determine_request_path(uint64_t i) {
+    struct stat st;
+    char *path;
+    int fd = determine_request_path(RequestUris[i % countof(RequestUris)], &path, &st);
+    Sink += (uintptr_t)fd + st.st_size;
+    if (fd >= 0) close(fd);
+    mem_free(path);
+}
+
+static void bench_skip_whitespace(uint64_t i) {
+    Sink += (uintptr_t)skip_whitespace(WhitespaceInputs[i % countof(WhitespaceInputs)]);
+}
+
+static void bench_http_status_string(uint64_t i) {
+    Sink += (uintptr_t)http_status_string((HTTPStatus)(i % (HTTP_STATUS_SERVICE_UNAVAILABLE + 1)));
+}
+
+typedef struct {
+    const char  *name;
+    void        (*function)(uint64_t);
+    double      ns;
+    double      allocations;
+    double      cycles;
+} Benchmark;
+
+static Benchmark Benchmarks[] = {
+    {"parse_request_method",    bench_parse_request_method},
+    {"parse_request_headers",   bench_parse_request_headers},
+    {"determine_mimetype",      bench_determine_mimetype},
+    {"determine_request_path",  bench_determine_request_path},
+    {"skip_whitespace",         bench_skip_whitespace},
+    {"http_status_string",      bench_http_status_string},
+};
+
+static uint64_t run_batch(Benchmark *b, uint64_t iterations) {
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        b->function(i);
+    }
+    return now_ns() - start;
+}
+
+/**
+ * Calibrate an iteration count, then measure ns, allocations and cycles per
+ * operation over roughly TARGET_NS.
+ **/
+static void run_benchmark(Benchmark *b) {
+    uint64_t iterations = 1;
+    uint64_t elapsed;
+
+    while ((elapsed = run_batch(b, iterations)) < CALIBRATE_NS) {
+        iterations *= 2;
+    }
+    /* Whole passes over every corpus keep allocs/op deterministic */
+    iterations = iterations * TARGET_NS / (elapsed ? elapsed : 1);
+    iterations = (iterations / CORPUS_PASS + 1) * CORPUS_PASS;
+
+    uint64_t allocations = Allocations;
+    cycles_start();
+    elapsed = run_batch(b, iterations);
+    int64_t cycles = cycles_stop();
+    allocations = Allocations - allocations;
+
+    b->ns          = (double)elapsed / iterations;
+    b->allocations = (double)allocations / iterations;
+    b->cycles      = cycles < 0 ? -1 : (double)cycles / iterations;
+}
+
+/* Baselines */
+
+static bool load_baseline(const char *path, const char *name, double *ns, double *allocations) {
+    FILE *fs = fopen(path, "r");
+    char entry[BUFSIZ];
+    bool found = false;
+
+    if (!fs) {
+        return false;
+    }
+    while (!found && fscanf(fs, "%s %lf %lf", entry, ns, allocations) == 3) {
+        found = streq(entry, name);
+    }
+    fclose(fs);
+    return found;
+}
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hjbsmrt]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -j            Report JSON\n");
+    fprintf(stderr, "    -b path       Compare against baseline file\n");
+    fprintf(stderr, "    -s path       Save results as baseline file\n");
+    fprintf(stderr, "    -t fraction   Allowed ns/op regression (0.25)\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -r path       Root directory\n");
+    exit(status);
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL;
+    const char *save = NULL;
+    double threshold = 0.25;
+    bool json = false;
+    int argind = 1;
+
+    RootPath = "www";
+    while (argind < argc && argv[argind][0] == '-') {
+        char flag = argv[argind][1];
+        if (strchr("bstmr", flag) && argind + 1 >= argc) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (flag) {
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            case 'j': json = true; break;
+            case 'b': baseline = argv[++argind]; break;
+            case 's': save = argv[++argind]; break;
+            case 't': threshold = strtod(argv[++argind], NULL); break;
+            case 'm': MimeTypesPath = argv[++argind]; break;
+            case 'r': RootPath = argv[++argind]; break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+        argind++;
+    }
+
+    if ((RootFd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", RootPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < countof(RequestLines); i++) {
+        LineStreams[i] = fmemopen((void *)RequestLines[i], strlen(RequestLines[i]), "r");
+    }
+    for (size_t i = 0; i < countof(HeaderBlocks); i++) {
+        HeaderStreams[i] = fmemopen((void *)HeaderBlocks[i], strlen(HeaderBlocks[i]), "r");
+    }
+
+    cycles_open();
+
+    /* The functions under test are built with log() and debug() compiled out */
+    for (size_t i = 0; i < countof(Benchmarks); i++) {
+        run_benchmark(&Benchmarks[i]);
+    }
+
+    /* Report */
+    if (json) {
+        printf("{\n");
+        for (size_t i = 0; i < countof(Benchmarks); i++) {
+            Benchmark *b = &Benchmarks[i];
+            printf("  \"%s\": {\"ns_per_op\": %.2f, \"allocs_per_op\": %.2f, \"cycles_per_op\": ",
+                b->name, b->ns, b->allocations);
+            if (b->cycles < 0) printf("null");
+            else printf("%.1f", b->cycles);
+            printf("}%s\n", i + 1 < countof(Benchmarks) ? "," : "");
+        }
+        printf("}\n");
+    } else {
+        printf("| %-24s| %12s| %12s| %12s|\n", "function", "ns/op", "allocs/op", "cycles/op");
+        printf("|%.25s|%.13s|%.13s|%.13s|\n", "--------------------------", "--------------",
+            "--------------", "--------------");
+        for (size_t i = 0; i < countof(Benchmarks); i++) {
+            Benchmark *b = &Benchmarks[i];
+            printf("| %-24s| %12.1f| %12.2f| ", b->name, b->ns, b->allocations);
+            if (b->cycles < 0) printf("%12s|\n", "n/a");
+            else printf("%12.1f|\n", b->cycles);
+        }
+    }
+
+    /* Baseline comparison: allocation counts are deterministic, time is not */
+    int regressions = 0;
+    if (baseline) {
+        for (size_t i = 0; i < countof(Benchmarks); i++) {
+            Benchmark *b = &Benchmarks[i];
+            double ns, allocations;
+            if (!load_baseline(baseline, b->name, &ns, &allocations)) {
+                continue;
+            }
+            if (b->ns > ns * (1 + threshold)) {
+                fprintf(stderr, "REGRESSION %s: %.1f -> %.1f ns/op\n", b->name, ns, b->ns);
+                regressions++;
+            }
+            if (b->allocations > allocations + 0.005) {
+                fprintf(stderr, "REGRESSION %s: %.2f -> %.2f allocs/op\n", b->name, allocations, b->allocations);
+                regressions++;
+            }
+        }
+    }
+
+    if (save) {
+        FILE *fs = fopen(save, "w");
+        if (!fs) {
+            fatal("Unable to write %s: %s", save, strerror(errno));
+        }
+        for (size_t i = 0; i < countof(Benchmarks); i++) {
+            fprintf(fs, "%s %.2f %.2f\n", Benchmarks[i].name, Benchmarks[i].ns, Benchmarks[i].allocations);
+        }
+        fclose(fs);
+    }
+
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,498 @@
+/* negcache.c: Negative Lookup Cache of Missing Paths */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NEGCACHE_URI_MAX    232         /* Longest URI remembered */
+#define NEGCACHE_PROBES     8           /* Linear probe limit */
+#define NEGCACHE_BITS       16          /* Filter bits per entry */
+#define NEGCACHE_HASHES     3           /* Filter bits per URI */
+#define NEGCACHE_ENTRIES_MAX (1 << 22)
+
+/**
+ * A URI that did not resolve (ENOENT or ENOTDIR).
+ *
+ * Entries are only valid in the generation they were added in: a flush
+ * just advances the table's generation.
+ */
+typedef struct {
+    uint64_t    hash;                   /**< string_hash of the URI */
+    uint64_t    expires;                /**< timer_now deadline (0 = none) */
+    uint32_t    generation;             /**< Table generation when added */
+    uint32_t    length;                 /**< Length of the URI (0 = empty) */
+    char        uri[NEGCACHE_URI_MAX];  /**< Request URI (percent-encoded) */
+} NegativeEntry;
+
+/**
+ * Table header, in shared memory so that forked children, per-CPU event
+ * loops and the watcher process all see (and flush) the same entries.  It is
+ * followed by the Bloom filter and then the entries.
+ */
+typedef struct {
+    pthread_mutex_t lock;               /**< Process-shared lock (writers and probes) */
+    uint32_t    generation;             /**< Advanced on every flush */
+    uint32_t    inserted;               /**< Insertions since the filter was rebuilt */
+} NegativeTable;
+
+/* Globals */
+
+static NegativeTable *Table   = NULL;
+static uint64_t      *Filter  = NULL;   /* Bloom filter over the URIs in the table */
+static NegativeEntry *Entries = NULL;
+static size_t         Slots   = 0;      /* Entries (power of two) */
+static size_t         FilterMask = 0;   /* Filter bits - 1 */
+static char         **Watched = NULL;   /* Directory path of each watch descriptor */
+static size_t         WatchedCount = 0;
+
+/* Pre-serialized 404: status line and "Date: ", then the rest of the head
+ * and the body for a kept-alive and a closed connection */
+static char             NotFoundHead[2][64];     /* By HTTP minor version */
+static char             NotFoundTail[2][384];
+static size_t           NotFoundHeadLength[2] = { 0, 0 };
+static size_t           NotFoundTailLength[2] = { 0, 0 };
+static size_t           NotFoundBodyLength = 0;  /* Left off the tail for HEAD */
+static pthread_once_t   NotFoundOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Parse a negative cache profile.
+ *
+ * @param   spec        Comma-separated options, e.g. "entries=16384,ttl=2"
+ *                      (entries=0 disables the cache; ttl is in seconds, 0
+ *                      to trust entries until inotify reports a change).
+ * @return  true if every option was understood, false otherwise.
+ **/
+bool negcache_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *option = strtok_r(copy, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        char *end   = NULL;
+
+        if (!value) {
+            fprintf(stderr, "Missing value for negative cache option %s\n", option);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+
+        double number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0) {
+            fprintf(stderr, "Invalid negative cache option %s=%s\n", option, value);
+            ok = false;
+            break;
+        }
+
+        if (streq(option, "entries") && number <= NEGCACHE_ENTRIES_MAX) {
+            NegativeCache.entries = number;
+        } else if (streq(option, "ttl") && number <= 86400) {
+            NegativeCache.ttl = number * 1000;
+        } else {
+            fprintf(stderr, "Unknown negative cache option %s=%s\n", option, value);
+            ok = false;
+            break;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+/* Bloom Filter */
+
+static bool negcache_filtered(uint64_t hash) {
+    uint32_t h1 = hash >> 32, h2 = (uint32_t)hash | 1;
+    for (int i = 0; i < NEGCACHE_HASHES; i++) {
+        size_t bit = (h1 + i * h2) & FilterMask;
+        if (!(__atomic_load_n(&Filter[bit / 64], __ATOMIC_RELAXED) & (1ull << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void negcache_filter(uint64_t hash) {
+    uint32_t h1 = hash >> 32, h2 = (uint32_t)hash | 1;
+    for (int i = 0; i < NEGCACHE_HASHES; i++) {
+        size_t bit = (h1 + i * h2) & FilterMask;
+        __atomic_or_fetch(&Filter[bit / 64], 1ull << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Clear the filter and set the bits of the entries that are still live
+ * (evicted URIs would otherwise fill it up).  Called with the lock held.
+ **/
+static void negcache_refilter(void) {
+    uint64_t now = timer_now();
+
+    for (size_t i = 0; i <= FilterMask / 64; i++) {
+        __atomic_store_n(&Filter[i], 0, __ATOMIC_RELAXED);
+    }
+    Table->inserted = 0;
+    for (size_t i = 0; i < Slots; i++) {
+        NegativeEntry *e = &Entries[i];
+        if (e->length && e->generation == Table->generation && (!e->expires || e->expires > now)) {
+            negcache_filter(e->hash);
+            Table->inserted++;
+        }
+    }
+}
+
+/**
+ * Forget every missing path (something was created or renamed).
+ **/
+static void negcache_flush(void) {
+    pthread_mutex_lock(&Table->lock);
+    __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+    negcache_refilter();
+    pthread_mutex_unlock(&Table->lock);
+}
+
+/* Watcher Process */
+
+/**
+ * Watch a directory and every directory beneath it for new names.
+ **/
+static void negcache_watch(int ifd, const char *path) {
+    int wd = inotify_add_watch(ifd, path, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        log("Unable to watch %s: %s", path, strerror(errno));
+        return;
+    }
+    if ((size_t)wd >= WatchedCount) {
+        size_t count = WatchedCount ? WatchedCount : 64;
+        while (count <= (size_t)wd) {
+            count *= 2;
+        }
+        char **watched = mem_realloc(MEM_CACHE, Watched, count * sizeof(char *));
+        if (!watched) {
+            return;
+        }
+        memset(watched + WatchedCount, 0, (count - WatchedCount) * sizeof(char *));
+        Watched = watched;
+        WatchedCount = count;
+    }
+    mem_free(Watched[wd]);
+    Watched[wd] = mem_strdup(MEM_CACHE, path);
+
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char child[PATH_MAX];
+        struct stat st;
+
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        /* Symbolic links resolve to directories that are watched anyway */
+        if (entry->d_type == DT_DIR ||
+            (entry->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            negcache_watch(ifd, child);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Flush the cache whenever a name appears anywhere beneath RootPath, until
+ * the server exits.
+ **/
+static void negcache_loop(int ifd) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t n = read(ifd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            log("Unable to read inotify events: %s", strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+
+        /* New directories are watched before the flush, so no name created
+         * in them can be missed */
+        for (char *p = buffer; p < buffer + n; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len &&
+                event->wd >= 0 && (size_t)event->wd < WatchedCount && Watched[event->wd]) {
+                char child[PATH_MAX];
+                snprintf(child, sizeof(child), "%s/%s", Watched[event->wd], event->name);
+                negcache_watch(ifd, child);
+            }
+            if ((event->mask & IN_IGNORED) && (size_t)event->wd < WatchedCount) {
+                mem_free(Watched[event->wd]);
+                Watched[event->wd] = NULL;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        negcache_flush();
+    }
+}
+
+/**
+ * Start the negative cache.
+ *
+ * @return  0 on success, -1 on error (every lookup then goes to the file
+ *          system).
+ *
+ * Allocates the shared table (before forking) and forks a watcher process
+ * that flushes it whenever inotify reports a name created or renamed beneath
+ * RootPath.  Entries also expire after the TTL, which covers changes inotify
+ * cannot see (e.g. on network file systems, or past the watch limit).
+ **/
+int negcache_start(void) {
+    pthread_mutexattr_t attr;
+    int ifd = -1;
+
+    if (NegativeCache.entries == 0) {
+        return 0;
+    }
+
+    for (Slots = NEGCACHE_PROBES; Slots < (size_t)NegativeCache.entries; Slots *= 2);
+    FilterMask = Slots * NEGCACHE_BITS - 1;
+
+    size_t filter = Slots * NEGCACHE_BITS / 8;
+    size_t header = (sizeof(NegativeTable) + 63) & ~(size_t)63;
+    size_t size   = header + filter + Slots * sizeof(NegativeEntry);
+    void *memory  = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        log("Unable to map negative cache: %s", strerror(errno));
+        goto fail;
+    }
+    mem_charge(MEM_CACHE, size);
+    Table   = memory;
+    Filter  = (uint64_t *)((char *)memory + header);
+    Entries = (NegativeEntry *)((char *)memory + header + filter);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&Table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) {
+        log("Unable to watch %s: %s", RootPath, strerror(errno));
+        if (NegativeCache.ttl == 0) {
+            goto fail;
+        }
+        log("Missing paths are remembered for %d ms", NegativeCache.ttl);
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork negative cache watcher: %s", strerror(errno));
+        close(ifd);
+        goto fail;
+    }
+
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        for (size_t i = 0; i < ListenCount; i++) {
+            close(ListenFds[i]);
+        }
+        negcache_watch(ifd, RootPath);
+        negcache_flush();                /* Names created while watching */
+        negcache_loop(ifd);
+    }
+
+    close(ifd);
+    log("Remembering %zu missing paths (ttl %d ms, watcher pid %d)", Slots, NegativeCache.ttl, pid);
+    return 0;
+
+fail:
+    if (Table) {
+        munmap(Table, size);
+        mem_charge(MEM_CACHE, -(int64_t)size);
+    }
+    Table = NULL;
+    NegativeCache.entries = 0;
+    return -1;
+}
+
+/**
+ * Check whether a URI is known not to exist.
+ *
+ * @param   uri         Request URI (without query).
+ * @param   generation  Set to the generation to pass to negcache_insert if
+ *                      the URI turns out to be missing.
+ * @return  true if the URI was missing at last look and nothing has been
+ *          created since (answer 404 without touching the file system).
+ *
+ * URIs that were never cached are turned away by the Bloom filter without
+ * taking the lock.
+ **/
+bool negcache_lookup(const char *uri, uint32_t *generation) {
+    bool found = false;
+
+    if (!Table) {
+        return false;
+    }
+    *generation = __atomic_load_n(&Table->generation, __ATOMIC_ACQUIRE);
+
+    size_t length = strlen(uri);
+    if (length >= NEGCACHE_URI_MAX) {
+        return false;
+    }
+    uint64_t hash = string_hash(uri, length);
+    if (!negcache_filtered(hash)) {
+        return false;
+    }
+
+    uint64_t now = timer_now();
+    pthread_mutex_lock(&Table->lock);
+    for (size_t probe = 0; probe < NEGCACHE_PROBES; probe++) {
+        NegativeEntry *e = &Entries[(hash + probe) & (Slots - 1)];
+        if (e->hash == hash && e->length == length && e->generation == Table->generation &&
+            (!e->expires || e->expires > now) && memcmp(e->uri, uri, length) == 0) {
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Table->lock);
+    return found;
+}
+
+/**
+ * Remember that a URI does not exist.
+ *
+ * @param   uri         Request URI whose lookup failed with ENOENT or ENOTDIR.
+ * @param   generation  Generation from negcache_lookup before the lookup;
+ *                      if the cache was flushed since, the URI may have been
+ *                      created in between and is not remembered.
+ **/
+void negcache_insert(const char *uri, uint32_t generation) {
+    size_t length = strlen(uri);
+
+    if (!Table || length >= NEGCACHE_URI_MAX) {
+        return;
+    }
+
+    uint64_t hash = string_hash(uri, length);
+    uint64_t now  = timer_now();
+
+    pthread_mutex_lock(&Table->lock);
+    if (Table->generation != generation) {
+        pthread_mutex_unlock(&Table->lock);
+        return;
+    }
+
+    /* Reuse the URI's own or a dead slot, otherwise the one expiring first */
+    NegativeEntry *victim = NULL;
+    for (size_t probe = 0; probe < NEGCACHE_PROBES; probe++) {
+        NegativeEntry *e = &Entries[(hash + probe) & (Slots - 1)];
+        if (!e->length || e->generation != generation || (e->expires && e->expires <= now) ||
+            (e->hash == hash && e->length == length && memcmp(e->uri, uri, length) == 0)) {
+            victim = e;
+            break;
+        }
+        if (!victim || e->expires < victim->expires) {
+            victim = e;
+        }
+    }
+
+    victim->hash       = hash;
+    victim->expires    = NegativeCache.ttl ? now + NegativeCache.ttl : 0;
+    victim->generation = generation;
+    victim->length     = length;
+    memcpy(victim->uri, uri, length);
+
+    negcache_filter(hash);
+    if (++Table->inserted > 2 * Slots) {
+        negcache_refilter();
+    }
+    pthread_mutex_unlock(&Table->lock);
+}
+
+/**
+ * Serialize the 404 response once: only its Date changes.
+ **/
+static void negcache_build(void) {
+    static const char Body[] =
+        "<html>\n"
+        "<h1>404 Not Found</h1>\n"
+        "<h2>Stuff's all borked. I blame nargles.</h2>\n"
+        "</html>\n";
+
+    int n;
+    for (int version = 0; version < 2; version++) {
+        n = snprintf(NotFoundHead[version], sizeof(NotFoundHead[version]), "HTTP/1.%d %s\r\nDate: ",
+                     version, http_status_string(HTTP_STATUS_NOT_FOUND));
+        NotFoundHeadLength[version] = n > 0 && (size_t)n < sizeof(NotFoundHead[version]) ? n : 0;
+    }
+
+    for (int keepalive = 0; keepalive < 2; keepalive++) {
+        n = snprintf(NotFoundTail[keepalive], sizeof(NotFoundTail[keepalive]),
+            "\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: %s\r\n"
+            "\r\n"
+            "%s",
+            sizeof(Body) - 1, keepalive ? "keep-alive" : "close", Body);
+        NotFoundTailLength[keepalive] = n > 0 && (size_t)n < sizeof(NotFoundTail[keepalive]) ? n : 0;
+    }
+    NotFoundBodyLength = sizeof(Body) - 1;
+}
+
+/**
+ * Answer a request with the pre-serialized 404 Not Found (the same response
+ * handle_error would build) in a single writev (its headers alone for HEAD).
+ *
+ * @param   r           HTTP/1.x request (HTTP/2 streams use handle_error).
+ * @return  Number of bytes written, or -1 on error.
+ **/
+ssize_t negcache_send(Request *r) {
+    static __thread time_t cached_time = 0;
+    static __thread char   cached_date[64];
+    static __thread size_t cached_length = 0;
+    time_t now = time(NULL);
+
+    pthread_once(&NotFoundOnce, negcache_build);
+    if (now != cached_time) {
+        cached_length = http_date(now, cached_date, sizeof(cached_date));
+        cached_time = now;
+    }
+
+    int version = r->version >= 1;
+    size_t tail = NotFoundTailLength[r->keepalive];
+    if (tail && r->method && streq(r->method, "HEAD")) {
+        tail -= NotFoundBodyLength;
+    }
+    struct iovec iov[3] = {
+        { NotFoundHead[version], NotFoundHeadLength[version] },
+        { cached_date,  cached_length },
+        { NotFoundTail[r->keepalive], tail },
+    };
+    ssize_t written = socket_writev(r->fd, iov, 3);
+    if (written < 0) {
+        log("Unable to send response: %s", strerror(errno));
+        r->keepalive = false;
+    }
+    return written;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
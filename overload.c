@@ -0,0 +1,146 @@
+/* overload.c: Admission Control and Load Shedding */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+static const char *ShedNames[SHED_COUNT] = { "connections", "children", "cgi" };
+
+/* Globals */
+
+static uint64_t         Shed[SHED_COUNT];       /* Requests shed per limit */
+static uint64_t         Reported = 0;           /* When the counters were last logged (ms) */
+static char             Unavailable[256];       /* Pre-serialized 503 */
+static size_t           UnavailableLength = 0;
+static pthread_once_t   UnavailableOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Parse an overload profile.
+ *
+ * @param   spec        Comma-separated limits, e.g.
+ *                      "connections=4096,children=256,cgi=64,retry=2"
+ *                      (0 = no limit; retry is the Retry-After in seconds).
+ * @return  true if every option was understood, false otherwise.
+ **/
+bool overload_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *option = strtok_r(copy, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        char *end   = NULL;
+
+        if (!value) {
+            fprintf(stderr, "Missing value for overload option %s\n", option);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+
+        long number = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || number < 0 || number > 1000000) {
+            fprintf(stderr, "Invalid overload option %s=%s\n", option, value);
+            ok = false;
+            break;
+        }
+
+        if (streq(option, "retry")) {
+            Overload.retry = number;
+            continue;
+        }
+
+        int reason;
+        for (reason = 0; reason < SHED_COUNT && !streq(option, ShedNames[reason]); reason++);
+        if (reason == SHED_COUNT) {
+            fprintf(stderr, "Unknown overload option %s\n", option);
+            ok = false;
+            break;
+        }
+        Overload.limits[reason] = number;
+    }
+
+    free(copy);
+    return ok;
+}
+
+/**
+ * Check a load against its limit.
+ *
+ * @param   reason      Limit to check.
+ * @param   load        Current number of connections, children or queued
+ *                      requests.
+ * @return  true if one more may be admitted.
+ **/
+bool overload_admit(ShedReason reason, size_t load) {
+    int limit = Overload.limits[reason];
+    return limit == 0 || load < (size_t)limit;
+}
+
+/**
+ * Serialize the 503 response once (the Retry-After is fixed at startup).
+ **/
+static void overload_build(void) {
+    static const char Body[] = "Service Unavailable\n";
+    int n = snprintf(Unavailable, sizeof(Unavailable),
+        "HTTP/1.0 %s\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "%s",
+        http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE), Overload.retry, sizeof(Body) - 1, Body);
+    UnavailableLength = n > 0 && (size_t)n < sizeof(Unavailable) ? n : 0;
+}
+
+/**
+ * Turn a client away with 503 Service Unavailable.
+ *
+ * @param   fd          Client socket (the caller closes it).
+ * @param   reason      Limit that was reached.
+ *
+ * The request is not parsed: whatever the client has sent so far is
+ * discarded (so closing does not reset the connection before the client reads
+ * the answer) and the pre-serialized response is written without blocking.
+ * Shed counts are logged at most once a second.
+ **/
+void overload_shed(int fd, ShedReason reason) {
+    char discard[BUFSIZ];
+
+    pthread_once(&UnavailableOnce, overload_build);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+    if (send(fd, Unavailable, UnavailableLength, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        debug("Unable to send 503: %s", strerror(errno));
+    }
+    shutdown(fd, SHUT_WR);
+
+    __atomic_add_fetch(&Shed[reason], 1, __ATOMIC_RELAXED);
+
+    uint64_t now  = timer_now();
+    uint64_t last = __atomic_load_n(&Reported, __ATOMIC_RELAXED);
+    if (now - last >= 1000 && __atomic_compare_exchange_n(&Reported, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        log("Overloaded: shed %lu connections, %lu children, %lu cgi",
+            (unsigned long)overload_shed_count(SHED_CONNECTIONS),
+            (unsigned long)overload_shed_count(SHED_CHILDREN),
+            (unsigned long)overload_shed_count(SHED_CGI));
+    }
+}
+
+/**
+ * Return how many requests have been shed at a limit.
+ **/
+uint64_t overload_shed_count(ShedReason reason) {
+    return __atomic_load_n(&Shed[reason], __ATOMIC_RELAXED);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
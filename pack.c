@@ -0,0 +1,396 @@
+/* pack.c: Pack Archive Builder */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define PACK_GZIP_MIN       256         /* Smallest body worth compressing */
+#define PACK_GZIP_SAVING    10          /* Percent a gzip body must save to be kept */
+
+/* Globals (used by utils.c) */
+
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath        = NULL;
+int   RootFd          = -1;
+
+/* Archive under construction: data offsets are relative to the data section
+ * until the layout is known */
+
+static bool         Compress      = false;
+static char        *Data          = NULL;
+static size_t       DataLength    = 0;
+static size_t       DataCapacity  = 0;
+static PackEntry   *Entries       = NULL;
+static size_t       EntryCount    = 0;
+static size_t       EntryCapacity = 0;
+
+/**
+ * Display usage message and exit with specified status code.
+ **/
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hmMz] root output\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -z            Add pre-compressed (gzip) bodies\n");
+    exit(status);
+}
+
+/**
+ * Append bytes to the data section.
+ *
+ * @param   s           Bytes to append.
+ * @param   length      Number of bytes.
+ * @param   terminate   Append a NUL as well (strings).
+ * @return  Offset of the bytes in the data section.
+ **/
+static uint64_t data_add(const void *s, size_t length, bool terminate) {
+    size_t needed = DataLength + length + (terminate ? 1 : 0);
+    if (needed > DataCapacity) {
+        size_t capacity = DataCapacity ? DataCapacity : BUFSIZ;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        if (!(Data = realloc(Data, capacity))) {
+            fatal("Unable to grow archive: %s", strerror(errno));
+        }
+        DataCapacity = capacity;
+    }
+    uint64_t offset = DataLength;
+    memcpy(Data + DataLength, s, length);
+    DataLength += length;
+    if (terminate) {
+        Data[DataLength++] = '\0';
+    }
+    return offset;
+}
+
+/**
+ * Compress a body with gzip framing.
+ *
+ * @return  Allocated compressed body (its length in *compressed), or NULL if
+ *          compression does not pay off.
+ **/
+static void *pack_gzip(const void *body, size_t length, size_t *compressed) {
+    z_stream zs = {0};
+    void *out;
+
+    if (length < PACK_GZIP_MIN ||
+        deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&zs, length);
+    if (!(out = malloc(bound))) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in   = (Bytef *)body;
+    zs.avail_in  = length;
+    zs.next_out  = out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END ||
+        zs.total_out > length - length * PACK_GZIP_SAVING / 100) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *compressed = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+/**
+ * Store one representation: its precomputed header lines, ETag and body.
+ **/
+static void pack_body(PackBody *b, const char *mimetype, const char *etag, time_t mtime,
+                      bool gzip, bool vary, const void *body, size_t length) {
+    char headers[BUFSIZ];
+    char date[64];
+
+    http_date(mtime, date, sizeof(date));
+    int n = snprintf(headers, sizeof(headers), "Content-Type: %s\r\nETag: %s\r\nLast-Modified: %s%s%s",
+        mimetype, etag, date,
+        gzip ? "\r\nContent-Encoding: gzip" : "",
+        vary ? "\r\nVary: Accept-Encoding" : "");
+    if (n < 0 || (size_t)n >= sizeof(headers)) {
+        fatal("Headers for %s do not fit", etag);
+    }
+
+    b->headers        = data_add(headers, n, false);
+    b->headers_length = n;
+    b->etag           = data_add(etag, strlen(etag), true);
+    b->body           = data_add(body, length, false);
+    b->body_length    = length;
+}
+
+/**
+ * Add a resource, with a gzip variant when asked for and worthwhile.
+ **/
+static void pack_resource(const char *key, const struct stat *st, const char *mimetype,
+                          const void *body, size_t length) {
+    char etag[64];
+    char gzip_etag[64];
+    size_t compressed = 0;
+    void *gzip = Compress ? pack_gzip(body, length, &compressed) : NULL;
+
+    if (EntryCount == EntryCapacity) {
+        EntryCapacity = EntryCapacity ? EntryCapacity * 2 : 64;
+        if (!(Entries = realloc(Entries, EntryCapacity * sizeof(PackEntry)))) {
+            fatal("Unable to grow archive: %s", strerror(errno));
+        }
+    }
+    PackEntry *e = &Entries[EntryCount++];
+    memset(e, 0, sizeof(*e));
+
+    e->hash  = string_hash(key, strlen(key));
+    e->key   = data_add(key, strlen(key), true);
+    e->mtime = st->st_mtime;
+
+    size_t n = http_etag(st, etag, sizeof(etag));
+    pack_body(&e->identity, mimetype, etag, st->st_mtime, false, gzip != NULL, body, length);
+    if (gzip) {
+        /* A different representation needs a different strong tag */
+        snprintf(gzip_etag, sizeof(gzip_etag), "%.*s-gz\"", (int)n - 1, etag);
+        pack_body(&e->gzip, mimetype, gzip_etag, st->st_mtime, true, true, gzip, compressed);
+        free(gzip);
+    }
+    debug("Packed %s (%zu bytes, %zu gzip)", key, length, compressed);
+}
+
+/**
+ * Read a whole file into memory.
+ **/
+static char *pack_read(const char *path, size_t size) {
+    char *body = malloc(size ? size : 1);
+    size_t total = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (!body || fd < 0) {
+        fatal("Unable to read %s: %s", path, strerror(errno));
+    }
+    while (total < size) {
+        ssize_t n = read(fd, body + total, size - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fatal("Unable to read %s: %s", path, n < 0 ? strerror(errno) : "file shrank");
+        }
+        total += n;
+    }
+    close(fd);
+    return body;
+}
+
+/**
+ * Pack a directory: its listing (rendered as spidey renders it) and,
+ * recursively, its contents.
+ *
+ * @param   path        Directory path.
+ * @param   key         Key of the directory ("." for the root).
+ * @param   st          Status of the directory.
+ **/
+static void pack_directory(const char *path, const char *key, const struct stat *st) {
+    struct dirent **entries;
+    char uri[BUFSIZ];
+    char *listing = NULL;
+    size_t length = 0;
+    FILE *stream;
+    int n;
+
+    if ((n = scandir(path, &entries, NULL, alphasort)) < 0) {
+        fatal("Unable to scan %s: %s", path, strerror(errno));
+    }
+    if (!(stream = open_memstream(&listing, &length))) {
+        fatal("Unable to render %s: %s", path, strerror(errno));
+    }
+
+    snprintf(uri, sizeof(uri), "/%s", streq(key, ".") ? "" : key);
+    const char *separator = strlen(uri) > 1 ? "/" : "";
+    fprintf(stream, "<html><ul>\n");
+
+    for (int i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        char child[BUFSIZ];
+        char child_key[BUFSIZ];
+        struct stat child_st;
+
+        if (streq(name, ".")) {
+            free(entries[i]);
+            continue;
+        }
+        fprintf(stream, "<li><a href=\"%s%s%s\">%s</a></li>\n", uri, separator, name, name);
+        if (streq(name, "..")) {
+            free(entries[i]);
+            continue;
+        }
+
+        snprintf(child, sizeof(child), "%s/%s", path, name);
+        snprintf(child_key, sizeof(child_key), "%s%s%s",
+            streq(key, ".") ? "" : key, streq(key, ".") ? "" : "/", name);
+
+        /* Symbolic links to files are packed as files; directory links are
+         * not followed, so the walk cannot loop */
+        if (lstat(child, &child_st) < 0) {
+            fatal("Unable to stat %s: %s", child, strerror(errno));
+        }
+        if (S_ISLNK(child_st.st_mode) && (stat(child, &child_st) < 0 || !S_ISREG(child_st.st_mode))) {
+            log("Skipping %s: not a link to a file", child);
+        } else if (S_ISDIR(child_st.st_mode)) {
+            pack_directory(child, child_key, &child_st);
+        } else if (!S_ISREG(child_st.st_mode)) {
+            log("Skipping %s: not a regular file", child);
+        } else if (child_st.st_mode & S_IXUSR) {
+            log("Skipping %s: CGI scripts cannot be served from a pack", child);
+        } else {
+            char *mimetype = determine_mimetype(name);
+            char *body = pack_read(child, child_st.st_size);
+            pack_resource(child_key, &child_st, mimetype, body, child_st.st_size);
+            free(body);
+            mem_free(mimetype);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    fprintf(stream, "</ul></html>");
+    fclose(stream);
+    pack_resource(key, st, "text/html", listing, length);
+    free(listing);
+}
+
+/**
+ * Lay out and write the archive: header, hash table, entries, data.
+ *
+ * The archive is written beside output and renamed over it, so servers that
+ * still map the old archive keep serving it undisturbed.
+ **/
+static void pack_write(const char *output) {
+    PackHeader header = {0};
+    uint32_t slots = 2;
+    char temporary[BUFSIZ];
+
+    while (slots < 2 * EntryCount) {
+        slots *= 2;
+    }
+
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.count   = EntryCount;
+    header.slots   = slots;
+    header.table   = sizeof(PackHeader);
+    header.entries = (header.table + (uint64_t)slots * sizeof(uint32_t) + 7) & ~7ull;
+
+    uint64_t base = header.entries + EntryCount * sizeof(PackEntry);
+    header.size   = base + DataLength;
+
+    /* Open addressing with linear probing; entries are stored 1-based */
+    uint32_t *table = calloc(slots, sizeof(uint32_t));
+    if (!table) {
+        fatal("Unable to allocate hash table: %s", strerror(errno));
+    }
+    for (size_t i = 0; i < EntryCount; i++) {
+        PackEntry *e = &Entries[i];
+        uint32_t slot = e->hash & (slots - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        table[slot] = i + 1;
+
+        e->key += base;
+        e->identity.headers += base;
+        e->identity.etag    += base;
+        e->identity.body    += base;
+        if (e->gzip.body_length) {
+            e->gzip.headers += base;
+            e->gzip.etag    += base;
+            e->gzip.body    += base;
+        }
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", output);
+    int fd = mkstemp(temporary);
+    FILE *stream = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!stream) {
+        fatal("Unable to create %s: %s", output, strerror(errno));
+    }
+
+    static const char padding[8];
+    if (fwrite(&header, sizeof(header), 1, stream) != 1 ||
+        fwrite(table, sizeof(uint32_t), slots, stream) != slots ||
+        fwrite(padding, 1, header.entries - header.table - slots * sizeof(uint32_t), stream) !=
+            header.entries - header.table - slots * sizeof(uint32_t) ||
+        fwrite(Entries, sizeof(PackEntry), EntryCount, stream) != EntryCount ||
+        fwrite(Data, 1, DataLength, stream) != DataLength ||
+        fchmod(fd, 0644) < 0 || fclose(stream) != 0) {
+        unlink(temporary);
+        fatal("Unable to write %s: %s", output, strerror(errno));
+    }
+    if (rename(temporary, output) < 0) {
+        unlink(temporary);
+        fatal("Unable to replace %s: %s", output, strerror(errno));
+    }
+    free(table);
+
+    log("Packed %zu resources into %s (%llu bytes)", EntryCount, output, (unsigned long long)header.size);
+}
+
+/**
+ * Bundle a document root into a pack archive for spidey -r pack:output.
+ **/
+int main(int argc, char *argv[]) {
+    char *progname = argv[0];
+    int argind = 1;
+    struct stat st;
+
+    while (argind < argc && argv[argind][0] == '-') {
+        switch (argv[argind][1]) {
+            case 'h':
+                usage(progname, EXIT_SUCCESS);
+                break;
+            case 'm':
+                if (++argind >= argc) usage(progname, EXIT_FAILURE);
+                MimeTypesPath = argv[argind];
+                break;
+            case 'M':
+                if (++argind >= argc) usage(progname, EXIT_FAILURE);
+                DefaultMimeType = argv[argind];
+                break;
+            case 'z':
+                Compress = true;
+                break;
+            default:
+                usage(progname, EXIT_FAILURE);
+                break;
+        }
+        argind++;
+    }
+    if (argc - argind != 2) {
+        usage(progname, EXIT_FAILURE);
+    }
+
+    RootPath = argv[argind];
+    if (stat(RootPath, &st) < 0) {
+        fatal("Unable to pack %s: %s", RootPath, strerror(errno));
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fatal("Unable to pack %s: not a directory", RootPath);
+    }
+
+    pack_directory(RootPath, ".", &st);
+    pack_write(argv[argind + 1]);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1094 @@
+/* proxy.c: Reverse Proxy to Upstream Pools */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PROXY_POOLS_MAX         16
+#define PROXY_BACKENDS_MAX      64      /* Backends of every pool together */
+#define PROXY_VNODES            64      /* Points per backend on a hash ring */
+#define PROXY_HEAD_MAX          8192    /* Largest response head a backend may send */
+#define PROXY_BLOCK_SIZE        65536   /* Buffer for the head and copied body blocks */
+#define PROXY_LINE_MAX          256     /* Longest chunk-size or trailer line */
+#define PROXY_CONNECT_TIMEOUT   2000    /* Milliseconds to connect to a backend */
+#define PROXY_RETRY             1000    /* Milliseconds a backend that refused a connection is skipped */
+#define PROXY_IDLE_TIMEOUT      4000    /* Milliseconds a pooled connection is trusted (under spidey's keep-alive) */
+#define PROXY_CHECK_TIMEOUT     1000    /* Milliseconds a health check may take */
+
+/**
+ * State of a backend shared by every process (and the health checker).
+ */
+typedef struct {
+    int32_t     active;                 /**< Requests in flight to it */
+    uint32_t    down;                   /**< Failed its last health check */
+    uint64_t    failed;                 /**< When a connection to it last failed (timer_now ms, 0 = never) */
+} ProxyState;
+
+/**
+ * Connection to a backend kept for the next request.
+ */
+typedef struct {
+    int         fd;
+    uint64_t    since;                  /**< When it went idle (timer_now ms) */
+} ProxyIdle;
+
+/**
+ * One upstream server.
+ */
+typedef struct {
+    struct sockaddr_storage addr;       /**< Address to connect to */
+    socklen_t   addrlen;
+    char        name[NI_MAXHOST + NI_MAXSERV]; /**< host:port as configured */
+    pthread_mutex_t lock;               /**< Guards idle (scheduler workers share it) */
+    ProxyIdle  *idle;                   /**< This process's idle connections (Proxy.idle slots) */
+    int         idle_count;
+} ProxyBackend;
+
+/**
+ * Point of a backend on a pool's consistent hash ring.
+ */
+typedef struct {
+    uint64_t    hash;
+    int         slot;                   /**< Backend's position in the pool */
+} ProxyPoint;
+
+struct proxy_pool {
+    char       *prefix;                 /**< URI prefix forwarded to the pool */
+    size_t      length;
+    int         backends[PROXY_BACKENDS_MAX]; /**< Indices into Backends */
+    int         count;
+    ProxyPoint *ring;                   /**< Points sorted by hash (balance=hash) */
+    size_t      points;
+    unsigned    next;                   /**< Where least-connections scans start (ties rotate) */
+};
+
+/**
+ * A backend's response: its head, then whatever body has arrived.
+ */
+typedef struct {
+    int         fd;                     /**< Connection to the backend */
+    char       *buffer;                 /**< PROXY_BLOCK_SIZE bytes */
+    size_t      length;                 /**< Bytes in buffer */
+    size_t      used;                   /**< Bytes consumed */
+    int         status;                 /**< Status code */
+    int64_t     content_length;         /**< Content-Length (-1 = none) */
+    bool        chunked;                /**< Body uses the chunked coding */
+    bool        keepalive;              /**< Backend keeps the connection open */
+} ProxyUpstream;
+
+/* Globals */
+
+static ProxyPool    Pools[PROXY_POOLS_MAX];
+static int          PoolCount    = 0;
+static ProxyBackend Backends[PROXY_BACKENDS_MAX];
+static int          BackendCount = 0;
+static ProxyState  *States       = NULL;    /* Shared by every process */
+
+/* Configuration */
+
+/**
+ * Add a backend given as host:port (or [address]:port).
+ *
+ * @return  Its index in Backends, or -1 if it is invalid.
+ **/
+static int proxy_backend(const char *spec) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *results;
+    char host[NI_MAXHOST];
+
+    /* A backend in several pools is one server: same state, same idle connections */
+    for (int i = 0; i < BackendCount; i++) {
+        if (streq(Backends[i].name, spec)) {
+            return i;
+        }
+    }
+
+    if (BackendCount == PROXY_BACKENDS_MAX) {
+        fprintf(stderr, "Too many upstream backends (at most %d)\n", PROXY_BACKENDS_MAX);
+        return -1;
+    }
+
+    snprintf(host, sizeof(host), "%s", spec);
+    char *port = strrchr(host, ':');
+    if (!port || port == host || port[1] == '\0') {
+        fprintf(stderr, "Upstream backend %s is not host:port\n", spec);
+        return -1;
+    }
+    *port++ = '\0';
+
+    char *name = host;
+    if (name[0] == '[' && port[-2] == ']') {
+        name++;
+        port[-2] = '\0';
+    }
+
+    int status = getaddrinfo(name, port, &hints, &results);
+    if (status != 0) {
+        fprintf(stderr, "Unable to resolve upstream backend %s: %s\n", spec, gai_strerror(status));
+        return -1;
+    }
+
+    ProxyBackend *b = &Backends[BackendCount];
+    memcpy(&b->addr, results->ai_addr, results->ai_addrlen);
+    b->addrlen = results->ai_addrlen;
+    freeaddrinfo(results);
+    snprintf(b->name, sizeof(b->name), "%s", spec);
+    pthread_mutex_init(&b->lock, NULL);
+    return BackendCount++;
+}
+
+/**
+ * Add a pool: a URI prefix and its backends separated by '+'.
+ **/
+static bool proxy_pool(const char *prefix, char *backends) {
+    char *saveptr = NULL;
+
+    if (PoolCount == PROXY_POOLS_MAX) {
+        fprintf(stderr, "Too many upstream pools (at most %d)\n", PROXY_POOLS_MAX);
+        return false;
+    }
+
+    ProxyPool *pool = &Pools[PoolCount];
+    for (char *spec = strtok_r(backends, "+", &saveptr); spec; spec = strtok_r(NULL, "+", &saveptr)) {
+        int index = proxy_backend(spec);
+        if (index < 0) {
+            return false;
+        }
+        pool->backends[pool->count++] = index;
+    }
+    if (pool->count == 0) {
+        fprintf(stderr, "Upstream pool %s has no backends\n", prefix);
+        return false;
+    }
+
+    pool->prefix = strdup(prefix);
+    pool->length = strlen(prefix);
+    PoolCount++;
+    return true;
+}
+
+/**
+ * Parse the upstream profile.
+ *
+ * @param   spec        Comma separated name=value list.
+ * @return  true if every setting was understood.
+ *
+ * Names starting with '/' are URI prefixes whose value lists the pool's
+ * backends (host:port joined by '+'); the longest matching prefix wins.
+ * The other settings apply to every pool:
+ *
+ *  balance=least|hash  Fewest requests in flight, or consistent hashing of
+ *                      the path (each path sticks to one backend's cache)
+ *  health=SECONDS      Interval of health checks (0 disables them)
+ *  check=PATH          Path the health checks request
+ *  idle=N              Idle connections kept per backend (0 = none)
+ **/
+bool proxy_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *option = strtok_r(copy, ",", &saveptr); option && ok; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        char *end   = NULL;
+
+        if (!value) {
+            fprintf(stderr, "Missing value for upstream %s\n", option);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+
+        if (option[0] == '/') {
+            ok = proxy_pool(option, value);
+        } else if (streq(option, "balance")) {
+            if (streq(value, "least") || streq(value, "hash")) {
+                Proxy.hash = streq(value, "hash");
+            } else {
+                fprintf(stderr, "Unknown upstream balance %s\n", value);
+                ok = false;
+            }
+        } else if (streq(option, "health")) {
+            double seconds = strtod(value, &end);
+            if (end == value || *end != '\0' || seconds < 0) {
+                fprintf(stderr, "Invalid upstream health interval %s\n", value);
+                ok = false;
+            }
+            Proxy.health = seconds * 1000;
+        } else if (streq(option, "check")) {
+            if (value[0] != '/') {
+                fprintf(stderr, "Upstream health check %s is not a path\n", value);
+                ok = false;
+            }
+            Proxy.check = strdup(value);
+        } else if (streq(option, "idle")) {
+            long idle = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || idle < 0 || idle > 4096) {
+                fprintf(stderr, "Invalid upstream idle connections %s\n", value);
+                ok = false;
+            }
+            Proxy.idle = idle;
+        } else {
+            fprintf(stderr, "Unknown upstream setting %s\n", option);
+            ok = false;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+/* Health Checks */
+
+/**
+ * Ask a backend for Proxy.check: it is healthy if it answers below 500.
+ **/
+static bool proxy_probe(const ProxyBackend *b) {
+    struct timeval tv = { .tv_sec = PROXY_CHECK_TIMEOUT / 1000, .tv_usec = (PROXY_CHECK_TIMEOUT % 1000) * 1000 };
+    char request[512], response[12];
+    bool healthy = false;
+
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int n = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: spidey-health\r\n\r\n",
+                     Proxy.check, b->name);
+    if (connect(fd, (const struct sockaddr *)&b->addr, b->addrlen) == 0 &&
+        send(fd, request, n, MSG_NOSIGNAL) == n) {
+        size_t got = 0;
+        ssize_t m;
+        while (got < sizeof(response) && (m = recv(fd, response + got, sizeof(response) - got, 0)) > 0) {
+            got += m;
+        }
+        /* "HTTP/1.x NNN" */
+        healthy = got == sizeof(response) && strncmp(response, "HTTP/1.", 7) == 0 &&
+                  response[9] >= '1' && response[9] <= '4';
+    }
+    close(fd);
+    return healthy;
+}
+
+/**
+ * Health checker process: probe every backend each interval and publish
+ * the results in the shared states.
+ **/
+static void proxy_check_loop(void) {
+    while (true) {
+        for (int i = 0; i < BackendCount; i++) {
+            uint32_t down = !proxy_probe(&Backends[i]);
+            if (down != __atomic_load_n(&States[i].down, __ATOMIC_RELAXED)) {
+                log("Upstream %s is %s", Backends[i].name, down ? "down" : "up");
+                __atomic_store_n(&States[i].down, down, __ATOMIC_RELAXED);
+            }
+        }
+        struct timespec ts = { .tv_sec = Proxy.health / 1000, .tv_nsec = (Proxy.health % 1000) * 1000000L };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+}
+
+static int proxy_point_compare(const void *a, const void *b) {
+    const ProxyPoint *pa = a, *pb = b;
+    return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+/**
+ * Set up the pools (before forking): share backend state between
+ * processes, build the hash rings and start the health checker.
+ *
+ * @return  0 on success (or with no pools), -1 on failure.
+ **/
+int proxy_start(void) {
+    if (PoolCount == 0) {
+        return 0;
+    }
+
+    States = mmap(NULL, BackendCount * sizeof(ProxyState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (States == MAP_FAILED) {
+        States = NULL;
+        log("Unable to allocate upstream states: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < BackendCount && Proxy.idle > 0; i++) {
+        if (!(Backends[i].idle = mem_calloc(MEM_PROXY, Proxy.idle, sizeof(ProxyIdle)))) {
+            log("Unable to allocate upstream connection pool: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Each backend owns PROXY_VNODES points, so adding or losing one only
+     * moves the paths next to its points */
+    for (int p = 0; p < PoolCount && Proxy.hash; p++) {
+        ProxyPool *pool = &Pools[p];
+        pool->points = (size_t)pool->count * PROXY_VNODES;
+        if (!(pool->ring = mem_calloc(MEM_PROXY, pool->points, sizeof(ProxyPoint)))) {
+            log("Unable to allocate upstream hash ring: %s", strerror(errno));
+            return -1;
+        }
+        for (int slot = 0; slot < pool->count; slot++) {
+            for (int v = 0; v < PROXY_VNODES; v++) {
+                char key[sizeof(Backends[0].name) + 16];
+                int n = snprintf(key, sizeof(key), "%s#%d", Backends[pool->backends[slot]].name, v);
+                pool->ring[slot * PROXY_VNODES + v] = (ProxyPoint){ string_hash(key, n), slot };
+            }
+        }
+        qsort(pool->ring, pool->points, sizeof(ProxyPoint), proxy_point_compare);
+    }
+
+    if (Proxy.health > 0) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            log("Unable to fork upstream health checker: %s", strerror(errno));
+            return -1;
+        }
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            proxy_check_loop();
+        }
+        debug("Upstream health checker started (pid %d)", pid);
+    }
+
+    log("Forwarding %d prefixes to %d upstream backends (%s)", PoolCount, BackendCount,
+        Proxy.hash ? "consistent hashing" : "least connections");
+    return 0;
+}
+
+/* Routing */
+
+/**
+ * Find the pool a request path is forwarded to.
+ *
+ * @return  Pool with the longest prefix matching uri (on a segment
+ *          boundary: /api matches /api and /api/x but not /apix), or NULL.
+ **/
+const ProxyPool *proxy_route(const char *uri) {
+    const ProxyPool *best = NULL;
+
+    for (int i = 0; i < PoolCount; i++) {
+        const ProxyPool *pool = &Pools[i];
+        if (strncmp(uri, pool->prefix, pool->length) != 0) {
+            continue;
+        }
+        char next = uri[pool->length];
+        if ((pool->prefix[pool->length - 1] == '/' || next == '\0' || next == '/') &&
+            (!best || pool->length > best->length)) {
+            best = pool;
+        }
+    }
+    return best;
+}
+
+static bool proxy_usable(int backend, uint64_t now) {
+    uint64_t failed = __atomic_load_n(&States[backend].failed, __ATOMIC_RELAXED);
+    return !__atomic_load_n(&States[backend].down, __ATOMIC_RELAXED) && (failed == 0 || now - failed >= PROXY_RETRY);
+}
+
+/**
+ * Choose a backend of the pool for a request.
+ *
+ * @param   pool        Pool.
+ * @param   uri         Request path (hashed with balance=hash).
+ * @param   tried       Slots already tried for this request (bit per slot).
+ * @return  Slot of the backend in the pool, or -1 if none is usable.
+ **/
+static int proxy_pick(ProxyPool *pool, const char *uri, uint64_t tried) {
+    uint64_t now = timer_now();
+
+    if (Proxy.hash) {
+        /* First point at or after the path's hash, walking on past
+         * backends that are down */
+        uint64_t hash = string_hash(uri, strlen(uri));
+        size_t low = 0, high = pool->points;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (pool->ring[middle].hash < hash) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (size_t i = 0; i < pool->points; i++) {
+            int slot = pool->ring[(low + i) % pool->points].slot;
+            if (!(tried & (1ull << slot)) && proxy_usable(pool->backends[slot], now)) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    unsigned start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    int32_t fewest = INT32_MAX;
+    int best = -1;
+    for (int i = 0; i < pool->count; i++) {
+        int slot = (start + i) % pool->count;
+        int backend = pool->backends[slot];
+        if ((tried & (1ull << slot)) || !proxy_usable(backend, now)) {
+            continue;
+        }
+        int32_t active = __atomic_load_n(&States[backend].active, __ATOMIC_RELAXED);
+        if (active < fewest) {
+            fewest = active;
+            best   = slot;
+        }
+    }
+    return best;
+}
+
+/* Upstream Connections */
+
+/**
+ * Get a connection to a backend: a pooled one that is still open, or a new
+ * one (waited on for at most PROXY_CONNECT_TIMEOUT).
+ *
+ * @return  Non-blocking socket, or -1 if the backend cannot be reached (it
+ *          is then skipped for PROXY_RETRY).
+ **/
+static int proxy_connect(int backend, bool *reused) {
+    ProxyBackend *b = &Backends[backend];
+    uint64_t now = timer_now();
+    char byte;
+
+    *reused = false;
+    pthread_mutex_lock(&b->lock);
+    while (b->idle_count > 0) {
+        ProxyIdle idle = b->idle[--b->idle_count];
+        pthread_mutex_unlock(&b->lock);
+        /* One the backend has closed (or written to unasked) reads something */
+        if (now - idle.since < PROXY_IDLE_TIMEOUT &&
+            recv(idle.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *reused = true;
+            return idle.fd;
+        }
+        close(idle.fd);
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int error = 0;
+    if (connect(fd, (struct sockaddr *)&b->addr, b->addrlen) < 0) {
+        error = errno;
+        if (error == EINPROGRESS) {
+            socklen_t length = sizeof(error);
+            int ready = coroutine_poll(fd, POLLOUT, PROXY_CONNECT_TIMEOUT);
+            if (ready <= 0) {
+                error = ready == 0 ? ETIMEDOUT : errno;
+            } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                error = errno;
+            }
+        }
+    }
+    if (error) {
+        log("Unable to connect to upstream %s: %s", b->name, strerror(error));
+        __atomic_store_n(&States[backend].failed, timer_now(), __ATOMIC_RELAXED);
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Close the idle connections a child inherited from the process that forked
+ * it: they stay pooled there, and one socket must not carry requests from
+ * both.
+ **/
+void proxy_forked(void) {
+    for (int i = 0; i < BackendCount; i++) {
+        ProxyBackend *b = &Backends[i];
+        pthread_mutex_lock(&b->lock);
+        while (b->idle_count > 0) {
+            close(b->idle[--b->idle_count].fd);
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+/**
+ * Keep a connection for the next request to its backend, or close it.
+ **/
+static void proxy_release(int backend, int fd, bool reusable) {
+    ProxyBackend *b = &Backends[backend];
+
+    if (reusable) {
+        pthread_mutex_lock(&b->lock);
+        if (b->idle_count < Proxy.idle) {
+            b->idle[b->idle_count++] = (ProxyIdle){ fd, timer_now() };
+            fd = -1;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* Requests */
+
+/**
+ * Check whether a message's Connection header lists a header name.
+ **/
+static bool proxy_connection_lists(const char *connection, const char *name) {
+    const char *end = connection + strcspn(connection, "\r\n");
+    size_t length = strlen(name);
+
+    for (const char *s = connection; s < end; s++) {
+        s += strspn(s, " \t,");
+        size_t n = strcspn(s, " \t,\r\n");
+        if (n == length && strncasecmp(s, name, n) == 0) {
+            return true;
+        }
+        s += n;
+        s += strcspn(s, ",\r\n");
+    }
+    return false;
+}
+
+/**
+ * Headers that describe one connection rather than the message (or whose
+ * framing the proxy redoes) are not passed on, nor are the ones the
+ * message's own Connection header (if any) names.
+ **/
+static bool proxy_hop_by_hop(const char *name, const char *connection) {
+    static const char *Names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding",
+        "Upgrade", "Content-Length", "Expect", "HTTP2-Settings", NULL,
+    };
+    for (const char **n = Names; *n; n++) {
+        if (strcasecmp(name, *n) == 0) {
+            return true;
+        }
+    }
+    return connection && proxy_connection_lists(connection, name);
+}
+
+/**
+ * Methods a request may be sent again with when a pooled connection turns
+ * out to have been closed: the backend may have acted on the first attempt
+ * before it went away (RFC 9110, section 9.2.2).
+ **/
+static bool proxy_idempotent(const char *method) {
+    static const char *Methods[] = { "GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE", NULL };
+    for (const char **m = Methods; *m; m++) {
+        if (streq(method, *m)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Length of a header value without the blanks (and CR) the parser leaves.
+ **/
+static int proxy_trim(const char *value) {
+    size_t length = strlen(value);
+    while (length > 0 && isspace((unsigned char)value[length - 1])) {
+        length--;
+    }
+    return (int)length;
+}
+
+/**
+ * Check that chunked is the last coding a Transfer-Encoding value lists: a
+ * message is only framed by its final coding.
+ **/
+static bool proxy_chunked(const char *value) {
+    const char *last = strrchr(value, ',');
+    last = last ? last + 1 : value;
+    while (*last == ' ' || *last == '\t') {
+        last++;
+    }
+    return strcasecmp(last, "chunked") == 0;
+}
+
+/**
+ * Send a backend the request line and headers.
+ *
+ * @param   r           Request.
+ * @param   backend     Backend (named in Host when the client gave none).
+ * @param   fd          Connection to it.
+ * @return  Bytes written, or -1 on error.
+ *
+ * The request goes out as HTTP/1.1 so the connection can be kept, with
+ * X-Forwarded-For naming the client and the body's framing as it arrived.
+ **/
+static ssize_t proxy_send_request(Request *r, int backend, int fd) {
+    const char *connection = request_header(r, "Connection");
+    const char *forwarded = NULL;
+    bool host = false;
+    char *head = NULL;
+    size_t length = 0;
+
+    FILE *stream = open_memstream(&head, &length);
+    if (!stream) {
+        return -1;
+    }
+
+    fprintf(stream, "%s %s%s%s HTTP/1.1\r\n", r->method, r->uri, r->query ? "?" : "", r->query ? r->query : "");
+    for (Header *h = r->headers; h; h = h->next) {
+        if (h->name[0] == ':' || proxy_hop_by_hop(h->name, connection)) {
+            continue;
+        }
+        if (strcasecmp(h->name, "X-Forwarded-For") == 0) {
+            forwarded = h->value;
+            continue;
+        }
+        host = host || strcasecmp(h->name, "Host") == 0;
+        fprintf(stream, "%s: %.*s\r\n", h->name, proxy_trim(h->value), h->value);
+    }
+    if (!host) {
+        fprintf(stream, "Host: %s\r\n", Backends[backend].name);
+    }
+    if (forwarded) {
+        fprintf(stream, "X-Forwarded-For: %.*s, %s\r\n", proxy_trim(forwarded), forwarded, r->host);
+    } else {
+        fprintf(stream, "X-Forwarded-For: %s\r\n", r->host);
+    }
+    if (r->chunked) {
+        fputs("Transfer-Encoding: chunked\r\n", stream);
+    } else if (r->content_length >= 0) {
+        fprintf(stream, "Content-Length: %lld\r\n", (long long)r->content_length);
+    }
+    fputs("\r\n", stream);
+    if (fclose(stream) != 0) {
+        free(head);
+        return -1;
+    }
+
+    ssize_t written;
+    if (!r->body_done) {
+        written = socket_send_more(fd, head, length);
+    } else {
+        struct iovec iov = { head, length };
+        written = socket_writev(fd, &iov, 1);
+    }
+    free(head);
+    return written;
+}
+
+/**
+ * Read a backend's response head and turn it into the client's response
+ * headers (hop-by-hop headers dropped, framing noted in u).
+ *
+ * @return  0 on success, -1 on error (u->length is 0 if nothing arrived):
+ *          EPROTO (502) for a malformed head or framing that is invalid or
+ *          ambiguous, which is checked as strictly as request_body_parse()
+ *          checks a client's.
+ **/
+static int proxy_read_head(ProxyUpstream *u, Response *res, Request *r) {
+    bool encoded = false;
+    char *end;
+
+    while (true) {
+        while (!(end = memmem(u->buffer, u->length, "\r\n\r\n", 4))) {
+            if (u->length >= PROXY_HEAD_MAX) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            ssize_t n = socket_recv(u->fd, u->buffer + u->length, PROXY_HEAD_MAX - u->length);
+            if (n <= 0) {
+                if (n == 0) {
+                    errno = ECONNRESET;
+                }
+                return -1;
+            }
+            u->length += n;
+        }
+        end += 2;           /* Past the last header line's CRLF */
+        u->used = end + 2 - u->buffer;
+        *end = '\0';
+
+        /* "HTTP/1.x NNN Reason" */
+        if (u->length < 12 || strncmp(u->buffer, "HTTP/1.", 7) != 0 || u->buffer[8] != ' ') {
+            errno = EPROTO;
+            return -1;
+        }
+        u->status = atoi(u->buffer + 9);
+        if (u->status < 100 || u->status > 999) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (u->status >= 200) {
+            break;
+        }
+
+        /* Interim responses (100 Continue) are dropped */
+        memmove(u->buffer, u->buffer + u->used, u->length - u->used);
+        u->length -= u->used;
+        u->used = 0;
+    }
+
+    u->keepalive      = u->buffer[7] == '1';
+    u->content_length = -1;
+    u->chunked        = false;
+
+    char *line = strstr(u->buffer, "\r\n");
+    *line = '\0';
+    response_init_status(res, r, u->buffer + 9);
+
+    const char *connection = NULL;
+    for (char *s = line + 2; *s && !connection; s = strstr(s, "\r\n") + 2) {
+        if (strncasecmp(s, "Connection:", 11) == 0) {
+            connection = s + 11;
+        }
+    }
+
+    for (line += 2; *line; ) {
+        char *eol = strstr(line, "\r\n");
+        *eol = '\0';
+
+        char *value = strchr(line, ':');
+        if (!value) {
+            errno = EPROTO;
+            return -1;
+        }
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        value[proxy_trim(value)] = '\0';
+
+        if (strcasecmp(line, "Content-Length") == 0) {
+            /* Digits only, and any repeats must agree */
+            errno = 0;
+            unsigned long long length = strtoull(value, &end, 10);
+            if (*value < '0' || *value > '9' || errno || *end != '\0' || length > INT64_MAX ||
+                (u->content_length >= 0 && (int64_t)length != u->content_length)) {
+                log("Upstream sent an invalid Content-Length: %s", value);
+                errno = EPROTO;
+                return -1;
+            }
+            u->content_length = length;
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            encoded    = true;
+            u->chunked = proxy_chunked(value);
+        } else if (strcasecmp(line, "Connection") == 0) {
+            u->keepalive = strcasestr(value, "close") ? false : strcasestr(value, "keep-alive") ? true : u->keepalive;
+        }
+        /* The response gets its own Date */
+        if (!proxy_hop_by_hop(line, connection) && strcasecmp(line, "Date") != 0) {
+            response_header(res, line, "%s", value);
+        }
+        line = eol + 2;
+    }
+
+    if (encoded && (!u->chunked || u->content_length >= 0)) {
+        log("Upstream sent ambiguous framing (Transfer-Encoding without a final chunked, or with Content-Length)");
+        errno = EPROTO;
+        return -1;
+    }
+    if (res->overflow) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (u->chunked || u->content_length < 0) {
+        u->content_length = -1;
+    }
+    return 0;
+}
+
+/**
+ * Take up to size body bytes: what followed the head first, then what the
+ * backend sends next.
+ *
+ * @return  Number of bytes (pointed to by *data), 0 at the end of the
+ *          backend's output, or -1 on error.
+ **/
+static ssize_t proxy_take(ProxyUpstream *u, size_t size, const char **data) {
+    if (u->used == u->length) {
+        ssize_t n = socket_recv(u->fd, u->buffer, PROXY_BLOCK_SIZE);
+        if (n <= 0) {
+            return n;
+        }
+        u->used   = 0;
+        u->length = n;
+    }
+    size_t n = u->length - u->used < size ? u->length - u->used : size;
+    *data = u->buffer + u->used;
+    u->used += n;
+    return n;
+}
+
+/**
+ * Read one CRLF-terminated framing line of a chunked response.
+ **/
+static int proxy_line(ProxyUpstream *u, char *line, size_t size) {
+    size_t length = 0;
+    const char *c;
+
+    while (true) {
+        ssize_t n = proxy_take(u, 1, &c);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        if (*c == '\n') {
+            break;
+        }
+        if (length + 1 >= size) {
+            errno = EPROTO;
+            return -1;
+        }
+        line[length++] = *c;
+    }
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+/**
+ * Copy count body bytes from the backend to the client.
+ **/
+static int proxy_copy(ProxyUpstream *u, Response *res, int64_t count) {
+    const char *data;
+
+    while (count > 0) {
+        ssize_t n = proxy_take(u, count < PROXY_BLOCK_SIZE ? count : PROXY_BLOCK_SIZE, &data);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        if (response_send_chunk(res, data, n) < 0) {
+            return -1;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send the client the backend's response body, as the backend framed it.
+ *
+ * @return  0 once the whole body has been relayed, -1 if either side failed.
+ *
+ * A Content-Length body moves from the backend's socket to the client's
+ * with splice (paced to the client's bandwidth limit).  Chunked bodies are
+ * decoded and re-framed for the client (chunked again to HTTP/1.1 clients),
+ * as are bodies delimited by the backend closing, and for HTTP/2 streams.
+ **/
+static int proxy_relay(ProxyUpstream *u, Response *res, Request *r) {
+    const char *data;
+    ssize_t n;
+
+    if (streq(r->method, "HEAD") || u->status == 204 || u->status == 304) {
+        if (u->content_length >= 0) {
+            response_content_length(res, u->content_length);
+        }
+        u->content_length = 0;
+        return response_send_head(res, -1) < 0 ? -1 : 0;
+    }
+
+    if (u->content_length >= 0) {
+        int64_t remaining = u->content_length;
+        if (response_send_head(res, remaining) < 0) {
+            return -1;
+        }
+        if (remaining == 0) {
+            return 0;
+        }
+
+        /* What arrived with the head, then socket to socket */
+        int64_t buffered = u->length - u->used;
+        if (proxy_copy(u, res, buffered < remaining ? buffered : remaining) < 0) {
+            return -1;
+        }
+        remaining -= buffered < remaining ? buffered : remaining;
+
+        if (r->stream) {
+            return proxy_copy(u, res, remaining) < 0 || response_end(res) < 0 ? -1 : 0;
+        }
+
+        size_t slice = ratelimit_slice();
+        while (remaining > 0) {
+            size_t want = (uint64_t)remaining < slice ? (size_t)remaining : slice;
+            ratelimit_pace(r, want);
+            n = socket_relay(u->fd, r->fd, want);
+            if (n < (ssize_t)want) {
+                if (n >= 0) {
+                    errno = ECONNRESET;
+                }
+                return -1;
+            }
+            remaining -= n;
+        }
+        return 0;
+    }
+
+    response_stream(res);
+    if (u->chunked) {
+        char line[PROXY_LINE_MAX];
+        while (true) {
+            char *end = NULL;
+            if (proxy_line(u, line, sizeof(line)) < 0) {
+                return -1;
+            }
+            errno = 0;
+            unsigned long long size = strtoull(line, &end, 16);
+            if (!isxdigit((unsigned char)line[0]) || errno) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (size == 0) {
+                break;
+            }
+            if (proxy_copy(u, res, size) < 0 || proxy_line(u, line, sizeof(line)) < 0) {
+                return -1;
+            }
+        }
+        /* Trailers (dropped) end with an empty line */
+        do {
+            if (proxy_line(u, line, sizeof(line)) < 0) {
+                return -1;
+            }
+        } while (line[0] != '\0');
+    } else {
+        while ((n = proxy_take(u, PROXY_BLOCK_SIZE, &data)) > 0) {
+            if (response_send_chunk(res, data, n) < 0) {
+                return -1;
+            }
+        }
+        if (n < 0) {
+            return -1;
+        }
+        u->keepalive = false;
+    }
+    return response_end(res) < 0 ? -1 : 0;
+}
+
+/**
+ * Forward a request to a backend of its pool and relay the response.
+ *
+ * @param   r           HTTP Request structure (r->upstream set by
+ *                      handle_prepare).
+ * @return  Status of the HTTP request.
+ *
+ * A backend that cannot be reached is skipped in favour of the next one.  A
+ * pooled connection the backend has meanwhile closed is retried on a fresh
+ * one when the request has no body and an idempotent method.  If no backend
+ * is usable the client gets 503; if the chosen one fails before answering,
+ * 502.  A backend that answers before taking the whole body has its answer
+ * relayed.
+ **/
+HTTPStatus handle_proxy_request(Request *r) {
+    ProxyPool *pool = (ProxyPool *)r->upstream;
+    ProxyUpstream u = { .fd = -1 };
+    Response res;
+    uint64_t tried = 0;
+    int backend = -1;
+
+    if (!(u.buffer = mem_malloc(MEM_PROXY, PROXY_BLOCK_SIZE))) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    while (true) {
+        bool reused;
+        int slot = proxy_pick(pool, r->uri, tried);
+        if (slot < 0) {
+            log("No upstream available for %s", r->uri);
+            mem_free(u.buffer);
+            return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        backend = pool->backends[slot];
+        if ((u.fd = proxy_connect(backend, &reused)) < 0) {
+            tried |= 1ull << slot;
+            continue;
+        }
+
+        __atomic_add_fetch(&States[backend].active, 1, __ATOMIC_RELAXED);
+        bool body = !r->body_done;
+        u.length = u.used = 0;
+
+        ssize_t sent = proxy_send_request(r, backend, u.fd);
+        if (sent >= 0 && body && request_body_relay(r, u.fd) < 0) {
+            /* The body did not arrive whole: the connection cannot carry
+             * another request */
+            int error = errno;
+            r->keepalive = false;
+            if (error == EPIPE && proxy_read_head(&u, &res, r) == 0) {
+                /* The backend answered (e.g. 413 or 401) without taking the
+                 * whole body: pass its answer on */
+                log("Upstream %s answered %s before taking its body", Backends[backend].name, r->uri);
+                u.keepalive = false;
+                break;
+            }
+            log("Couldn't relay request body for %s to %s: %s", r->uri, Backends[backend].name,
+                error == EPIPE ? "upstream stopped taking it" : strerror(error));
+            __atomic_sub_fetch(&States[backend].active, 1, __ATOMIC_RELAXED);
+            close(u.fd);
+            mem_free(u.buffer);
+            if (error == ECONNRESET) {
+                return HTTP_STATUS_BAD_REQUEST;     /* Client is gone */
+            }
+            return handle_error(r, error == EFBIG     ? HTTP_STATUS_PAYLOAD_TOO_LARGE :
+                                   error == EINVAL    ? HTTP_STATUS_BAD_REQUEST :
+                                   error == ETIMEDOUT ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_GATEWAY);
+        }
+        if (sent >= 0 && proxy_read_head(&u, &res, r) == 0) {
+            break;
+        }
+
+        int error = errno;
+        __atomic_sub_fetch(&States[backend].active, 1, __ATOMIC_RELAXED);
+        close(u.fd);
+        if (!body && u.length == 0 && proxy_idempotent(r->method)) {
+            if (reused) {
+                continue;       /* Closed while pooled: try another connection */
+            }
+            tried |= 1ull << slot;
+            __atomic_store_n(&States[backend].failed, timer_now(), __ATOMIC_RELAXED);
+            log("Upstream %s failed: %s", Backends[backend].name, strerror(error));
+            continue;
+        }
+        log("Upstream %s failed for %s: %s", Backends[backend].name, r->uri, strerror(error));
+        mem_free(u.buffer);
+        r->keepalive = false;
+        return handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+    }
+
+    /* Relay the response; a truncated one must not look complete */
+    bool complete = proxy_relay(&u, &res, r) == 0;
+    if (!complete) {
+        log("Couldn't relay response of %s for %s: %s", Backends[backend].name, r->uri, strerror(errno));
+        r->keepalive = false;
+    }
+    __atomic_sub_fetch(&States[backend].active, 1, __ATOMIC_RELAXED);
+    proxy_release(backend, u.fd, complete && u.keepalive && u.used == u.length);
+    mem_free(u.buffer);
+    return complete ? HTTP_STATUS_OK : HTTP_STATUS_BAD_GATEWAY;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,332 @@
+/* ratelimit.c: Per-Client Request and Bandwidth Limits */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define RATELIMIT_CLIENTS   4096        /* Clients tracked at once (power of two) */
+#define RATELIMIT_SLICE_MIN 16384       /* Smallest paced write (bytes) */
+#define RATELIMIT_SLICES    20          /* Paced writes per second of bandwidth */
+
+/**
+ * Token buckets of one client address.
+ *
+ * Buckets fill at the configured rate up to their burst.  A paced write
+ * takes its bytes up front, leaving the bucket in debt that the writer then
+ * waits out, so concurrent transfers of one client queue behind each other.
+ */
+typedef struct {
+    uint8_t     family;                 /**< AF_INET or AF_INET6 */
+    uint8_t     address[16];            /**< Raw network address */
+    double      requests;               /**< Request tokens */
+    double      bytes;                  /**< Byte tokens (negative while in debt) */
+    uint64_t    updated;                /**< When the buckets were last filled (us) */
+    int32_t     chain;                  /**< Next client in the hash bucket (-1 = none) */
+    int32_t     newer;                  /**< More recently seen client (-1 = none) */
+    int32_t     older;                  /**< Less recently seen client (-1 = none) */
+} RateClient;
+
+/**
+ * Client table, in shared memory so that forked children and every event
+ * loop charge the same buckets.  Clients are kept in least-recently-seen
+ * order; once the table is full the client idle the longest is replaced.
+ */
+typedef struct {
+    pthread_mutex_t lock;               /**< Process-shared lock */
+    int32_t     heads[RATELIMIT_CLIENTS]; /**< Hash buckets */
+    int32_t     newest;                 /**< Most recently seen client */
+    int32_t     oldest;                 /**< Least recently seen client */
+    int32_t     used;                   /**< Clients allocated */
+    RateClient  clients[RATELIMIT_CLIENTS];
+} RateTable;
+
+/* Globals */
+
+static RateTable *Table = NULL;
+
+/* Helpers */
+
+static uint64_t monotonic_microseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/**
+ * Parse a rate limit profile.
+ *
+ * @param   spec        Comma-separated rate[:burst] limits per client address,
+ *                      e.g. "requests=20:40,bytes=1M:4M" (per second; the
+ *                      burst defaults to one second's worth).
+ * @return  true if every option was understood, false otherwise.
+ **/
+bool ratelimit_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *option = strtok_r(copy, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        char *end   = NULL;
+        double rate, burst;
+
+        if (!value) {
+            fprintf(stderr, "Missing value for rate limit %s\n", option);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+
+        bool valid = parse_size(value, &end, &rate);
+        burst = rate;
+        if (valid && *end == ':') {
+            valid = parse_size(end + 1, &end, &burst);
+        }
+        if (!valid || *end != '\0' || (rate > 0 && burst < 1)) {
+            fprintf(stderr, "Invalid rate limit %s=%s\n", option, value);
+            ok = false;
+            break;
+        }
+
+        if (streq(option, "requests")) {
+            RateLimit.requests      = rate;
+            RateLimit.request_burst = burst;
+        } else if (streq(option, "bytes")) {
+            RateLimit.bytes         = rate;
+            RateLimit.byte_burst    = burst;
+        } else {
+            fprintf(stderr, "Unknown rate limit %s\n", option);
+            ok = false;
+            break;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+/**
+ * Allocate the shared client table (before forking) if any limit is set.
+ *
+ * @return  0 on success, -1 on failure.
+ **/
+int ratelimit_start(void) {
+    pthread_mutexattr_t attr;
+
+    if (RateLimit.requests == 0 && RateLimit.bytes == 0) {
+        return 0;
+    }
+
+    Table = mmap(NULL, sizeof(RateTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Table == MAP_FAILED) {
+        Table = NULL;
+        log("Unable to allocate rate limit table: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&Table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    memset(Table->heads, 0xff, sizeof(Table->heads));
+    Table->newest = Table->oldest = -1;
+    Table->used   = 0;
+
+    log("Limiting clients to %.0f requests/s (burst %.0f), %.0f bytes/s (burst %.0f)",
+        RateLimit.requests, RateLimit.request_burst, RateLimit.bytes, RateLimit.byte_burst);
+    return 0;
+}
+
+/**
+ * Unlink a client from the recency list.  Called with the lock held.
+ **/
+static void ratelimit_unlink(int32_t index) {
+    RateClient *c = &Table->clients[index];
+
+    if (c->newer >= 0) {
+        Table->clients[c->newer].older = c->older;
+    } else {
+        Table->newest = c->older;
+    }
+    if (c->older >= 0) {
+        Table->clients[c->older].newer = c->newer;
+    } else {
+        Table->oldest = c->newer;
+    }
+}
+
+/**
+ * Remove the client idle the longest from its hash bucket and return its
+ * slot.  Called with the lock held.
+ **/
+static int32_t ratelimit_evict(void) {
+    int32_t index = Table->oldest;
+    RateClient *c = &Table->clients[index];
+
+    int32_t *link = &Table->heads[address_hash(c->family, c->address) & (RATELIMIT_CLIENTS - 1)];
+    while (*link != index) {
+        link = &Table->clients[*link].chain;
+    }
+    *link = c->chain;
+    ratelimit_unlink(index);
+    return index;
+}
+
+/**
+ * Find (or start tracking) the client with the given address, mark it as
+ * most recently seen and fill its buckets.  Called with the lock held.
+ *
+ * @return  Client, or NULL for addresses that are not limited (e.g. UNIX).
+ **/
+static RateClient *ratelimit_client(const struct sockaddr *sa) {
+    uint8_t key[16];
+    uint64_t now = monotonic_microseconds();
+
+    if (!address_key(sa, key)) {
+        return NULL;
+    }
+
+    uint8_t family = sa->sa_family;
+    int32_t *head  = &Table->heads[address_hash(family, key) & (RATELIMIT_CLIENTS - 1)];
+    int32_t index;
+    RateClient *c = NULL;
+
+    for (index = *head; index >= 0; index = Table->clients[index].chain) {
+        c = &Table->clients[index];
+        if (c->family == family && memcmp(c->address, key, 16) == 0) {
+            break;
+        }
+    }
+
+    if (index >= 0) {
+        /* Refill for the time since the client was last seen */
+        double elapsed = (now - c->updated) / 1e6;
+        c->requests += elapsed * RateLimit.requests;
+        c->bytes    += elapsed * RateLimit.bytes;
+        if (c->requests > RateLimit.request_burst) c->requests = RateLimit.request_burst;
+        if (c->bytes    > RateLimit.byte_burst)    c->bytes    = RateLimit.byte_burst;
+        ratelimit_unlink(index);
+    } else {
+        index = Table->used < RATELIMIT_CLIENTS ? Table->used++ : ratelimit_evict();
+        c = &Table->clients[index];
+        c->family   = family;
+        memcpy(c->address, key, 16);
+        c->requests = RateLimit.request_burst;
+        c->bytes    = RateLimit.byte_burst;
+        c->chain    = *head;
+        *head = index;
+    }
+    c->updated = now;
+
+    /* Most recently seen first */
+    c->newer = -1;
+    c->older = Table->newest;
+    if (Table->newest >= 0) {
+        Table->clients[Table->newest].newer = index;
+    }
+    Table->newest = index;
+    if (Table->oldest < 0) {
+        Table->oldest = index;
+    }
+    return c;
+}
+
+/**
+ * Charge a request to its client.
+ *
+ * @param   r           Request (its client address is used).
+ * @return  true if the request may be served, false if the client is over
+ *          its request rate (answer 429).
+ **/
+bool ratelimit_request(Request *r) {
+    bool allowed = true;
+
+    if (!Table || RateLimit.requests == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&Table->lock);
+    RateClient *c = ratelimit_client((struct sockaddr *)&r->addr);
+    if (c) {
+        if (c->requests >= 1) {
+            c->requests -= 1;
+        } else {
+            allowed = false;
+        }
+    }
+    pthread_mutex_unlock(&Table->lock);
+
+    if (!allowed) {
+        log("Client %s is over its request rate", r->host);
+    }
+    return allowed;
+}
+
+/**
+ * Return how many seconds a client over its request rate should wait.
+ **/
+int ratelimit_retry(void) {
+    if (RateLimit.requests <= 0 || RateLimit.requests >= 1) {
+        return 1;
+    }
+    return (int)(1 / RateLimit.requests + 0.999);
+}
+
+/**
+ * Return the largest body write to pace at once (SIZE_MAX when bandwidth is
+ * not limited): about a twentieth of a second's worth.
+ **/
+size_t ratelimit_slice(void) {
+    if (!Table || RateLimit.bytes == 0) {
+        return SIZE_MAX;
+    }
+    size_t slice = RateLimit.bytes / RATELIMIT_SLICES;
+    return slice < RATELIMIT_SLICE_MIN ? RATELIMIT_SLICE_MIN : slice;
+}
+
+/**
+ * Wait until the request's client may send length more bytes, and charge
+ * them.
+ *
+ * @param   r           Request being answered.
+ * @param   length      Bytes about to be written (at most ratelimit_slice
+ *                      for smooth pacing).
+ *
+ * The wait happens in the coroutine, scheduler worker or forked child
+ * writing the response.  A write made by the event loop itself (e.g. an
+ * error answered before any handler runs) is charged but does not wait:
+ * the client's debt is waited out by its next paced write instead.
+ **/
+void ratelimit_pace(Request *r, size_t length) {
+    uint64_t wait = 0;
+
+    if (!Table || RateLimit.bytes == 0 || length == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&Table->lock);
+    RateClient *c = ratelimit_client((struct sockaddr *)&r->addr);
+    if (c) {
+        c->bytes -= length;
+        if (c->bytes < 0) {
+            wait = (uint64_t)(-c->bytes / RateLimit.bytes * 1e6);
+        }
+    }
+    pthread_mutex_unlock(&Table->lock);
+
+    if (wait && !coroutine_on_loop()) {
+        coroutine_sleep((wait + 999) / 1000);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
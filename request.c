@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
@@ -11,65 +12,62 @@ int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
 
 /**
- * Accept request from server socket.
+ * Accept the next request from a client connection.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   c           Client connection.
+ * @param   length      Length of the request head at the start of c->buffer
+ *                      (0 for a request that never arrived).
  * @return  Newly allocated Request structure.
  *
  * This function does the following:
  *
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
+ *  3. Copies the client socket and address from the connection.
+ *  4. Opens a stream over the buffered request head for the parser.
+ *  5. Notes the bytes buffered after the head (the start of any body).
  *  6. Returns the request struct.
  *
- * The returned request struct must be deallocated using free_request.
+ * The returned request struct must be deallocated using free_request; the
+ * connection keeps ownership of the socket.
  **/
-Request * accept_request(int sfd) {
+Request * accept_request(Connection *c, size_t length) {
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
 
     /* Allocate request struct (zeroed) */
-    if((r = calloc(1, sizeof(Request))) == NULL)
+    if((r = mem_calloc(MEM_REQUEST, 1, sizeof(Request))) == NULL)
     {
         log("Couldn't allocate memory: %s", strerror(errno));
-        goto fail;
-    }
-
-    /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
-    if(r->fd < 0)
-    {
-        log("accept failed: %s", strerror(errno));
-        goto fail;
-    }
-
-    /* Lookup client information */
-    if((getnameinfo(&raddr, rlen, r->host, NI_MAXHOST, r->port, NI_MAXHOST, 0)) < 0)
-    {
-        log("Failed to get client info: %s", strerror(errno));
-        goto fail;
+        return NULL;
     }
 
-    /* Open socket stream */
-    r->file = fdopen(r->fd, "w+");
-    if(!r->file)
+    r->pathfd  = -1;
+    r->content_length = -1;
+    r->body_done = true;
+
+    /* Record client information (hostnames are resolved lazily by
+     * request_hostname so that DNS never delays the accept path) */
+    r->fd      = c->fd;
+    r->addr    = c->addr;
+    r->addrlen = c->addrlen;
+    memcpy(r->host, c->host, sizeof(r->host));
+    memcpy(r->port, c->port, sizeof(r->port));
+
+    /* Open stream over the request head: the event loop has already read it,
+     * so parsing never waits on the socket */
+    if(length > 0 && (r->file = fmemopen(c->buffer, length, "r")) == NULL)
     {
         log("Couldn't open stream: %s", strerror(errno));
-        goto fail;
+        free_request(r);
+        return NULL;
     }
 
-    log("Accepted request from %s:%s", r->host, r->port);
-    return r;
+    /* Whatever follows the head may be the start of its body */
+    r->buffered        = c->buffer + length;
+    r->buffered_length = c->length > length ? c->length - length : 0;
 
-fail:
-    /* Deallocate request struct */
-    free_request(r);
-
-    return NULL;
+    debug("Accepted request from %s:%s", r->host, r->port);
+    return r;
 }
 
 /**
@@ -79,7 +77,7 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request head stream (the connection owns the socket).
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -91,44 +89,71 @@ void free_request(Request *r) {
 
     if(r->method != NULL)
     {
-        free(r->method);
+        mem_free(r->method);
     }
     
     if(r->path != NULL)
     {
-        free(r->path);
+        mem_free(r->path);
     }
 
     if(r->uri != NULL)
     {
-        free(r->uri);
+        mem_free(r->uri);
     }
 
     if(r->query != NULL)
     {
-        free(r->query);
+        mem_free(r->query);
     }
 
-    /* Close socket or fd */
-    if(r->file != NULL)
+    /* Close resource */
+    if(r->pathfd >= 0)
     {
-        fclose(r->file);
+        close(r->pathfd);
     }
-    else if(r->fd > 0)
+
+    /* Close request head stream */
+    if(r->file != NULL)
     {
-        close(r->fd);
+        fclose(r->file);
     }
 
     /* Free headers */
-    for(Header * head = r->headers; head != NULL; )
+    free_headers(r->headers);
+
+    /* Free request */
+    mem_free(r);
+}
+
+/**
+ * Deallocate a list of headers (including their names and values).
+ **/
+void free_headers(Header *headers) {
+    for(Header * head = headers; head != NULL; )
     {
         Header * curr = head;
         head = head->next;
-        free(curr);
+        mem_free(curr->name);
+        mem_free(curr->value);
+        mem_free(curr);
     }
+}
 
-    /* Free request */
-    free(r);
+/**
+ * Look up a request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name (case-insensitive).
+ * @return  Value of the first matching header, or NULL if absent.
+ **/
+const char * request_header(Request *r, const char *name) {
+    for (Header *header = r->headers; header != NULL; header = header->next) {
+        if (strcasecmp(header->name, name) == 0) {
+            return header->value;
+        }
+    }
+    return NULL;
 }
 
 /**
@@ -155,6 +180,29 @@ int parse_request(Request *r) {
         return -1;
     }
 
+    /* Work out how any body is delimited */
+    if(request_body_parse(r) < 0)
+    {
+        return -1;
+    }
+
+    /* HTTP/1.1 connections persist unless the client closes them, HTTP/1.0
+     * ones only when asked (and only once any body has been consumed, see
+     * connection_complete) */
+    const char *connection = request_header(r, "Connection");
+    if(r->version >= 1)
+    {
+        r->keepalive = !(connection && strncasecmp(connection, "close", 5) == 0);
+    }
+    else
+    {
+        r->keepalive = connection && strncasecmp(connection, "keep-alive", 10) == 0;
+    }
+    if(Timeouts.idle <= 0)
+    {
+        r->keepalive = false;
+    }
+
     debug("Request parsed, homeslice");
     return 0;
 }
@@ -181,6 +229,7 @@ int parse_request_method(Request *r) {
     char *method;
     char *uri;
     char *query;
+    char *version;
 
     /* Read line from socket */
     debug("Reading line from socket");
@@ -214,6 +263,13 @@ int parse_request_method(Request *r) {
 
     log("Uri: %s", uri);
 
+    /* Parse protocol version (requests without one are HTTP/0.9-style 1.0) */
+    version = strtok(NULL, " \r");
+    if(version && strncmp(version, "HTTP/1.", 7) == 0)
+    {
+        r->version = atoi(version + 7);
+    }
+
     /* Parse query from uri */
     debug("Parsing query from uri");
     uri = strtok(uri, "?");
@@ -224,15 +280,15 @@ int parse_request_method(Request *r) {
 
     /* Record method, uri, and query in request struct */
     debug("Recording method");
-    r->method = strdup(method);
+    r->method = mem_strdup(MEM_REQUEST, method);
     log("Method: %s", r->method);
 
     debug("Recording uri");
-    r->uri = strdup(uri);
+    r->uri = mem_strdup(MEM_REQUEST, uri);
     log("Uri: %s", r->uri);
 
     debug("Recording query");
-    if(query) r->query = strdup(query);
+    if(query) r->query = mem_strdup(MEM_REQUEST, query);
     else r->query = NULL;
 
     log("Query: %s", r->query);
@@ -316,11 +372,17 @@ int parse_request_headers(Request *r) {
             goto fail;
         }
 
+        if(!header_token(name))
+        {
+            log("Invalid header name: %s", name);
+            goto fail;
+        }
+
         log("Name: %s", name);
 
         // create and allocate header
         debug("Allocate header");
-        if((temp = calloc(1, sizeof(Header))) == NULL)
+        if((temp = mem_calloc(MEM_HEADERS, 1, sizeof(Header))) == NULL)
         {
             log("Couldn't allocate memory: %s", strerror(errno));
             goto fail;
@@ -328,10 +390,10 @@ int parse_request_headers(Request *r) {
         
 
         debug("Allocate name");
-        temp->name = strdup(name);
+        temp->name = mem_strdup(MEM_HEADERS, name);
 
         debug("Allocate value");
-        temp->value = strdup(value);
+        temp->value = mem_strdup(MEM_HEADERS, value);
         
         // if list doesn't have root
         if(r->headers == NULL)
@@ -0,0 +1,277 @@
+/* resolver.c: Asynchronous Client Hostname Resolution */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RESOLVER_SLOTS      1024        /* Cache entries (power of two) */
+#define RESOLVER_PROBES     8           /* Linear probe limit */
+#define RESOLVER_HOSTLEN    256         /* Longest cached hostname */
+#define RESOLVER_TTL        300         /* Seconds a resolved name is trusted */
+#define RESOLVER_NEG_TTL    60          /* Seconds a failed lookup is remembered */
+#define RESOLVER_PENDING    10          /* Seconds before a lost lookup is retried */
+
+/**
+ * Cache entry keyed by client address (without port).
+ *
+ * The cache lives in shared memory so that forked request handlers see names
+ * resolved on behalf of earlier connections.  The resolver process is the
+ * only writer; readers use the sequence number as a seqlock.
+ */
+typedef struct {
+    uint32_t    sequence;               /**< Odd while the entry is being written */
+    uint8_t     family;                 /**< AF_INET or AF_INET6, 0 if empty */
+    uint8_t     state;                  /**< Entry state */
+    uint8_t     address[16];            /**< Raw network address */
+    time_t      expires;                /**< Monotonic expiry (seconds) */
+    char        host[RESOLVER_HOSTLEN]; /**< Resolved hostname */
+} ResolverEntry;
+
+enum {
+    RESOLVER_EMPTY = 0,
+    RESOLVER_PENDING_LOOKUP,
+    RESOLVER_RESOLVED,
+    RESOLVER_FAILED,
+};
+
+/* Globals */
+
+static ResolverEntry *Cache = NULL;
+static int QueueFd = -1;               /* Write end of the lookup queue */
+
+/* Helpers */
+
+static time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Find the slot for an address: its current entry or a slot to replace.
+ *
+ * Only the resolver process calls this: as the sole writer it reads entries
+ * without the seqlock.
+ **/
+static ResolverEntry *cache_slot(uint8_t family, const uint8_t key[16], bool *found) {
+    uint32_t hash = address_hash(family, key);
+    ResolverEntry *victim = NULL;
+    time_t now = monotonic_seconds();
+
+    for (int probe = 0; probe < RESOLVER_PROBES; probe++) {
+        ResolverEntry *e = &Cache[(hash + probe) & (RESOLVER_SLOTS - 1)];
+        if (e->family == family && memcmp(e->address, key, 16) == 0) {
+            *found = true;
+            return e;
+        }
+        if (!victim || e->family == 0 || (victim->family != 0 && e->expires < victim->expires)) {
+            victim = e;
+        }
+        if (e->family == 0 || e->expires < now) {
+            break;
+        }
+    }
+    *found = false;
+    return victim;
+}
+
+/**
+ * Copy an entry consistently with respect to the resolver process.
+ *
+ * @return  Whether the copy is the entry for family and key.
+ *
+ * The address is compared on the copy, never on the live entry: a torn read
+ * could otherwise match one client and return another client's hostname.
+ **/
+static bool cache_read(ResolverEntry *e, uint8_t family, const uint8_t key[16], ResolverEntry *copy) {
+    uint32_t sequence;
+
+    do {
+        sequence = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+        memcpy(copy, e, sizeof(ResolverEntry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || sequence != __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE));
+
+    return copy->family == family && memcmp(copy->address, key, 16) == 0;
+}
+
+static void cache_store(ResolverEntry *e, uint8_t family, const uint8_t key[16], uint8_t state, time_t ttl, const char *host) {
+    __atomic_add_fetch(&e->sequence, 1, __ATOMIC_ACQ_REL);
+    e->family  = family;
+    e->state   = state;
+    e->expires = monotonic_seconds() + ttl;
+    memcpy(e->address, key, 16);
+    snprintf(e->host, sizeof(e->host), "%s", host ? host : "");
+    __atomic_add_fetch(&e->sequence, 1, __ATOMIC_RELEASE);
+}
+
+/* Resolver Process */
+
+/**
+ * Serve lookups from the queue until every writer has gone away.
+ **/
+static void resolver_loop(int rfd) {
+    struct sockaddr_storage addr;
+    char host[NI_MAXHOST];
+
+    while (read(rfd, &addr, sizeof(addr)) == sizeof(addr)) {
+        uint8_t key[16];
+        bool found;
+        socklen_t len = addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+        if (!address_key((struct sockaddr *)&addr, key)) {
+            continue;
+        }
+
+        /* Several connections from one client queue the same address */
+        ResolverEntry *e = cache_slot(addr.ss_family, key, &found);
+        if (found && e->state != RESOLVER_PENDING_LOOKUP && e->expires >= monotonic_seconds()) {
+            continue;
+        }
+
+        /* Handlers that miss while the lookup runs must not queue it again */
+        cache_store(e, addr.ss_family, key, RESOLVER_PENDING_LOOKUP, RESOLVER_PENDING, NULL);
+
+        if (getnameinfo((struct sockaddr *)&addr, len, host, sizeof(host), NULL, 0, NI_NAMEREQD) == 0) {
+            cache_store(e, addr.ss_family, key, RESOLVER_RESOLVED, RESOLVER_TTL, host);
+        } else {
+            cache_store(e, addr.ss_family, key, RESOLVER_FAILED, RESOLVER_NEG_TTL, NULL);
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start the background resolver.
+ *
+ * @return  0 on success, -1 on error (lookups are then disabled).
+ *
+ * Allocates the shared hostname cache and forks a resolver process that reads
+ * client addresses from a pipe, so that request handlers never wait on DNS.
+ **/
+int resolver_start(void) {
+    int fds[2];
+
+    if (!HostnameLookups) {
+        return 0;
+    }
+
+    Cache = mmap(NULL, RESOLVER_SLOTS * sizeof(ResolverEntry), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Cache == MAP_FAILED) {
+        log("Unable to map resolver cache: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        log("Unable to create resolver queue: %s", strerror(errno));
+        goto fail;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork resolver: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        goto fail;
+    }
+
+    if (pid == 0) {
+        close(fds[1]);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        resolver_loop(fds[0]);
+    }
+
+    close(fds[0]);
+    QueueFd = fds[1];
+    /* A full queue drops lookups instead of stalling the accept path */
+    fcntl(QueueFd, F_SETFL, O_NONBLOCK);
+    debug("Resolver started (pid %d)", pid);
+    return 0;
+
+fail:
+    if (Cache && Cache != MAP_FAILED) {
+        munmap(Cache, RESOLVER_SLOTS * sizeof(ResolverEntry));
+    }
+    Cache = NULL;
+    HostnameLookups = false;
+    return -1;
+}
+
+/**
+ * Look up the cached hostname for a client address without blocking.
+ *
+ * @param   sa          Client socket address.
+ * @param   host        Buffer for the hostname.
+ * @param   hostlen     Size of host buffer.
+ * @return  host if a fresh name is cached, otherwise NULL.
+ *
+ * On a miss (or an expired entry) the address is queued for the resolver so
+ * that a later request from the same client finds its name.
+ **/
+const char * resolver_lookup(const struct sockaddr *sa, char *host, size_t hostlen) {
+    uint8_t key[16];
+
+    if (!Cache || QueueFd < 0 || !address_key(sa, key)) {
+        return NULL;
+    }
+
+    /* Probe as cache_slot() does, but only trust stable copies */
+    uint32_t hash = address_hash(sa->sa_family, key);
+    time_t now = monotonic_seconds();
+    for (int probe = 0; probe < RESOLVER_PROBES; probe++) {
+        ResolverEntry entry;
+        if (cache_read(&Cache[(hash + probe) & (RESOLVER_SLOTS - 1)], sa->sa_family, key, &entry)) {
+            if (entry.expires < now) {
+                break;
+            }
+            if (entry.state != RESOLVER_RESOLVED) {
+                return NULL;
+            }
+            snprintf(host, hostlen, "%s", entry.host);
+            return host;
+        }
+        if (entry.family == 0 || entry.expires < now) {
+            break;
+        }
+    }
+
+    /* Queue a lookup; the resolver writes the entry (a pipe write of this
+     * size is atomic, so concurrent handlers cannot interleave). */
+    struct sockaddr_storage addr = {0};
+    memcpy(&addr, sa, sa->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    if (write(QueueFd, &addr, sizeof(addr)) < 0 && errno != EAGAIN) {
+        debug("Unable to queue lookup: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+/**
+ * Return the client's hostname if known, otherwise its numeric address.
+ *
+ * @param   r           Request structure.
+ * @return  Hostname (resolved lazily through the cache) or r->host.
+ **/
+const char * request_hostname(Request *r) {
+    if (r->hostname[0] == '\0' && HostnameLookups) {
+        resolver_lookup((struct sockaddr *)&r->addr, r->hostname, sizeof(r->hostname));
+    }
+    return r->hostname[0] ? r->hostname : r->host;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
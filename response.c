@@ -0,0 +1,446 @@
+/* response.c: HTTP Response Builder */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Begin a response.
+ *
+ * @param   res         Response structure.
+ * @param   r           Request being answered.
+ * @param   status      HTTP status of the response.
+ *
+ * Writes the status line (from http_status_string) and a Date header into the
+ * preallocated header buffer.
+ **/
+void response_init(Response *res, Request *r, HTTPStatus status) {
+    response_init_status(res, r, http_status_string(status));
+    res->status = status;
+}
+
+/**
+ * Begin a response with a status given as text (e.g. "302 Found" from a CGI
+ * script) rather than one of the known HTTPStatus values.
+ *
+ * HTTP/1.1 clients get an HTTP/1.1 status line: chunked framing and
+ * keep-alive under an HTTP/1.0 one would make them close the connection.
+ **/
+void response_init_status(Response *res, Request *r, const char *status) {
+    res->request       = r;
+    res->status        = HTTP_STATUS_OK;
+    res->length        = 0;
+    res->overflow      = false;
+    res->streaming     = false;
+    res->chunked       = false;
+    res->head          = !r->stream && r->method && streq(r->method, "HEAD");
+    res->body          = NULL;
+    res->body_length   = 0;
+    res->body_capacity = 0;
+
+    response_header(res, NULL, "HTTP/1.%d %s", r->version >= 1, status);
+    response_date(res);
+}
+
+/**
+ * Declare a body whose length is not known in advance: HTTP/1.1 clients get
+ * it chunked, HTTP/1.0 clients get it delimited by closing the connection.
+ **/
+void response_stream(Response *res) {
+    res->streaming = true;
+    if (res->request->stream) {
+        return;         /* HTTP/2 DATA frames delimit the body */
+    }
+    res->chunked   = res->request->version >= 1;
+    if (!res->chunked) {
+        res->request->keepalive = false;
+    }
+}
+
+/**
+ * Append a header line.
+ *
+ * @param   res         Response structure.
+ * @param   name        Header name (NULL writes the formatted text verbatim).
+ * @param   format      printf-style format of the header value.
+ *
+ * Headers that do not fit in the buffer are dropped and logged.
+ **/
+void response_header(Response *res, const char *name, const char *format, ...) {
+    char *start = res->headers + res->length;
+    size_t space = RESPONSE_HEADERS_MAX - res->length;
+    int n = 0, m;
+    va_list args;
+
+    if (name) {
+        n = snprintf(start, space, "%s: ", name);
+        if (n < 0 || (size_t)n >= space) goto overflow;
+    }
+
+    va_start(args, format);
+    m = vsnprintf(start + n, space - n, format, args);
+    va_end(args);
+    if (m < 0 || (size_t)(n + m + 2) >= space) goto overflow;
+
+    memcpy(start + n + m, "\r\n", 2);
+    res->length += n + m + 2;
+    return;
+
+overflow:
+    res->headers[res->length] = '\0';
+    res->overflow = true;
+    log("Response header %s does not fit", name ? name : format);
+}
+
+void response_content_type(Response *res, const char *mimetype) {
+    response_header(res, "Content-Type", "%s", mimetype);
+}
+
+void response_content_length(Response *res, size_t length) {
+    response_header(res, "Content-Length", "%zu", length);
+}
+
+/**
+ * Append a Date header; the formatted date is cached for the current second.
+ **/
+void response_date(Response *res) {
+    static __thread time_t cached_time = 0;
+    static __thread char   cached_date[64];
+    time_t now = time(NULL);
+
+    if (now != cached_time) {
+        http_date(now, cached_date, sizeof(cached_date));
+        cached_time = now;
+    }
+    response_header(res, "Date", "%s", cached_date);
+}
+
+void response_connection(Response *res) {
+    response_header(res, "Connection", "%s", res->request->keepalive ? "keep-alive" : "close");
+}
+
+void response_last_modified(Response *res, time_t mtime) {
+    char date[64];
+    http_date(mtime, date, sizeof(date));
+    response_header(res, "Last-Modified", "%s", date);
+}
+
+void response_cache_control(Response *res, const char *policy) {
+    response_header(res, "Cache-Control", "%s", policy);
+}
+
+/**
+ * Append the ETag and Last-Modified validators for a static file.
+ **/
+void response_validators(Response *res, const char *etag, time_t mtime) {
+    response_header(res, "ETag", "%s", etag);
+    response_last_modified(res, mtime);
+}
+
+/**
+ * Append formatted text to the response body.
+ *
+ * @return  Number of bytes appended, or -1 on allocation failure.
+ **/
+int response_append(Response *res, const char *format, ...) {
+    va_list args;
+    int n;
+
+    while (true) {
+        size_t space = res->body_capacity - res->body_length;
+        va_start(args, format);
+        n = vsnprintf(res->body ? res->body + res->body_length : NULL, space, format, args);
+        va_end(args);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < space) {
+            res->body_length += n;
+            return n;
+        }
+        if (response_reserve(res, n + 1) < 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Ensure the body buffer has room for at least size more bytes.
+ **/
+int response_reserve(Response *res, size_t size) {
+    if (res->body_capacity - res->body_length >= size) {
+        return 0;
+    }
+    size_t capacity = res->body_capacity ? res->body_capacity : RESPONSE_BODY_INITIAL;
+    while (capacity - res->body_length < size) {
+        capacity *= 2;
+    }
+    MemTag tag = res->request->kind == INDEX_DIR ? MEM_BROWSE : MEM_RESPONSE;
+    char *body = mem_realloc(tag, res->body, capacity);
+    if (!body) {
+        log("Unable to grow response body: %s", strerror(errno));
+        return -1;
+    }
+    res->body = body;
+    res->body_capacity = capacity;
+    return 0;
+}
+
+/**
+ * A response that was not delivered whole leaves the connection unusable.
+ **/
+static ssize_t response_check(Response *res, ssize_t written) {
+    if (written < 0) {
+        log("Unable to send response: %s", strerror(errno));
+        res->request->keepalive = false;
+    }
+    return written;
+}
+
+/**
+ * Terminate the header block with framing headers.
+ **/
+static void response_finish(Response *res, size_t content_length) {
+    if (res->chunked) {
+        response_header(res, "Transfer-Encoding", "%s", "chunked");
+    } else if (!res->streaming && res->status != HTTP_STATUS_NOT_MODIFIED) {
+        /* An unchunked stream ends when the connection closes; a 304 has no
+         * body, and its length would describe the cached entity */
+        response_content_length(res, content_length);
+    }
+    response_connection(res);
+    response_header(res, NULL, "%s", "");
+}
+
+/**
+ * Send headers and body with a single writev.
+ *
+ * @param   res         Response structure.
+ * @param   body        Body to send, or NULL to send the appended body.
+ * @param   length      Length of body.
+ * @return  Number of bytes written, or -1 on error.
+ *
+ * Content-Length and Connection are added automatically.  The answer to a
+ * HEAD request keeps the Content-Length but leaves out the body, which a
+ * kept-alive client would otherwise read as the start of the next response.
+ **/
+ssize_t response_send(Response *res, const void *body, size_t length) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (!body) {
+        body   = res->body;
+        length = res->body_length;
+    }
+
+    response_finish(res, length);
+
+    if (res->request->stream) {
+        /* HTTP/2: the header block becomes a HEADERS frame, the body DATA */
+        ssize_t written = http2_send_headers(res->request, res->headers, res->length, length == 0);
+        if (written >= 0 && length) {
+            written = http2_send_data(res->request, body, length, true);
+        }
+        res->length = 0;
+        res->body_length = 0;
+        return response_check(res, written);
+    }
+
+    if (res->length) {
+        iov[iovcnt++] = (struct iovec){ res->headers, res->length };
+    }
+    if (length && !res->head) {
+        iov[iovcnt++] = (struct iovec){ (void *)body, length };
+    }
+    res->length = 0;
+    res->body_length = 0;
+    return response_check(res, iovcnt ? socket_writev(res->request->fd, iov, iovcnt) : 0);
+}
+
+/**
+ * Send the headers alone, ahead of a body the caller sends itself (e.g.
+ * relayed from an upstream with splice) or of none.
+ *
+ * @param   res         Response structure.
+ * @param   length      Content-Length of the body to follow, or -1 for a
+ *                      response without one (HEAD, 204, 304) whose framing
+ *                      headers the caller has set.
+ * @return  Number of bytes written, or -1 on error.
+ **/
+ssize_t response_send_head(Response *res, int64_t length) {
+    ssize_t written;
+
+    res->streaming = true;      /* response_finish adds no Content-Length */
+    if (length >= 0) {
+        response_content_length(res, length);
+    }
+    response_finish(res, 0);
+
+    if (res->request->stream) {
+        written = http2_send_headers(res->request, res->headers, res->length, length <= 0);
+    } else if (length > 0) {
+        written = socket_send_more(res->request->fd, res->headers, res->length);
+    } else {
+        struct iovec iov = { res->headers, res->length };
+        written = socket_writev(res->request->fd, &iov, 1);
+    }
+    res->length = 0;
+    return response_check(res, written);
+}
+
+/**
+ * Send headers followed by the contents of a file.
+ *
+ * @param   res         Response structure.
+ * @param   fd          Open file descriptor.
+ * @param   offset      Offset of the first byte to send.
+ * @param   size        Number of bytes to send.
+ * @return  Number of bytes written, or -1 on error.
+ *
+ * Small files are read into memory and sent with the headers in one writev;
+ * larger files send the headers with MSG_MORE and the body with sendfile.
+ * With a bandwidth limit (-q bytes=...) the body is paced in slices.
+ **/
+ssize_t response_send_file(Response *res, int fd, off_t offset, size_t size) {
+    if (res->head) {
+        return response_send(res, "", size);    /* Content-Length alone */
+    }
+    if (size <= RESPONSE_INLINE_MAX) {
+        char buffer[RESPONSE_INLINE_MAX];
+        size_t total = 0;
+        while (total < size) {
+            /* pread: indexed descriptors are shared by every request */
+            ssize_t n = pread(fd, buffer + total, size - total, offset + total);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            total += n;
+        }
+        if (total < size) {
+            log("Short read of file: %s", strerror(errno));
+            return response_check(res, -1);
+        }
+        ratelimit_pace(res->request, size);
+        return response_send(res, buffer, size);
+    }
+
+    response_finish(res, size);
+    if (res->request->stream) {
+        ssize_t header = http2_send_headers(res->request, res->headers, res->length, false);
+        res->length = 0;
+        return response_check(res, header < 0 ? -1 : http2_send_file(res->request, fd, offset, size));
+    }
+
+    ssize_t header = socket_send_more(res->request->fd, res->headers, res->length);
+    res->length = 0;
+    if (header < 0) {
+        return response_check(res, -1);
+    }
+
+    size_t slice = ratelimit_slice();
+    ssize_t body = 0;
+    while ((size_t)body < size) {
+        size_t n = size - body < slice ? size - body : slice;
+        ratelimit_pace(res->request, n);
+        ssize_t sent = socket_sendfile(res->request->fd, fd, &offset, n);
+        if (sent < 0 || (size_t)sent < n) {
+            body = -1;  /* Framing promised more than was sent */
+            break;
+        }
+        body += sent;
+    }
+    return response_check(res, body < 0 ? -1 : header + body);
+}
+
+/**
+ * Send part of a streamed body (see response_stream), preceded by the
+ * headers if they have not been sent yet.
+ *
+ * @param   res         Response structure.
+ * @param   data        Body bytes.
+ * @param   length      Number of bytes (0 sends nothing but pending headers).
+ * @return  Number of bytes written, or -1 on error.
+ *
+ * Headers, chunk framing and data leave in a single writev (paced to the
+ * client's bandwidth limit).
+ **/
+ssize_t response_send_chunk(Response *res, const void *data, size_t length) {
+    struct iovec iov[4];
+    char size[32];
+    int iovcnt = 0;
+
+    if (res->head) {
+        length = 0;
+    }
+    ratelimit_pace(res->request, length);
+    if (res->request->stream) {
+        ssize_t written = 0;
+        if (res->length) {
+            response_finish(res, 0);
+            written = http2_send_headers(res->request, res->headers, res->length, false);
+            res->length = 0;
+        }
+        if (written >= 0 && length) {
+            written = http2_send_data(res->request, data, length, false);
+        }
+        return response_check(res, written);
+    }
+
+    if (res->length) {
+        response_finish(res, 0);
+        iov[iovcnt++] = (struct iovec){ res->headers, res->length };
+        res->length = 0;
+    }
+    if (length) {
+        if (res->chunked) {
+            int n = snprintf(size, sizeof(size), "%zx\r\n", length);
+            iov[iovcnt++] = (struct iovec){ size, n };
+        }
+        iov[iovcnt++] = (struct iovec){ (void *)data, length };
+        if (res->chunked) {
+            iov[iovcnt++] = (struct iovec){ "\r\n", 2 };
+        }
+    }
+    return response_check(res, iovcnt ? socket_writev(res->request->fd, iov, iovcnt) : 0);
+}
+
+/**
+ * Finish a streamed body: send any pending headers and the last chunk.
+ **/
+ssize_t response_end(Response *res) {
+    if (res->request->stream) {
+        /* HTTP/2 ends the stream on the headers or with an empty DATA frame */
+        ssize_t written;
+        if (res->length) {
+            response_finish(res, 0);
+            written = http2_send_headers(res->request, res->headers, res->length, true);
+            res->length = 0;
+        } else {
+            written = http2_send_data(res->request, NULL, 0, true);
+        }
+        return response_check(res, written);
+    }
+
+    ssize_t written = response_send_chunk(res, NULL, 0);
+    if (written >= 0 && res->chunked && !res->head) {
+        struct iovec iov = { "0\r\n\r\n", 5 };
+        written = response_check(res, socket_writev(res->request->fd, &iov, 1));
+    }
+    return written;
+}
+
+/**
+ * Release the body buffer.
+ **/
+void response_free(Response *res) {
+    mem_free(res->body);
+    res->body = NULL;
+    res->body_length = res->body_capacity = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
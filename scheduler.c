@@ -0,0 +1,297 @@
+/* scheduler.c: Request Scheduling Lanes */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Constants */
+
+static const char *LaneNames[LANE_COUNT] = { "cached", "static", "browse", "cgi" };
+
+/**
+ * Queue and accounting of one lane.
+ *
+ * Lanes are served by start-time fair queueing: a lane's virtual time grows
+ * by the worker time it used divided by its weight, and a free worker takes
+ * the oldest request of the eligible (non-empty, under cap) lane with the
+ * smallest virtual time.
+ */
+typedef struct {
+    Connection *head;                   /**< Oldest queued connection */
+    Connection *tail;                   /**< Newest queued connection */
+    size_t      queued;                 /**< Requests waiting */
+    int         running;                /**< Requests being served */
+    uint64_t    vtime;                  /**< Weighted worker time used (ns) */
+} LaneQueue;
+
+/* Globals */
+
+static LaneQueue        Queues[LANE_COUNT];
+static pthread_mutex_t  Lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   Ready  = PTHREAD_COND_INITIALIZER;
+static Connection      *Done   = NULL;  /* Served connections for the event loop */
+static int              WakeFd = -1;    /* Signals the event loop about Done */
+
+/**
+ * Parse a scheduler profile.
+ *
+ * @param   spec        Comma-separated options, e.g.
+ *                      "workers=8,cached=0:8,static=2:2,browse=2:1,cgi=2:1"
+ *                      where each lane takes cap[:weight] (cap 0 = no cap).
+ * @return  true if every option was understood, false otherwise.
+ **/
+bool scheduler_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *option = strtok_r(copy, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        char *end   = NULL;
+
+        if (!value) {
+            fprintf(stderr, "Missing value for scheduler option %s\n", option);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+
+        if (streq(option, "workers")) {
+            long workers = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || workers < 0 || workers > SCHEDULER_WORKERS_MAX) {
+                fprintf(stderr, "Invalid number of workers %s\n", value);
+                ok = false;
+                break;
+            }
+            Scheduler.workers = workers;
+            continue;
+        }
+
+        int lane;
+        for (lane = 0; lane < LANE_COUNT && !streq(option, LaneNames[lane]); lane++);
+        if (lane == LANE_COUNT) {
+            fprintf(stderr, "Unknown scheduler option %s\n", option);
+            ok = false;
+            break;
+        }
+
+        long cap = strtol(value, &end, 10);
+        long weight = Scheduler.lanes[lane].weight;
+        bool valid = end != value && cap >= 0;
+        if (valid && *end == ':') {
+            char *start = end + 1;
+            weight = strtol(start, &end, 10);
+            valid = end != start;
+        }
+        if (!valid || *end != '\0' || weight < 1 || weight > 1000) {
+            fprintf(stderr, "Invalid lane %s=%s\n", option, value);
+            ok = false;
+            break;
+        }
+        Scheduler.lanes[lane].cap    = cap;
+        Scheduler.lanes[lane].weight = weight;
+    }
+
+    free(copy);
+    return ok;
+}
+
+/**
+ * Take the next request to serve, or NULL if no lane is eligible.
+ * Called with Lock held.
+ **/
+static Connection *scheduler_pick(void) {
+    LaneQueue *best = NULL;
+
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        LaneQueue *q = &Queues[lane];
+        int cap = Scheduler.lanes[lane].cap;
+        if (!q->head || (cap && q->running >= cap)) {
+            continue;
+        }
+        if (!best || q->vtime < best->vtime) {
+            best = q;
+        }
+    }
+    if (!best) {
+        return NULL;
+    }
+
+    Connection *c = best->head;
+    if (!(best->head = c->next)) {
+        best->tail = NULL;
+    }
+    c->next = NULL;
+    best->queued--;
+    best->running++;
+    return c;
+}
+
+/**
+ * Worker thread: serve requests lane by lane and hand their connections back
+ * to the event loop (pinned with --cpus).
+ **/
+static void *scheduler_worker(void *arg) {
+    affinity_pin_thread((int)(intptr_t)arg);
+
+    pthread_mutex_lock(&Lock);
+    while (true) {
+        Connection *c;
+        while ((c = scheduler_pick()) == NULL) {
+            pthread_cond_wait(&Ready, &Lock);
+        }
+        pthread_mutex_unlock(&Lock);
+
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        connection_run(c);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        uint64_t elapsed = (uint64_t)(stop.tv_sec - start.tv_sec) * 1000000000ull + stop.tv_nsec - start.tv_nsec;
+
+        pthread_mutex_lock(&Lock);
+        LaneQueue *q = &Queues[c->lane];
+        q->running--;
+        q->vtime += elapsed / Scheduler.lanes[c->lane].weight;
+
+        c->next = Done;
+        Done = c;
+        if (q->head) {
+            pthread_cond_signal(&Ready);    /* A capped lane has room again */
+        }
+
+        uint64_t one = 1;
+        if (write(WakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log("Unable to wake event loop: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the worker threads.
+ *
+ * @return  Descriptor that becomes readable when served connections are
+ *          waiting in scheduler_completed, or -1 if the scheduler is
+ *          disabled or could not start (requests are then served on the
+ *          event loop).
+ **/
+int scheduler_start(void) {
+    if (Scheduler.workers == 0) {
+        return -1;
+    }
+    if ((WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        log("Unable to create scheduler eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < Scheduler.workers; i++) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int status = pthread_create(&thread, &attr, scheduler_worker, (void *)(intptr_t)i);
+        pthread_attr_destroy(&attr);
+        if (status != 0) {
+            log("Unable to start scheduler worker: %s", strerror(status));
+            if (i == 0) {
+                close(WakeFd);
+                WakeFd = -1;
+                return -1;
+            }
+            Scheduler.workers = i;
+            break;
+        }
+    }
+
+    log("Scheduling requests on %d workers (cached=%d:%d static=%d:%d browse=%d:%d cgi=%d:%d)",
+        Scheduler.workers,
+        Scheduler.lanes[LANE_CACHED].cap, Scheduler.lanes[LANE_CACHED].weight,
+        Scheduler.lanes[LANE_STATIC].cap, Scheduler.lanes[LANE_STATIC].weight,
+        Scheduler.lanes[LANE_BROWSE].cap, Scheduler.lanes[LANE_BROWSE].weight,
+        Scheduler.lanes[LANE_CGI].cap,    Scheduler.lanes[LANE_CGI].weight);
+    return WakeFd;
+}
+
+bool scheduler_active(void) {
+    return WakeFd >= 0;
+}
+
+/**
+ * Queue a connection whose prepared request is in c->request.
+ *
+ * @param   c           Connection (owned by the scheduler until it is
+ *                      returned by scheduler_completed).
+ * @param   lane        Lane of the request.
+ **/
+void scheduler_submit(Connection *c, Lane lane) {
+    pthread_mutex_lock(&Lock);
+    LaneQueue *q = &Queues[lane];
+
+    /* A lane that was idle starts level with the least served busy lane
+     * rather than spending credit it banked while it had nothing to do */
+    if (!q->head && q->running == 0) {
+        uint64_t floor = 0;
+        bool busy = false;
+        for (int other = 0; other < LANE_COUNT; other++) {
+            LaneQueue *o = &Queues[other];
+            if (o != q && (o->head || o->running) && (!busy || o->vtime < floor)) {
+                floor = o->vtime;
+                busy  = true;
+            }
+        }
+        if (busy && q->vtime < floor) {
+            q->vtime = floor;
+        }
+    }
+
+    c->lane = lane;
+    c->next = NULL;
+    if (q->tail) {
+        q->tail->next = c;
+    } else {
+        q->head = c;
+    }
+    q->tail = c;
+    q->queued++;
+
+    pthread_cond_signal(&Ready);
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Return how many requests are waiting in a lane.
+ **/
+size_t scheduler_queued(Lane lane) {
+    pthread_mutex_lock(&Lock);
+    size_t queued = Queues[lane].queued;
+    pthread_mutex_unlock(&Lock);
+    return queued;
+}
+
+/**
+ * Collect the connections workers have finished with (event loop only).
+ *
+ * @return  List of connections linked by next, or NULL.
+ **/
+Connection * scheduler_completed(void) {
+    uint64_t count;
+    if (read(WakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log("Unable to read scheduler eventfd: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&Lock);
+    Connection *list = Done;
+    Done = NULL;
+    pthread_mutex_unlock(&Lock);
+    return list;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,40 +3,294 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 
+#include <sys/epoll.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define SINGLE_EVENTS_MAX   64
+
+/* Globals */
+
+static int          EventFd = -1;
+static int          WakeFd  = -1;       /* Scheduler workers hand connections back */
+static int          YieldFd = -1;       /* Coroutines waiting on descriptors */
+static TimerWheel   Wheel;
+static int         *Listeners = NULL;
+static size_t       ListenerCount = 0;
+static Connection  *Newest  = NULL;     /* Open connections, most recently accepted first */
+
+/**
+ * Add a connection to the list of open ones.
+ **/
+static void single_track(Connection *c) {
+    c->newer = NULL;
+    c->older = Newest;
+    if (Newest) {
+        Newest->newer = c;
+    }
+    Newest = c;
+}
+
+/**
+ * Take a connection off the list of open ones and close it.
+ **/
+static void single_free(Connection *c) {
+    if (c->newer) {
+        c->newer->older = c->older;
+    } else {
+        Newest = c->older;
+    }
+    if (c->older) {
+        c->older->newer = c->newer;
+    }
+    connection_free(c);
+}
+
+/**
+ * Stop watching a connection and close it.
+ **/
+static void single_close(Connection *c) {
+    epoll_ctl(EventFd, EPOLL_CTL_DEL, c->fd, NULL);
+    single_free(c);
+}
+
+/**
+ * Deadline callback: time out the connection that owns the timer.
+ **/
+static void single_expire(Timer *timer) {
+    Connection *c = (Connection *)((char *)timer - offsetof(Connection, timer));
+    connection_expire(c);
+    single_close(c);
+}
+
+/**
+ * Re-arm a waiting connection's timer for its current deadline.
+ **/
+static void single_schedule(Connection *c) {
+    if (c->deadline) {
+        timer_add(&Wheel, &c->timer, c->deadline);
+    } else {
+        timer_cancel(&c->timer);
+    }
+}
+
+/**
+ * Act on what processing a connection left it waiting for.
+ *
+ * @param   c           Connection.
+ * @param   state       Result of connection_process or connection_resume.
+ * @param   watched     Whether the connection is registered with epoll.
+ **/
+static void single_update(Connection *c, ConnectionState state, bool watched) {
+    switch (state) {
+        case CONNECTION_CLOSE:
+            if (watched) {
+                epoll_ctl(EventFd, EPOLL_CTL_DEL, c->fd, NULL);
+            }
+            single_free(c);
+            break;
+        case CONNECTION_BUSY:
+            /* A worker (or a suspended coroutine) owns the connection until
+             * it is handed back */
+            if (watched) {
+                epoll_ctl(EventFd, EPOLL_CTL_DEL, c->fd, NULL);
+            }
+            timer_cancel(&c->timer);
+            break;
+        default:
+            if (!watched) {
+                struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+                if (epoll_ctl(EventFd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+                    log("Unable to watch connection: %s", strerror(errno));
+                    single_free(c);
+                    break;
+                }
+            }
+            single_schedule(c);
+            break;
+    }
+}
+
 /**
- * Handle one HTTP request at a time.
+ * Leave a forked child of the event loop with nothing of the loop's but
+ * the connection it serves.
+ *
+ * @param   keep        Connection handed to the child.
+ *
+ * Every other connection's socket, the listeners and the loop's epoll,
+ * scheduler and coroutine descriptors are closed, so that the parent
+ * closing a connection reaches its client at once rather than when the
+ * child exits.  Idle upstream connections stay the parent's too.
+ **/
+void single_forked(Connection *keep) {
+    for (Connection *c = Newest; c; c = c->older) {
+        if (c != keep && c->fd >= 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+    for (size_t i = 0; i < ListenerCount; i++) {
+        close(Listeners[i]);
+    }
+    ListenerCount = 0;
+    if (WakeFd >= 0) {
+        close(WakeFd);
+        WakeFd = -1;
+    }
+    coroutine_stop();
+    YieldFd = -1;
+    close(EventFd);
+    EventFd = -1;
+    proxy_forked();
+}
+
+/**
+ * Handle HTTP requests from many connections in one process.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Connections are multiplexed with epoll and only handed to handle_request
+ * once a whole request head has arrived, so a client that connects and then
+ * stalls cannot hold up everyone else.  Header and keep-alive deadlines are
+ * kept in a timer wheel.
+ *
+ * With a scheduler profile (-s), resolved requests are queued by lane and
+ * served by worker threads, and the event loop takes their connections back
+ * for keep-alive once the response is sent.
+ *
+ * With --coroutines (and no scheduler workers), each resolved request is
+ * served by a coroutine that yields to the loop whenever its socket, pipe or
+ * rate limit would block, and the loop resumes it once the descriptor is
+ * ready (or its deadline passes in the same timer wheel).  Bandwidth limits
+ * (-q bytes=) turn coroutines on when there are no workers.
+ *
+ * With a CPU list (--cpus), one such event loop runs per CPU, pinned to it
+ * and accepting from its own listeners (see affinity_spawn).
  **/
 int single_server(int sfd) {
-    /* Accept and handle HTTP request */
+    struct epoll_event events[SINGLE_EVENTS_MAX];
+
     if (sfd < 0) {
         return EXIT_FAILURE;
     }
-    while (true) {
-    	/* Accept request */
-        Request* client = NULL;
-        if ((client = accept_request(sfd)) == NULL) {
-            log("Accept_request failed!");
+    if (Affinity.count > 0 && affinity_spawn() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int   *listeners = ListenCount ? ListenFds : &sfd;
+    size_t nlisteners = ListenCount ? ListenCount : 1;
+    Listeners     = listeners;
+    ListenerCount = nlisteners;
+
+    if ((EventFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        log("Unable to create epoll instance: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    timer_wheel_init(&Wheel, timer_now());
+
+    /* Paced writes (-q bytes=) wait out their client's debt, which only a
+     * worker thread or a coroutine can do without stalling the loop */
+    if (RateLimit.bytes > 0 && Scheduler.workers == 0 && CoroutineStack == 0) {
+        log("Pacing client bandwidth: running handlers as coroutines");
+        CoroutineStack = COROUTINE_STACK_DEFAULT;
+    }
+
+    if ((WakeFd = scheduler_start()) >= 0) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &WakeFd };
+        if (epoll_ctl(EventFd, EPOLL_CTL_ADD, WakeFd, &event) < 0) {
+            log("Unable to watch scheduler: %s", strerror(errno));
             return EXIT_FAILURE;
         }
+    }
 
-        /* Handle request */
-        debug("Accept success!");
-        handle_request(client);
-        debug("Handle success!");
+    if (!scheduler_active() && (YieldFd = coroutine_start(&Wheel)) >= 0) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &YieldFd };
+        if (epoll_ctl(EventFd, EPOLL_CTL_ADD, YieldFd, &event) < 0) {
+            log("Unable to watch coroutines: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
 
-	/* Free request */
-        free_request(client);
+    /* Listeners are registered by address of their fd, connections by pointer */
+    for (size_t i = 0; i < nlisteners; i++) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listeners[i] };
+        if (epoll_ctl(EventFd, EPOLL_CTL_ADD, listeners[i], &event) < 0) {
+            log("Unable to watch listener: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
     }
 
-    /* Close server socket */
-    close(sfd);
+    while (true) {
+        int n = epoll_wait(EventFd, events, SINGLE_EVENTS_MAX, timer_timeout(&Wheel));
+        if (n < 0 && errno != EINTR) {
+            log("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            /* Accept new connections */
+            if ((int *)ptr >= listeners && (int *)ptr < listeners + nlisteners) {
+                Connection *c;
+                while ((c = connection_accept(*(int *)ptr)) != NULL) {
+                    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+                    single_track(c);
+                    if (epoll_ctl(EventFd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+                        log("Unable to watch connection: %s", strerror(errno));
+                        single_free(c);
+                        continue;
+                    }
+                    c->timer.callback = single_expire;
+                    single_schedule(c);
+                }
+                continue;
+            }
+
+            /* Carry on with connections whose requests workers have served */
+            if (ptr == &WakeFd) {
+                Connection *c = scheduler_completed();
+                while (c) {
+                    Connection *next = c->next;
+                    single_update(c, connection_resume(c), false);
+                    c = next;
+                }
+                continue;
+            }
+
+            /* Coroutines are resumed below, once deadlines are known too */
+            if (ptr == &YieldFd) {
+                continue;
+            }
+
+            /* Read and handle requests */
+            Connection *c = ptr;
+            single_update(c, connection_process(c), true);
+        }
+
+        timer_advance(&Wheel, timer_now());
+
+        /* Resume coroutines whose waits are over; take back the connections
+         * of those that are done */
+        if (YieldFd >= 0) {
+            Connection *c;
+            coroutine_run();
+            while ((c = coroutine_finished()) != NULL) {
+                single_update(c, connection_resume(c), false);
+            }
+        }
+    }
+
+    /* Close server sockets */
+    close(EventFd);
+    for (size_t i = 0; i < nlisteners; i++) {
+        close(listeners[i]);
+    }
     return EXIT_SUCCESS;
 }
 
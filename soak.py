@@ -0,0 +1,382 @@
+#!/usr/bin/env python3
+
+import json
+import os
+import platform
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Globals
+
+ROOT        = os.path.dirname(os.path.abspath(__file__))
+SPIDEY      = os.path.join(ROOT, 'spidey')
+THOR        = os.path.join(ROOT, 'thor')
+ALLOCATOR   = os.path.join(ROOT, 'soakalloc.so')
+WWW         = os.path.join(ROOT, 'www')
+
+# Modes: name -> spidey arguments
+MODES       = {
+    'single':   ['-c', 'single'],
+    'forking':  ['-c', 'forking'],
+    'workers':  ['-c', 'single', '-s', 'workers=4'],
+    'index':    ['-c', 'single', '--index'],
+}
+SELECTED    = list(MODES)
+REQUESTS    = 1000000
+ROUND       = 20000
+CONCURRENCY = 8
+TIMEOUT     = 60
+WARMUP      = 0.10
+THRESHOLD   = 0.10
+RSS_SLACK   = 2048          # KB of growth always tolerated
+FD_SLACK    = 4
+LEAK_SLACK  = 64            # Live blocks a call site may gain
+TRACK       = True
+OUTPUT      = os.path.join(ROOT, 'soak_output.json')
+
+# Mix: (uri, weight); {round} makes every round miss different paths
+MIX = [
+    ('/html/index.html',         8),
+    ('/html/1k.txt',             4),
+    ('/text/hackers.txt',        4),
+    ('/',                        2),
+    ('/text',                    2),
+    ('/scripts/env.sh',          1),
+    ('/missing/{round}.php',     2),
+]
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [options]
+    -h              Display help message
+    -m MODES        Comma separated modes ({})
+    -n REQUESTS     Requests per mode ({})
+    -r ROUND        Requests between samples ({})
+    -c CONNS        Concurrent connections ({})
+    -t THRESHOLD    Allowed anonymous RSS growth after warm-up as a fraction ({})
+    -A              Do not preload the allocation tracker
+    -o PATH         Results file ({})
+    '''.format(os.path.basename(sys.argv[0]), ','.join(MODES), REQUESTS, ROUND, CONCURRENCY,
+               THRESHOLD, os.path.relpath(OUTPUT)))
+    sys.exit(status)
+
+def make_fixtures(workspace):
+    ''' Copy www into workspace and add a small text fixture. '''
+    root = os.path.join(workspace, 'www')
+    shutil.copytree(WWW, root, symlinks=True)
+    with open(os.path.join(root, 'html', '1k.txt'), 'wb') as fs:
+        fs.write(b'Spidey soak fixture: 0123456789abcdefghijklmnopqrstuvwxyz\n' * 17)
+    return root
+
+def free_port():
+    ''' Ask the kernel for an unused loopback port. '''
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def wait_for_port(port, deadline=5.0):
+    end = time.time() + deadline
+    while time.time() < end:
+        try:
+            with socket.create_connection(('127.0.0.1', port), timeout=0.2):
+                return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+def start_spidey(mode, root, port, log, report):
+    command = [SPIDEY, '-r', root, '-p', str(port)] + MODES[mode]
+    env     = dict(os.environ)
+    if report:
+        env['LD_PRELOAD']        = ALLOCATOR
+        env['SOAK_ALLOC_REPORT'] = report
+    server  = subprocess.Popen(command, stdout=log, stderr=log, env=env)
+    if not wait_for_port(port):
+        server.kill()
+        server.wait()
+        sys.exit('Unable to start {}'.format(' '.join(command)))
+    time.sleep(0.1)
+    return server
+
+def stop_spidey(server):
+    server.terminate()
+    try:
+        server.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+def run_thor(port, uri, requests, keepalive):
+    command = [THOR, '-j', '-c', str(CONCURRENCY), '-n', str(requests), '-t', str(TIMEOUT)]
+    if keepalive:
+        command.append('-k')
+    command.append('http://127.0.0.1:{}{}'.format(port, uri))
+
+    try:
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                                timeout=TIMEOUT * 2)
+        report = json.loads(result.stdout.decode())
+    except (subprocess.TimeoutExpired, ValueError):
+        return requests
+    return sum(report['errors'].values())
+
+# Sampling
+
+def children(pid):
+    ''' Count processes whose parent is pid. '''
+    count = 0
+    for entry in os.listdir('/proc'):
+        if not entry.isdigit():
+            continue
+        try:
+            with open('/proc/{}/stat'.format(entry)) as fs:
+                fields = fs.read().rsplit(')', 1)[1].split()
+        except OSError:
+            continue
+        if int(fields[1]) == pid:
+            count += 1
+    return count
+
+def sample(pid):
+    ''' Resident set (KB, and its private anonymous part), open descriptors and
+    children of the server. Shared tables (e.g. the negative cache) are
+    touched gradually but are bounded, so growth is judged on anon_kb. '''
+    rss = anon = 0
+    with open('/proc/{}/status'.format(pid)) as fs:
+        for line in fs:
+            if line.startswith('VmRSS:'):
+                rss = int(line.split()[1])
+            elif line.startswith('RssAnon:'):
+                anon = int(line.split()[1])
+    return {
+        'rss_kb':   rss,
+        'anon_kb':  anon,
+        'fds':      len(os.listdir('/proc/{}/fd'.format(pid))),
+        'children': children(pid),
+    }
+
+def settle(pid, baseline, deadline=5.0):
+    ''' Give forked children time to exit before the final sample. '''
+    end = time.time() + deadline
+    current = sample(pid)
+    while current['children'] > baseline['children'] and time.time() < end:
+        time.sleep(0.1)
+        current = sample(pid)
+    return current
+
+# Allocation reports
+
+def allocations(pid, report):
+    ''' Ask the tracker in the server for its call sites: offset -> counters. '''
+    path = '{}.{}'.format(report, pid)
+    try:
+        before = os.stat(path).st_mtime_ns
+    except OSError:
+        before = None
+    os.kill(pid, signal.SIGUSR2)
+
+    end = time.time() + 5
+    while time.time() < end:
+        try:
+            if os.stat(path).st_mtime_ns != before:
+                break
+        except OSError:
+            pass
+        time.sleep(0.05)
+
+    sites = {}
+    try:
+        with open(path) as fs:
+            for line in fs:
+                offset, calls, live, size = line.split()
+                sites[offset] = {'calls': int(calls), 'live': int(live), 'bytes': int(size)}
+    except OSError:
+        pass
+    return sites
+
+def symbolize(offsets):
+    ''' Map executable offsets (return addresses) to function and line.
+
+    The allocation wrappers are inlined into their callers, so each address
+    is resolved with its inline frames (innermost first) and named after the
+    outermost one: the function that made the call. '''
+    known = [o for o in offsets if o != '0']
+    names = {'0': '(outside spidey)'}
+    if not known:
+        return names
+    command = ['addr2line', '-a', '-f', '-i', '-s', '-e', SPIDEY] + ['{:x}'.format(int(o, 16) - 1) for o in known]
+    try:
+        lines = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL).stdout.decode().splitlines()
+    except OSError:
+        lines = []
+    frames = []
+    for line in lines:
+        if line.startswith('0x'):
+            frames.append([])
+        elif frames:
+            frames[-1].append(line)
+    for index, offset in enumerate(known):
+        if index < len(frames) and len(frames[index]) >= 2:
+            names[offset] = '{} ({})'.format(frames[index][-2], frames[index][-1])
+        else:
+            names[offset] = offset
+    return names
+
+def growth(first, last):
+    ''' Per-site change between two reports. '''
+    rows = []
+    for offset, counters in last.items():
+        start = first.get(offset, {'calls': 0, 'live': 0, 'bytes': 0})
+        rows.append({
+            'site':   offset,
+            'calls':  counters['calls'] - start['calls'],
+            'live':   counters['live'] - start['live'],
+            'bytes':  counters['bytes'] - start['bytes'],
+        })
+    return rows
+
+# Soak
+
+def soak(mode, root, workspace):
+    port    = free_port()
+    report  = os.path.join(workspace, 'alloc-{}'.format(mode)) if TRACK else None
+    log     = open(os.path.join(workspace, 'spidey-{}.log'.format(mode)), 'w')
+    server  = start_spidey(mode, root, port, log, report)
+    weights = sum(weight for _, weight in MIX)
+    rounds  = max(1, REQUESTS // ROUND)
+    warmup  = max(1, int(rounds * WARMUP)) if rounds > 1 else 0
+    entry   = {'mode': mode, 'samples': [], 'errors': 0, 'failures': []}
+    first   = None
+
+    try:
+        baseline = sample(server.pid)
+        for index in range(rounds):
+            errors = 0
+            for uri, weight in MIX:
+                requests = max(CONCURRENCY, ROUND * weight // weights)
+                errors  += run_thor(port, uri.format(round=index), requests, index % 2 == 1)
+
+            current = sample(server.pid)
+            current.update({'requests': (index + 1) * ROUND, 'errors': errors})
+            entry['samples'].append(current)
+            entry['errors'] += errors
+            print('| {:8}| {:>10}| {:>10}| {:>10}| {:>6}| {:>9}| {:>7}|'.format(
+                mode, current['requests'], current['rss_kb'], current['anon_kb'], current['fds'],
+                current['children'], errors))
+            sys.stdout.flush()
+
+            if index + 1 == warmup:
+                baseline = settle(server.pid, baseline)
+                if report:
+                    first = allocations(server.pid, report)
+
+        final = settle(server.pid, baseline)
+        last  = allocations(server.pid, report) if report else None
+    finally:
+        stop_spidey(server)
+        log.close()
+
+    # Growth after warm-up (caches and pools fill during it)
+    limit = max(baseline['anon_kb'] * THRESHOLD, RSS_SLACK)
+    if final['anon_kb'] - baseline['anon_kb'] > limit:
+        entry['failures'].append('anonymous RSS {} -> {} KB'.format(baseline['anon_kb'], final['anon_kb']))
+    if final['fds'] - baseline['fds'] > FD_SLACK:
+        entry['failures'].append('descriptors {} -> {}'.format(baseline['fds'], final['fds']))
+    if final['children'] > baseline['children']:
+        entry['failures'].append('children {} -> {}'.format(baseline['children'], final['children']))
+    if entry['errors']:
+        entry['failures'].append('{} failed requests'.format(entry['errors']))
+
+    if last:
+        rows  = growth(first or {}, last)
+        names = symbolize([row['site'] for row in rows])
+        for row in rows:
+            row['name'] = names.get(row['site'], row['site'])
+            if row['live'] > LEAK_SLACK:
+                entry['failures'].append('{} leaked {} blocks ({} bytes)'.format(row['name'], row['live'], row['bytes']))
+        entry['sites'] = sorted(rows, key=lambda row: (-row['live'], -row['calls']))
+
+        print('\n    {:>10} {:>8} {:>10}  {}'.format('calls', 'live', 'bytes', 'call site ({})'.format(mode)))
+        for row in entry['sites'][:15]:
+            print('    {:>10} {:>8} {:>10}  {}'.format(row['calls'], row['live'], row['bytes'], row['name']))
+        print()
+
+    entry['baseline'] = baseline
+    entry['final']    = final
+    return entry
+
+# Main execution
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    while args and args[0].startswith('-') and len(args[0]) > 1:
+        arg = args.pop(0)
+        if arg == '-h':
+            usage(0)
+        elif arg == '-m' and args:
+            SELECTED = args.pop(0).split(',')
+        elif arg == '-n' and args:
+            REQUESTS = int(args.pop(0))
+        elif arg == '-r' and args:
+            ROUND = int(args.pop(0))
+        elif arg == '-c' and args:
+            CONCURRENCY = int(args.pop(0))
+        elif arg == '-t' and args:
+            THRESHOLD = float(args.pop(0))
+        elif arg == '-A':
+            TRACK = False
+        elif arg == '-o' and args:
+            OUTPUT = args.pop(0)
+        else:
+            usage(1)
+
+    for mode in SELECTED:
+        if mode not in MODES:
+            sys.exit('Unknown mode {}'.format(mode))
+    for binary in (SPIDEY, THOR) + ((ALLOCATOR,) if TRACK else ()):
+        if not os.path.exists(binary):
+            sys.exit('Missing {} (run make first)'.format(binary))
+
+    print('| {:8}| {:>10}| {:>10}| {:>10}| {:>6}| {:>9}| {:>7}|'.format(
+        'mode', 'requests', 'rss (KB)', 'anon (KB)', 'fds', 'children', 'errors'))
+    print('|{:-<9}|{:-<11}|{:-<11}|{:-<11}|{:-<7}|{:-<10}|{:-<8}|'.format(*'-' * 7))
+
+    workspace = tempfile.mkdtemp(prefix='spidey-soak.')
+    try:
+        root    = make_fixtures(workspace)
+        results = [soak(mode, root, workspace) for mode in SELECTED]
+    finally:
+        shutil.rmtree(workspace, ignore_errors=True)
+
+    document = {
+        'meta': {
+            'host':        platform.node(),
+            'machine':     platform.machine(),
+            'date':        time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'requests':    REQUESTS,
+            'round':       ROUND,
+            'concurrency': CONCURRENCY,
+            'threshold':   THRESHOLD,
+        },
+        'results': results,
+    }
+    with open(OUTPUT, 'w') as fs:
+        json.dump(document, fs, indent=2)
+    print('Results written to {}'.format(os.path.relpath(OUTPUT)))
+
+    failures = [(entry['mode'], failure) for entry in results for failure in entry['failures']]
+    if failures:
+        print('\nFAILURES:')
+        for mode, failure in failures:
+            print('    {}: {}'.format(mode, failure))
+        sys.exit(1)
+
+    print('No growth after warm-up (threshold {:.0f}%)'.format(THRESHOLD * 100))
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
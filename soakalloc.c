@@ -0,0 +1,353 @@
+/* soakalloc.c: Allocation Accounting Interposer for Soak Tests
+ *
+ * Build as a shared object and preload it into spidey:
+ *
+ *      SOAK_ALLOC_REPORT=/tmp/alloc LD_PRELOAD=./soakalloc.so ./spidey ...
+ *
+ * Every allocation is charged to its call site: the innermost return address
+ * inside the spidey executable (so strdup, fopen or getaddrinfo are charged to
+ * their caller).  On SIGUSR2 each process writes its sites to
+ * $SOAK_ALLOC_REPORT.<pid>, one per line:
+ *
+ *      <offset in executable (hex)> <calls> <live blocks> <live bytes>
+ *
+ * Sites whose live blocks keep growing between reports are leaking.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define SOAK_SITES          4096        /* Call sites tracked (power of two) */
+#define SOAK_FRAMES         8           /* Frames searched for a spidey caller */
+#define SOAK_HEADER         16          /* Bytes before each block (keeps 16-byte alignment) */
+#define SOAK_MAGIC          0x50AC      /* Marks blocks carrying a header */
+
+/**
+ * Header placed before every block handed out.
+ */
+typedef struct {
+    uint64_t    size;                   /**< Requested size */
+    uint16_t    magic;                  /**< SOAK_MAGIC */
+    uint16_t    site;                   /**< Index of the call site */
+    uint32_t    offset;                 /**< Bytes from the real block to the user pointer */
+} SoakHeader;
+
+/**
+ * Counters of one call site (updated atomically; read racily by reports).
+ */
+typedef struct {
+    uintptr_t   address;                /**< Return address (0 = free slot) */
+    uint64_t    calls;                  /**< Allocations made */
+    int64_t     live;                   /**< Blocks not yet freed */
+    int64_t     bytes;                  /**< Bytes not yet freed */
+} SoakSite;
+
+/* glibc's own allocator */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void  __libc_free(void *ptr);
+
+/* Globals */
+
+static SoakSite         Sites[SOAK_SITES];
+static uintptr_t        TextStart = 0;  /* Executable code of the main program */
+static uintptr_t        TextEnd   = 0;
+static uintptr_t        LoadBase  = 0;
+static bool             Ready     = false;
+static __thread bool    Inside __attribute__((tls_model("initial-exec"))) = false;
+
+/* Call Sites */
+
+/**
+ * Return the index of a call site, adding it if it is new (site 0 collects
+ * allocations made from outside spidey or while unwinding).
+ **/
+static uint16_t soak_site(uintptr_t address) {
+    if (!address) {
+        return 0;
+    }
+    for (size_t probe = 0; probe < SOAK_SITES - 1; probe++) {
+        size_t index = 1 + ((address >> 4) + probe) % (SOAK_SITES - 1);
+        uintptr_t current = __atomic_load_n(&Sites[index].address, __ATOMIC_ACQUIRE);
+        if (current == address) {
+            return index;
+        }
+        if (current == 0) {
+            uintptr_t expected = 0;
+            if (__atomic_compare_exchange_n(&Sites[index].address, &expected, address, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == address) {
+                return index;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find the innermost caller inside the executable.
+ **/
+static uint16_t soak_caller(void) {
+    void *frames[SOAK_FRAMES];
+
+    if (!Ready || Inside) {
+        return 0;
+    }
+    Inside = true;
+    int n = backtrace(frames, SOAK_FRAMES);
+    Inside = false;
+
+    for (int i = 1; i < n; i++) {
+        uintptr_t address = (uintptr_t)frames[i];
+        if (address >= TextStart && address < TextEnd) {
+            return soak_site(address);
+        }
+    }
+    return 0;
+}
+
+static void soak_charge(uint16_t site, int64_t blocks, int64_t bytes) {
+    if (blocks > 0) {
+        __atomic_add_fetch(&Sites[site].calls, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&Sites[site].live, blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Sites[site].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Blocks */
+
+static void *soak_wrap(void *base, size_t offset, size_t size, uint16_t site) {
+    if (!base) {
+        return NULL;
+    }
+    char *user = (char *)base + offset;
+    SoakHeader *h = (SoakHeader *)(user - SOAK_HEADER);
+    h->size   = size;
+    h->magic  = SOAK_MAGIC;
+    h->site   = site;
+    h->offset = offset;
+    soak_charge(site, 1, size);
+    return user;
+}
+
+static SoakHeader *soak_header(void *ptr) {
+    SoakHeader *h = (SoakHeader *)((char *)ptr - SOAK_HEADER);
+    if (h->magic != SOAK_MAGIC) {
+        abort();                        /* Not ours: double free or corruption */
+    }
+    return h;
+}
+
+/* Interposed Allocator */
+
+void *malloc(size_t size) {
+    return soak_wrap(__libc_malloc(size + SOAK_HEADER), SOAK_HEADER, size, soak_caller());
+}
+
+void *calloc(size_t count, size_t size) {
+    if (size && count > (SIZE_MAX - SOAK_HEADER) / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return soak_wrap(__libc_calloc(1, count * size + SOAK_HEADER), SOAK_HEADER, count * size, soak_caller());
+}
+
+void free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    SoakHeader *h = soak_header(ptr);
+    soak_charge(h->site, -1, -(int64_t)h->size);
+    h->magic = 0;
+    __libc_free((char *)ptr - h->offset);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    SoakHeader *h = soak_header(ptr);
+    if (h->offset != SOAK_HEADER) {
+        /* Aligned blocks cannot move with __libc_realloc */
+        void *moved = malloc(size);
+        if (moved) {
+            memcpy(moved, ptr, h->size < size ? h->size : size);
+            free(ptr);
+        }
+        return moved;
+    }
+
+    /* The block stays charged to the site that first allocated it */
+    uint16_t site = h->site;
+    uint64_t old  = h->size;
+    char *base = __libc_realloc((char *)ptr - SOAK_HEADER, size + SOAK_HEADER);
+    if (!base) {
+        return NULL;
+    }
+    h = (SoakHeader *)base;
+    h->size = size;
+    soak_charge(site, 0, (int64_t)size - (int64_t)old);
+    return base + SOAK_HEADER;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (alignment <= SOAK_HEADER) {
+        return malloc(size);
+    }
+    /* The header goes in the alignment padding before the block */
+    return soak_wrap(__libc_memalign(alignment, size + alignment), alignment, size, soak_caller());
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void *block = memalign(alignment, size);
+    if (!block) {
+        return ENOMEM;
+    }
+    *ptr = block;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr ? soak_header(ptr)->size : 0;
+}
+
+/* Reports */
+
+static char *soak_format(char *p, uint64_t value, int base) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    while (n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static char *soak_signed(char *p, int64_t value) {
+    if (value < 0) {
+        *p++ = '-';
+        return soak_format(p, -(uint64_t)value, 10);
+    }
+    return soak_format(p, value, 10);
+}
+
+/**
+ * Write this process's call sites (only async-signal-safe calls).
+ **/
+static void soak_report(int signum) {
+    const char *prefix = getenv("SOAK_ALLOC_REPORT");
+    char path[4096], line[128];
+    int saved = errno;
+
+    if (!prefix || strlen(prefix) > sizeof(path) - 32) {
+        return;
+    }
+    char *p = stpcpy(path, prefix);
+    *p++ = '.';
+    *soak_format(p, getpid(), 10) = '\0';
+
+    /* Written beside the final name, then renamed, so readers never see half */
+    char temporary[4096 + 8];
+    strcpy(stpcpy(temporary, path), ".tmp");
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        errno = saved;
+        return;
+    }
+    for (size_t i = 0; i < SOAK_SITES; i++) {
+        SoakSite *s = &Sites[i];
+        uint64_t calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+        if (!calls) {
+            continue;
+        }
+        p = line;
+        p = soak_format(p, s->address ? s->address - LoadBase : 0, 16);
+        *p++ = ' ';
+        p = soak_format(p, calls, 10);
+        *p++ = ' ';
+        p = soak_signed(p, __atomic_load_n(&s->live, __ATOMIC_RELAXED));
+        *p++ = ' ';
+        p = soak_signed(p, __atomic_load_n(&s->bytes, __ATOMIC_RELAXED));
+        *p++ = '\n';
+        if (write(fd, line, p - line) < 0) {
+            break;
+        }
+    }
+    close(fd);
+    rename(temporary, path);
+    errno = saved;
+}
+
+/**
+ * Find the executable segment of the main program (the first object).
+ **/
+static int soak_text(struct dl_phdr_info *info, size_t size, void *data) {
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {
+            TextStart = info->dlpi_addr + ph->p_vaddr;
+            TextEnd   = TextStart + ph->p_memsz;
+            LoadBase  = info->dlpi_addr;
+        }
+    }
+    return 1;
+}
+
+__attribute__((constructor))
+static void soak_start(void) {
+    void *frames[1];
+    struct sigaction action = { .sa_handler = soak_report, .sa_flags = SA_RESTART };
+
+    dl_iterate_phdr(soak_text, NULL);
+
+    /* The first backtrace loads the unwinder, which allocates */
+    Inside = true;
+    backtrace(frames, 1);
+    Inside = false;
+
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+    Ready = true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
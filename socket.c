@@ -1,29 +1,117 @@
 /* socket.c: Simple Socket Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+/* Listening sockets (one per address family) */
+int ListenFds[SOCKET_LISTENERS_MAX];
+size_t ListenCount = 0;
+
+/**
+ * Parse a listener tuning profile.
+ *
+ * @param   spec        Comma separated key[=value] list.
+ * @return  true if every setting was understood.
+ *
+ * Recognized settings (booleans take no value or =0 / =1):
+ *
+ *  reuseaddr           SO_REUSEADDR
+ *  reuseport           SO_REUSEPORT
+ *  defer=SECONDS       TCP_DEFER_ACCEPT (0 disables)
+ *  fastopen=QLEN       TCP_FASTOPEN queue length (0 disables)
+ *  backlog=N           listen(2) backlog
+ *  nodelay             TCP_NODELAY on accepted sockets
+ *  cork                TCP_CORK around each response's header and body
+ *  family=any|ipv4|ipv6
+ **/
+bool socket_configure(const char *spec) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    bool ok = true;
+
+    for (char *item = strtok_r(copy, ",", &saveptr); item && ok; item = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(item, '=');
+        long number = 1;
+        if (value) {
+            *value++ = '\0';
+            number = strtol(value, NULL, 10);
+        }
+
+        if (streq(item, "reuseaddr")) {
+            Listener.reuseaddr = number != 0;
+        } else if (streq(item, "reuseport")) {
+            Listener.reuseport = number != 0;
+        } else if (streq(item, "defer")) {
+            Listener.defer_accept = (int)number;
+        } else if (streq(item, "fastopen")) {
+            Listener.fastopen = (int)number;
+        } else if (streq(item, "backlog")) {
+            Listener.backlog = (int)number;
+        } else if (streq(item, "nodelay")) {
+            Listener.nodelay = number != 0;
+        } else if (streq(item, "cork")) {
+            Listener.cork = number != 0;
+        } else if (streq(item, "family") && value) {
+            if (streq(value, "any")) {
+                Listener.family = AF_UNSPEC;
+            } else if (streq(value, "ipv4")) {
+                Listener.family = AF_INET;
+            } else if (streq(value, "ipv6")) {
+                Listener.family = AF_INET6;
+            } else {
+                ok = false;
+            }
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Unknown listener setting: %s\n", item);
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+static void socket_option(int fd, int level, int option, int value, const char *name) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0) {
+        log("Unable to set %s: %s", name, strerror(errno));
+    }
+}
+
 /**
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
  * @return  Allocated server socket file descriptor.
+ *
+ * A listener is bound for every address family getaddrinfo returns (limited
+ * by Listener.family), configured according to the Listener profile.  The
+ * first is returned; all of them are recorded in ListenFds for socket_accept.
  **/
 int socket_listen(const char *port) {
     /* Lookup server address information */
     struct addrinfo  hints = {
-        .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
-        .ai_socktype = SOCK_STREAM, /* Use TCP */
-        .ai_flags    = AI_PASSIVE,  /* Use all interfaces */
+        .ai_family   = Listener.family, /* IPv4 and/or IPv6 choices */
+        .ai_socktype = SOCK_STREAM,     /* Use TCP */
+        .ai_flags    = AI_PASSIVE,      /* Use all interfaces */
     };
     struct addrinfo *results;
     int status;
@@ -33,34 +121,467 @@ int socket_listen(const char *port) {
     }
 
 
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+    /* For each server entry, allocate socket and try to bind */
+    for (struct addrinfo *p = results; p != NULL && ListenCount < SOCKET_LISTENERS_MAX; p = p->ai_next) {
+        int socket_fd;
+
 	/* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+        if ((socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) < 0) {
             fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
             continue;
         }
 
+        /* Apply listener profile */
+        if (Listener.reuseaddr) {
+            socket_option(socket_fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+        }
+        if (Listener.reuseport) {
+            socket_option(socket_fd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+        }
+        if (p->ai_family == AF_INET6) {
+            /* Separate IPv4 listener handles IPv4 clients */
+            socket_option(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, 1, "IPV6_V6ONLY");
+        }
+        if (Listener.defer_accept > 0) {
+            /* Connections that send nothing never reach accept() */
+            socket_option(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, Listener.defer_accept, "TCP_DEFER_ACCEPT");
+        }
+        if (Listener.fastopen > 0) {
+            socket_option(socket_fd, IPPROTO_TCP, TCP_FASTOPEN, Listener.fastopen, "TCP_FASTOPEN");
+        }
+
 	/* Bind socket */
         if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
             close(socket_fd);
-            socket_fd = -1;
             continue;
         }
 
     	/* Listen to socket */
-        if (listen(socket_fd, SOMAXCONN) < 0) {
+        if (listen(socket_fd, Listener.backlog) < 0) {
             fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
             close(socket_fd);
-            socket_fd = -1;
             continue;
         }
+
+        ListenFds[ListenCount++] = socket_fd;
     }
 
     freeaddrinfo(results);
-    return socket_fd;
+    return ListenCount ? ListenFds[0] : -1;
+}
+
+/**
+ * Accept a client connection from any of the listening sockets.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   addr        Client address (output).
+ * @param   addrlen     Length of client address (input / output).
+ * @return  Non-blocking, close-on-exec client socket, or -1 on error.
+ *
+ * Listeners are non-blocking so that several processes may wait on them;
+ * spurious wakeups and aborted connections are retried.
+ **/
+int socket_accept(int sfd, struct sockaddr *addr, socklen_t *addrlen) {
+    struct pollfd pfds[SOCKET_LISTENERS_MAX];
+    size_t nfds = ListenCount;
+    socklen_t capacity = *addrlen;
+
+    if (nfds == 0) {
+        pfds[0].fd = sfd;
+        nfds = 1;
+    } else {
+        for (size_t i = 0; i < nfds; i++) {
+            pfds[i].fd = ListenFds[i];
+        }
+    }
+
+    while (true) {
+        for (size_t i = 0; i < nfds; i++) {
+            pfds[i].events  = POLLIN;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        for (size_t i = 0; i < nfds; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            *addrlen = capacity;
+            int fd = socket_accept_ready(pfds[i].fd, addr, addrlen);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    continue;
+                }
+                return -1;
+            }
+            return fd;
+        }
+    }
+}
+
+/**
+ * Accept a pending connection from one listener without waiting.
+ *
+ * @param   lfd         Listening socket (non-blocking).
+ * @param   addr        Client address (output).
+ * @param   addrlen     Length of client address (input / output).
+ * @return  Non-blocking, close-on-exec client socket, or -1 with errno EAGAIN
+ *          when nothing is pending (aborted connections are skipped).
+ **/
+int socket_accept_ready(int lfd, struct sockaddr *addr, socklen_t *addrlen) {
+    socklen_t capacity = *addrlen;
+
+    while (true) {
+        *addrlen = capacity;
+        int fd = accept4(lfd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (Listener.nodelay) {
+            socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+        }
+        return fd;
+    }
+}
+
+/**
+ * Hold back partial segments so a response's header and first body bytes
+ * leave together (when the cork setting is enabled).
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   on          true to cork, false to flush and uncork.
+ **/
+void socket_cork(int fd, bool on) {
+    if (Listener.cork) {
+        int value = on;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    }
+}
+
+/* Socket Output */
+
+/**
+ * Wait until a socket is ready, giving up after the configured deadline
+ * (Timeouts.write for output, Timeouts.body for input).
+ *
+ * @return  true when the operation should be retried, false on timeout
+ *          (errno is ETIMEDOUT) or error.
+ *
+ * A handler coroutine yields to the event loop here rather than blocking it.
+ **/
+static bool socket_wait(int fd, short events) {
+    int timeout = (events & POLLOUT) ? Timeouts.write : Timeouts.body;
+    int n = coroutine_poll(fd, events, timeout > 0 ? timeout : -1);
+    if (n == 0) {
+        log("Client stalled for %d ms", timeout);
+        errno = ETIMEDOUT;
+        return false;
+    }
+    return n > 0 || errno == EINTR;
+}
+
+/**
+ * Write every byte of an iovec array to a (non-blocking) socket.
+ *
+ * @return  Number of bytes written, or -1 on error.
+ **/
+ssize_t socket_writev(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLOUT)) continue;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+
+        /* Advance past fully written vectors */
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+/**
+ * Write a buffer, telling the kernel more data follows immediately.
+ **/
+ssize_t socket_send_more(int fd, const void *buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = send(fd, (const char *)buffer + total, length - total, MSG_NOSIGNAL | MSG_MORE);
+        if (n < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLOUT)) continue;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+    }
+    return (ssize_t)total;
+}
+
+/**
+ * Send count bytes of a file to a socket without copying through user space.
+ *
+ * @return  Number of bytes sent, or -1 on error.
+ **/
+ssize_t socket_sendfile(int fd, int in_fd, off_t *offset, size_t count) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = sendfile(fd, in_fd, offset, count - total);
+        if (n < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLOUT)) continue;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            break;      /* File shrank underneath us */
+        }
+        total += n;
+    }
+    return (ssize_t)total;
+}
+
+/* Socket Input */
+
+/**
+ * Read what has arrived on a (non-blocking) socket, waiting for at least one
+ * byte for up to Timeouts.body.
+ *
+ * @return  Number of bytes read, 0 at end of input, or -1 on error.
+ **/
+ssize_t socket_recv(int fd, void *buffer, size_t size) {
+    while (true) {
+        ssize_t n = recv(fd, buffer, size, 0);
+        if (n >= 0) {
+            return n;
+        }
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLIN)) continue;
+        if (errno == EINTR) continue;
+        return -1;
+    }
+}
+
+/**
+ * Move count bytes from a socket into a pipe without copying through user
+ * space.
+ *
+ * @param   fd          Non-blocking client socket.
+ * @param   pipefd      Write end of a pipe.
+ * @param   count       Number of bytes to move.
+ * @param   wait        Waits for the pipe to drain (NULL = Timeouts.body on
+ *                      the pipe alone).
+ * @param   context     Passed to wait.
+ * @return  count, or -1 on error: ECONNRESET if the client stopped sending
+ *          early, ETIMEDOUT if it stalled for Timeouts.body, EPIPE if nobody
+ *          reads the pipe (or it stayed full for Timeouts.body).
+ **/
+ssize_t socket_splice(int fd, int pipefd, size_t count, PipeWait wait, void *context) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = splice(fd, NULL, pipefd, NULL, count - total, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+
+        /* Either the socket is drained or the pipe is full: wait for both */
+        if (!socket_wait(fd, POLLIN)) {
+            return -1;
+        }
+        int ready = wait ? wait(pipefd, context) : coroutine_poll(pipefd, POLLOUT, Timeouts.body > 0 ? Timeouts.body : -1);
+        if (ready == 0) {
+            errno = EPIPE;              /* The reader stopped reading */
+            return -1;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready > 0 && (ready & (POLLERR | POLLHUP))) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return (ssize_t)total;
+}
+
+/* Empty relay pipes, cached per thread */
+static __thread int SocketPipes[SOCKET_PIPES_MAX][2];
+static __thread int SocketPipeCount = 0;
+
+/**
+ * Take an empty pipe for socket_relay.
+ **/
+static bool socket_pipe_get(int pipefd[2]) {
+    if (SocketPipeCount > 0) {
+        SocketPipeCount--;
+        pipefd[0] = SocketPipes[SocketPipeCount][0];
+        pipefd[1] = SocketPipes[SocketPipeCount][1];
+        return true;
+    }
+    if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        return false;
+    }
+    fcntl(pipefd[0], F_SETPIPE_SZ, SOCKET_PIPE_SIZE);  /* Best effort */
+    return true;
+}
+
+/**
+ * Return a pipe to the cache (only if it was drained: a relay that failed
+ * part way may have left bytes in it).
+ **/
+static void socket_pipe_put(int pipefd[2], bool empty) {
+    if (empty && SocketPipeCount < SOCKET_PIPES_MAX) {
+        SocketPipes[SocketPipeCount][0] = pipefd[0];
+        SocketPipes[SocketPipeCount][1] = pipefd[1];
+        SocketPipeCount++;
+        return;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+/**
+ * Move up to count bytes from one socket to another (e.g. between a client
+ * and an upstream server) through a pipe, so they never pass through user
+ * space.
+ *
+ * @param   from        Non-blocking socket to read.
+ * @param   to          Non-blocking socket to write.
+ * @param   count       Number of bytes to move.
+ * @return  Bytes moved (fewer than count if from reached its end), or -1 on
+ *          error: EPIPE if to failed or stalled for Timeouts.write, so the
+ *          caller can tell which side let it down; ETIMEDOUT if from stalled
+ *          for Timeouts.body.
+ *
+ * Each pipe is owned by one relay at a time, so handler coroutines that
+ * yield mid-relay never share one.
+ **/
+ssize_t socket_relay(int from, int to, size_t count) {
+    size_t filled = 0, drained = 0;
+    int pipefd[2];
+
+    if (!socket_pipe_get(pipefd)) {
+        return -1;
+    }
+
+    while (drained < count) {
+        ssize_t n;
+        if (drained == filled) {
+            /* Pipe is empty: fill it from the source */
+            n = splice(from, NULL, pipefd[1], NULL, count - filled, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                filled += n;
+                continue;
+            }
+            if (n == 0) {
+                break;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(from, POLLIN)) continue;
+        } else {
+            n = splice(pipefd[0], NULL, to, NULL, filled - drained, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                drained += n;
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(to, POLLOUT)) continue;
+            if (errno != EINTR) {
+                errno = EPIPE;
+            }
+        }
+        if (errno == EINTR) continue;
+        socket_pipe_put(pipefd, false);
+        return -1;
+    }
+
+    socket_pipe_put(pipefd, true);
+    return (ssize_t)drained;
+}
+
+/* Socket Streams */
+
+static ssize_t socket_stream_read(void *cookie, char *buffer, size_t size) {
+    int fd = (int)(intptr_t)cookie;
+    while (true) {
+        ssize_t n = read(fd, buffer, size);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!socket_wait(fd, POLLIN)) {
+                return -1;
+            }
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static ssize_t socket_stream_write(void *cookie, const char *buffer, size_t size) {
+    int fd = (int)(intptr_t)cookie;
+    while (true) {
+        ssize_t n = send(fd, buffer, size, MSG_NOSIGNAL);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!socket_wait(fd, POLLOUT)) {
+                return 0;
+            }
+        } else if (errno != EINTR) {
+            /* fopencookie expects 0 (not -1) on write errors */
+            return 0;
+        }
+    }
+}
+
+static int socket_stream_close(void *cookie) {
+    return close((int)(intptr_t)cookie);
+}
+
+/**
+ * Open a stdio stream on a non-blocking client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @return  Stream that waits for readiness instead of failing with EAGAIN.
+ *
+ * Writes use MSG_NOSIGNAL so a disconnected client cannot kill the server
+ * with SIGPIPE.  Closing the stream closes the socket.
+ **/
+FILE * socket_stream(int fd) {
+    cookie_io_functions_t functions = {
+        .read  = socket_stream_read,
+        .write = socket_stream_write,
+        .seek  = NULL,
+        .close = socket_stream_close,
+    };
+    return fopencookie((void *)(intptr_t)fd, "w+", functions);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
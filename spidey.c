@@ -1,11 +1,15 @@
 /* spidey: Simple HTTP Server */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 #include <linux/limits.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <signal.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -13,6 +17,65 @@ char *Port	      = "9000";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "/afs/nd.edu/user40/lyokum/gitlab_projects/systems_programming/cse-20289-sp18-project/www";
+int   RootFd          = -1;
+bool  IndexEnabled    = false;
+bool  IndexMlock      = false;
+char *PackPath        = NULL;
+bool  Http2Enabled    = true;
+OverloadConfig Overload = {
+    .limits = {
+        [SHED_CONNECTIONS] = 4096,
+        [SHED_CHILDREN]    = 256,
+        [SHED_CGI]         = 64,
+    },
+    .retry = 1,
+};
+size_t BodyMax         = 64 * 1024 * 1024;
+size_t CoroutineStack  = 0;
+RateLimitConfig RateLimit = {
+    .requests = 0,
+    .bytes    = 0,
+};
+NegativeCacheConfig NegativeCache = {
+    .entries  = 16384,
+    .ttl      = 2000,
+};
+ProxyConfig Proxy = {
+    .hash     = false,
+    .health   = 2000,
+    .idle     = 32,
+    .check    = "/",
+};
+AffinityConfig Affinity = {
+    .count = 0,
+    .numa  = false,
+};
+bool  HostnameLookups = true;
+ListenerConfig Listener = {
+    .reuseaddr    = true,
+    .reuseport    = false,
+    .defer_accept = 10,
+    .fastopen     = 0,
+    .backlog      = SOMAXCONN,
+    .nodelay      = true,
+    .cork         = true,
+    .family       = AF_UNSPEC,
+};
+TimeoutConfig Timeouts = {
+    .header       = 10000,
+    .body         = 30000,
+    .write        = 30000,
+    .idle         = 5000,
+};
+SchedulerConfig Scheduler = {
+    .workers      = 0,
+    .lanes        = {
+        [LANE_CACHED] = { .cap = 0, .weight = 8 },
+        [LANE_STATIC] = { .cap = 2, .weight = 2 },
+        [LANE_BROWSE] = { .cap = 2, .weight = 1 },
+        [LANE_CGI]    = { .cap = 2, .weight = 1 },
+    },
+};
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +84,28 @@ char *RootPath	      = "/afs/nd.edu/user40/lyokum/gitlab_projects/systems_progra
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hbclmMnNopqrstu] [--index[=mlock]] [--no-h2c] [--cpus=list] [--numa] [--coroutines[=size]]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -b size       Largest request body passed to CGI scripts (e.g. 64M; 0 = no limit)\n");
+    fprintf(stderr, "    -c mode       Single, Forking or Hybrid mode (event loop that forks only for CGI and large files)\n");
+    fprintf(stderr, "    -l profile    Listener tuning (e.g. reuseport,defer=5,fastopen=256,backlog=1024,nodelay,cork,family=ipv4)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -n            Numeric client addresses only (no reverse DNS)\n");
+    fprintf(stderr, "    -N profile    Remember missing paths until inotify or the ttl says otherwise (e.g. entries=16384,ttl=2; entries=0 disables)\n");
+    fprintf(stderr, "    -o limits     Shed load with 503 past these limits (e.g. connections=4096,children=256,cgi=64,retry=1; 0 = none)\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
-    fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -q limits     Per-client address limits, rate[:burst] per second (e.g. requests=20:40,bytes=1M:4M)\n");
+    fprintf(stderr, "    -r path       Root directory (or pack:file to serve a pack archive)\n");
+    fprintf(stderr, "    -s profile    Scheduler lanes in single mode, cap[:weight] each (e.g. workers=8,cached=0:8,static=2:2,browse=2:1,cgi=2:1)\n");
+    fprintf(stderr, "    -t timeouts   Deadlines in seconds (e.g. header=10,body=30,write=30,idle=5; idle=0 disables keep-alive)\n");
+    fprintf(stderr, "    -u upstreams  Forward URI prefixes to backend pools (e.g. /api=10.0.0.1:9000+10.0.0.2:9000,balance=least|hash,health=2,idle=32,check=/)\n");
+    fprintf(stderr, "    --index       Index RootPath at startup (immutable trees); =mlock locks small files in memory\n");
+    fprintf(stderr, "    --no-h2c      Speak HTTP/1.x only (no prior-knowledge or Upgrade: h2c HTTP/2)\n");
+    fprintf(stderr, "    --cpus=list   Pin workers to CPUs (e.g. 0-3,8 or all); single mode runs one event loop per CPU\n");
+    fprintf(stderr, "    --numa        Allocate each worker's memory on its CPU's node (all CPUs unless --cpus)\n");
+    fprintf(stderr, "    --coroutines  Run handlers as coroutines that yield instead of blocking the event loop (=size of each stack, default 64K)\n");
     exit(status);
 }
 
@@ -55,16 +132,36 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             case 'h': 
                 usage(progname,0);
                 break;
+            case 'b':
+                argind++;
+                {
+                    char *end = NULL;
+                    double size;
+                    if (!parse_size(argv[argind], &end, &size) || *end != '\0') {
+                        fprintf(stderr, "Invalid body size %s\n", argv[argind]);
+                        return false;
+                    }
+                    BodyMax = size;
+                }
+                break;
             case 'c':
                 argind++;
                 if (strcmp(argv[argind],"forking")==0) {
                     *mode = FORKING;
                 } else if (strcmp(argv[argind],"single")==0){
                     *mode = SINGLE;
+                } else if (strcmp(argv[argind],"hybrid")==0){
+                    *mode = HYBRID;
                 } else {
                     *mode = UNKNOWN;
                 }
                 break;
+            case 'l':
+                argind++;
+                if (!socket_configure(argv[argind])) {
+                    return false;
+                }
+                break;
             case 'm':
                 argind++;
                 MimeTypesPath = argv[argind];
@@ -73,13 +170,85 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
                 argind++;
                 DefaultMimeType = argv[argind];
                 break;
+            case 'n':
+                HostnameLookups = false;
+                break;
+            case 'N':
+                argind++;
+                if (!negcache_configure(argv[argind])) {
+                    return false;
+                }
+                break;
+            case 'o':
+                argind++;
+                if (!overload_configure(argv[argind])) {
+                    return false;
+                }
+                break;
             case 'p':
                 argind++;
                 Port = argv[argind];
                 break;
+            case 'q':
+                argind++;
+                if (!ratelimit_configure(argv[argind])) {
+                    return false;
+                }
+                break;
             case 'r':
                 argind++;
-                RootPath = argv[argind];
+                if (strncmp(argv[argind], "pack:", 5) == 0) {
+                    PackPath = argv[argind] + 5;
+                } else {
+                    RootPath = argv[argind];
+                }
+                break;
+            case '-':
+                /* Long options */
+                if (streq(argv[argind], "--index")) {
+                    IndexEnabled = true;
+                } else if (streq(argv[argind], "--index=mlock")) {
+                    IndexEnabled = true;
+                    IndexMlock   = true;
+                } else if (streq(argv[argind], "--no-h2c")) {
+                    Http2Enabled = false;
+                } else if (strncmp(argv[argind], "--cpus=", 7) == 0) {
+                    if (!affinity_configure(argv[argind] + 7)) {
+                        return false;
+                    }
+                } else if (streq(argv[argind], "--numa")) {
+                    Affinity.numa = true;
+                } else if (streq(argv[argind], "--coroutines")) {
+                    CoroutineStack = COROUTINE_STACK_DEFAULT;
+                } else if (strncmp(argv[argind], "--coroutines=", 13) == 0) {
+                    char *end = NULL;
+                    double size;
+                    if (!parse_size(argv[argind] + 13, &end, &size) || *end != '\0' || size < 1) {
+                        fprintf(stderr, "Invalid coroutine stack size %s\n", argv[argind] + 13);
+                        return false;
+                    }
+                    CoroutineStack = size;
+                } else {
+                    return false;
+                }
+                break;
+            case 's':
+                argind++;
+                if (!scheduler_configure(argv[argind])) {
+                    return false;
+                }
+                break;
+            case 't':
+                argind++;
+                if (!timeouts_configure(argv[argind])) {
+                    return false;
+                }
+                break;
+            case 'u':
+                argind++;
+                if (!proxy_configure(argv[argind])) {
+                    return false;
+                }
                 break;
             default:
                 return false;
@@ -101,22 +270,62 @@ int main(int argc, char *argv[]) {
     }
     else {
         //parse_options(argc,argv,&mode);
+    /* Count allocations per subsystem (SIGUSR1 logs them) */
+        mem_start();
+    /* Check worker placement; per-CPU event loops each listen on their own
+     * SO_REUSEPORT socket */
+        if (affinity_start() < 0) {
+            return EXIT_FAILURE;
+        }
+        if (mode != FORKING && Affinity.count > 1) {
+            Listener.reuseport = true;
+        }
+    /* Writes to a CGI script that has exited fail with EPIPE rather than
+     * killing the server */
+        signal(SIGPIPE, SIG_IGN);
+    /* Share per-client limits between every worker */
+        if (ratelimit_start() < 0) {
+            return EXIT_FAILURE;
+        }
+    /* Resolve upstream backends, share their state and start health checks */
+        if (proxy_start() < 0) {
+            return EXIT_FAILURE;
+        }
+    /* Start background hostname resolver (before the listener exists) */
+        resolver_start();
     /* Listen to server socket */
         sfd = socket_listen(Port);
         if (sfd == -1) {
             debug("socket failure");
             return 1;
         }
-    /* Determine real RootPath */
-        char buffer[PATH_MAX+1];
-        RootPath = realpath(RootPath,buffer);
+    /* A pack archive replaces the root directory: map it once (before
+     * forking, so children share its pages) */
+        if (PackPath) {
+            if (pack_open(PackPath) < 0) {
+                fatal("Unable to open pack %s: %s", PackPath, strerror(errno));
+            }
+            RootPath = strdup(PackPath);
+        } else {
+    /* Determine real RootPath and keep it open: request paths are resolved
+     * beneath this directory for the lifetime of the server */
+            if ((RootPath = realpath(RootPath, NULL)) == NULL ||
+                (RootFd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+                fatal("Unable to open root directory: %s", strerror(errno));
+            }
+    /* Build the static index (before forking, so children share it) */
+            index_build();
+    /* Remember paths that do not exist (shared with children, flushed by a
+     * watcher process) */
+            negcache_start();
+        }
     }
 
     log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == FORKING ? "Forking" : mode == HYBRID ? "Hybrid" : "Single");
 
     /* Start either forking or single HTTP server */
     //sfd = socket_listen(Port);
@@ -126,6 +335,10 @@ int main(int argc, char *argv[]) {
         } /*else {
             forking_server(sfd);
         }*/
+    } else if (mode==HYBRID) {
+        if (hybrid_server(sfd)!=0) {
+            return EXIT_FAILURE;
+        }
     } else if (mode==SINGLE) {
         if (single_server(sfd)!=0) {
             return EXIT_FAILURE;
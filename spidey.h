@@ -2,10 +2,17 @@
 #define SPIDEY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
@@ -18,15 +25,140 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    HYBRID,                             /**< Event loop that forks only for scripts and large files */
     UNKNOWN
 } ServerMode;
 
+/**
+ * Listener socket tuning profile
+ */
+typedef struct {
+    bool    reuseaddr;                  /**< SO_REUSEADDR */
+    bool    reuseport;                  /**< SO_REUSEPORT */
+    int     defer_accept;               /**< TCP_DEFER_ACCEPT seconds (0 = off) */
+    int     fastopen;                   /**< TCP_FASTOPEN queue length (0 = off) */
+    int     backlog;                    /**< listen(2) backlog */
+    bool    nodelay;                    /**< TCP_NODELAY on client sockets */
+    bool    cork;                       /**< TCP_CORK around responses */
+    int     family;                     /**< AF_UNSPEC (both), AF_INET or AF_INET6 */
+} ListenerConfig;
+
+/**
+ * Connection deadlines (milliseconds, 0 = none)
+ */
+typedef struct {
+    int     header;                     /**< Whole request head, from its first byte */
+    int     body;                       /**< Progress while reading a request body */
+    int     write;                      /**< Progress while writing a response */
+    int     idle;                       /**< Keep-alive wait for the next request (0 = close) */
+} TimeoutConfig;
+
+/**
+ * Scheduler lanes (request classes)
+ */
+typedef enum {
+    LANE_CACHED,                        /**< Served from memory: packed, indexed, 304, small files */
+    LANE_STATIC,                        /**< Other (large) static files */
+    LANE_BROWSE,                        /**< Directory listings */
+    LANE_CGI,                           /**< Scripts */
+    LANE_COUNT,
+} Lane;
+
+/**
+ * Per-lane scheduling limits
+ */
+typedef struct {
+    int     cap;                        /**< Most workers serving the lane at once (0 = all) */
+    int     weight;                     /**< Share of worker time while lanes compete */
+} LaneConfig;
+
+/**
+ * Request scheduler profile
+ */
+typedef struct {
+    int        workers;                 /**< Worker threads (0 = serve on the event loop) */
+    LaneConfig lanes[LANE_COUNT];       /**< Per-lane limits */
+} SchedulerConfig;
+
+#define AFFINITY_CPUS_MAX       256
+
+/**
+ * CPU and NUMA placement of workers
+ */
+typedef struct {
+    int     cpus[AFFINITY_CPUS_MAX];    /**< CPUs workers are pinned to, in slot order */
+    int     count;                      /**< Listed CPUs (0 = no placement, -1 = all) */
+    bool    numa;                       /**< Prefer memory from each worker's node */
+} AffinityConfig;
+
+/**
+ * Admission limits past which requests are shed with 503
+ */
+typedef enum {
+    SHED_CONNECTIONS,                   /**< In-flight connections of an event loop */
+    SHED_CHILDREN,                      /**< Child processes in forking mode */
+    SHED_CGI,                           /**< CGI requests queued for scheduler workers */
+    SHED_COUNT,
+} ShedReason;
+
+/**
+ * Overload protection profile
+ */
+typedef struct {
+    int     limits[SHED_COUNT];         /**< Admission limit per reason (0 = none) */
+    int     retry;                      /**< Retry-After of the 503 (seconds) */
+} OverloadConfig;
+
+/**
+ * Per-client rate limits (0 = unlimited)
+ */
+typedef struct {
+    double  requests;                   /**< Requests per second per client address */
+    double  request_burst;              /**< Requests a client may make at once */
+    double  bytes;                      /**< Response bytes per second per client address */
+    double  byte_burst;                 /**< Bytes a client may be sent at once */
+} RateLimitConfig;
+
+/**
+ * Negative lookup cache of missing paths
+ */
+typedef struct {
+    int     entries;                    /**< Missing URIs remembered (0 = no cache) */
+    int     ttl;                        /**< Milliseconds one is trusted (0 = until inotify reports a change) */
+} NegativeCacheConfig;
+
+/**
+ * Reverse proxy settings (the pools themselves are kept by proxy.c)
+ */
+typedef struct {
+    bool    hash;                       /**< Balance by consistent hashing of the path (else least connections) */
+    int     health;                     /**< Milliseconds between health checks (0 = none) */
+    int     idle;                       /**< Idle connections kept per backend */
+    char   *check;                      /**< Path requested by health checks */
+} ProxyConfig;
+
 /* Global Variables */
 
 extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern int   RootFd;                    /**< Open root directory (paths resolve beneath it) */
+extern bool  HostnameLookups;           /**< Resolve client hostnames in the background */
+extern ListenerConfig Listener;         /**< Listener socket profile */
+extern TimeoutConfig Timeouts;          /**< Connection deadlines */
+extern SchedulerConfig Scheduler;       /**< Request scheduling lanes */
+extern bool  IndexEnabled;              /**< Serve from the startup-built static index */
+extern bool  IndexMlock;                /**< Lock small indexed files into memory */
+extern char *PackPath;                  /**< Pack archive served instead of RootPath (or NULL) */
+extern bool  Http2Enabled;              /**< Accept cleartext HTTP/2 (prior knowledge or Upgrade: h2c) */
+extern AffinityConfig Affinity;         /**< Worker placement */
+extern OverloadConfig Overload;         /**< Admission limits */
+extern RateLimitConfig RateLimit;       /**< Per-client limits */
+extern size_t BodyMax;                  /**< Largest request body accepted (0 = no limit) */
+extern NegativeCacheConfig NegativeCache; /**< Cache of URIs that do not exist */
+extern ProxyConfig Proxy;              /**< Upstream pools */
+extern size_t CoroutineStack;           /**< Stack of each handler coroutine (0 = handlers block the event loop) */
 
 /* Logging Macros */
 
@@ -37,54 +169,490 @@ extern char *RootPath;                  /**< Path to root directory */
 #endif
 
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
+
+#ifdef NLOG
+/* Never evaluated, but keeps the arguments (and their variables) in use */
+#define log(M, ...)     ((void)(0 && fprintf(stderr, M, ##__VA_ARGS__)))
+#else
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#endif
+
+/* Memory Accounting */
+
+typedef enum {
+    MEM_REQUEST,                        /* Request structures, methods, URIs and queries */
+    MEM_HEADERS,                        /* Request header lists */
+    MEM_MIME,                           /* MIME type strings */
+    MEM_PATH,                           /* Resolved filesystem paths */
+    MEM_BROWSE,                         /* Directory scans and listings */
+    MEM_CGI,                            /* CGI environments and output buffers */
+    MEM_CACHE,                          /* Static index and negative cache */
+    MEM_CONNECTION,                     /* Connections and their receive buffers */
+    MEM_RESPONSE,                       /* Buffered response bodies (error pages) */
+    MEM_HTTP2,                          /* HTTP/2 sessions, streams and HPACK tables */
+    MEM_PROXY,                          /* Upstream pools and relay buffers */
+    MEM_TAGS,
+} MemTag;
+
+#define MEM_HEADER              16      /* Bytes before each tracked block (keeps 16-byte alignment) */
+
+void *          mem_track(void *base, MemTag tag, size_t size);
+void *          mem_moved(void *base, bool resized, MemTag tag, size_t size);
+void            mem_free(void *ptr);
+char *          mem_asprintf(MemTag tag, const char *format, ...)
+                    __attribute__((format(printf, 2, 3)));
+void            mem_charge(MemTag tag, int64_t bytes);
+void            mem_start(void);
+void            mem_dump(void);
+
+/* The allocators are always inlined so that malloc is still called from each
+ * call site (soakalloc.so charges allocations to their caller) */
+
+static inline __attribute__((always_inline)) void *mem_malloc(MemTag tag, size_t size) {
+    return mem_track(malloc(size + MEM_HEADER), tag, size);
+}
+
+static inline __attribute__((always_inline)) void *mem_calloc(MemTag tag, size_t count, size_t size) {
+    if (size && count > (SIZE_MAX - MEM_HEADER) / size) {
+        return NULL;
+    }
+    return mem_track(calloc(1, count * size + MEM_HEADER), tag, count * size);
+}
+
+static inline __attribute__((always_inline)) void *mem_realloc(MemTag tag, void *ptr, size_t size) {
+    void *base = ptr ? (char *)ptr - MEM_HEADER : NULL;
+    return mem_moved(realloc(base, size + MEM_HEADER), base != NULL, tag, size);
+}
+
+static inline __attribute__((always_inline)) char *mem_strcopy(MemTag tag, const char *s, size_t length) {
+    char *copy = mem_malloc(tag, length + 1);
+    if (copy) {
+        memcpy(copy, s, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+static inline __attribute__((always_inline)) char *mem_strndup(MemTag tag, const char *s, size_t n) {
+    return mem_strcopy(tag, s, strnlen(s, n));
+}
+
+static inline __attribute__((always_inline)) char *mem_strdup(MemTag tag, const char *s) {
+    return mem_strcopy(tag, s, strlen(s));
+}
+
+/* Timers */
+
+#define TIMER_RESOLUTION    10          /* Milliseconds per tick */
+#define TIMER_BITS          6
+#define TIMER_SLOTS         (1 << TIMER_BITS)
+#define TIMER_LEVELS        4           /* 64^4 ticks (about 46 hours) of range */
+
+typedef struct timer Timer;
+typedef struct timer_wheel TimerWheel;
+struct timer {
+    Timer      *next;                   /**< Next timer in slot (NULL if not pending) */
+    Timer      *prev;                   /**< Previous timer in slot */
+    TimerWheel *wheel;                  /**< Wheel the timer is armed on */
+    uint64_t    expires;                /**< Expiry tick */
+    void      (*callback)(Timer *timer);/**< Called (disarmed) on expiry */
+};
+
+struct timer_wheel {
+    Timer       slots[TIMER_LEVELS][TIMER_SLOTS]; /**< Slot list sentinels */
+    uint64_t    tick;                   /**< Current tick */
+    size_t      count;                  /**< Pending timers */
+};
+
+uint64_t        timer_now(void);
+void            timer_wheel_init(TimerWheel *wheel, uint64_t now);
+void            timer_add(TimerWheel *wheel, Timer *timer, uint64_t when);
+void            timer_cancel(Timer *timer);
+bool            timer_pending(const Timer *timer);
+void            timer_advance(TimerWheel *wheel, uint64_t now);
+int             timer_timeout(const TimerWheel *wheel);
+
+/* Connections */
+
+#define CONNECTION_BUFFER_MAX   8192    /* Largest request head */
+
+typedef enum {
+    CONNECTION_WAIT,                    /* Waiting for (more of) a request */
+    CONNECTION_CLOSE,                   /* Done; close the socket */
+    CONNECTION_BUSY,                    /* Handed to a scheduler worker */
+} ConnectionState;
+
+typedef struct request Request;
+typedef struct connection Connection;
+typedef struct http2_session Http2Session;
+typedef struct http2_stream Http2Stream;
+struct connection {
+    int     fd;                         /**< Client socket file descriptor */
+    struct sockaddr_storage addr;       /**< Raw client socket address */
+    socklen_t addrlen;                  /**< Length of client socket address */
+    char    host[NI_MAXHOST];           /**< Numeric address of client */
+    char    port[NI_MAXSERV];           /**< Port number of client */
+
+    char    buffer[CONNECTION_BUFFER_MAX]; /**< Request head(s) received so far */
+    size_t  length;                     /**< Bytes in buffer */
+    size_t  requests;                   /**< Requests served */
+    bool    idle;                       /**< Deadline is the keep-alive idle time */
+    uint64_t deadline;                  /**< Current deadline (timer_now ms, 0 = none) */
+    Timer   timer;                      /**< Deadline timer (event loop) */
+    bool    eof;                        /**< Client has finished sending */
+
+    Request *request;                   /**< Request awaiting a scheduler worker */
+    size_t  head;                       /**< Length of its head in buffer */
+    bool    keepalive;                  /**< Connection survived the request */
+    int     lane;                       /**< Scheduler lane of the request */
+    Connection *next;                   /**< Next connection in a scheduler list */
+    Connection *older;                  /**< Previously accepted connection still open (event loop) */
+    Connection *newer;                  /**< Next accepted connection still open (event loop) */
+
+    Http2Session *h2;                   /**< HTTP/2 session once the connection has switched */
+};
+
+bool            timeouts_configure(const char *spec);
+Connection *    connection_new(int fd, const struct sockaddr *addr, socklen_t addrlen);
+Connection *    connection_accept(int lfd);
+ConnectionState connection_process(Connection *c);
+void            connection_run(Connection *c);
+ConnectionState connection_resume(Connection *c);
+void            connection_expire(Connection *c);
+int             connection_serve(Connection *c);
+void            connection_free(Connection *c);
+
+/* Static Index */
+
+typedef enum {
+    INDEX_FILE,                         /* Static file */
+    INDEX_DIR,                          /* Directory listing */
+    INDEX_CGI,                          /* Executable script */
+    INDEX_PROXY,                        /* Forwarded to an upstream pool */
+} IndexKind;
+
+typedef struct {
+    uint64_t    hash;                   /**< Hash of the URI */
+    uint32_t    uri;                    /**< URI (string pool offset) */
+    uint32_t    path;                   /**< Full path (string pool offset) */
+    uint32_t    mimetype;               /**< MIME type (string pool offset) */
+    uint32_t    etag;                   /**< ETag (string pool offset) */
+    int32_t     fd;                     /**< Open file or directory (-1 for CGI) */
+    uint32_t    kind;                   /**< IndexKind */
+    uint64_t    size;                   /**< Size in bytes */
+    time_t      mtime;                  /**< Modification time */
+    const char *data;                   /**< Mapped (locked) contents, or NULL */
+} IndexEntry;
+
+int                 index_build(void);
+const IndexEntry *  index_lookup(const char *uri);
+const char *        index_string(uint32_t offset);
 
 /* HTTP Request */
 
 typedef struct header Header;
+typedef struct pack_body PackBody;
+typedef struct proxy_pool ProxyPool;
 struct header {
-    char    *name;                      /*< Name of header entry */
-    char    *value;                     /*< Value of header entry */
-    Header  *next;                      /*< Next header entry */
+    char    *name;                      /**< Name of header entry */
+    char    *value;                     /**< Value of header entry */
+    Header  *next;                      /**< Next header entry */
 };
 
-typedef struct {
-    int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
-    char    *method;                    /*< HTTP method */
-    char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
-    char    *query;                     /*< HTTP query string */
+struct request {
+    int     fd;                         /**< Client socket file descripter */
+    FILE    *file;                      /**< Client socket file stream */
+    char    *method;                    /**< HTTP method */
+    char    *uri;                       /**< HTTP uniform resource identifier */
+    char    *path;                      /**< Real path corrsponding to URI and RootPath */
+    int     pathfd;                     /**< Open resource beneath RootFd (-1 if none) */
+    struct stat st;                     /**< Status of the open resource */
+    IndexKind kind;                     /**< Kind of resource (once resolved) */
+    const IndexEntry *entry;            /**< Static index record, or NULL */
+    const PackBody *packed;             /**< Pack archive representation, or NULL */
+    const ProxyPool *upstream;          /**< Upstream pool the request is forwarded to, or NULL */
+    char    *query;                     /**< HTTP query string */
+
+    struct sockaddr_storage addr;       /**< Raw client socket address */
+    socklen_t addrlen;                  /**< Length of client socket address */
+    char host[NI_MAXHOST];              /**< Numeric address of client */
+    char port[NI_MAXSERV];              /**< Port number of client */
+    char hostname[NI_MAXHOST];          /**< Resolved host name of client (lazy) */
 
-    char host[NI_MAXHOST];              /*< Host name of client */
-    char port[NI_MAXSERV];              /*< Port number of client */
+    int     version;                    /**< HTTP minor version (0 or 1) */
+    bool    keepalive;                  /**< Connection stays open after the response */
 
-    Header  *headers;                   /*< List of name, value Header pairs */
-} Request;
+    Header  *headers;                   /**< List of name, value Header pairs */
+    Http2Stream *stream;                /**< HTTP/2 stream carrying the request, or NULL */
+
+    int64_t content_length;             /**< Content-Length of the body (-1 = none given) */
+    bool    chunked;                    /**< Body uses the chunked transfer coding */
+    bool    body_done;                  /**< Body has been consumed (or there is none) */
+    char    *buffered;                  /**< Bytes that arrived after the head */
+    size_t  buffered_length;            /**< Number of them */
+    size_t  buffered_used;              /**< Number consumed as body */
+};
 
-Request *       accept_request(int sfd);
+Request *       accept_request(Connection *c, size_t length);
 void	        free_request(Request *request);
+void            free_headers(Header *headers);
 int	        parse_request(Request *request);
+const char *    request_header(Request *request, const char *name);
+
+/* Waits for a full pipe to take more (as coroutine_poll for POLLOUT), free
+ * to do other work meanwhile; NULL waits on the pipe alone */
+typedef int (*PipeWait)(int pipefd, void *context);
+
+int             request_body_parse(Request *request);
+ssize_t         request_body_splice(Request *request, int pipefd, PipeWait wait, void *context);
+ssize_t         request_body_relay(Request *request, int fd);
+void            request_body_skip(Request *request);
+
+/* HPACK */
+
+#define HPACK_TABLE_SIZE    4096        /* Dynamic table size (SETTINGS_HEADER_TABLE_SIZE default) */
+
+typedef struct hpack_field HpackField;
+
+typedef struct {
+    HpackField *fields;                 /**< Ring of entries */
+    size_t      capacity;               /**< Slots in fields (power of two) */
+    size_t      first;                  /**< Slot of the newest entry */
+    size_t      count;                  /**< Entries in the table */
+    size_t      size;                   /**< Size of the entries (RFC 7541 section 4.1) */
+    size_t      max;                    /**< Current maximum size */
+    size_t      limit;                  /**< Largest maximum the peer allows */
+    bool        resized;                /**< Encoder must announce max in its next block */
+} HpackTable;
+
+void            hpack_init(HpackTable *t, size_t limit);
+void            hpack_limit(HpackTable *t, size_t limit);
+void            hpack_free(HpackTable *t);
+int             hpack_decode(HpackTable *t, const uint8_t *block, size_t length, Header **headers);
+ssize_t         hpack_encode(HpackTable *t, uint8_t *out, size_t size, const char *name, size_t name_length,
+                             const char *value, size_t value_length, bool index);
 
 /* HTTP Request Handlers */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_TOO_MANY_REQUESTS,	/* 429 Too Many Requests */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } HTTPStatus;
 
 HTTPStatus      handle_request(Request *request);
+HTTPStatus      handle_prepare(Request *request);
+HTTPStatus      handle_resolved(Request *request);
+HTTPStatus      handle_error(Request *request, HTTPStatus status);
+
+/* HTTP Response */
+
+#define RESPONSE_HEADERS_MAX    2048    /* Preallocated header block */
+#define RESPONSE_BODY_INITIAL   4096    /* First body allocation */
+#define RESPONSE_INLINE_MAX     16384   /* Largest file sent with its headers in one writev */
+
+typedef struct {
+    Request    *request;                /**< Request being answered */
+    HTTPStatus  status;                 /**< Response status */
+    char        headers[RESPONSE_HEADERS_MAX]; /**< Status line and headers */
+    size_t      length;                 /**< Bytes used in headers */
+    bool        overflow;               /**< A header did not fit */
+    bool        streaming;              /**< Body length is not known in advance */
+    bool        chunked;                /**< Streamed body uses chunked coding */
+    bool        head;                   /**< HEAD over HTTP/1.x: framing headers but no body */
+    char       *body;                   /**< Buffered body */
+    size_t      body_length;            /**< Bytes used in body */
+    size_t      body_capacity;          /**< Bytes allocated for body */
+} Response;
+
+void            response_init(Response *res, Request *r, HTTPStatus status);
+void            response_init_status(Response *res, Request *r, const char *status);
+void            response_stream(Response *res);
+void            response_header(Response *res, const char *name, const char *format, ...)
+                    __attribute__((format(printf, 3, 4)));
+void            response_content_type(Response *res, const char *mimetype);
+void            response_content_length(Response *res, size_t length);
+void            response_date(Response *res);
+void            response_connection(Response *res);
+void            response_last_modified(Response *res, time_t mtime);
+void            response_cache_control(Response *res, const char *policy);
+void            response_validators(Response *res, const char *etag, time_t mtime);
+int             response_append(Response *res, const char *format, ...)
+                    __attribute__((format(printf, 2, 3)));
+int             response_reserve(Response *res, size_t size);
+ssize_t         response_send(Response *res, const void *body, size_t length);
+ssize_t         response_send_head(Response *res, int64_t length);
+ssize_t         response_send_file(Response *res, int fd, off_t offset, size_t size);
+ssize_t         response_send_chunk(Response *res, const void *data, size_t length);
+ssize_t         response_end(Response *res);
+void            response_free(Response *res);
+
+/* Pack Archive */
+
+#define PACK_MAGIC      "SPIDPAK1"      /* Archives use the byte order of the host that built them */
+
+typedef struct {
+    char        magic[8];               /**< PACK_MAGIC */
+    uint32_t    count;                  /**< Number of entries */
+    uint32_t    slots;                  /**< Hash table slots (power of two, > count) */
+    uint64_t    table;                  /**< Offset of uint32_t slots (entry + 1, 0 = empty) */
+    uint64_t    entries;                /**< Offset of PackEntry records */
+    uint64_t    size;                   /**< Archive size in bytes */
+} PackHeader;
+
+struct pack_body {
+    uint64_t    headers;                /**< Offset of header lines (CRLF-separated, no final CRLF) */
+    uint64_t    etag;                   /**< Offset of ETag (NUL-terminated) */
+    uint64_t    body;                   /**< Offset of body */
+    uint64_t    body_length;            /**< Body size in bytes (0 for no gzip variant) */
+    uint32_t    headers_length;         /**< Size of header lines */
+    uint32_t    reserved;
+};
+
+typedef struct {
+    uint64_t    hash;                   /**< string_hash of the key */
+    uint64_t    key;                    /**< Offset of decoded path below the root ("." for the root) */
+    int64_t     mtime;                  /**< Modification time */
+    PackBody    identity;               /**< Uncompressed representation */
+    PackBody    gzip;                   /**< Pre-compressed representation, if any */
+} PackEntry;
+
+int                 pack_open(const char *path);
+const PackEntry *   pack_lookup(const char *uri);
+const char *        pack_data(uint64_t offset);
+ssize_t             pack_send(Response *res, const PackBody *body);
+
+/* Scheduler */
+
+#define SCHEDULER_WORKERS_MAX   256
+#define SCHEDULER_SMALL_MAX     65536   /* Largest file counted as a cheap (cached) hit */
+
+bool            scheduler_configure(const char *spec);
+int             scheduler_start(void);
+bool            scheduler_active(void);
+void            scheduler_submit(Connection *c, Lane lane);
+Connection *    scheduler_completed(void);
+size_t          scheduler_queued(Lane lane);
+Lane            request_lane(Request *request);
+
+/* Coroutines */
+
+#define COROUTINE_STACK_DEFAULT 65536
+
+int             coroutine_start(TimerWheel *wheel);
+bool            coroutine_active(void);
+bool            coroutine_on_loop(void);
+void            coroutine_stop(void);
+bool            coroutine_spawn(void (*function)(void *), void *argument);
+void            coroutine_run(void);
+void *          coroutine_finished(void);
+int             coroutine_poll(int fd, short events, int timeout);
+int             coroutine_pollv(struct pollfd *fds, nfds_t nfds, int timeout);
+void            coroutine_sleep(int milliseconds);
+
+/* HTTP/2 */
+
+#define HTTP2_PREFACE           "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH    24
+#define HTTP2_FRAME_MAX         16384   /* Largest frame accepted (SETTINGS_MAX_FRAME_SIZE) */
+#define HTTP2_STREAMS_MAX       100     /* Most open streams per connection */
+#define HTTP2_HEADERS_MAX       65536   /* Largest request header block */
+
+bool            http2_upgradable(Request *request);
+ConnectionState http2_start(Connection *c, Request *request, HTTPStatus status);
+ConnectionState http2_process(Connection *c);
+void            http2_run(Connection *c);
+ConnectionState http2_resume(Connection *c);
+void            http2_expire(Connection *c);
+void            http2_free(Http2Session *s);
+ssize_t         http2_send_headers(Request *request, const char *headers, size_t length, bool end);
+ssize_t         http2_send_data(Request *request, const void *data, size_t length, bool end);
+ssize_t         http2_send_file(Request *request, int fd, off_t offset, size_t size);
 
 /* HTTP Server */
 
 int             single_server(int sfd);
+void            single_forked(Connection *keep);
 int             forking_server(int sfd);
+int             hybrid_server(int sfd);
+bool            hybrid_active(void);
+bool            hybrid_fork(Connection *c, Request *r);
 
 /* Socket */
 
+#define SOCKET_LISTENERS_MAX    4
+#define SOCKET_PIPES_MAX        8       /* Idle relay pipes kept per thread */
+#define SOCKET_PIPE_SIZE        262144  /* Capacity asked of each relay pipe */
+
+extern int      ListenFds[SOCKET_LISTENERS_MAX];
+extern size_t   ListenCount;
+
+bool            socket_configure(const char *spec);
 int	        socket_listen(const char *port);
+int             socket_accept(int sfd, struct sockaddr *addr, socklen_t *addrlen);
+int             socket_accept_ready(int lfd, struct sockaddr *addr, socklen_t *addrlen);
+void            socket_cork(int fd, bool on);
+FILE *          socket_stream(int fd);
+ssize_t         socket_writev(int fd, struct iovec *iov, int iovcnt);
+ssize_t         socket_send_more(int fd, const void *buffer, size_t length);
+ssize_t         socket_sendfile(int fd, int in_fd, off_t *offset, size_t count);
+ssize_t         socket_recv(int fd, void *buffer, size_t size);
+ssize_t         socket_splice(int fd, int pipefd, size_t count, PipeWait wait, void *context);
+ssize_t         socket_relay(int from, int to, size_t count);
+
+/* CPU Affinity */
+
+bool            affinity_configure(const char *spec);
+int             affinity_start(void);
+int             affinity_spawn(void);
+void            affinity_pin(int slot);
+void            affinity_pin_thread(int index);
+int             affinity_slot(int fd);
+
+/* Overload Protection */
+
+bool            overload_configure(const char *spec);
+bool            overload_admit(ShedReason reason, size_t load);
+void            overload_shed(int fd, ShedReason reason);
+uint64_t        overload_shed_count(ShedReason reason);
+
+/* Rate Limits */
+
+bool            ratelimit_configure(const char *spec);
+int             ratelimit_start(void);
+bool            ratelimit_request(Request *r);
+int             ratelimit_retry(void);
+size_t          ratelimit_slice(void);
+void            ratelimit_pace(Request *r, size_t length);
+
+/* Negative Cache */
+
+bool            negcache_configure(const char *spec);
+int             negcache_start(void);
+bool            negcache_lookup(const char *uri, uint32_t *generation);
+void            negcache_insert(const char *uri, uint32_t generation);
+ssize_t         negcache_send(Request *r);
+
+/* Reverse Proxy */
+
+bool            proxy_configure(const char *spec);
+int             proxy_start(void);
+void            proxy_forked(void);
+const ProxyPool *proxy_route(const char *uri);
+HTTPStatus      handle_proxy_request(Request *r);
+
+/* Resolver */
+
+int             resolver_start(void);
+const char *    resolver_lookup(const struct sockaddr *sa, char *host, size_t hostlen);
+const char *    request_hostname(Request *r);
 
 /* Utilities */
 
@@ -92,8 +660,16 @@ int	        socket_listen(const char *port);
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
 char *	        determine_mimetype(const char *path);
-char *	        determine_request_path(const char *uri);
+bool            decode_request_path(const char *uri, char *buffer, size_t size);
+int	        determine_request_path(const char *uri, char **path, struct stat *st);
 const char *    http_status_string(HTTPStatus status);
+size_t          http_date(time_t when, char *buffer, size_t size);
+size_t          http_etag(const struct stat *st, char *buffer, size_t size);
+uint64_t        string_hash(const char *s, size_t length);
+size_t          address_key(const struct sockaddr *sa, uint8_t key[16]);
+uint32_t        address_hash(uint8_t family, const uint8_t key[16]);
+bool            parse_size(const char *s, char **end, double *value);
+bool            header_token(const char *name);
 char *	        skip_nonwhitespace(char *s);
 char *	        skip_whitespace(char *s);
 
@@ -14,6 +14,7 @@ error() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
+    stop_server
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -37,7 +38,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($0) ~ /^content-type/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -66,6 +67,28 @@ grep_count() {
     return 0;
 }
 
+grep_header() {
+    if ! grep -q -i -E "$1" $WORKSPACE/header; then
+	echo "FAILURE: Missing header '$1'" > $WORKSPACE/test
+	return 1;
+    fi
+    return 0;
+}
+
+start_server() {
+    ./$PROGRAM -p $TEST_PORT "$@" > $WORKSPACE/server.log 2>&1 &
+    SERVER=$!
+    sleep 1
+}
+
+stop_server() {
+    if [ -n "$SERVER" ]; then
+	kill $SERVER 2> /dev/null
+	wait $SERVER 2> /dev/null
+	SERVER=
+    fi
+}
+
 check_hrefs() {
     if [ "$(sed -En 's/.*href="([^"]+)".*/\1/p' $WORKSPACE/test | sort | paste -s -d ,)" != $1 ]; then
 	echo "FAILURE: hrefs != $1" > $WORKSPACE/test
@@ -115,7 +138,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -138,9 +161,9 @@ fi
 sleep 2
 
 printf "     %-60s ... " "/scripts"
-HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh"
+HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/echo.sh,/scripts/env.sh"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts > $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all ".. cowsay.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+if ! check_status $? 0 || ! grep_all ".. cowsay.sh echo.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
 else
     echo "Success"
@@ -163,7 +186,7 @@ printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=55cdbe19dcf3ea685707213cdada01ef
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "avengers Spidey html" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -265,7 +288,7 @@ sleep 2
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -297,3 +320,489 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Conditional Requests"
+
+printf "     %-60s ... " "/html/index.html If-None-Match"
+curl -s -D $WORKSPACE/header -o /dev/null $HOST:$PORT/html/index.html
+ETAG=$(awk 'tolower($1) == "etag:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+MODIFIED=$(awk 'tolower($1) == "last-modified:" { $1 = ""; print substr($0, 2) }' $WORKSPACE/header | tr -d '\r\n')
+STATUS="HTTP/1.1 304 Not Modified"
+curl -s -D $WORKSPACE/header -H "If-None-Match: $ETAG" $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || [ -z "$ETAG" ] || [ -s $WORKSPACE/test ] || ! grep_header "^$STATUS"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/html/index.html If-Modified-Since"
+curl -s -D $WORKSPACE/header -H "If-Modified-Since: $MODIFIED" $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || [ -z "$MODIFIED" ] || [ -s $WORKSPACE/test ] || ! grep_header "^$STATUS"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/html/index.html If-None-Match (stale)"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header -H 'If-None-Match: "stale"' $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Keep-Alive"
+
+printf "     %-60s ... " "Two requests, one connection"
+curl -s -o /dev/null -w "%{num_connects}" $HOST:$PORT/ --next -s -o /dev/null -w "%{num_connects}" $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != "10" ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "HEAD then GET"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+curl -s -I -o $WORKSPACE/header $HOST:$PORT/html/index.html --next -s -o $WORKSPACE/test $HOST:$PORT/html/index.html
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! grep_header "^Content-Length: 943"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Streamed CGI Output"
+
+printf "     %-60s ... " "/scripts/env.sh (HTTP/1.1, chunked)"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=GET" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT" || ! grep_header "^Transfer-Encoding: chunked"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (HTTP/1.0, not chunked)"
+STATUS="HTTP/1.0 200 OK"
+curl -s -0 -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=GET" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT" || grep -q -i "^Transfer-Encoding" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle HTTP/2"
+
+printf "     %-60s ... " "/html/index.html (prior knowledge)"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/2 200 "
+CONTENT="text/html"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/html/index.html (Upgrade: h2c)"
+curl -s --http2 -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_header "^HTTP/1.1 101 " || ! grep_header "^HTTP/2 200"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "Two streams, one connection"
+if ! command -v nghttp > /dev/null; then
+    echo "Skipped (no nghttp)"
+else
+    nghttp -nv http://$HOST:$PORT/html/index.html http://$HOST:$PORT/text/lyrics.txt > $WORKSPACE/test 2>&1
+    if ! check_status $? 0 || [ $(grep -c -E "recv \(stream_id=[0-9]+\) :status: 200" $WORKSPACE/test) -ne 2 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (prior knowledge)"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=GET REQUEST_URI=/scripts/env.sh" $WORKSPACE/test || ! grep_header "^HTTP/2 200"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/asdf (prior knowledge)"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! grep_header "^HTTP/2 404"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Request Bodies"
+
+head -c 1300000 /dev/urandom > $WORKSPACE/upload
+UPLOAD=$(md5sum $WORKSPACE/upload | awk '{print $1}')
+
+printf "     %-60s ... " "POST /scripts/env.sh"
+curl -s -D $WORKSPACE/header --data-binary "name=spidey" $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=POST CONTENT_LENGTH=11" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "POST /scripts/echo.sh (1.3 MB)"
+curl -s -m 30 --data-binary @$WORKSPACE/upload $HOST:$PORT/scripts/echo.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $UPLOAD; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "POST /scripts/echo.sh (1.3 MB, chunked)"
+curl -s -m 30 -H "Transfer-Encoding: chunked" --data-binary @$WORKSPACE/upload $HOST:$PORT/scripts/echo.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $UPLOAD; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Cached Errors"
+
+printf "     %-60s ... " "/asdf (twice)"
+STATUS="HTTP/1.1 404 Not Found"
+CONTENT="text/html"
+curl -s -o /dev/null $HOST:$PORT/asdf
+curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "HEAD /asdf then GET"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/1.1 404 Not Found"
+curl -s -I -o $WORKSPACE/header $HOST:$PORT/asdf --next -s -o $WORKSPACE/test $HOST:$PORT/html/index.html
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+# ------------------------------------------------------------------------------
+
+# The remaining checks start servers of their own with particular options,
+# on the port after PORT, from the spidey built in this directory
+
+if [ ! -x ./$PROGRAM ] || [ ! -d www ]; then
+    echo
+    echo "Skipping server option checks (no ./$PROGRAM or www here)"
+    exit
+fi
+
+TEST_PORT=$((PORT + 1))
+
+printf "\n %-64s ... \n" "Handle Timeouts"
+
+start_server -r www -t header=1,idle=1
+
+printf "     %-60s ... " "Incomplete request head"
+exec 3<> /dev/tcp/localhost/$TEST_PORT
+printf "GET / HTTP/1.1\r\n" >&3
+timeout 5 cat <&3 > $WORKSPACE/test
+STATUS_CODE=$?
+exec 3<&-
+if ! check_status $STATUS_CODE 0 || ! grep_all "408" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "Idle keep-alive connection"
+exec 3<> /dev/tcp/localhost/$TEST_PORT
+printf "GET /html/index.html HTTP/1.1\r\nHost: localhost\r\n\r\n" >&3
+timeout 5 cat <&3 > $WORKSPACE/test
+STATUS_CODE=$?
+exec 3<&-
+if ! check_status $STATUS_CODE 0 || ! grep_all "Spidey" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Static Index"
+
+start_server -r www --index
+
+printf "     %-60s ... " "/html/index.html"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/text"
+HREFS="/text/..,/text/hackers.txt,/text/lyrics.txt"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/text > $WORKSPACE/test
+if ! check_status $? 0 || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/scripts/env.sh"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=GET" $WORKSPACE/test || ! check_header "$STATUS" "text/plain"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/asdf"
+STATUS="HTTP/1.1 404 Not Found"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Pack Archives"
+
+./pack -z www $WORKSPACE/www.pack > /dev/null 2>&1
+start_server -r pack:$WORKSPACE/www.pack
+
+printf "     %-60s ... " "/html/index.html"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! grep_header "^Content-Length: 943"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/html/index.html (gzip)"
+curl -s --compressed -D $WORKSPACE/header localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_header "^Content-Encoding: gzip" || ! grep_header "^Vary: Accept-Encoding"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/text"
+HREFS="/text/..,/text/hackers.txt,/text/lyrics.txt"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/text > $WORKSPACE/test
+if ! check_status $? 0 || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/asdf"
+STATUS="HTTP/1.1 404 Not Found"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Scheduler Lanes"
+
+start_server -r www -s workers=2
+
+printf "     %-60s ... " "Concurrent files and scripts"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+CLIENTS=
+for i in 1 2 3 4; do
+    curl -s -m 10 -o $WORKSPACE/static.$i localhost:$TEST_PORT/html/index.html &
+    CLIENTS="$CLIENTS $!"
+    curl -s -m 10 -o $WORKSPACE/cgi.$i localhost:$TEST_PORT/scripts/env.sh &
+    CLIENTS="$CLIENTS $!"
+done
+wait $CLIENTS
+MISSING=0
+for i in 1 2 3 4; do
+    if [ "$(md5sum < $WORKSPACE/static.$i | awk '{print $1}')" != $MD5SUM ] || ! grep -q "REQUEST_METHOD=GET" $WORKSPACE/cgi.$i; then
+	MISSING=$((MISSING + 1))
+    fi
+done
+if [ $MISSING -ne 0 ]; then
+    echo "FAILURE: $MISSING of 4 pairs of replies missing or wrong" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Limits"
+
+start_server -r www -o connections=1
+
+printf "     %-60s ... " "Connection limit"
+STATUS="HTTP/1.0 503 Service Unavailable"
+exec 3<> /dev/tcp/localhost/$TEST_PORT
+printf "GET / HTTP/1.1\r\n" >&3
+sleep 1
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+STATUS_CODE=$?
+exec 3<&-
+if ! check_status $STATUS_CODE 0 || ! grep_header "^$STATUS" || ! grep_header "^Retry-After: "; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+start_server -r www -q requests=1:1
+
+printf "     %-60s ... " "Request rate"
+STATUS="HTTP/1.1 429 Too Many Requests"
+curl -s -o /dev/null localhost:$TEST_PORT/html/index.html
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_header "^$STATUS" || ! grep_header "^Retry-After: "; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Coroutines"
+
+start_server -r www --coroutines
+
+printf "     %-60s ... " "/html/index.html during a stalled upload"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+(sleep 3; echo spidey) | curl -s -m 10 -X POST -T - -o $WORKSPACE/stalled localhost:$TEST_PORT/scripts/echo.sh &
+STALLED=$!
+sleep 1
+curl -s -m 1 localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+STATUS_CODE=$?
+wait $STALLED
+if ! check_status $STATUS_CODE 0 || ! check_md5sum $MD5SUM || [ "$(cat $WORKSPACE/stalled)" != "spidey" ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "POST /scripts/echo.sh (1.3 MB)"
+curl -s -m 30 --data-binary @$WORKSPACE/upload localhost:$TEST_PORT/scripts/echo.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $UPLOAD; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Upstreams"
+
+start_server -r www -u /html=$HOST:$PORT
+
+printf "     %-60s ... " "/html/index.html (proxied)"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header localhost:$TEST_PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+# A name padded before the colon must not reach a pooled backend as framing
+printf "     %-60s ... " "Content-Length with a padded name (proxied)"
+STATUS="HTTP/1.1 400 Bad Request"
+exec 3<> /dev/tcp/localhost/$TEST_PORT
+env printf "POST /html/index.html HTTP/1.1\r\nHost: localhost\r\nContent-Length : 27\r\n\r\nGET /html/index.html HTTP/1.1\r\n\r\n" >&3 2> /dev/null
+timeout 5 cat <&3 > $WORKSPACE/test
+STATUS_CODE=$?
+exec 3<&-
+if ! check_status $STATUS_CODE 0 || [ "$(head -n 1 $WORKSPACE/test | tr -d '\r')" != "$STATUS" ] || [ $(grep -c "^HTTP/" $WORKSPACE/test) -ne 1 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
+
+printf "\n %-64s ... \n" "Handle Hybrid Mode"
+
+start_server -r www -c hybrid
+
+printf "     %-60s ... " "/html/index.html then POST /scripts/echo.sh"
+curl -s -o /dev/null -w "%{http_code}" localhost:$TEST_PORT/html/index.html --next -s -m 30 --data-binary @$WORKSPACE/upload -o $WORKSPACE/test localhost:$TEST_PORT/scripts/echo.sh > $WORKSPACE/header
+if ! check_status $? 0 || ! check_md5sum $UPLOAD || [ "$(cat $WORKSPACE/header)" != "200" ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
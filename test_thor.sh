@@ -352,3 +352,94 @@ if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5s
 else
     echo "Success"
 fi
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s\n" "Replay"
+
+# Replays run against a local server so results do not depend on the network
+PORT=${PORT:-9876}
+DOMAIN=http://localhost:$PORT
+python3 -m http.server $PORT --bind 127.0.0.1 --directory www &> /dev/null &
+SERVER=$!
+trap "kill $SERVER 2> /dev/null; cleanup" EXIT
+trap "kill $SERVER 2> /dev/null; cleanup 1" INT TERM
+sleep 1
+
+cat > $WORKSPACE/trace <<EOF
+127.0.0.1 - - [05/May/2018:15:02:23 -0400] "GET /html/index.html HTTP/1.1" 200 943
+127.0.0.1 - - [05/May/2018:15:02:23 -0400] "POST /scripts/env.sh HTTP/1.1" 200 1024
+127.0.0.1 - - [05/May/2018:15:02:24 -0400] "GET /text/hackers.txt HTTP/1.1" 200 2514
+127.0.0.1 - - [05/May/2018:15:02:24 -0400] "GET /asdf HTTP/1.1" 404 84
+EOF
+
+cat > $WORKSPACE/offsets <<EOF
+0.0 /html/index.html
+1.0 /text/lyrics.txt
+EOF
+
+cat > $WORKSPACE/mix <<EOF
+# weight uri [class]
+3 /html/index.html
+1 /text/hackers.txt
+1 /text/ browse
+EOF
+
+# Print "requests errors" of one class from a JSON report
+summary() {
+    python3 -c 'import json, sys; c = json.load(sys.stdin)["classes"].get(sys.argv[1], {}); print(c.get("requests", 0), c.get("errors", 0))' $1 < ${2:-$WORKSPACE/test}
+}
+
+elapsed() {
+    python3 -c 'import json, sys; print(json.load(sys.stdin)["elapsed"])' < $WORKSPACE/test
+}
+
+printf "     %-60s ... " "$DOMAIN (-t trace)"
+./$PROGRAM -t $WORKSPACE/trace -s 0 $DOMAIN &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "class requests errors static browse TOTAL Skipped" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "$DOMAIN (-t trace -j)"
+./$PROGRAM -t $WORKSPACE/trace -s 0 -j $DOMAIN 2> /dev/null > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(summary TOTAL)" != "3 1" ] || [ "$(summary static)" != "2 0" ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "$DOMAIN (-t offsets -s 2 -j)"
+./$PROGRAM -t $WORKSPACE/offsets -s 2 -j $DOMAIN > $WORKSPACE/test 2>&1
+if ! check_status $? 0 || [ "$(summary TOTAL)" != "2 0" ] || ! python3 -c "import sys; sys.exit(not 0.5 <= $(elapsed) < 2.5)"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "$DOMAIN (-p 2 -m mix -r 10 -S 1 -j)"
+./$PROGRAM -p 2 -m $WORKSPACE/mix -r 10 -S 1 -j $DOMAIN > $WORKSPACE/test 2>&1
+if ! check_status $? 0 || [ "$(summary TOTAL)" != "20 0" ] || [ "$(summary browse | cut -d ' ' -f 1)" -eq 0 ]; then
+    error "Failure"
+else
+    cp $WORKSPACE/test $WORKSPACE/mix.1
+    echo "Success"
+fi
+
+printf "     %-60s ... " "$DOMAIN (-p 2 -m mix -r 10 -S 1 -j, same seed)"
+./$PROGRAM -p 2 -m $WORKSPACE/mix -r 10 -S 1 -j $DOMAIN > $WORKSPACE/test 2>&1
+if ! check_status $? 0 || [ "$(summary static)" != "$(summary static $WORKSPACE/mix.1)" ] || \
+   [ "$(summary browse)" != "$(summary browse $WORKSPACE/mix.1)" ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "$DOMAIN (-m mix -r 10 -R 20 -S 1 -j)"
+./$PROGRAM -m $WORKSPACE/mix -r 10 -R 20 -S 1 -j $DOMAIN > $WORKSPACE/test 2>&1
+if ! check_status $? 0 || [ "$(summary TOTAL)" != "10 0" ] || ! python3 -c "import sys; sys.exit(not $(elapsed) >= 0.2)"; then
+    error "Failure"
+else
+    echo "Success"
+fi
@@ -0,0 +1,883 @@
+/* thor.c: Native HTTP Load Generator */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define fatal(M, ...)   do { fprintf(stderr, "thor: " M "\n", ##__VA_ARGS__); exit(EXIT_FAILURE); } while (0)
+
+#define THOR_MAX_EVENTS     1024            /* Events per epoll_wait */
+#define THOR_HEADER_MAX     16384           /* Largest response header block */
+#define THOR_READ_SIZE      65536           /* Shared socket read buffer */
+#define THOR_TICK_MS        10              /* Timeout / pacing resolution */
+
+#define HIST_SUB_BITS       7               /* 2^7 linear sub-buckets (<1% error) */
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT     (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS        (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+/**
+ * Latency histogram (log-linear buckets in microseconds, HdrHistogram style).
+ */
+typedef struct {
+    uint64_t    counts[HIST_BUCKETS];       /**< Count per bucket */
+    uint64_t    total;                      /**< Number of samples */
+    uint64_t    min;                        /**< Smallest sample */
+    uint64_t    max;                        /**< Largest sample */
+    double      sum;                        /**< Sum of samples */
+    double      sum2;                       /**< Sum of squared samples */
+} Histogram;
+
+/**
+ * Response parser states.
+ */
+typedef enum {
+    PARSE_HEADER,                           /**< Accumulating header block */
+    PARSE_BODY_LENGTH,                      /**< Reading Content-Length bytes */
+    PARSE_BODY_EOF,                         /**< Reading until connection close */
+    PARSE_CHUNK_SIZE,                       /**< Reading chunk size line */
+    PARSE_CHUNK_DATA,                       /**< Reading chunk payload */
+    PARSE_CHUNK_END,                        /**< Reading CRLF after payload */
+    PARSE_TRAILER,                          /**< Reading trailer lines */
+    PARSE_DONE,                             /**< Response complete */
+} ParseState;
+
+/**
+ * Connection states.
+ */
+typedef enum {
+    CONN_CLOSED,                            /**< No socket */
+    CONN_CONNECTING,                        /**< Non-blocking connect in flight */
+    CONN_WRITING,                           /**< Sending request */
+    CONN_READING,                           /**< Receiving response */
+    CONN_IDLE,                              /**< Open keep-alive socket, no request */
+} ConnState;
+
+typedef struct connection Connection;
+struct connection {
+    int         fd;                         /**< Socket file descriptor */
+    int         slot;                       /**< Index in connection array */
+    ConnState   state;                      /**< Connection state */
+    ParseState  parse;                      /**< Response parser state */
+
+    size_t      woff;                       /**< Bytes of request already sent */
+    char        *hbuf;                      /**< Header / line accumulation buffer */
+    size_t      hlen;                       /**< Bytes in hbuf */
+    uint64_t    remaining;                  /**< Body or chunk bytes remaining */
+    bool        close_after;                /**< Server will close after response */
+
+    int         status;                     /**< HTTP status code */
+    uint64_t    received;                   /**< Bytes received for response */
+    uint64_t    intended_ns;                /**< Scheduled start (open loop) */
+    uint64_t    start_ns;                   /**< Actual start of request */
+    unsigned    served;                     /**< Responses on this socket */
+    unsigned    completed;                  /**< Requests completed by slot (compat) */
+    double      elapsed;                    /**< Sum of elapsed seconds by slot (compat) */
+    bool        active;                     /**< Request outstanding */
+};
+
+/* Options */
+
+static const char  *Url         = NULL;
+static char        *Host        = NULL;
+static char        *Service     = NULL;
+static char        *Path        = NULL;
+static size_t       Connections = 1;
+static uint64_t     Requests    = 0;        /* 0 means limited by duration */
+static double       Duration    = 0;        /* Seconds, 0 means limited by Requests */
+static double       Rate        = 0;        /* Requests per second, 0 means closed loop */
+static double       Timeout     = 30;       /* Seconds per request */
+static bool         KeepAlive   = false;
+static bool         Verbose     = false;
+static bool         Compat      = false;    /* thor.py -p/-r interface */
+static bool         Json        = false;    /* Force JSON in compat mode */
+static size_t       PerSlot     = 1;        /* Requests per slot in compat mode */
+
+/* State */
+
+static struct addrinfo *Address = NULL;
+static char        *RequestText = NULL;
+static size_t       RequestLength = 0;
+static int          Epoll       = -1;
+static Connection  *Slots       = NULL;
+static size_t      *FreeSlots   = NULL;     /* Stack of slots without a request */
+static size_t       FreeCount   = 0;
+static size_t       Active      = 0;        /* Requests outstanding */
+static size_t       Open        = 0;        /* Sockets open or connecting */
+
+static uint64_t     Started     = 0;        /* Requests issued */
+static uint64_t     Finished    = 0;        /* Requests completed (ok or error) */
+static uint64_t     StartNs     = 0;
+static uint64_t     EndNs       = 0;
+static uint64_t     Bytes       = 0;
+static uint64_t     StatusClass[6] = {0};
+static uint64_t     ErrConnect = 0, ErrRead = 0, ErrWrite = 0, ErrTimeout = 0, ErrParse = 0;
+static uint64_t     Reconnects  = 0;
+
+static Histogram    Latency;                /* Corrected latency (from intended start) */
+static Histogram    ServiceTime;            /* Uncorrected latency (from actual send) */
+
+/* Time */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Histogram */
+
+static int histogram_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    int shift = (63 - __builtin_clzll(v)) - (HIST_SUB_BITS - 1);
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + (int)((v >> shift) - HIST_HALF_COUNT);
+}
+
+static uint64_t histogram_value(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    int shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    int sub   = (index - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((uint64_t)sub << shift) + ((1ull << shift) >> 1);
+}
+
+static void histogram_record(Histogram *h, uint64_t us) {
+    h->counts[histogram_index(us)]++;
+    if (h->total == 0 || us < h->min) h->min = us;
+    if (us > h->max) h->max = us;
+    h->total++;
+    h->sum  += (double)us;
+    h->sum2 += (double)us * (double)us;
+}
+
+static uint64_t histogram_percentile(const Histogram *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * (double)h->total);
+    uint64_t seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = histogram_value(i);
+            return v > h->max ? h->max : (v < h->min ? h->min : v);
+        }
+    }
+    return h->max;
+}
+
+static void histogram_json(const char *name, const Histogram *h) {
+    static const double Percentiles[] = {50, 75, 90, 95, 99, 99.9, 99.99, 99.999};
+    static const char  *Labels[]      = {"p50", "p75", "p90", "p95", "p99", "p99.9", "p99.99", "p99.999"};
+    double mean  = h->total ? h->sum / h->total : 0;
+    double var   = h->total ? h->sum2 / h->total - mean * mean : 0;
+
+    printf("  \"%s\": {\n", name);
+    printf("    \"count\": %lu,\n", (unsigned long)h->total);
+    printf("    \"min\": %lu,\n", (unsigned long)h->min);
+    printf("    \"mean\": %.1f,\n", mean);
+    printf("    \"stdev\": %.1f,\n", var > 0 ? sqrt(var) : 0.0);
+    for (size_t i = 0; i < sizeof(Percentiles) / sizeof(Percentiles[0]); i++) {
+        printf("    \"%s\": %lu,\n", Labels[i], (unsigned long)histogram_percentile(h, Percentiles[i]));
+    }
+    printf("    \"max\": %lu\n", (unsigned long)h->max);
+    printf("  }");
+}
+
+/* Usage */
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options] URL\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -v            Display verbose output (response bodies)\n");
+    fprintf(stderr, "    -c conns      Number of concurrent connections (1)\n");
+    fprintf(stderr, "    -n requests   Total number of requests\n");
+    fprintf(stderr, "    -d seconds    Duration of test\n");
+    fprintf(stderr, "    -R rate       Open loop at fixed requests/second (closed loop if unset)\n");
+    fprintf(stderr, "    -k            Reuse connections (keep-alive)\n");
+    fprintf(stderr, "    -t seconds    Per-request timeout (30)\n");
+    fprintf(stderr, "    -j            Report JSON (default unless -p/-r are used)\n");
+    fprintf(stderr, "Compatibility (thor.py):\n");
+    fprintf(stderr, "    -p PROCESSES  Number of processes to utilize (1)\n");
+    fprintf(stderr, "    -r REQUESTS   Number of requests per process (1)\n");
+    exit(status);
+}
+
+/**
+ * Split http://host[:port]/path into Host, Service and Path.
+ *
+ * @param   url         URL to parse.
+ * @return  true if the URL could be parsed.
+ **/
+static bool parse_url(const char *url) {
+    const char *s = url;
+    if (strncmp(s, "http://", 7) == 0) {
+        s += 7;
+    } else if (strstr(s, "://")) {
+        fprintf(stderr, "Unsupported scheme in %s (only http:// is supported)\n", url);
+        return false;
+    }
+
+    const char *slash = strchr(s, '/');
+    size_t hostlen = slash ? (size_t)(slash - s) : strlen(s);
+    char *authority = strndup(s, hostlen);
+    char *colon = NULL;
+
+    if (authority[0] == '[') {
+        char *close = strchr(authority, ']');
+        if (!close) {
+            free(authority);
+            return false;
+        }
+        *close = '\0';
+        Host  = strdup(authority + 1);
+        colon = strchr(close + 1, ':');
+    } else {
+        colon = strrchr(authority, ':');
+        if (colon) *colon = '\0';
+        Host = strdup(authority);
+    }
+    Service = strdup(colon ? colon + 1 : "80");
+    Path    = strdup(slash ? slash : "/");
+    free(authority);
+    return Host[0] != '\0';
+}
+
+/**
+ * Parse command-line options.
+ **/
+static void parse_options(int argc, char *argv[]) {
+    int argind = 1;
+    bool modern = false;
+    size_t processes = 1;
+
+    if (argc == 1) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    while (argind < argc && argv[argind][0] == '-' && strlen(argv[argind]) > 1) {
+        char *arg = argv[argind++];
+        bool needs_value = strchr("cndRtpr", arg[1]) != NULL;
+        if (arg[2] != '\0' || (needs_value && argind >= argc)) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (arg[1]) {
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            case 'v': Verbose = true; break;
+            case 'k': KeepAlive = true; modern = true; break;
+            case 'j': Json = true; break;
+            case 'c': Connections = strtoul(argv[argind++], NULL, 10); modern = true; break;
+            case 'n': Requests = strtoull(argv[argind++], NULL, 10); modern = true; break;
+            case 'd': Duration = strtod(argv[argind++], NULL); modern = true; break;
+            case 'R': Rate = strtod(argv[argind++], NULL); modern = true; break;
+            case 't': Timeout = strtod(argv[argind++], NULL); break;
+            case 'p': processes = strtoul(argv[argind++], NULL, 10); Compat = true; break;
+            case 'r': PerSlot = strtoul(argv[argind++], NULL, 10); Compat = true; break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (argind >= argc) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    Url = argv[argind];
+
+    /* thor.py semantics: PROCESSES workers each making REQUESTS sequential
+     * requests over a fresh connection. */
+    if (!modern) {
+        Compat      = true;
+        Connections = processes;
+        Requests    = (uint64_t)processes * PerSlot;
+    } else {
+        Compat = false;
+        if (Requests == 0 && Duration == 0) {
+            Requests = Connections;
+        }
+    }
+
+    if (Connections == 0 || (Compat && PerSlot == 0) || Timeout <= 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (!parse_url(Url)) {
+        fprintf(stderr, "Invalid URL: %s\n", Url);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Connections */
+
+static bool more_requests(uint64_t now) {
+    if (Requests && Started >= Requests) {
+        return false;
+    }
+    if (Duration > 0 && now >= StartNs + (uint64_t)(Duration * 1e9)) {
+        return false;
+    }
+    return true;
+}
+
+static uint64_t intended_time(uint64_t index) {
+    return StartNs + (uint64_t)((double)index * 1e9 / Rate);
+}
+
+static void conn_close(Connection *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        Open--;
+    }
+    c->fd     = -1;
+    c->state  = CONN_CLOSED;
+    c->served = 0;
+}
+
+static void conn_watch(Connection *c, uint32_t events, int op) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(Epoll, op, c->fd, &ev) < 0) {
+        fatal("epoll_ctl: %s", strerror(errno));
+    }
+}
+
+static bool conn_connect(Connection *c) {
+    c->fd = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, Address->ai_protocol);
+    if (c->fd < 0) {
+        return false;
+    }
+    Open++;
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        Open--;
+        return false;
+    }
+    c->state = CONN_CONNECTING;
+    c->served = 0;
+    conn_watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+    return true;
+}
+
+static void conn_reset_parser(Connection *c) {
+    c->parse       = PARSE_HEADER;
+    c->hlen        = 0;
+    c->remaining   = 0;
+    c->close_after = !KeepAlive;
+    c->status      = 0;
+    c->received    = 0;
+    c->woff        = 0;
+}
+
+static void conn_begin(Connection *c, uint64_t intended, uint64_t now);
+static void conn_fail(Connection *c, uint64_t *counter);
+
+/**
+ * Send (the remainder of) the request on a connected socket.
+ **/
+static void conn_send(Connection *c) {
+    while (c->woff < RequestLength) {
+        ssize_t n = send(c->fd, RequestText + c->woff, RequestLength - c->woff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (c->state != CONN_WRITING) {
+                    c->state = CONN_WRITING;
+                    conn_watch(c, EPOLLOUT, EPOLL_CTL_MOD);
+                }
+                return;
+            }
+            if (errno == EINTR) continue;
+            conn_fail(c, &ErrWrite);
+            return;
+        }
+        c->woff += (size_t)n;
+    }
+    c->state = CONN_READING;
+    conn_watch(c, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+}
+
+/**
+ * Start a request on a slot, connecting first if needed.
+ **/
+static void conn_begin(Connection *c, uint64_t intended, uint64_t now) {
+    conn_reset_parser(c);
+    c->intended_ns = intended;
+    c->start_ns    = now;
+    if (!c->active) {
+        c->active = true;
+        Active++;
+    }
+
+    if (c->fd >= 0 && c->state == CONN_IDLE) {
+        c->state = CONN_WRITING;
+        conn_send(c);
+        return;
+    }
+
+    if (c->fd >= 0) {
+        conn_close(c);
+    }
+    if (!conn_connect(c)) {
+        conn_fail(c, &ErrConnect);
+    }
+}
+
+/**
+ * Record the outcome of the slot's outstanding request.
+ **/
+static void conn_finish(Connection *c, bool ok) {
+    uint64_t now = now_ns();
+    c->active = false;
+    Active--;
+    Finished++;
+
+    if (ok) {
+        Bytes += c->received;
+        int klass = c->status / 100;
+        StatusClass[(klass >= 1 && klass <= 5) ? klass : 0]++;
+        histogram_record(&Latency, (now - c->intended_ns) / 1000);
+        histogram_record(&ServiceTime, (now - c->start_ns) / 1000);
+    }
+
+    if (Compat) {
+        double elapsed = (double)(now - c->start_ns) / 1e9;
+        c->elapsed += elapsed;
+        if (!Json) {
+            printf("Process: %d, Request: %u, Elapsed Time: %.2f\n", c->slot, c->completed, elapsed);
+        }
+        c->completed++;
+        if (!Json && c->completed == PerSlot) {
+            printf("Process: %d, AVERAGE   , Elapsed Time: %.2f\n", c->slot, c->elapsed / PerSlot);
+        }
+        if (c->completed >= PerSlot) {
+            return;
+        }
+    }
+    FreeSlots[FreeCount++] = (size_t)c->slot;
+}
+
+static void conn_fail(Connection *c, uint64_t *counter) {
+    (*counter)++;
+    if (Verbose) {
+        fprintf(stderr, "slot %d: request failed: %s\n", c->slot, strerror(errno));
+    }
+    conn_close(c);
+    if (c->active) {
+        conn_finish(c, false);
+    }
+}
+
+/**
+ * Examine the accumulated header block, deciding how the body is framed.
+ **/
+static bool conn_parse_header(Connection *c) {
+    char *line = c->hbuf;
+    char *end  = c->hbuf + c->hlen;
+    bool chunked = false;
+    bool have_length = false;
+    uint64_t length = 0;
+    int major = 1, minor = 0;
+
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &c->status) != 3) {
+        return false;
+    }
+    c->close_after = !KeepAlive || (major == 1 && minor == 0);
+
+    while (line < end) {
+        char *eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol) break;
+        *eol = '\0';
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            length = strtoull(line + 15, NULL, 10);
+            have_length = true;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = strcasestr(line + 18, "chunked") != NULL;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            if (strcasestr(line + 11, "close")) {
+                c->close_after = true;
+            } else if (KeepAlive && strcasestr(line + 11, "keep-alive")) {
+                c->close_after = false;
+            }
+        }
+        line = eol + 1;
+    }
+
+    if (c->status == 204 || c->status == 304 || (c->status >= 100 && c->status < 200)) {
+        c->parse = PARSE_DONE;
+    } else if (chunked) {
+        c->parse = PARSE_CHUNK_SIZE;
+    } else if (have_length) {
+        c->remaining = length;
+        c->parse = length ? PARSE_BODY_LENGTH : PARSE_DONE;
+    } else {
+        c->parse = PARSE_BODY_EOF;
+        c->close_after = true;
+    }
+    c->hlen = 0;
+    return true;
+}
+
+static void body(const char *data, size_t n) {
+    if (Verbose && n) {
+        fwrite(data, 1, n, stdout);
+    }
+}
+
+/**
+ * Feed received bytes through the response parser.
+ *
+ * @return  Number of bytes consumed, or -1 on a malformed response.
+ **/
+static ssize_t conn_feed(Connection *c, const char *data, size_t n) {
+    size_t i = 0;
+
+    while (i < n && c->parse != PARSE_DONE) {
+        switch (c->parse) {
+            case PARSE_HEADER:
+            case PARSE_CHUNK_SIZE:
+            case PARSE_CHUNK_END:
+            case PARSE_TRAILER: {
+                /* Line oriented states accumulate into hbuf */
+                if (c->hlen >= THOR_HEADER_MAX) {
+                    return -1;
+                }
+                char ch = data[i++];
+                c->hbuf[c->hlen++] = ch;
+                if (ch != '\n') break;
+
+                if (c->parse == PARSE_HEADER) {
+                    /* Header block ends with an empty line (\n\n or \n\r\n) */
+                    if ((c->hlen >= 2 && c->hbuf[c->hlen - 2] == '\n') ||
+                        (c->hlen >= 3 && c->hbuf[c->hlen - 3] == '\n' && c->hbuf[c->hlen - 2] == '\r')) {
+                        c->hbuf[c->hlen] = '\0';
+                        if (!conn_parse_header(c)) return -1;
+                    }
+                } else if (c->parse == PARSE_CHUNK_SIZE) {
+                    c->hbuf[c->hlen] = '\0';
+                    c->remaining = strtoull(c->hbuf, NULL, 16);
+                    c->hlen = 0;
+                    c->parse = c->remaining ? PARSE_CHUNK_DATA : PARSE_TRAILER;
+                } else if (c->parse == PARSE_CHUNK_END) {
+                    c->hlen = 0;
+                    c->parse = PARSE_CHUNK_SIZE;
+                } else {
+                    bool empty = c->hlen <= 2;
+                    c->hlen = 0;
+                    if (empty) c->parse = PARSE_DONE;
+                }
+                break;
+            }
+            case PARSE_BODY_LENGTH:
+            case PARSE_CHUNK_DATA: {
+                size_t take = n - i;
+                if (take > c->remaining) take = (size_t)c->remaining;
+                body(data + i, take);
+                i += take;
+                c->remaining -= take;
+                if (c->remaining == 0) {
+                    c->parse = c->parse == PARSE_BODY_LENGTH ? PARSE_DONE : PARSE_CHUNK_END;
+                }
+                break;
+            }
+            case PARSE_BODY_EOF:
+                body(data + i, n - i);
+                i = n;
+                break;
+            case PARSE_DONE:
+                break;
+        }
+    }
+    return (ssize_t)i;
+}
+
+/**
+ * Complete the current response and schedule this slot's next request.
+ **/
+static void conn_complete(Connection *c) {
+    conn_finish(c, true);
+    c->served++;
+    if (c->close_after) {
+        conn_close(c);
+    } else {
+        c->state = CONN_IDLE;
+        conn_watch(c, EPOLLRDHUP, EPOLL_CTL_MOD);
+    }
+}
+
+static void conn_readable(Connection *c) {
+    static char buffer[THOR_READ_SIZE];
+
+    while (true) {
+        ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            conn_fail(c, &ErrRead);
+            return;
+        }
+        if (n == 0) {
+            if (c->parse == PARSE_BODY_EOF) {
+                c->close_after = true;
+                conn_complete(c);
+            } else if (c->parse == PARSE_HEADER && c->hlen == 0 && c->received == 0 && c->served > 0) {
+                /* Keep-alive socket closed by the server before we reused it */
+                Reconnects++;
+                conn_close(c);
+                uint64_t intended = c->intended_ns, start = c->start_ns;
+                conn_begin(c, intended, start);
+            } else {
+                conn_fail(c, &ErrRead);
+            }
+            return;
+        }
+
+        c->received += (uint64_t)n;
+        ssize_t used = conn_feed(c, buffer, (size_t)n);
+        if (used < 0) {
+            conn_fail(c, &ErrParse);
+            return;
+        }
+        if (c->parse == PARSE_DONE) {
+            if ((size_t)used < (size_t)n) {
+                /* Unsolicited trailing bytes: not safe to reuse */
+                c->close_after = true;
+            }
+            conn_complete(c);
+            return;
+        }
+    }
+}
+
+static void conn_event(Connection *c, uint32_t events) {
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & (EPOLLERR | EPOLLHUP))) {
+            errno = err;
+            conn_fail(c, &ErrConnect);
+            return;
+        }
+        c->state = CONN_WRITING;
+        conn_send(c);
+        return;
+    }
+
+    if (c->state == CONN_WRITING) {
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            conn_fail(c, &ErrWrite);
+        } else {
+            conn_send(c);
+        }
+        return;
+    }
+
+    if (c->state == CONN_READING) {
+        conn_readable(c);
+        return;
+    }
+
+    if (c->state == CONN_IDLE && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        conn_close(c);
+    }
+}
+
+/* Scheduling */
+
+/**
+ * Hand out requests to free slots.
+ *
+ * Closed loop: every free slot immediately issues its next request.
+ *
+ * Open loop: request i is due at StartNs + i / Rate.  Its latency is measured
+ * from that intended time, not from when a slot became free, which corrects
+ * for coordinated omission when the server (or the slot pool) falls behind.
+ *
+ * @return  Nanoseconds until the next scheduled request (open loop), or -1.
+ **/
+static int64_t schedule(uint64_t now) {
+    while (FreeCount > 0 && more_requests(now)) {
+        uint64_t intended = now;
+        if (Rate > 0) {
+            intended = intended_time(Started);
+            if (intended > now) {
+                return (int64_t)(intended - now);
+            }
+        }
+        Started++;
+        conn_begin(&Slots[FreeSlots[--FreeCount]], intended, now);
+    }
+
+    if (Rate > 0 && FreeCount > 0 && more_requests(now)) {
+        uint64_t next = intended_time(Started);
+        return next > now ? (int64_t)(next - now) : 0;
+    }
+    return -1;
+}
+
+static void expire(uint64_t now) {
+    uint64_t limit = (uint64_t)(Timeout * 1e9);
+    for (size_t i = 0; i < Connections; i++) {
+        Connection *c = &Slots[i];
+        if (c->active && now - c->start_ns > limit) {
+            errno = ETIMEDOUT;
+            conn_fail(c, &ErrTimeout);
+        }
+    }
+}
+
+/* Reporting */
+
+static void report_json(void) {
+    double elapsed = (double)(EndNs - StartNs) / 1e9;
+    uint64_t ok = Latency.total;
+
+    printf("{\n");
+    printf("  \"url\": \"%s\",\n", Url);
+    printf("  \"mode\": \"%s\",\n", Rate > 0 ? "open" : "closed");
+    printf("  \"connections\": %zu,\n", Connections);
+    printf("  \"keepalive\": %s,\n", KeepAlive ? "true" : "false");
+    printf("  \"rate\": %.1f,\n", Rate);
+    printf("  \"duration\": %.6f,\n", elapsed);
+    printf("  \"requests\": %lu,\n", (unsigned long)Finished);
+    printf("  \"completed\": %lu,\n", (unsigned long)ok);
+    printf("  \"bytes\": %lu,\n", (unsigned long)Bytes);
+    printf("  \"reconnects\": %lu,\n", (unsigned long)Reconnects);
+    printf("  \"status\": {\"1xx\": %lu, \"2xx\": %lu, \"3xx\": %lu, \"4xx\": %lu, \"5xx\": %lu, \"other\": %lu},\n",
+        (unsigned long)StatusClass[1], (unsigned long)StatusClass[2], (unsigned long)StatusClass[3],
+        (unsigned long)StatusClass[4], (unsigned long)StatusClass[5], (unsigned long)StatusClass[0]);
+    printf("  \"errors\": {\"connect\": %lu, \"read\": %lu, \"write\": %lu, \"timeout\": %lu, \"parse\": %lu},\n",
+        (unsigned long)ErrConnect, (unsigned long)ErrRead, (unsigned long)ErrWrite,
+        (unsigned long)ErrTimeout, (unsigned long)ErrParse);
+    printf("  \"throughput\": {\"requests_per_sec\": %.2f, \"bytes_per_sec\": %.2f},\n",
+        elapsed > 0 ? ok / elapsed : 0.0, elapsed > 0 ? Bytes / elapsed : 0.0);
+    histogram_json("latency_us", &Latency);
+    printf(",\n");
+    histogram_json("service_time_us", &ServiceTime);
+    printf("\n}\n");
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+
+    /* Resolve server once */
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int status;
+    if ((status = getaddrinfo(Host, Service, &hints, &Address)) != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    /* Thousands of sockets need a matching descriptor limit */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < Connections + 64) {
+        rl.rlim_cur = rl.rlim_max < Connections + 64 ? rl.rlim_max : Connections + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* Pre-serialize the request */
+    RequestLength = (size_t)asprintf(&RequestText,
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: thor\r\nConnection: %s\r\n\r\n",
+        Path, Host, KeepAlive ? "keep-alive" : "close");
+
+    if ((Epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fatal("epoll_create1: %s", strerror(errno));
+    }
+
+    Slots     = calloc(Connections, sizeof(Connection));
+    FreeSlots = calloc(Connections, sizeof(size_t));
+    if (!Slots || !FreeSlots) {
+        fatal("Unable to allocate %zu connections", Connections);
+    }
+    for (size_t i = 0; i < Connections; i++) {
+        Slots[i].fd   = -1;
+        Slots[i].slot = (int)i;
+        Slots[i].hbuf = malloc(THOR_HEADER_MAX + 1);
+        FreeSlots[FreeCount++] = Connections - 1 - i;
+    }
+
+    struct epoll_event events[THOR_MAX_EVENTS];
+    uint64_t last_expire = 0;
+    StartNs = now_ns();
+
+    while (true) {
+        uint64_t now = now_ns();
+        int64_t next = schedule(now);
+
+        if (!more_requests(now_ns()) && Active == 0) {
+            break;
+        }
+
+        int wait_ms = THOR_TICK_MS;
+        if (next >= 0 && next / 1000000 < wait_ms) {
+            wait_ms = (int)(next / 1000000);
+        }
+
+        int n = epoll_wait(Epoll, events, THOR_MAX_EVENTS, wait_ms);
+        if (n < 0 && errno != EINTR) {
+            fatal("epoll_wait: %s", strerror(errno));
+        }
+        for (int i = 0; i < n; i++) {
+            conn_event(events[i].data.ptr, events[i].events);
+        }
+
+        now = now_ns();
+        if (now - last_expire > THOR_TICK_MS * 1000000ull) {
+            expire(now);
+            last_expire = now;
+        }
+    }
+    EndNs = now_ns();
+
+    if (Compat && !Json) {
+        double total = 0;
+        for (size_t i = 0; i < Connections; i++) {
+            total += Slots[i].elapsed / PerSlot;
+        }
+        printf("TOTAL AVERAGE ELAPSED TIME: %.2f\n", total / Connections);
+    } else {
+        report_json();
+    }
+
+    for (size_t i = 0; i < Connections; i++) {
+        if (Slots[i].fd >= 0) close(Slots[i].fd);
+        free(Slots[i].hbuf);
+    }
+    free(Slots);
+    free(FreeSlots);
+    free(RequestText);
+    free(Host);
+    free(Service);
+    free(Path);
+    freeaddrinfo(Address);
+    return (ErrConnect + ErrRead + ErrWrite + ErrTimeout + ErrParse) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
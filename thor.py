@@ -1,11 +1,15 @@
 #!/usr/bin/env python3
 
+import json
 import multiprocessing
 import os
+import random
+import re
 import requests
 import sys
 import time
 import platform
+from datetime import datetime
 # Globals
 
 PROCESSES = 1
@@ -13,17 +17,32 @@ REQUESTS  = 1
 VERBOSE   = False
 URL       = None
 
+TRACE     = None        # Access log (or "offset uri" lines) to replay
+MIX       = None        # Weighted URL mix specification
+SPEEDUP   = 1.0         # Replay time scale (0 = as fast as possible)
+RATE      = 0.0         # Mix arrival rate in requests/second (0 = back to back)
+SEED      = None
+JSON      = False
+
 args= sys.argv[1:]
 # Functions
 TOTALL = None
 def usage(status=0):
     print('''Usage: {} [-p PROCESSES -r REQUESTS -v] URL
+       {} [-p PROCESSES] (-t TRACE | -m MIX [-r REQUESTS -R RATE]) [-s SPEEDUP -j] BASEURL
     -h              Display help message
     -v              Display verbose output
 
     -p  PROCESSES   Number of processes to utilize (1)
     -r  REQUESTS    Number of requests per process (1)
-    '''.format(os.path.basename(sys.argv[0])))
+
+    -t  TRACE       Replay an access log (Common Log Format or "SECONDS URI" lines)
+    -m  MIX         Replay a weighted URL mix ("WEIGHT URI [CLASS]" lines)
+    -s  SPEEDUP     Scale trace inter-arrival times by 1/SPEEDUP (0 = no delays)
+    -R  RATE        Poisson arrival rate for a mix in requests/second (back to back)
+    -S  SEED        Random seed for a mix
+    -j              Report replay results as JSON
+    '''.format(os.path.basename(sys.argv[0]), os.path.basename(sys.argv[0])))
     sys.exit(status)
 
 def do_request(pid):
@@ -50,6 +69,166 @@ def do_request(pid):
 #def init(args):
 #    global TOTALL
 #    TOTALL = args
+# Replay
+
+CLF = re.compile(r'^\S+ \S+ \S+ \[([^\]]+)\] "(\S+) (\S+)[^"]*" (\d{3}|-) (\S+)')
+
+def classify(uri):
+    ''' Guess the URL class of a request the way spidey dispatches it. '''
+    path = uri.split('?', 1)[0]
+    name = os.path.basename(path.rstrip('/'))
+    if '?' in uri or path.startswith('/scripts/') or name.endswith(('.sh', '.cgi', '.py', '.pl')):
+        return 'cgi'
+    if path.endswith('/') or '.' not in name:
+        return 'browse'
+    return 'static'
+
+def load_trace(path):
+    ''' Return [(offset seconds, uri, class)] sorted by offset. '''
+    entries = []
+    skipped = 0
+    with open(path) as fs:
+        for line in fs:
+            line = line.strip()
+            if not line or line.startswith('#'):
+                continue
+            match = CLF.match(line)
+            if match:
+                stamp, method, uri = match.group(1), match.group(2), match.group(3)
+                if method != 'GET':
+                    skipped += 1
+                    continue
+                when = datetime.strptime(stamp, '%d/%b/%Y:%H:%M:%S %z').timestamp()
+                entries.append([when, uri, classify(uri)])
+                continue
+            fields = line.split()
+            try:
+                entries.append([float(fields[0]), fields[1], fields[2] if len(fields) > 2 else classify(fields[1])])
+            except (ValueError, IndexError):
+                skipped += 1
+
+    if not entries:
+        sys.exit('No replayable requests in {}'.format(path))
+    if skipped:
+        print('Skipped {} non-GET or malformed trace lines'.format(skipped), file=sys.stderr)
+
+    entries.sort(key=lambda e: e[0])
+
+    # Common Log Format has one second resolution: spread requests that share
+    # a timestamp evenly across that second instead of replaying a burst.
+    first = entries[0][0]
+    i = 0
+    while i < len(entries):
+        j = i
+        while j < len(entries) and entries[j][0] == entries[i][0]:
+            j += 1
+        if j - i > 1 and entries[i][0] == int(entries[i][0]):
+            for k in range(i, j):
+                entries[k][0] += (k - i) / float(j - i)
+        i = j
+
+    return [(when - first, uri, klass) for when, uri, klass in entries]
+
+def load_mix(path):
+    ''' Expand a weighted mix into PROCESSES * REQUESTS scheduled requests. '''
+    choices = []
+    with open(path) as fs:
+        for line in fs:
+            fields = line.split()
+            if not fields or fields[0].startswith('#'):
+                continue
+            uri = fields[1]
+            choices.append((float(fields[0]), uri, fields[2] if len(fields) > 2 else classify(uri)))
+
+    if not choices:
+        sys.exit('Empty mix {}'.format(path))
+
+    rng     = random.Random(SEED)
+    weights = [c[0] for c in choices]
+    offset  = 0.0
+    entries = []
+    for _ in range(PROCESSES * REQUESTS):
+        _, uri, klass = rng.choices(choices, weights)[0]
+        entries.append((offset, uri, klass))
+        if RATE > 0:
+            offset += rng.expovariate(RATE)
+    return entries
+
+def do_replay(work):
+    ''' Replay a share of the schedule against a common start time. '''
+    start, entries = work
+    results = []
+    for offset, uri, klass in entries:
+        due = start + (offset / SPEEDUP if SPEEDUP > 0 else 0)
+        delay = due - time.time()
+        if delay > 0:
+            time.sleep(delay)
+        sent = time.time()
+        try:
+            r = requests.get(URL.rstrip('/') + uri)
+            status, size = r.status_code, len(r.content)
+            ok = 200 <= status < 400
+            if VERBOSE:
+                print(r.text)
+        except (OSError, ValueError) as e:
+            status, ok, size = 0, False, 0
+            if VERBOSE:
+                print('{}: {}'.format(uri, e), file=sys.stderr)
+        results.append((klass, uri, status, ok, size, time.time() - sent, max(0.0, sent - due)))
+    return results
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, max(0, int(round(p / 100.0 * len(values) + 0.5)) - 1))]
+
+def summarize(results, elapsed):
+    classes = {}
+    for klass, uri, status, ok, size, latency, lag in results:
+        classes.setdefault(klass, []).append((ok, size, latency, lag))
+    classes['TOTAL'] = [r for rows in list(classes.values()) for r in rows]
+
+    summary = {}
+    for klass, rows in classes.items():
+        latencies = [r[2] for r in rows]
+        summary[klass] = {
+            'requests':        len(rows),
+            'errors':          sum(1 for r in rows if not r[0]),
+            'bytes':           sum(r[1] for r in rows),
+            'requests_per_sec': len(rows) / elapsed if elapsed else 0.0,
+            'bytes_per_sec':   sum(r[1] for r in rows) / elapsed if elapsed else 0.0,
+            'latency_mean':    sum(latencies) / len(latencies),
+            'latency_p50':     percentile(latencies, 50),
+            'latency_p90':     percentile(latencies, 90),
+            'latency_p99':     percentile(latencies, 99),
+            'latency_max':     max(latencies),
+            'schedule_lag_p99': percentile([r[3] for r in rows], 99),
+        }
+    return summary
+
+def replay():
+    entries = load_trace(TRACE) if TRACE else load_mix(MIX)
+    shares  = [entries[i::PROCESSES] for i in range(PROCESSES)]
+    start   = time.time() + 0.5     # Give every worker time to start
+    pool    = multiprocessing.Pool(PROCESSES)
+    results = [r for share in pool.map(do_replay, [(start, s) for s in shares]) for r in share]
+    elapsed = time.time() - start
+    summary = summarize(results, elapsed)
+
+    if JSON:
+        print(json.dumps({'base': URL, 'processes': PROCESSES, 'speedup': SPEEDUP,
+                          'elapsed': elapsed, 'classes': summary}, indent=2))
+        return
+
+    print('| {:7}| {:>8}| {:>6}| {:>9}| {:>10}| {:>9}| {:>9}| {:>9}| {:>9}|'.format(
+        'class', 'requests', 'errors', 'req/s', 'MB/s', 'mean (s)', 'p50 (s)', 'p99 (s)', 'lag99 (s)'))
+    print('|{:-<8}|{:-<9}|{:-<7}|{:-<10}|{:-<11}|{:-<10}|{:-<10}|{:-<10}|{:-<10}|'.format(*'-' * 9))
+    for klass in sorted(summary, key=lambda k: (k == 'TOTAL', k)):
+        s = summary[klass]
+        print('| {:7}| {:8}| {:6}| {:9.2f}| {:10.4f}| {:9.4f}| {:9.4f}| {:9.4f}| {:9.4f}|'.format(
+            klass, s['requests'], s['errors'], s['requests_per_sec'], s['bytes_per_sec'] / 1048576.0,
+            s['latency_mean'], s['latency_p50'], s['latency_p99'], s['schedule_lag_p99']))
 # Main execution
 
 if __name__ == '__main__':
@@ -65,10 +244,24 @@ if __name__ == '__main__':
             PROCESSES = int(args.pop(0))
         elif arg == '-r':
             REQUESTS = int(args.pop(0))
+        elif arg == '-t':
+            TRACE = args.pop(0)
+        elif arg == '-m':
+            MIX = args.pop(0)
+        elif arg == '-s':
+            SPEEDUP = float(args.pop(0))
+        elif arg == '-R':
+            RATE = float(args.pop(0))
+        elif arg == '-S':
+            SEED = int(args.pop(0))
+        elif arg == '-j':
+            JSON = True
         else:
             usage(1)
     if args:
         URL = args.pop(0)
+    else:
+        usage(1)
    # if(VERBOSE):
    #     p = os.path.basename(URL)
    #     f = open(p, "r")
@@ -77,6 +270,10 @@ if __name__ == '__main__':
         #    print(i)
         
 
+    if TRACE or MIX:
+        replay()
+        sys.exit(0)
+
     #TOTALL = Value('f',0)
     
     #p = Pool(initializer = init, initargs =(TOTALL, ))
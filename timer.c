@@ -0,0 +1,177 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <time.h>
+
+/**
+ * Return the monotonic clock in milliseconds.
+ **/
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize an empty timer wheel.
+ *
+ * @param   wheel       Timer wheel.
+ * @param   now         Current time (timer_now milliseconds).
+ *
+ * Each slot is a sentinel of a circular doubly-linked list so that timers
+ * can be inserted and cancelled in constant time.
+ **/
+void timer_wheel_init(TimerWheel *wheel, uint64_t now) {
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Timer *head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+    wheel->tick  = now / TIMER_RESOLUTION;
+    wheel->count = 0;
+}
+
+/**
+ * Link a timer into the slot matching its distance from the current tick.
+ *
+ * A timer cascading down on its own tick goes into the current slot, which
+ * timer_advance() runs right after the cascade; anything older (or added
+ * for the current tick) is overdue and fires on the next one.
+ **/
+static void timer_link(TimerWheel *wheel, Timer *timer, bool cascading) {
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level = 0;
+
+    if (expires < wheel->tick || (expires == wheel->tick && !cascading)) {
+        expires = wheel->tick + 1;      /* Overdue: fire on the next tick */
+    }
+    delta = expires - wheel->tick;
+
+    /* Level n holds timers due within TIMER_SLOTS^(n+1) ticks */
+    while (level < TIMER_LEVELS - 1 && delta >= (1ull << (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ull << (TIMER_BITS * TIMER_LEVELS))) {
+        expires = wheel->tick + (1ull << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    Timer *head = &wheel->slots[level][(expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * Arm (or re-arm) a timer.
+ *
+ * @param   wheel       Timer wheel.
+ * @param   timer       Timer with its callback set.
+ * @param   when        Absolute expiry time (timer_now milliseconds).
+ **/
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t when) {
+    if (timer_pending(timer)) {
+        timer_cancel(timer);
+    }
+    timer->wheel   = wheel;
+    timer->expires = (when + TIMER_RESOLUTION - 1) / TIMER_RESOLUTION;
+    timer_link(wheel, timer, false);
+    wheel->count++;
+}
+
+/**
+ * Disarm a timer (a no-op if it is not pending).
+ **/
+void timer_cancel(Timer *timer) {
+    if (!timer_pending(timer)) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    timer->wheel->count--;
+}
+
+bool timer_pending(const Timer *timer) {
+    return timer->next != NULL;
+}
+
+/**
+ * Move every timer in a slot of an upper level down to finer slots.
+ **/
+static void timer_cascade(TimerWheel *wheel, int level) {
+    Timer *head = &wheel->slots[level][(wheel->tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    Timer *timer = head->next;
+
+    head->next = head->prev = head;
+    while (timer != head) {
+        Timer *next = timer->next;
+        timer_link(wheel, timer, true);
+        timer = next;
+    }
+}
+
+/**
+ * Advance the wheel to now, running the callback of every expired timer.
+ *
+ * @param   wheel       Timer wheel.
+ * @param   now         Current time (timer_now milliseconds).
+ *
+ * Callbacks may add or cancel timers, including their own.
+ **/
+void timer_advance(TimerWheel *wheel, uint64_t now) {
+    uint64_t target = now / TIMER_RESOLUTION;
+
+    while (wheel->tick < target) {
+        if (wheel->count == 0) {
+            wheel->tick = target;
+            break;
+        }
+
+        wheel->tick++;
+
+        /* Refill finer levels whenever a coarser slot comes due */
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (wheel->tick & ((1ull << (TIMER_BITS * level)) - 1)) {
+                break;
+            }
+            timer_cascade(wheel, level);
+        }
+
+        Timer *head = &wheel->slots[0][wheel->tick & (TIMER_SLOTS - 1)];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            timer_cancel(timer);
+            timer->callback(timer);
+        }
+    }
+}
+
+/**
+ * Return how long the caller may sleep before the wheel needs advancing.
+ *
+ * @return  Milliseconds until the next occupied slot or cascade, or -1 if no
+ *          timers are pending.
+ **/
+int timer_timeout(const TimerWheel *wheel) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    uint64_t ticks = 1;
+    while ((wheel->tick + ticks) & (TIMER_SLOTS - 1)) {
+        const Timer *head = &wheel->slots[0][(wheel->tick + ticks) & (TIMER_SLOTS - 1)];
+        if (head->next != head) {
+            break;
+        }
+        ticks++;
+    }
+
+    int64_t timeout = (int64_t)((wheel->tick + ticks) * TIMER_RESOLUTION) - (int64_t)timer_now();
+    return timeout > 0 ? (int)timeout : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,10 +1,15 @@
 /* utils.c: spidey utilities */
+#define _GNU_SOURCE
 #include "spidey.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <linux/limits.h>
+#include <linux/openat2.h>
+#include <netinet/in.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 
@@ -12,7 +17,8 @@
  * Determine mime-type from file extension.
  *
  * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
+ * @return  An allocated string containing the mime-type of the specified file
+ *          (free with mem_free).
  *
  * This function first finds the file's extension and then scans the contents
  * of the MimeTypesPath file to determine which mimetype the file has.
@@ -35,21 +41,23 @@ char * determine_mimetype(const char *path) {
     char *mimetype;
     char *token;
     char buffer[BUFSIZ];
+    char *saveptr = NULL;
     FILE *fs = NULL;
     
-    ext = strstr(path, ".");
-    ext++;
-    fs = fopen(MimeTypesPath,"r");
+    ext = strrchr(path, '.');
+    fs = (ext != NULL) ? fopen(MimeTypesPath,"r") : NULL;
     if(!fs)
     {
         debug("Failed to open MimeTypePath: %s", MimeTypesPath);
+        return mem_strdup(MEM_MIME, DefaultMimeType);
     }
+    ext++;
     while(fgets(buffer, BUFSIZ, fs)){
-        mimetype = strtok(buffer," \t\r\n\v");
+        mimetype = strtok_r(buffer," \t\r\n\v", &saveptr);
         token = mimetype;
        // printf("Mimetype1: %s\n", mimetype);
         while(token!= NULL){
-            token = strtok(NULL, " \r\n");
+            token = strtok_r(NULL, " \r\n", &saveptr);
             token = skip_whitespace(token);
          //   printf("Mimetype2:hh %s..", token);
 
@@ -58,8 +66,8 @@ char * determine_mimetype(const char *path) {
                 {
                     debug("Mimetype matched: %s", mimetype);
                     
-                    char * mime = calloc(1, strlen(mimetype)+1);
-                    strcpy(mime, mimetype);
+                    char * mime = mem_strdup(MEM_MIME, mimetype);
+                    fclose(fs);
                     return mime;
                 }
 
@@ -67,8 +75,7 @@ char * determine_mimetype(const char *path) {
     }
     fclose(fs);
     debug ("Mimetype not found, using defualt mimetype: %s", DefaultMimeType);
-    char * mime = calloc(1, strlen(DefaultMimeType)+1);
-    strcpy(mime, DefaultMimeType);
+    char * mime = mem_strdup(MEM_MIME, DefaultMimeType);
     /* Find file extension */
     
     /* Open MimeTypesPath file */
@@ -79,53 +86,246 @@ char * determine_mimetype(const char *path) {
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Percent-decode a URI path into a path relative to RootPath.
  *
  * @param   uri         Resource path of URI.
- * @return  An allocated string containing the full path of the resource on the
- * local filesystem.
- *
- * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
+ * @param   buffer      Decoded path (leading slashes removed, "." for the root).
+ * @param   size        Size of buffer.
+ * @return  true on success, false for malformed escapes, embedded NULs or
+ *          paths that do not fit.
+ **/
+bool decode_request_path(const char *uri, char *buffer, size_t size) {
+    size_t length = 0;
+
+    while (*uri == '/') {
+        uri++;
+    }
+
+    for (const char *s = uri; *s; s++) {
+        char c = *s;
+        if (c == '%') {
+            if (!isxdigit((unsigned char)s[1]) || !isxdigit((unsigned char)s[2])) {
+                return false;
+            }
+            char hex[3] = { s[1], s[2], '\0' };
+            c = (char)strtol(hex, NULL, 16);
+            if (c == '\0') {
+                return false;
+            }
+            s += 2;
+        }
+        if (length + 1 >= size) {
+            return false;
+        }
+        buffer[length++] = c;
+    }
+
+    if (length == 0) {
+        buffer[length++] = '.';
+    }
+    buffer[length] = '\0';
+    return true;
+}
+
+/**
+ * Open a path beneath RootFd one component at a time (kernels without
+ * openat2).  Symbolic links and ".." components are refused outright.
+ **/
+static int walk_request_path(char *path, int flags) {
+    char *saveptr = NULL;
+    char *component = strtok_r(path, "/", &saveptr);
+    int fd = RootFd;
+
+    if (component == NULL) {
+        return openat(RootFd, ".", flags);
+    }
+
+    while (component) {
+        char *next = strtok_r(NULL, "/", &saveptr);
+        int nfd;
+
+        if (streq(component, "..")) {
+            errno = EXDEV;
+            nfd = -1;
+        } else if (next) {
+            nfd = openat(fd, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        } else {
+            nfd = openat(fd, component, flags | O_NOFOLLOW);
+        }
+
+        if (fd != RootFd) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+        }
+        if (nfd < 0) {
+            return -1;
+        }
+        fd = nfd;
+        component = next;
+    }
+    return fd;
+}
+
+/**
+ * Resolve and open the resource named by a URI beneath RootPath.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * @param   uri         Resource path of URI (percent-encoded, no query).
+ * @param   path        Set to a newly allocated full path of the resource
+ *                      (used for CGI and logging); must later be mem_free'd.
+ * @param   st          Set to the status of the opened resource.
+ * @return  Read-only, close-on-exec descriptor of the resource, or -1 with
+ *          errno set (EINVAL for a malformed URI, EXDEV or ELOOP for a path
+ *          that would leave RootPath, otherwise the open error).
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * The lookup is relative to RootFd with openat2(RESOLVE_BENEATH |
+ * RESOLVE_NO_MAGICLINKS), so "..", absolute symlinks and /proc links cannot
+ * escape the root, and opening and stat'ing take two syscalls in total.  On
+ * kernels without openat2 the path is walked component by component instead.
  **/
-char * determine_request_path(const char *uri) {
-    
-//    char pa[BUFSIZ];
-//    strcat(pa, RootPath);
-//    strcat(pa, uri);
-    /*char uri_buffer [BUFSIZ];
-    strcpy(uri_buffer, "www");
-    strcat(uri_buffer, uri);
+int determine_request_path(const char *uri, char **path, struct stat *st) {
+    static bool NoOpenat2 = false;
+    char relative[PATH_MAX];
+    int flags = O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK;
+    int fd = -1;
 
-    debug("Uri_buffer: %s", uri_buffer);
+    *path = NULL;
+    if (!decode_request_path(uri, relative, sizeof(relative))) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    char* real_path = realpath(uri_buffer, NULL);
-    if (real_path==NULL)
-    {
-        debug("real_path not found");
-        return NULL;
+    if (!NoOpenat2) {
+        struct open_how how = {
+            .flags   = flags,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+        };
+        fd = syscall(SYS_openat2, RootFd, relative, &how, sizeof(how));
+        if (fd < 0 && errno == ENOSYS) {
+            NoOpenat2 = true;
+        }
+    }
+    if (NoOpenat2) {
+        char walk[PATH_MAX];
+        strcpy(walk, relative);
+        fd = walk_request_path(walk, flags);
+    }
+    if (fd < 0) {
+        return -1;
     }
-    */
- 
-    char check_path [BUFSIZ];
-    strcpy(check_path, RootPath);
-    strcat(check_path, uri);
 
-    /*log("Real path: %s", real_path);
-    log("Check path: %s", check_path);
-    
-    */
-    if (strstr(check_path, RootPath) != check_path)
-        return NULL;
+    if (fstat(fd, st) < 0 || !(*path = mem_asprintf(MEM_PATH, "%s/%s", RootPath, relative))) {
+        int saved = errno;
+        close(fd);
+        *path = NULL;
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
 
-    
-    return strdup(check_path);
+/**
+ * Format an HTTP date (RFC 7231 IMF-fixdate).
+ **/
+size_t http_date(time_t when, char *buffer, size_t size) {
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    return strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * Format an entity tag from the file's inode, size and modification time.
+ **/
+size_t http_etag(const struct stat *st, char *buffer, size_t size) {
+    int n = snprintf(buffer, size, "\"%lx-%llx-%llx\"",
+        (unsigned long)st->st_ino,
+        (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec);
+    return n < 0 ? 0 : (size_t)n;
+}
+
+/**
+ * Hash a string (64-bit FNV-1a), as used by the static index and pack archives.
+ **/
+uint64_t string_hash(const char *s, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Extract the raw address bytes (no port) of an IPv4 or IPv6 sockaddr.
+ *
+ * @return  Number of address bytes, or 0 for unsupported families.
+ **/
+size_t address_key(const struct sockaddr *sa, uint8_t key[16]) {
+    if (sa->sa_family == AF_INET) {
+        memcpy(key, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+        memset(key + 4, 0, 12);
+        return 4;
+    }
+    if (sa->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        return 16;
+    }
+    return 0;
+}
+
+/**
+ * Hash a raw client address (32-bit FNV-1a), as used by the hostname cache
+ * and the per-client rate limits.
+ **/
+uint32_t address_hash(uint8_t family, const uint8_t key[16]) {
+    uint32_t hash = 2166136261u ^ family;   /* FNV-1a */
+    for (int i = 0; i < 16; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Parse a size or rate with an optional K, M or G (binary) suffix.
+ *
+ * @param   s           Text to parse.
+ * @param   end         Set to the first character after the number.
+ * @param   value       Parsed value.
+ * @return  true if s starts with a non-negative number.
+ **/
+bool parse_size(const char *s, char **end, double *value) {
+    *value = strtod(s, end);
+    if (*end == s || *value < 0) {
+        return false;
+    }
+    switch (**end) {
+        case 'K': case 'k': *value *= 1024.0;                   (*end)++; break;
+        case 'M': case 'm': *value *= 1024.0 * 1024.0;          (*end)++; break;
+        case 'G': case 'g': *value *= 1024.0 * 1024.0 * 1024.0; (*end)++; break;
+    }
+    return true;
+}
+
+/**
+ * Check that a header field name is an HTTP token (RFC 7230 tchar only).
+ *
+ * @param   name        Header field name.
+ * @return  true if name is a non-empty token.
+ *
+ * Anything else, such as blanks before the colon, is refused rather than
+ * kept: "Content-Length : 5" is not the Content-Length header to us, but a
+ * backend given it could frame the body by it.
+ **/
+bool header_token(const char *name) {
+    if (*name == '\0') {
+        return false;
+    }
+    for (; *name != '\0'; name++) {
+        if (!isalnum((unsigned char)*name) && !strchr("!#$%&'*+-.^_`|~", *name)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
@@ -139,12 +339,18 @@ char * determine_request_path(const char *uri) {
 const char * http_status_string(HTTPStatus status) {
     static char *StatusStrings[] = {
         "200 OK",
+        "304 Not Modified",
         "400 Bad Request",
         "404 Not Found",
+        "408 Request Timeout",
+        "413 Payload Too Large",
+        "429 Too Many Requests",
         "500 Internal Server Error",
+        "502 Bad Gateway",
+        "503 Service Unavailable",
         "418 I'm A Teapot",
     };
-    if(status < 5)
+    if(status < sizeof(StatusStrings) / sizeof(StatusStrings[0]))
         return StatusStrings[status];
     return NULL;
 }
@@ -187,15 +393,4 @@ char * skip_whitespace(char *s) {
     }
 }
 
-/*int main(int argc, char* argv[])
-{
-    char* a = "script.cgi";
-    char *z = determine_request_path(a) ;
-    if (z)
-        printf("%s",z);
-    else 
-        printf ("URI not found");
-    return 0;
-	
-}*/
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
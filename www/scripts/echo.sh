@@ -0,0 +1,6 @@
+#!/bin/sh
+
+echo "Content-type: application/octet-stream"
+echo
+
+exec cat